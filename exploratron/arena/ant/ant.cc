@@ -26,8 +26,9 @@ AntArena::AntArena(
     std::string_view path)
     : AbstractGameArena(controller_builders, BuildMapDefinition()) {
   // common_game::InitializeFromPng("assets/map/ant_1.png",  this);
-  common_game::InitializeFromTmx(absl::StrCat("exploratron/assets/map/", path),
-                                 this);
+  prototype_ = common_game::GetMapPrototype(
+      absl::StrCat("exploratron/assets/map/", path));
+  common_game::InstantiateMap(*prototype_, this);
 
   /*
     map_->IterateLine( {15, 10},{5, 5}, [&](const Vector2i &p) -> bool {
@@ -38,6 +39,14 @@ AntArena::AntArena(
     */
 }
 
+bool AntArena::Reset(
+    const std::vector<const AbstractControllerBuilder *> &controller_builders,
+    uint64_t seed) {
+  ResetState(controller_builders, seed);
+  common_game::InstantiateMap(*prototype_, this);
+  return true;
+}
+
 bool AntArena::Step() {
   if (!AbstractGameArena::Step()) {
     return false;
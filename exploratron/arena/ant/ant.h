@@ -23,9 +23,14 @@ public:
       const std::vector<const AbstractControllerBuilder *> &controller_builders,
       std::string_view path);
   bool Step() override;
+  bool Reset(
+      const std::vector<const AbstractControllerBuilder *> &controller_builders,
+      uint64_t seed) override;
   virtual ~AntArena() = default;
 
 private:
+  // Initial state of the map.
+  std::shared_ptr<const common_game::MapPrototype> prototype_;
 };
 
 class AntArenaBuilder : public AbstractArenaBuilder {
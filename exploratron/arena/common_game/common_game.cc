@@ -2,14 +2,20 @@
 
 #include <stdio.h>
 
+#include <chrono>
+#include <filesystem>
+#include <mutex>
 #include <queue>
 #include <random>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
+#include "exploratron/arena/common_game/compiled_map.h"
+#include "exploratron/arena/common_game/tmx_reader.h"
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_game_area.h"
 #include "exploratron/core/utils/logging.h"
@@ -20,37 +26,121 @@
 namespace exploratron {
 namespace common_game {
 
-void InitializeFromPng(std::string_view path, AbstractGameArena *arena) {
+namespace {
+
+// Symbols used in the png maps. The png colors are converted into the
+// corresponding tmx symbol.
+struct PngSymbol {
+  RGB color;
+  int symbol;
+};
+
+constexpr PngSymbol kPngSymbols[] = {
+    {{0, 0, 0}, 219},        // Wall
+    {{255, 127, 39}, 'a'},   // Ant
+    {{0, 255, 0}, 2},        // Player
+    {{255, 174, 201}, ','},  // Patrol route
+    {{34, 177, 76}, '"'},    // Fungus
+    {{185, 122, 87}, '&'},   // Soft wall
+    {{136, 0, 21}, 'f'},     // Food
+    {{163, 73, 164}, '>'},   // Exit door
+    {{112, 146, 190}, 'U'},  // Unbreakable wall
+    {{127, 127, 127}, 'O'},  // Boulder
+    {{255, 0, 0}, 'A'},      // Ant queen
+};
+
+}  // namespace
+
+MapPrototype LoadPng(std::string_view path) {
+  MapPrototype prototype;
   const auto builder = [&](Vector2i pos, RGB color) {
-    if (color == RGB{0, 0, 0}) {
-      arena->AddEntity(pos, std::make_shared<common_game::Wall>());
-    } else if (color == RGB{255, 127, 39}) {
-      arena->AddEntity(pos, std::make_shared<common_game::Ant>());
-    } else if (color == RGB{0, 255, 0}) {
-      auto player = std::make_shared<common_game::Player>();
-      player->SetControlled(true);
-      arena->AddEntity(pos, std::move(player));
-    } else if (color == RGB{0, 0, 255}) {
-      // AddEntity(pos, std::make_shared<common_game::Water>());
-    } else if (color == RGB{255, 174, 201}) {
-      arena->AddEntity(pos, std::make_shared<common_game::PatrolRoute>());
-    } else if (color == RGB{34, 177, 76}) {
-      arena->AddEntity(pos, std::make_shared<common_game::Fungus>());
-    } else if (color == RGB{185, 122, 87}) {
-      arena->AddEntity(pos, std::make_shared<common_game::SoftWall>());
-    } else if (color == RGB{136, 0, 21}) {
-      arena->AddEntity(pos, std::make_shared<common_game::Food>());
-    } else if (color == RGB{163, 73, 164}) {
-      arena->AddEntity(pos, std::make_shared<common_game::ExitDoor>());
-    } else if (color == RGB{112, 146, 190}) {
-      arena->AddEntity(pos, std::make_shared<common_game::UnbreakableWall>());
-    } else if (color == RGB{127, 127, 127}) {
-      arena->AddEntity(pos, std::make_shared<common_game::Boulder>());
-    } else if (color == RGB{255, 0, 0}) {
-      arena->AddEntity(pos, std::make_shared<common_game::AntQueen>());
+    for (const auto &item : kPngSymbols) {
+      if (color == item.color) {
+        prototype.layers.front()[pos.x + pos.y * prototype.size.x] =
+            item.symbol + 1;
+        break;
+      }
+    }
+  };
+
+  // Load image.
+  std::vector<unsigned char> image;
+  unsigned int width, height;
+  unsigned int error = lodepng::decode(image, width, height, std::string(path));
+  if (error) {
+    LOG(FATAL) << "decoder error " << error << " when reading " << path << " : "
+               << lodepng_error_text(error);
+  }
+
+  prototype.size = {(int)width, (int)height};
+  prototype.layers.emplace_back(prototype.size.Size(), 0);
+  unsigned char *iter = image.data();
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      RGB color{iter[0], iter[1], iter[2]};
+      builder({x, y}, color);
+      iter += 4;
     }
+  }
+  return prototype;
+}
+
+std::shared_ptr<const MapPrototype> GetMapPrototype(std::string_view path) {
+  // Minimum duration in between two checks of the modification time of a file.
+  constexpr auto kCheckInterval = std::chrono::seconds(1);
+
+  struct CacheItem {
+    std::filesystem::file_time_type modification_time;
+    std::chrono::steady_clock::time_point last_check;
+    std::shared_ptr<const MapPrototype> prototype;
   };
-  InitializeFromPng(path, builder, arena);
+  static std::mutex mutex;
+  static std::unordered_map<std::string, CacheItem> cache;
+
+  // The file is checked and parsed without holding the lock, so a slow load
+  // does not block the other arenas. If several threads load the same map at
+  // the same time, each one parses it.
+  const std::string key(path);
+  const auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = cache.find(key);
+    if (it != cache.end() && now - it->second.last_check < kCheckInterval) {
+      return it->second.prototype;
+    }
+  }
+
+  std::error_code error;
+  const auto modification_time = std::filesystem::last_write_time(key, error);
+  CHECK(!error) << " Cannot read " << path << " : " << error.message();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &item = cache[key];
+    if (item.prototype && item.modification_time == modification_time) {
+      item.last_check = now;
+      return item.prototype;
+    }
+  }
+
+  std::shared_ptr<const MapPrototype> prototype;
+  if (std::filesystem::path(key).extension() == ".png") {
+    prototype = std::make_shared<const MapPrototype>(LoadPng(key));
+  } else if (IsCompiledMap(key)) {
+    prototype = std::make_shared<const MapPrototype>(LoadCompiledMap(key));
+  } else {
+    prototype = std::make_shared<const MapPrototype>(LoadTmx(key));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &item = cache[key];
+  item.modification_time = modification_time;
+  item.last_check = now;
+  item.prototype = prototype;
+  return prototype;
+}
+
+void InitializeFromPng(std::string_view path, AbstractGameArena *arena) {
+  InstantiateMap(*GetMapPrototype(path), arena);
 }
 
 void InitializeFromPng(std::string_view path,
@@ -77,108 +167,48 @@ void InitializeFromPng(std::string_view path,
   arena->map().ApplyPending();
 }
 
-void InitializeFromTmx(std::string_view path, AbstractGameArena *arena) {
-  const auto builder = [&](Vector2i pos, int symbol,
-                           const std::string &message) {
-    switch (symbol) {
-      case 0:
-      case ' ':
-        break;
-      case 219:
-        arena->AddEntity(pos, std::make_shared<common_game::Wall>());
-        break;
-      case 'a':
-        arena->AddEntity(pos, std::make_shared<common_game::Ant>());
-        break;
-      case 2: {
-        auto player = std::make_shared<common_game::Player>();
-        player->SetControlled(true);
-        arena->AddEntity(pos, std::move(player));
-      } break;
-      case ',':
-        arena->AddEntity(pos, std::make_shared<common_game::PatrolRoute>());
-        break;
-      case '"':
-        arena->AddEntity(pos, std::make_shared<common_game::Fungus>());
-        break;
-      case '&':
-        arena->AddEntity(pos, std::make_shared<common_game::SoftWall>());
-        break;
-      case 'f':
-        arena->AddEntity(pos, std::make_shared<common_game::Food>());
-        break;
-      case 'x':
-        arena->AddEntity(pos, std::make_shared<common_game::Explosive>());
-        break;
-      case '>':
-        arena->AddEntity(pos, std::make_shared<common_game::ExitDoor>());
-        break;
-      case 'U':
-        arena->AddEntity(pos, std::make_shared<common_game::UnbreakableWall>());
-        break;
-      case 'O':
-        arena->AddEntity(pos, std::make_shared<common_game::Boulder>());
-        break;
-      case 'A':
-        arena->AddEntity(pos, std::make_shared<common_game::AntQueen>());
-        break;
+std::shared_ptr<Entity> CreateEntity(int symbol, const std::string &message) {
+  if (symbol == 0 || symbol == ' ') {
+    return {};
+  }
+  CHECK(symbol >= 0 && symbol < abstract_game_area::kNumSymbols)
+      << "Symbol " << symbol << " unknown";
+  const auto builder = abstract_game_area::global_symbol_builders[symbol];
+  if (!builder) {
+    LOG(FATAL) << "Symbol " << symbol << "(" << (char)symbol << ") unknown";
+  }
+  return builder(message);
+}
 
-      case '+':
-        arena->AddEntity(pos, std::make_shared<common_game::AutomaticDoor>());
-        break;
-      case 255:  // button
-        arena->AddEntity(pos, std::make_shared<common_game::Button>());
-        break;
-      case 24:  // up
-        arena->AddEntity(
-            pos, std::make_shared<common_game::ConveyorBelt>(eDirection::UP));
-        break;
-      case 25:  // down
-        arena->AddEntity(
-            pos, std::make_shared<common_game::ConveyorBelt>(eDirection::DOWN));
-        break;
-      case 26:  // right
-        arena->AddEntity(pos, std::make_shared<common_game::ConveyorBelt>(
-                                  eDirection::RIGHT));
-        break;
-      case 27:  // left
+void InstantiateMap(const MapPrototype &prototype, AbstractGameArena *arena) {
+  if (!arena->map_) {
+    arena->Initialize(prototype.size);
+  }
+  DCHECK(arena->map().size() == prototype.size);
+  for (const auto &layer : prototype.layers) {
+    for (int cell_idx = 0; cell_idx < layer.size(); cell_idx++) {
+      if (layer[cell_idx] == 0) {
+        continue;
+      }
+      auto entity = CreateEntity(layer[cell_idx] - 1, {});
+      if (entity) {
         arena->AddEntity(
-            pos, std::make_shared<common_game::ConveyorBelt>(eDirection::LEFT));
-        break;
-      case 254:  // steel wall
-        arena->AddEntity(pos, std::make_shared<common_game::SteelWall>());
-        break;
-      case 'X':  // explosive barel
-        arena->AddEntity(pos, std::make_shared<common_game::ExplosiveBarel>());
-        break;
-      case '.':
-        arena->AddEntity(pos, std::make_shared<common_game::Wire>());
-        break;
-      case 'p':
-        arena->AddEntity(pos, std::make_shared<common_game::ProxySensor>());
-        break;
-      case '?':
-        arena->AddEntity(pos, std::make_shared<common_game::Message>(message));
-        break;
-      case 't':
-        arena->AddEntity(pos, std::make_shared<common_game::Turret>());
-        break;
-      case 'r':
-        arena->AddEntity(pos, std::make_shared<common_game::Robot>());
-        break;
-      case 'G':
-        arena->AddEntity(pos, std::make_shared<common_game::Goliat>());
-        break;
-      case 'W':
-        arena->AddEntity(pos, std::make_shared<common_game::Worm>());
-        break;
-
-      default:
-        LOG(FATAL) << "Symbol " << symbol << "(" << (char)symbol << ") unknown";
-        break;
+            {cell_idx % prototype.size.x, cell_idx / prototype.size.x},
+            std::move(entity));
+      }
     }
-  };
-  InitializeFromTmx(path, builder, arena);
+  }
+  for (const auto &object : prototype.objects) {
+    auto entity = CreateEntity(object.symbol, object.message);
+    if (entity) {
+      arena->AddEntity(object.pos, std::move(entity));
+    }
+  }
+  arena->map().ApplyPending();
+}
+
+void InitializeFromTmx(std::string_view path, AbstractGameArena *arena) {
+  InstantiateMap(*GetMapPrototype(path), arena);
 }
 
 void InitializeFromTmx(
@@ -186,6 +216,54 @@ void InitializeFromTmx(
     std::function<void(Vector2i pos, int symbol, const std::string &message)>
         builder,
     AbstractGameArena *arena) {
+  const auto prototype = GetMapPrototype(path);
+  arena->Initialize(prototype->size);
+  for (const auto &layer : prototype->layers) {
+    for (int cell_idx = 0; cell_idx < layer.size(); cell_idx++) {
+      if (layer[cell_idx] != 0) {
+        builder({cell_idx % prototype->size.x, cell_idx / prototype->size.x},
+                layer[cell_idx] - 1, {});
+      }
+    }
+  }
+  for (const auto &object : prototype->objects) {
+    builder(object.pos, object.symbol, object.message);
+  }
+  arena->map().ApplyPending();
+}
+
+MapPrototype LoadTmx(std::string_view path) {
+  MapPrototype prototype;
+  TmxReaderCallbacks callbacks;
+  callbacks.map = [&](Vector2i size) {
+    if (size.x > 67) {
+      LOG(INFO) << "Map's width is greater than 67";
+    }
+    if (size.y > 44) {
+      LOG(INFO) << "Map's height is greater than 44";
+    }
+    prototype.size = size;
+    LOG(INFO) << "Load map " << path << " with size " << size.x << " x "
+              << size.y;
+  };
+  callbacks.layer = [&](int layer_idx) {
+    prototype.layers.emplace_back(prototype.size.Size(), 0);
+  };
+  callbacks.tile = [&](int layer_idx, Vector2i pos, int gid) {
+    DCHECK_LE(gid, std::numeric_limits<uint16_t>::max());
+    prototype.layers[layer_idx][pos.x + pos.y * prototype.size.x] = gid;
+  };
+  callbacks.object = [&](Vector2i pos, int gid, const std::string &message) {
+    prototype.objects.push_back(
+        {pos, gid - 1, absl::StrReplaceAll(message, {{"\\n", "\n"}})});
+  };
+  ReadTmx(path, callbacks);
+  return prototype;
+}
+
+MapPrototype LoadTmxWithTinyXml(std::string_view path) {
+  MapPrototype prototype;
+
   tinyxml2::XMLDocument doc;
   doc.LoadFile(std::string(path).c_str());
   auto *map = doc.FirstChildElement("map");
@@ -200,7 +278,7 @@ void InitializeFromTmx(
     LOG(INFO) << "Map's height is greater than 44";
   }
 
-  arena->Initialize({width, height});
+  prototype.size = {width, height};
 
   LOG(INFO) << "Load map " << path << " with size " << width << " x " << height;
 
@@ -210,6 +288,7 @@ void InitializeFromTmx(
       auto *data = cur_layer->FirstChildElement("data");
       CHECK(data);
       CHECK(std::strcmp(data->Attribute("encoding"), "csv") == 0);
+      auto &layer = prototype.layers.emplace_back(prototype.size.Size(), 0);
       auto *cstr_csv_data = data->GetText();
       std::string_view csv_data(cstr_csv_data);
       std::vector<std::string> csv_rows = absl::StrSplit(csv_data, "\n");
@@ -228,7 +307,8 @@ void InitializeFromTmx(
             // Tiled index the symbols starting at 1.
             if (symbol > 0) {
               if (col_idx < width && row_idx < height) {
-                builder({col_idx, row_idx}, symbol - 1, {});
+                DCHECK_LE(symbol, std::numeric_limits<uint16_t>::max());
+                layer[col_idx + row_idx * width] = symbol;
               }
             }
           }
@@ -269,7 +349,7 @@ void InitializeFromTmx(
           }
           message = absl::StrReplaceAll(message, {{"\\n", "\n"}});
 
-          builder({x / 16, y / 16 - 1}, gid - 1, message);
+          prototype.objects.push_back({{x / 16, y / 16 - 1}, gid - 1, message});
         }
 
         cur_object = cur_object->NextSiblingElement("object");
@@ -278,7 +358,7 @@ void InitializeFromTmx(
     }
   }
 
-  arena->map().ApplyPending();
+  return prototype;
 }
 
 void Ant::Step(Output action, std::shared_ptr<Entity> me, Map *map) {
@@ -131,6 +131,7 @@ class UnbreakableWall : public Entity {
   }
 };
 REGISTER_ENTITY(UnbreakableWall);
+REGISTER_ENTITY_SYMBOL(UnbreakableWall, 'U');
 
 class SteelWall : public Entity {
  public:
@@ -145,6 +146,7 @@ class SteelWall : public Entity {
   }
 };
 REGISTER_ENTITY(SteelWall);
+REGISTER_ENTITY_SYMBOL(SteelWall, 254);
 
 class Wall : public Entity {
  public:
@@ -159,6 +161,7 @@ class Wall : public Entity {
   }
 };
 REGISTER_ENTITY(Wall);
+REGISTER_ENTITY_SYMBOL(Wall, 219);
 
 class SoftWall : public Entity {
  public:
@@ -174,6 +177,7 @@ class SoftWall : public Entity {
   }
 };
 REGISTER_ENTITY(SoftWall);
+REGISTER_ENTITY_SYMBOL(SoftWall, '&');
 
 class AutomaticDoor : public Entity {
  public:
@@ -199,6 +203,7 @@ class AutomaticDoor : public Entity {
   bool closed_ = true;
 };
 REGISTER_ENTITY(AutomaticDoor);
+REGISTER_ENTITY_SYMBOL(AutomaticDoor, '+');
 
 class Fungus : public Entity {
  public:
@@ -220,6 +225,7 @@ class Fungus : public Entity {
   int left_ = 10;
 };
 REGISTER_ENTITY(Fungus);
+REGISTER_ENTITY_SYMBOL(Fungus, '"');
 
 class FungusTower : public Entity {
  public:
@@ -284,6 +290,7 @@ class Ant : public Entity {
   eDirection last_pheromone_dir_ = eDirection::NONE;
 };
 REGISTER_ENTITY(Ant);
+REGISTER_ENTITY_SYMBOL(Ant, 'a');
 
 class AntQueen : public Entity {
  public:
@@ -328,6 +335,7 @@ class AntQueen : public Entity {
   int time_to_spwan_ = 0;
 };
 REGISTER_ENTITY(AntQueen);
+REGISTER_ENTITY_SYMBOL(AntQueen, 'A');
 
 class PatrolRoute : public Entity {
  public:
@@ -340,6 +348,7 @@ class PatrolRoute : public Entity {
   std::vector<int> Tags() const override { return {}; }
 };
 REGISTER_ENTITY(PatrolRoute);
+REGISTER_ENTITY_SYMBOL(PatrolRoute, ',');
 
 class Player : public Entity {
  public:
@@ -394,6 +403,15 @@ class Player : public Entity {
 };
 REGISTER_ENTITY(Player);
 
+// The player of the maps is controlled by the agent.
+inline std::shared_ptr<Entity> BuildControlledPlayer(
+    const std::string &message) {
+  auto player = abstract_game_area::MakeEntity<Player>();
+  player->SetControlled(true);
+  return player;
+}
+REGISTER_ENTITY_SYMBOL_BUILDER(Player, 2, BuildControlledPlayer);
+
 class Water : public Entity {
  public:
   Water() {}
@@ -458,6 +476,7 @@ class Food : public Entity {
   int amount_left = 100;
 };
 REGISTER_ENTITY(Food);
+REGISTER_ENTITY_SYMBOL(Food, 'f');
 
 class ExitDoor : public Entity {
  public:
@@ -472,6 +491,7 @@ class ExitDoor : public Entity {
   }
 };
 REGISTER_ENTITY(ExitDoor);
+REGISTER_ENTITY_SYMBOL(ExitDoor, '>');
 
 class Pheromone : public Entity {
  public:
@@ -513,6 +533,7 @@ class Explosive : public Entity {
   bool active_ = false;
 };
 REGISTER_ENTITY(Explosive);
+REGISTER_ENTITY_SYMBOL(Explosive, 'x');
 
 class Explosion : public Entity {
  public:
@@ -548,6 +569,7 @@ class Boulder : public Entity {
   }
 };
 REGISTER_ENTITY(Boulder);
+REGISTER_ENTITY_SYMBOL(Boulder, 'O');
 
 class Button : public Entity {
  public:
@@ -572,6 +594,7 @@ class Button : public Entity {
   bool state = false;  // Only used visually.
 };
 REGISTER_ENTITY(Button);
+REGISTER_ENTITY_SYMBOL(Button, 255);
 
 class ConveyorBelt : public Entity {
  public:
@@ -588,6 +611,10 @@ class ConveyorBelt : public Entity {
   int direction_ = eDirection::RIGHT;
 };
 REGISTER_ENTITY(ConveyorBelt);
+REGISTER_ENTITY_SYMBOL(ConveyorBelt, 24, eDirection::UP);
+REGISTER_ENTITY_SYMBOL(ConveyorBelt, 25, eDirection::DOWN);
+REGISTER_ENTITY_SYMBOL(ConveyorBelt, 26, eDirection::RIGHT);
+REGISTER_ENTITY_SYMBOL(ConveyorBelt, 27, eDirection::LEFT);
 
 class ExplosiveBarel : public Entity {
  public:
@@ -619,6 +646,7 @@ class ExplosiveBarel : public Entity {
   bool active_ = false;
 };
 REGISTER_ENTITY(ExplosiveBarel);
+REGISTER_ENTITY_SYMBOL(ExplosiveBarel, 'X');
 
 class Wire : public Entity {
  public:
@@ -631,6 +659,7 @@ class Wire : public Entity {
   std::vector<int> Tags() const override { return {}; }
 };
 REGISTER_ENTITY(Wire);
+REGISTER_ENTITY_SYMBOL(Wire, '.');
 
 class ProxySensor : public Entity {
  public:
@@ -653,6 +682,7 @@ class ProxySensor : public Entity {
   std::vector<int> last_entity_ids_;
 };
 REGISTER_ENTITY(ProxySensor);
+REGISTER_ENTITY_SYMBOL(ProxySensor, 'p');
 
 class Message : public Entity {
  public:
@@ -674,6 +704,7 @@ class Message : public Entity {
   std::string message_;
 };
 REGISTER_ENTITY(Message);
+REGISTER_ENTITY_SYMBOL(Message, '?');
 
 class Turret : public Entity {
  public:
@@ -711,6 +742,7 @@ class Turret : public Entity {
   int attack_dir = 1;
 };
 REGISTER_ENTITY(Turret);
+REGISTER_ENTITY_SYMBOL(Turret, 't');
 
 class Robot : public Entity {
  public:
@@ -750,6 +782,7 @@ class Robot : public Entity {
   bool attacking_ = false;
 };
 REGISTER_ENTITY(Robot);
+REGISTER_ENTITY_SYMBOL(Robot, 'r');
 
 class Goliat : public Entity {
  public:
@@ -788,6 +821,7 @@ class Goliat : public Entity {
   bool attacking_ = false;
 };
 REGISTER_ENTITY(Goliat);
+REGISTER_ENTITY_SYMBOL(Goliat, 'G');
 
 class Laser : public Entity {
  public:
@@ -871,6 +905,41 @@ class Worm : public Entity {
   int last_target_time_ = 0;
 };
 REGISTER_ENTITY(Worm);
+REGISTER_ENTITY_SYMBOL(Worm, 'W');
+
+// Content of a map file. Used to instantiate maps without re-reading the file.
+struct MapPrototype {
+  struct Object {
+    Vector2i pos;
+    int symbol;
+    std::string message;
+  };
+
+  Vector2i size;
+  // Tile layers. Each layer contains "size.Size()" tiles in row-major order. A
+  // tile is 0 for an empty cell, and symbol + 1 otherwise (like in Tiled).
+  std::vector<std::vector<uint16_t>> layers;
+  std::vector<Object> objects;
+};
+
+MapPrototype LoadPng(std::string_view path);
+MapPrototype LoadTmx(std::string_view path);
+// Former tmx loader based on tinyxml2. Only supports csv layers. Kept as a
+// reference for benchmarking "LoadTmx".
+MapPrototype LoadTmxWithTinyXml(std::string_view path);
+
+// Gets the prototype of a png, tmx or compiled map (see compiled_map.h).
+// Prototypes are cached by path and modification time, and shared in between
+// threads. The modification time of a file is checked at most once per second.
+std::shared_ptr<const MapPrototype> GetMapPrototype(std::string_view path);
+
+// Creates the entity corresponding to a map symbol with the builder registered
+// by REGISTER_ENTITY_SYMBOL. Returns null for empty symbols.
+std::shared_ptr<Entity> CreateEntity(int symbol, const std::string &message);
+
+// Adds the entities of a prototype to an arena. The arena's map is created if
+// it does not exist yet.
+void InstantiateMap(const MapPrototype &prototype, AbstractGameArena *arena);
 
 void InitializeFromPng(std::string_view path,
                        std::function<void(Vector2i pos, RGB color)> builder,
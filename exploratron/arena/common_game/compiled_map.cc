@@ -0,0 +1,225 @@
+#include "exploratron/arena/common_game/compiled_map.h"
+
+#include <string.h>
+
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "exploratron/core/utils/logging.h"
+
+namespace exploratron {
+namespace common_game {
+namespace {
+
+constexpr char kMagic[4] = {'E', 'X', 'P', 'M'};
+constexpr uint32_t kVersion = 1;
+
+// Read-only content of a file. Memory mapped if supported by the platform.
+class MappedFile {
+ public:
+  MappedFile(std::string_view path) {
+#ifdef _WIN32
+    std::ifstream file(std::string(path), std::ios::binary);
+    CHECK(file.is_open()) << " Cannot open " << path;
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    content_ = buffer.str();
+    data_ = content_.data();
+    size_ = content_.size();
+#else
+    const int fd = open(std::string(path).c_str(), O_RDONLY);
+    CHECK(fd >= 0) << " Cannot open " << path;
+    struct stat file_stat;
+    CHECK(fstat(fd, &file_stat) == 0) << " Cannot stat " << path;
+    size_ = file_stat.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      CHECK(data != MAP_FAILED) << " Cannot map " << path;
+      data_ = static_cast<const char *>(data);
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#ifndef _WIN32
+    if (data_) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  std::string content_;
+#endif
+};
+
+// Pointers to the sections of a compiled map.
+struct CompiledMapView {
+  const CompiledMapHeader *header;
+  const uint16_t *tiles;
+  const CompiledMapObject *objects;
+  const char *string_pool;
+
+  Vector2i size() const { return {header->width, header->height}; }
+  // Does not overflow since the width and height are non-negative int32.
+  uint64_t num_tiles() const {
+    return static_cast<uint64_t>(header->width) * header->height;
+  }
+
+  std::string_view message(const CompiledMapObject &object) const {
+    return std::string_view(string_pool + object.message_begin,
+                            object.message_size);
+  }
+};
+
+uint64_t PaddedTilesSize(const uint64_t num_tiles) {
+  return (num_tiles * sizeof(uint16_t) + 3) / 4 * 4;
+}
+
+CompiledMapView ParseCompiledMap(const char *data, const size_t size,
+                                 std::string_view path) {
+  CHECK_GE(size, sizeof(CompiledMapHeader)) << " Invalid compiled map " << path;
+  CompiledMapView view;
+  view.header = reinterpret_cast<const CompiledMapHeader *>(data);
+  CHECK(memcmp(view.header->magic, kMagic, sizeof(kMagic)) == 0)
+      << " Invalid compiled map " << path;
+  CHECK_EQ(view.header->version, kVersion)
+      << " Unsupported compiled map version in " << path;
+  CHECK_GE(view.header->width, 0);
+  CHECK_GE(view.header->height, 0);
+
+  // The sizes are computed in 64 bits, and the tiles are bounded by the file
+  // size before being multiplied, so that a corrupted header cannot wrap them.
+  const uint64_t num_tiles = view.num_tiles();
+  const uint64_t num_layers = view.header->num_layers;
+  CHECK(num_layers == 0 || num_tiles <= size / sizeof(uint16_t) / num_layers)
+      << " Invalid compiled map " << path;
+  const uint64_t tiles_offset = sizeof(CompiledMapHeader);
+  const uint64_t objects_offset =
+      tiles_offset + PaddedTilesSize(num_tiles * num_layers);
+  const uint64_t string_pool_offset =
+      objects_offset + static_cast<uint64_t>(sizeof(CompiledMapObject)) *
+                           view.header->num_objects;
+  CHECK_EQ(string_pool_offset + view.header->string_pool_size, size)
+      << " Invalid compiled map " << path;
+
+  view.tiles = reinterpret_cast<const uint16_t *>(data + tiles_offset);
+  view.objects =
+      reinterpret_cast<const CompiledMapObject *>(data + objects_offset);
+  view.string_pool = data + string_pool_offset;
+
+  for (int object_idx = 0; object_idx < view.header->num_objects;
+       object_idx++) {
+    const auto &object = view.objects[object_idx];
+    CHECK_LE(static_cast<size_t>(object.message_begin) + object.message_size,
+             view.header->string_pool_size)
+        << " Invalid compiled map " << path;
+    CHECK(object.x >= 0 && object.x < view.header->width && object.y >= 0 &&
+          object.y < view.header->height)
+        << " Object out of the map in " << path;
+  }
+  return view;
+}
+
+template <typename T>
+void AppendRaw(const T &value, std::string *output) {
+  output->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+}  // namespace
+
+bool IsCompiledMap(std::string_view path) {
+  const std::string_view extension(kCompiledMapExtension);
+  return path.size() >= extension.size() &&
+         path.substr(path.size() - extension.size()) == extension;
+}
+
+std::string SerializeCompiledMap(const MapPrototype &prototype) {
+  std::string string_pool;
+  std::vector<CompiledMapObject> objects;
+  objects.reserve(prototype.objects.size());
+  for (const auto &object : prototype.objects) {
+    objects.push_back({object.pos.x, object.pos.y, object.symbol,
+                       static_cast<uint32_t>(string_pool.size()),
+                       static_cast<uint32_t>(object.message.size())});
+    string_pool += object.message;
+  }
+
+  CompiledMapHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.width = prototype.size.x;
+  header.height = prototype.size.y;
+  header.num_layers = prototype.layers.size();
+  header.num_objects = objects.size();
+  header.string_pool_size = string_pool.size();
+
+  std::string output;
+  AppendRaw(header, &output);
+  for (const auto &layer : prototype.layers) {
+    CHECK_EQ(layer.size(), prototype.size.Size());
+    output.append(reinterpret_cast<const char *>(layer.data()),
+                  layer.size() * sizeof(uint16_t));
+  }
+  output.resize(sizeof(CompiledMapHeader) +
+                    PaddedTilesSize(static_cast<size_t>(prototype.size.Size()) *
+                                    prototype.layers.size()),
+                0);
+  for (const auto &object : objects) {
+    AppendRaw(object, &output);
+  }
+  output += string_pool;
+  return output;
+}
+
+void SaveCompiledMap(const MapPrototype &prototype, std::string_view path) {
+  std::ofstream file(std::string(path), std::ios::binary);
+  CHECK(file.is_open()) << " Cannot open " << path;
+  const auto content = SerializeCompiledMap(prototype);
+  file.write(content.data(), content.size());
+  CHECK(file.good()) << " Cannot write " << path;
+}
+
+MapPrototype LoadCompiledMap(std::string_view path) {
+  MappedFile file(path);
+  const auto view = ParseCompiledMap(file.data(), file.size(), path);
+
+  MapPrototype prototype;
+  prototype.size = view.size();
+  prototype.layers.resize(view.header->num_layers);
+  const uint16_t *tiles = view.tiles;
+  for (auto &layer : prototype.layers) {
+    layer.assign(tiles, tiles + view.num_tiles());
+    tiles += view.num_tiles();
+  }
+  prototype.objects.reserve(view.header->num_objects);
+  for (int object_idx = 0; object_idx < view.header->num_objects;
+       object_idx++) {
+    const auto &object = view.objects[object_idx];
+    prototype.objects.push_back({{object.x, object.y},
+                                 object.symbol,
+                                 std::string(view.message(object))});
+  }
+  return prototype;
+}
+
+}  // namespace common_game
+}  // namespace exploratron
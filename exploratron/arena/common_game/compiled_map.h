@@ -0,0 +1,58 @@
+#ifndef EXPLORATRON_AREA_COMMON_GAME_COMPILED_MAP_H_
+#define EXPLORATRON_AREA_COMMON_GAME_COMPILED_MAP_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+#include "exploratron/arena/common_game/common_game.h"
+
+// Compiled maps are a binary version of the tmx maps that can be loaded
+// without parsing. A compiled map file contains, in order:
+//
+//   CompiledMapHeader header;
+//   uint16_t tiles[num_layers][height][width];  // Padded to 4 bytes.
+//   CompiledMapObject objects[num_objects];
+//   char string_pool[string_pool_size];  // Messages of the objects.
+//
+// Values are stored in the host byte order: a map should be compiled on a
+// platform with the same endianness as the one loading it. Tiles follow the
+// "MapPrototype::layers" convention.
+
+namespace exploratron {
+namespace common_game {
+
+constexpr char kCompiledMapExtension[] = ".cmap";
+
+struct CompiledMapHeader {
+  char magic[4];
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  uint32_t num_layers;
+  uint32_t num_objects;
+  uint32_t string_pool_size;
+};
+
+struct CompiledMapObject {
+  int32_t x;
+  int32_t y;
+  int32_t symbol;
+  // Message of the object in the string pool.
+  uint32_t message_begin;
+  uint32_t message_size;
+};
+
+// Tests if a path is a compiled map.
+bool IsCompiledMap(std::string_view path);
+
+// Serializes a map prototype into a compiled map.
+std::string SerializeCompiledMap(const MapPrototype &prototype);
+void SaveCompiledMap(const MapPrototype &prototype, std::string_view path);
+
+MapPrototype LoadCompiledMap(std::string_view path);
+
+}  // namespace common_game
+}  // namespace exploratron
+#endif
@@ -0,0 +1,578 @@
+#include "exploratron/arena/common_game/tmx_reader.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <array>
+#include <charconv>
+#include <fstream>
+#include <memory>
+#include <optional>
+
+#ifdef TMX_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef TMX_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "exploratron/core/utils/logging.h"
+
+namespace exploratron {
+namespace common_game {
+namespace {
+
+// Size of the intermediate buffers used to decode the layers.
+constexpr int kBufferSize = 16384;
+
+// Bits of the Tiled global tile ids used for flipping and rotation.
+constexpr uint32_t kGidFlagsMask = 0xF0000000;
+
+struct XmlTag {
+  std::string_view name;
+  std::string_view attributes;
+  // </name>
+  bool closing = false;
+  // <name/>
+  bool self_closing = false;
+};
+
+// Iterates over the tags of a XML document.
+class XmlScanner {
+ public:
+  XmlScanner(std::string_view content) : content_(content) {}
+
+  // Moves to the next tag. Returns false at the end of the document.
+  bool Next(XmlTag *tag) {
+    while (true) {
+      const auto begin = content_.find('<', pos_);
+      if (begin == std::string_view::npos) {
+        return false;
+      }
+      pos_ = begin + 1;
+
+      // Prolog, comments, doctype and cdata.
+      if (Skip("?", "?>") || Skip("!--", "-->") || Skip("![CDATA[", "]]>") ||
+          Skip("!", ">")) {
+        continue;
+      }
+
+      *tag = {};
+      if (pos_ < content_.size() && content_[pos_] == '/') {
+        tag->closing = true;
+        pos_++;
+      }
+      const auto name_begin = pos_;
+      while (pos_ < content_.size() && !IsSpace(content_[pos_]) &&
+             content_[pos_] != '>' && content_[pos_] != '/') {
+        pos_++;
+      }
+      tag->name = content_.substr(name_begin, pos_ - name_begin);
+
+      // Find the end of the tag, ignoring the quoted attribute values.
+      const auto attributes_begin = pos_;
+      char quote = 0;
+      while (pos_ < content_.size()) {
+        const char c = content_[pos_];
+        if (quote) {
+          if (c == quote) {
+            quote = 0;
+          }
+        } else if (c == '"' || c == '\'') {
+          quote = c;
+        } else if (c == '>') {
+          break;
+        }
+        pos_++;
+      }
+      CHECK(pos_ < content_.size()) << " Unterminated XML tag " << tag->name;
+      auto attributes_end = pos_;
+      if (attributes_end > attributes_begin &&
+          content_[attributes_end - 1] == '/') {
+        tag->self_closing = true;
+        attributes_end--;
+      }
+      tag->attributes =
+          content_.substr(attributes_begin, attributes_end - attributes_begin);
+      pos_++;
+      return true;
+    }
+  }
+
+  // Returns the text until the closing tag "name", and moves after it.
+  std::string_view TextUntilClosing(std::string_view name) {
+    const auto closing = std::string("</").append(name);
+    const auto end = content_.find(closing, pos_);
+    CHECK(end != std::string_view::npos) << " Missing XML tag " << closing;
+    const auto text = content_.substr(pos_, end - pos_);
+    pos_ = content_.find('>', end);
+    CHECK(pos_ != std::string_view::npos);
+    pos_++;
+    return text;
+  }
+
+  static bool IsSpace(const char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+ private:
+  // Skips a section starting with "begin" and ending with "end".
+  bool Skip(std::string_view begin, std::string_view end) {
+    if (content_.substr(pos_, begin.size()) != begin) {
+      return false;
+    }
+    const auto end_pos = content_.find(end, pos_ + begin.size());
+    CHECK(end_pos != std::string_view::npos) << " Missing XML " << end;
+    pos_ = end_pos + end.size();
+    return true;
+  }
+
+  std::string_view content_;
+  size_t pos_ = 0;
+};
+
+// Gets the raw (i.e. not unescaped) value of an attribute.
+std::optional<std::string_view> GetAttribute(std::string_view attributes,
+                                             std::string_view name) {
+  size_t pos = 0;
+  while (true) {
+    while (pos < attributes.size() && XmlScanner::IsSpace(attributes[pos])) {
+      pos++;
+    }
+    if (pos >= attributes.size()) {
+      return {};
+    }
+    const auto name_begin = pos;
+    while (pos < attributes.size() && attributes[pos] != '=' &&
+           !XmlScanner::IsSpace(attributes[pos])) {
+      pos++;
+    }
+    const auto attribute_name = attributes.substr(name_begin, pos - name_begin);
+    while (pos < attributes.size() && attributes[pos] != '"' &&
+           attributes[pos] != '\'') {
+      pos++;
+    }
+    if (pos >= attributes.size()) {
+      return {};
+    }
+    const char quote = attributes[pos++];
+    const auto value_end = attributes.find(quote, pos);
+    if (value_end == std::string_view::npos) {
+      return {};
+    }
+    if (attribute_name == name) {
+      return attributes.substr(pos, value_end - pos);
+    }
+    pos = value_end + 1;
+  }
+}
+
+// Parses the integer part of an attribute value (e.g. "12.5" -> 12).
+int GetIntAttribute(std::string_view attributes, std::string_view name,
+                    const int default_value = 0) {
+  const auto value = GetAttribute(attributes, name);
+  if (!value.has_value()) {
+    return default_value;
+  }
+  int result = default_value;
+  std::from_chars(value->data(), value->data() + value->size(), result);
+  return result;
+}
+
+std::string UnescapeXml(std::string_view value) {
+  std::string result;
+  result.reserve(value.size());
+  size_t pos = 0;
+  while (pos < value.size()) {
+    const auto amp = value.find('&', pos);
+    if (amp == std::string_view::npos) {
+      result.append(value.substr(pos));
+      break;
+    }
+    result.append(value.substr(pos, amp - pos));
+    const auto semicolon = value.find(';', amp);
+    CHECK(semicolon != std::string_view::npos) << " Invalid XML entity";
+    const auto entity = value.substr(amp + 1, semicolon - amp - 1);
+    if (entity == "lt") {
+      result += '<';
+    } else if (entity == "gt") {
+      result += '>';
+    } else if (entity == "amp") {
+      result += '&';
+    } else if (entity == "quot") {
+      result += '"';
+    } else if (entity == "apos") {
+      result += '\'';
+    } else if (!entity.empty() && entity[0] == '#') {
+      int code = 0;
+      if (entity.size() > 1 && entity[1] == 'x') {
+        std::from_chars(entity.data() + 2, entity.data() + entity.size(), code,
+                        16);
+      } else {
+        std::from_chars(entity.data() + 1, entity.data() + entity.size(), code);
+      }
+      // Only ASCII characters are used in the maps.
+      result += static_cast<char>(code);
+    } else {
+      LOG(FATAL) << "Unknown XML entity &" << entity << ";";
+    }
+    pos = semicolon + 1;
+  }
+  return result;
+}
+
+// Receives the tiles of a layer in row-major order.
+class TileSink {
+ public:
+  TileSink(Vector2i size, int layer_idx, const TmxReaderCallbacks &callbacks)
+      : size_(size), layer_idx_(layer_idx), callbacks_(callbacks) {}
+
+  void Add(uint32_t gid) {
+    gid &= ~kGidFlagsMask;
+    if (gid > 0 && num_tiles_ < size_.Size()) {
+      callbacks_.tile(layer_idx_, {num_tiles_ % size_.x, num_tiles_ / size_.x},
+                      gid);
+    }
+    num_tiles_++;
+  }
+
+  void Finalize() const {
+    CHECK_EQ(num_tiles_, size_.Size())
+        << " Unexpected number of tiles in layer " << layer_idx_;
+  }
+
+ private:
+  Vector2i size_;
+  int layer_idx_;
+  int num_tiles_ = 0;
+  const TmxReaderCallbacks &callbacks_;
+};
+
+// Converts a stream of bytes into little-endian 32 bits tiles.
+class ByteSink {
+ public:
+  ByteSink(TileSink *tiles) : tiles_(tiles) {}
+
+  void Add(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      value_ |= static_cast<uint32_t>(data[i]) << (8 * num_bytes_);
+      if (++num_bytes_ == 4) {
+        tiles_->Add(value_);
+        value_ = 0;
+        num_bytes_ = 0;
+      }
+    }
+  }
+
+  void Finalize() const {
+    CHECK_EQ(num_bytes_, 0) << " Truncated layer data";
+    tiles_->Finalize();
+  }
+
+ private:
+  TileSink *tiles_;
+  uint32_t value_ = 0;
+  int num_bytes_ = 0;
+};
+
+void DecodeCsv(std::string_view text, TileSink *tiles) {
+  uint32_t value = 0;
+  bool has_value = false;
+  for (const char c : text) {
+    if (c >= '0' && c <= '9') {
+      value = value * 10 + (c - '0');
+      has_value = true;
+    } else if (c == ',' || XmlScanner::IsSpace(c)) {
+      if (has_value) {
+        tiles->Add(value);
+        value = 0;
+        has_value = false;
+      }
+    } else {
+      LOG(FATAL) << "Unexpected character '" << c << "' in csv layer";
+    }
+  }
+  if (has_value) {
+    tiles->Add(value);
+  }
+  tiles->Finalize();
+}
+
+constexpr std::array<int8_t, 256> BuildBase64Table() {
+  std::array<int8_t, 256> table{};
+  for (auto &v : table) {
+    v = -1;
+  }
+  for (int i = 0; i < 26; i++) {
+    table['A' + i] = i;
+    table['a' + i] = 26 + i;
+  }
+  for (int i = 0; i < 10; i++) {
+    table['0' + i] = 52 + i;
+  }
+  table['+'] = 62;
+  table['/'] = 63;
+  return table;
+}
+
+// Decodes base64 text, and sends the bytes to "output" by chunks.
+template <typename Output>
+void DecodeBase64(std::string_view text, Output output) {
+  static constexpr auto kTable = BuildBase64Table();
+  uint8_t buffer[kBufferSize];
+  int buffer_size = 0;
+  uint32_t bits = 0;
+  int num_bits = 0;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    // Fast path: Four characters (i.e. three bytes) without whitespaces.
+    if (num_bits == 0 && pos + 4 <= text.size() &&
+        buffer_size + 3 <= kBufferSize) {
+      const int8_t v0 = kTable[static_cast<uint8_t>(text[pos])];
+      const int8_t v1 = kTable[static_cast<uint8_t>(text[pos + 1])];
+      const int8_t v2 = kTable[static_cast<uint8_t>(text[pos + 2])];
+      const int8_t v3 = kTable[static_cast<uint8_t>(text[pos + 3])];
+      if ((v0 | v1 | v2 | v3) >= 0) {
+        const uint32_t v = (v0 << 18) | (v1 << 12) | (v2 << 6) | v3;
+        buffer[buffer_size++] = static_cast<uint8_t>(v >> 16);
+        buffer[buffer_size++] = static_cast<uint8_t>(v >> 8);
+        buffer[buffer_size++] = static_cast<uint8_t>(v);
+        if (buffer_size + 3 > kBufferSize) {
+          output(buffer, buffer_size);
+          buffer_size = 0;
+        }
+        pos += 4;
+        continue;
+      }
+    }
+
+    const char c = text[pos++];
+    if (c == '=') {
+      break;
+    }
+    const int8_t v = kTable[static_cast<uint8_t>(c)];
+    if (v < 0) {
+      CHECK(XmlScanner::IsSpace(c))
+          << " Unexpected character '" << c << "' in base64 layer";
+      continue;
+    }
+    bits = (bits << 6) | v;
+    num_bits += 6;
+    if (num_bits >= 8) {
+      num_bits -= 8;
+      buffer[buffer_size++] = static_cast<uint8_t>(bits >> num_bits);
+      if (buffer_size == kBufferSize) {
+        output(buffer, buffer_size);
+        buffer_size = 0;
+      }
+    }
+  }
+  if (buffer_size > 0) {
+    output(buffer, buffer_size);
+  }
+}
+
+#ifdef TMX_WITH_ZLIB
+// Decompresses a zlib or gzip stream.
+class ZlibDecoder {
+ public:
+  ZlibDecoder(ByteSink *output) : output_(output) {
+    memset(&stream_, 0, sizeof(stream_));
+    // +32: Automatic detection of the zlib and gzip headers.
+    CHECK_EQ(inflateInit2(&stream_, 15 + 32), Z_OK);
+  }
+  ~ZlibDecoder() { inflateEnd(&stream_); }
+
+  void Add(const uint8_t *data, size_t size) {
+    stream_.next_in = const_cast<Bytef *>(data);
+    stream_.avail_in = size;
+    int ret;
+    do {
+      stream_.next_out = buffer_;
+      stream_.avail_out = kBufferSize;
+      ret = inflate(&stream_, Z_NO_FLUSH);
+      CHECK(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR)
+          << " Invalid zlib layer data: " << ret;
+      output_->Add(buffer_, kBufferSize - stream_.avail_out);
+    } while (stream_.avail_out == 0 && ret != Z_STREAM_END);
+  }
+
+ private:
+  ByteSink *output_;
+  z_stream stream_;
+  uint8_t buffer_[kBufferSize];
+};
+#endif
+
+#ifdef TMX_WITH_ZSTD
+// Decompresses a zstd stream.
+class ZstdDecoder {
+ public:
+  ZstdDecoder(ByteSink *output)
+      : output_(output), context_(ZSTD_createDCtx()) {
+    CHECK(context_);
+  }
+  ~ZstdDecoder() { ZSTD_freeDCtx(context_); }
+
+  void Add(const uint8_t *data, size_t size) {
+    ZSTD_inBuffer input{data, size, 0};
+    bool output_full = true;
+    while (input.pos < input.size || output_full) {
+      ZSTD_outBuffer output{buffer_, kBufferSize, 0};
+      const size_t ret = ZSTD_decompressStream(context_, &output, &input);
+      CHECK(!ZSTD_isError(ret))
+          << " Invalid zstd layer data: " << ZSTD_getErrorName(ret);
+      output_->Add(buffer_, output.pos);
+      output_full = output.pos == output.size;
+    }
+  }
+
+ private:
+  ByteSink *output_;
+  ZSTD_DCtx *context_;
+  uint8_t buffer_[kBufferSize];
+};
+#endif
+
+void DecodeLayer(std::string_view encoding, std::string_view compression,
+                 std::string_view text, TileSink *tiles) {
+  if (encoding == "csv") {
+    CHECK(compression.empty()) << " csv layers cannot be compressed";
+    DecodeCsv(text, tiles);
+    return;
+  }
+  CHECK(encoding == "base64") << " Unsupported layer encoding \"" << encoding
+                              << "\"";
+  ByteSink bytes(tiles);
+  if (compression.empty()) {
+    DecodeBase64(text, [&](const uint8_t *data, size_t size) {
+      bytes.Add(data, size);
+    });
+  } else if (compression == "zlib" || compression == "gzip") {
+#ifdef TMX_WITH_ZLIB
+    auto decoder = std::make_unique<ZlibDecoder>(&bytes);
+    DecodeBase64(text, [&](const uint8_t *data, size_t size) {
+      decoder->Add(data, size);
+    });
+#else
+    LOG(FATAL) << "Layer compression \"" << compression
+               << "\" requires --define=tmx_zlib=1";
+#endif
+  } else if (compression == "zstd") {
+#ifdef TMX_WITH_ZSTD
+    auto decoder = std::make_unique<ZstdDecoder>(&bytes);
+    DecodeBase64(text, [&](const uint8_t *data, size_t size) {
+      decoder->Add(data, size);
+    });
+#else
+    LOG(FATAL) << "Layer compression \"" << compression
+               << "\" requires --define=tmx_zstd=1";
+#endif
+  } else {
+    LOG(FATAL) << "Unsupported layer compression \"" << compression << "\"";
+  }
+  bytes.Finalize();
+}
+
+}  // namespace
+
+void ReadTmx(std::string_view path, const TmxReaderCallbacks &callbacks) {
+  std::ifstream file(std::string(path), std::ios::binary);
+  CHECK(file.is_open()) << " Cannot open " << path;
+  std::string content;
+  file.seekg(0, std::ios::end);
+  content.resize(file.tellg());
+  file.seekg(0, std::ios::beg);
+  file.read(content.data(), content.size());
+  CHECK(file.good()) << " Cannot read " << path;
+  ReadTmxContent(content, callbacks);
+}
+
+void ReadTmxContent(std::string_view content,
+                    const TmxReaderCallbacks &callbacks) {
+  XmlScanner scanner(content);
+  XmlTag tag;
+
+  bool has_map = false;
+  Vector2i size;
+  Vector2i tile_size;
+
+  int layer_idx = -1;
+  bool in_layer = false;
+
+  bool in_object = false;
+  Vector2i object_pos;
+  int object_gid = 0;
+  bool object_in_map = false;
+  std::string object_message;
+
+  const auto emit_object = [&]() {
+    if (object_in_map) {
+      callbacks.object(object_pos, object_gid, object_message);
+    }
+    in_object = false;
+  };
+
+  while (scanner.Next(&tag)) {
+    if (tag.closing) {
+      if (tag.name == "layer") {
+        in_layer = false;
+      } else if (tag.name == "object" && in_object) {
+        emit_object();
+      }
+      continue;
+    }
+
+    if (tag.name == "map") {
+      CHECK(!has_map) << " Multiple maps";
+      CHECK_EQ(GetIntAttribute(tag.attributes, "infinite"), 0)
+          << " Infinite maps are not supported";
+      size = {GetIntAttribute(tag.attributes, "width"),
+              GetIntAttribute(tag.attributes, "height")};
+      tile_size = {GetIntAttribute(tag.attributes, "tilewidth", 16),
+                   GetIntAttribute(tag.attributes, "tileheight", 16)};
+      has_map = true;
+      callbacks.map(size);
+    } else if (tag.name == "layer") {
+      CHECK(has_map);
+      layer_idx++;
+      in_layer = !tag.self_closing;
+      callbacks.layer(layer_idx);
+    } else if (tag.name == "data" && in_layer && !tag.self_closing) {
+      const auto encoding = GetAttribute(tag.attributes, "encoding");
+      CHECK(encoding.has_value()) << " XML layers are not supported";
+      const auto compression =
+          GetAttribute(tag.attributes, "compression").value_or("");
+      TileSink tiles(size, layer_idx, callbacks);
+      DecodeLayer(*encoding, compression, scanner.TextUntilClosing("data"),
+                  &tiles);
+    } else if (tag.name == "object") {
+      CHECK(has_map);
+      const int gid = GetIntAttribute(tag.attributes, "gid");
+      const int x = GetIntAttribute(tag.attributes, "x");
+      const int y = GetIntAttribute(tag.attributes, "y");
+      CHECK(gid >= 0);
+      CHECK(x >= 0);
+      CHECK(y >= 0);
+      in_object = true;
+      object_gid = gid;
+      // Tile objects are anchored on their bottom-left corner.
+      object_pos = {x / tile_size.x, y / tile_size.y - 1};
+      object_in_map = x < size.x * tile_size.x && y < size.y * tile_size.y;
+      object_message.clear();
+      if (tag.self_closing) {
+        emit_object();
+      }
+    } else if (tag.name == "property" && in_object) {
+      if (GetAttribute(tag.attributes, "name") == "message") {
+        object_message =
+            UnescapeXml(GetAttribute(tag.attributes, "value").value_or(""));
+      }
+    }
+  }
+  CHECK(has_map) << " No map found";
+}
+
+}  // namespace common_game
+}  // namespace exploratron
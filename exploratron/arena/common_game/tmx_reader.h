@@ -0,0 +1,44 @@
+#ifndef EXPLORATRON_AREA_COMMON_GAME_TMX_READER_H_
+#define EXPLORATRON_AREA_COMMON_GAME_TMX_READER_H_
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "exploratron/core/utils/maths.h"
+
+// Streaming reader for the tmx map format of Tiled.
+// See https://doc.mapeditor.org/en/stable/reference/tmx-map-format/
+//
+// The file is scanned in a single pass, without building a XML document, and
+// the tiles are decoded directly into the callbacks. Supported layer
+// encodings are csv, base64, base64+zlib/gzip (requires TMX_WITH_ZLIB) and
+// base64+zstd (requires TMX_WITH_ZSTD).
+
+namespace exploratron {
+namespace common_game {
+
+struct TmxReaderCallbacks {
+  // Called once with the size of the map (in tiles), before any other
+  // callback.
+  std::function<void(Vector2i size)> map;
+  // Called at the start of each tile layer.
+  std::function<void(int layer_idx)> layer;
+  // Called for each non-empty tile of a layer. "gid" is the Tiled global tile
+  // id (>0) without the flip flags.
+  std::function<void(int layer_idx, Vector2i pos, int gid)> tile;
+  // Called for each tile object inside the map. "message" is the value of the
+  // "message" property of the object, if any.
+  std::function<void(Vector2i pos, int gid, const std::string &message)>
+      object;
+};
+
+void ReadTmx(std::string_view path, const TmxReaderCallbacks &callbacks);
+
+// Same as "ReadTmx", but reads the content of a tmx file already in memory.
+void ReadTmxContent(std::string_view content,
+                    const TmxReaderCallbacks &callbacks);
+
+}  // namespace common_game
+}  // namespace exploratron
+#endif
@@ -0,0 +1,248 @@
+// Benchmarks the streaming tmx reader ("LoadTmx") against the tinyxml2 based
+// loader ("LoadTmxWithTinyXml") on the bundled maps, and on a synthetic
+// 1024x1024 map saved with each of the supported layer encodings.
+//
+// Usage example:
+//   bazel run -c opt --config=linux
+//     //exploratron/arena/common_game:tmx_reader_benchmark
+//     -- --map_dir=$(pwd)/exploratron/assets/map
+//
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef TMX_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef TMX_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_cat.h"
+#include "exploratron/arena/common_game/common_game.h"
+#include "exploratron/core/utils/logging.h"
+
+ABSL_FLAG(std::string, map_dir, "exploratron/assets/map",
+          "Directory containing the bundled maps.");
+ABSL_FLAG(int, repetitions, 20, "Number of loads of each map.");
+ABSL_FLAG(int, synthetic_size, 1024,
+          "Width and height of the synthetic map.");
+
+namespace exploratron {
+namespace {
+
+// Average loading time, in milliseconds.
+template <typename Loader>
+double TimeLoad(Loader loader, const std::string &path) {
+  const int repetitions = absl::GetFlag(FLAGS_repetitions);
+  int num_objects = 0;
+  const auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < repetitions; i++) {
+    num_objects += loader(path).objects.size();
+  }
+  const auto end = std::chrono::steady_clock::now();
+  CHECK_GE(num_objects, 0);
+  return std::chrono::duration<double, std::milli>(end - begin).count() /
+         repetitions;
+}
+
+std::string EncodeBase64(const std::string &data) {
+  static constexpr char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string result;
+  result.reserve((data.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < data.size(); i += 3) {
+    const uint32_t v = (static_cast<uint8_t>(data[i]) << 16) |
+                       (static_cast<uint8_t>(data[i + 1]) << 8) |
+                       static_cast<uint8_t>(data[i + 2]);
+    result += kAlphabet[(v >> 18) & 63];
+    result += kAlphabet[(v >> 12) & 63];
+    result += kAlphabet[(v >> 6) & 63];
+    result += kAlphabet[v & 63];
+  }
+  if (i + 1 == data.size()) {
+    const uint32_t v = static_cast<uint8_t>(data[i]) << 16;
+    result += kAlphabet[(v >> 18) & 63];
+    result += kAlphabet[(v >> 12) & 63];
+    result += "==";
+  } else if (i + 2 == data.size()) {
+    const uint32_t v = (static_cast<uint8_t>(data[i]) << 16) |
+                       (static_cast<uint8_t>(data[i + 1]) << 8);
+    result += kAlphabet[(v >> 18) & 63];
+    result += kAlphabet[(v >> 12) & 63];
+    result += kAlphabet[(v >> 6) & 63];
+    result += '=';
+  }
+  return result;
+}
+
+// Encodes a layer. Returns the attributes and the content of the "data" tag.
+std::pair<std::string, std::string> EncodeLayer(
+    const std::vector<uint32_t> &tiles, const int width,
+    const std::string &encoding) {
+  if (encoding == "csv") {
+    std::string csv = "\n";
+    for (size_t tile_idx = 0; tile_idx < tiles.size(); tile_idx++) {
+      absl::StrAppend(&csv, tiles[tile_idx]);
+      if (tile_idx + 1 < tiles.size()) {
+        csv += ',';
+      }
+      if ((tile_idx + 1) % width == 0) {
+        csv += '\n';
+      }
+    }
+    return {"encoding=\"csv\"", csv};
+  }
+
+  std::string raw(tiles.size() * sizeof(uint32_t), 0);
+  for (size_t tile_idx = 0; tile_idx < tiles.size(); tile_idx++) {
+    for (int byte_idx = 0; byte_idx < 4; byte_idx++) {
+      raw[tile_idx * 4 + byte_idx] = (tiles[tile_idx] >> (8 * byte_idx)) & 0xFF;
+    }
+  }
+  if (encoding == "base64") {
+    return {"encoding=\"base64\"", EncodeBase64(raw)};
+  }
+#ifdef TMX_WITH_ZLIB
+  if (encoding == "base64+zlib") {
+    uLongf size = compressBound(raw.size());
+    std::string compressed(size, 0);
+    CHECK_EQ(compress(reinterpret_cast<Bytef *>(compressed.data()), &size,
+                      reinterpret_cast<const Bytef *>(raw.data()), raw.size()),
+             Z_OK);
+    compressed.resize(size);
+    return {"encoding=\"base64\" compression=\"zlib\"",
+            EncodeBase64(compressed)};
+  }
+#endif
+#ifdef TMX_WITH_ZSTD
+  if (encoding == "base64+zstd") {
+    std::string compressed(ZSTD_compressBound(raw.size()), 0);
+    const size_t size = ZSTD_compress(compressed.data(), compressed.size(),
+                                      raw.data(), raw.size(), 3);
+    CHECK(!ZSTD_isError(size));
+    compressed.resize(size);
+    return {"encoding=\"base64\" compression=\"zstd\"",
+            EncodeBase64(compressed)};
+  }
+#endif
+  LOG(FATAL) << "Unsupported encoding " << encoding;
+  return {};
+}
+
+// Saves a synthetic map with two layers (ground and walls) and objects.
+void SaveSyntheticMap(const std::string &path, const int size,
+                      const std::string &encoding) {
+  std::mt19937 rnd(1234);
+  std::vector<uint32_t> ground(size * size);
+  std::vector<uint32_t> walls(size * size);
+  for (int cell_idx = 0; cell_idx < size * size; cell_idx++) {
+    // Empty cells, floor and a few wall variations of the tileset.
+    ground[cell_idx] = std::uniform_int_distribution<int>(0, 1)(rnd);
+    walls[cell_idx] = std::uniform_int_distribution<int>(0, 9)(rnd) == 0
+                          ? 220 + std::uniform_int_distribution<int>(0, 3)(rnd)
+                          : 0;
+  }
+
+  std::ofstream file(path);
+  CHECK(file.is_open()) << " Cannot open " << path;
+  file << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+       << "<map version=\"1.5\" orientation=\"orthogonal\" "
+          "renderorder=\"right-down\" width=\""
+       << size << "\" height=\"" << size
+       << "\" tilewidth=\"16\" tileheight=\"16\" infinite=\"0\">\n"
+       << " <tileset firstgid=\"1\" source=\"tileset.tsx\"/>\n";
+  int layer_id = 1;
+  for (const auto *layer : {&ground, &walls}) {
+    const auto [attributes, data] = EncodeLayer(*layer, size, encoding);
+    file << " <layer id=\"" << layer_id << "\" name=\"layer_" << layer_id
+         << "\" width=\"" << size << "\" height=\"" << size << "\">\n"
+         << "  <data " << attributes << ">" << data << "</data>\n"
+         << " </layer>\n";
+    layer_id++;
+  }
+  file << " <objectgroup id=\"3\" name=\"objects\">\n";
+  for (int object_idx = 0; object_idx < size; object_idx++) {
+    file << "  <object id=\"" << object_idx + 4 << "\" gid=\"238\" x=\""
+         << object_idx * 16 << "\" y=\"" << (object_idx + 1) * 16
+         << "\" width=\"16\" height=\"16\">\n"
+         << "   <properties>\n"
+         << "    <property name=\"message\" value=\"Message "
+         << object_idx << "\"/>\n"
+         << "   </properties>\n"
+         << "  </object>\n";
+  }
+  file << " </objectgroup>\n</map>\n";
+  CHECK(file.good()) << " Cannot write " << path;
+}
+
+// Checks that two loaders read the same map.
+void CheckSameMap(const common_game::MapPrototype &a,
+                  const common_game::MapPrototype &b) {
+  CHECK(a.size == b.size);
+  CHECK(a.layers == b.layers);
+  CHECK_EQ(a.objects.size(), b.objects.size());
+  for (size_t i = 0; i < a.objects.size(); i++) {
+    CHECK(a.objects[i].pos == b.objects[i].pos);
+    CHECK_EQ(a.objects[i].symbol, b.objects[i].symbol);
+    CHECK_EQ(a.objects[i].message, b.objects[i].message);
+  }
+}
+
+// "with_tinyxml": Also benchmark the tinyxml2 loader. Only for csv layers.
+void Report(const std::string &name, const std::string &path,
+            const bool with_tinyxml) {
+  const double streaming = TimeLoad(common_game::LoadTmx, path);
+  std::string line = absl::StrCat(name, ": streaming ", streaming, " ms");
+  if (with_tinyxml) {
+    CheckSameMap(common_game::LoadTmx(path),
+                 common_game::LoadTmxWithTinyXml(path));
+    const double tinyxml = TimeLoad(common_game::LoadTmxWithTinyXml, path);
+    absl::StrAppend(&line, ", tinyxml2 ", tinyxml, " ms, speedup x",
+                    tinyxml / streaming);
+  }
+  LOG(INFO) << line;
+}
+
+void Benchmark() {
+  const auto map_dir = absl::GetFlag(FLAGS_map_dir);
+  for (const auto &entry : std::filesystem::directory_iterator(map_dir)) {
+    if (entry.path().extension() == ".tmx") {
+      Report(entry.path().filename().string(), entry.path().string(),
+             /*with_tinyxml=*/true);
+    }
+  }
+
+  const int size = absl::GetFlag(FLAGS_synthetic_size);
+  std::vector<std::string> encodings = {"csv", "base64"};
+#ifdef TMX_WITH_ZLIB
+  encodings.push_back("base64+zlib");
+#endif
+#ifdef TMX_WITH_ZSTD
+  encodings.push_back("base64+zstd");
+#endif
+  for (const auto &encoding : encodings) {
+    const auto path = (std::filesystem::temp_directory_path() /
+                       absl::StrCat("synthetic_", size, "_", encoding, ".tmx"))
+                          .string();
+    SaveSyntheticMap(path, size, encoding);
+    Report(absl::StrCat("synthetic ", size, "x", size, " ", encoding), path,
+           /*with_tinyxml=*/encoding == "csv");
+    std::filesystem::remove(path);
+  }
+}
+
+}  // namespace
+}  // namespace exploratron
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  exploratron::Benchmark();
+}
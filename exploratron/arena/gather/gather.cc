@@ -37,12 +37,34 @@ GatherArena::GatherArena(
   rnd.seed(seed);
 
   options_ = options;
+  initial_options_ = options;
   map_def = BuildMapDefinition(options_);
   DCHECK_EQ(controller_builders.size(), 1);
   controller_ = controller_builders[0]->Create(map_def);
 
   input.surouding.Initialize(map_def.shape);
 
+  InitializeCells();
+
+  InitRandom(&rnd);
+}
+
+bool GatherArena::Reset(
+    const std::vector<const AbstractControllerBuilder *> &controller_builders,
+    uint64_t seed) {
+  rnd.seed(seed);
+  options_ = initial_options_;
+  DCHECK_EQ(controller_builders.size(), 1);
+  controller_ = controller_builders[0]->Create(map_def);
+  num_food = 0;
+  num_coins = 0;
+  score = 0;
+  last_score_step = -1;
+  InitializeCells();
+  return true;
+}
+
+void GatherArena::InitializeCells() {
   cells_.assign(options_.width_ * options_.height_, {});
 
   for (int y = 0; y < options_.height_; y++) {
@@ -70,8 +92,6 @@ GatherArena::GatherArena(
     cell({x, options_.height_ / 2 - 1}).content = CellContent::WALL;
   }
   */
-
-  InitRandom(&rnd);
 }
 
 void GatherArena::FillCells(Vector2i corner, Vector2i size, CellContent type) {
@@ -175,7 +195,15 @@ void GatherArena::FillInput() {
 
 bool GatherArena::Step() {
   FillInput();
-  const auto control = controller_->Step(input);
+  return Act(controller_->Step(input));
+}
+
+const Input *GatherArena::Observe() {
+  FillInput();
+  return &input;
+}
+
+bool GatherArena::Act(const Output &control) {
   if (control.stop) {
     return false;
   }
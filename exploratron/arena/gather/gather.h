@@ -6,6 +6,7 @@
 
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 
 namespace exploratron {
 namespace gather_area {
@@ -42,8 +43,13 @@ public:
 
   virtual ~GatherArena() = default;
   bool Step() override;
+  const Input *Observe() override;
+  bool Act(const Output &control) override;
   Scores FinalScore() const override;
   void Draw() const override;
+  bool Reset(
+      const std::vector<const AbstractControllerBuilder *> &controller_builders,
+      uint64_t seed) override;
 
 private:
   Cell &cell(Vector2i p) { return cells_[p.x + p.y * options_.width_]; }
@@ -55,8 +61,10 @@ private:
   void FillCells(Vector2i corner, Vector2i size, CellContent type);
   bool AddRandomCell(CellContent type, int border = 1);
   void FillInput();
+  void InitializeCells();
 
   Options options_;
+  Options initial_options_;
 
   std::unique_ptr<AbstractController> controller_;
   std::vector<Cell> cells_;
@@ -64,7 +72,7 @@ private:
   int num_food = 0;
   int num_coins = 0;
   int score = 0;
-  std::mt19937_64 rnd;
+  CounterRng rnd;
   MapDef map_def;
   Input input;
   int last_score_step = -1;
@@ -12,6 +12,7 @@
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_split.h"
 #include "exploratron/arena/common_game/common_game.h"
+#include "exploratron/arena/common_game/compiled_map.h"
 #include "exploratron/controller/buffer/buffer.h"
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_controller.h"
@@ -20,7 +21,8 @@
 #include "exploratron/core/utils/terminal.h"
 
 ABSL_FLAG(std::string, map, "",
-          "Path to tmx file. If set, load this word at startup.");
+          "Path to tmx or compiled map file. If set, load this word at "
+          "startup.");
 
 namespace exploratron {
 
@@ -553,6 +555,11 @@ eFinishFollowup RunArea(const MapInfo &map) {
   return PrintFinalScreen2(game, map);
 }
 
+// Format of a map file, as listed in "list.txt".
+std::string MapFormat(std::string_view path) {
+  return common_game::IsCompiledMap(path) ? "CMAP" : "TMX";
+}
+
 std::vector<MapInfo> ListMaps() {
   std::vector<MapInfo> maps;
   std::ifstream file("exploratron/assets/map/list.txt");
@@ -564,6 +571,7 @@ std::vector<MapInfo> ListMaps() {
     }
     std::vector<std::string> items = absl::StrSplit(line, "\t");
     CHECK_EQ(items.size(), 3);
+    CHECK_EQ(items[1], MapFormat(items[0])) << " for map " << items[0];
     maps.push_back(
         {.path = items[0], .format = items[1], .name = items[2], .idx = idx++});
   }
@@ -741,7 +749,7 @@ void Main() {
     if (selected_map == -1) {
       map.path = flag_map;
       map.name = "manual";
-      map.format = "TMX";
+      map.format = MapFormat(flag_map);
     } else {
       if (!skip_select_map) {
         // Select map
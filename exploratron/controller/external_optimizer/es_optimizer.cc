@@ -0,0 +1,470 @@
+#include "exploratron/controller/external_optimizer/es_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+#include "exploratron/core/utils/logging.h"
+
+namespace exploratron {
+namespace external_optimizer {
+namespace {
+
+double Norm(const neural_net::VectorF &values) {
+  double sum = 0;
+  for (const float v : values) {
+    sum += static_cast<double>(v) * v;
+  }
+  return std::sqrt(sum);
+}
+
+// Writes in "output" the weighted sum of the squared noise vectors:
+//   output[j] = sum_r row_weights[r] * table[row_offsets[r] + j]^2.
+void WeightedSquaredRows(const NoiseTable &table,
+                         const std::vector<int> &row_offsets,
+                         const std::vector<float> &row_weights,
+                         neural_net::VectorF *output) {
+  std::fill(output->begin(), output->end(), 0.f);
+  const int size = output->size();
+  float *dst = output->data();
+  for (int r = 0; r < row_offsets.size(); r++) {
+    const float *row = table.data() + row_offsets[r];
+    const float weight = row_weights[r];
+    for (int j = 0; j < size; j++) {
+      dst[j] += weight * row[j] * row[j];
+    }
+  }
+}
+
+// PGPE with symmetric sampling (Sehnke et al. 2010) and the ClipUp optimizer
+// for the center.
+class PgpeOptimizer : public AbstractEsOptimizer {
+public:
+  PgpeOptimizer(const EsOptions &options, const int num_weights)
+      : AbstractEsOptimizer(options.population_size, num_weights),
+        options_(options), table_(options.noise_table_size, options.seed),
+        rnd_(options.seed, /*stream=*/1),
+        stdev_(num_weights, options.pgpe_stdev_init),
+        velocity_(num_weights, 0.f), gradient_(num_weights),
+        stdev_gradient_(num_weights) {
+    CHECK_EQ(options.population_size % 2, 0);
+    center_.assign(num_weights, 0.f);
+  }
+
+  void Ask() override {
+    NewCandidates();
+    const int num_directions = num_candidates() / 2;
+    offsets_.resize(num_directions);
+    for (int k = 0; k < num_directions; k++) {
+      offsets_[k] = table_.SampleOffset(num_weights(), &rnd_);
+      const float *noise = table_.data() + offsets_[k];
+      auto positive = mutable_candidate(2 * k);
+      auto negative = mutable_candidate(2 * k + 1);
+      for (int j = 0; j < num_weights(); j++) {
+        const float delta = stdev_[j] * noise[j];
+        positive[j] = center_[j] + delta;
+        negative[j] = center_[j] - delta;
+      }
+    }
+  }
+
+  void Tell(absl::Span<const double> fitnesses) override {
+    CHECK_EQ(fitnesses.size(), num_candidates());
+    CenteredRanks(fitnesses, &ranks_);
+    const int num_directions = num_candidates() / 2;
+    const float baseline =
+        std::accumulate(ranks_.begin(), ranks_.end(), 0.f) / num_candidates();
+
+    // Center gradient: mean of noise_k * stdev * (f+ - f-) / 2.
+    center_weights_.resize(num_directions);
+    stdev_weights_.resize(num_directions);
+    float sum_stdev_weights = 0;
+    for (int k = 0; k < num_directions; k++) {
+      const float positive = ranks_[2 * k];
+      const float negative = ranks_[2 * k + 1];
+      center_weights_[k] = (positive - negative) / (2.f * num_directions);
+      stdev_weights_[k] =
+          ((positive + negative) / 2.f - baseline) / num_directions;
+      sum_stdev_weights += stdev_weights_[k];
+    }
+    std::fill(gradient_.begin(), gradient_.end(), 0.f);
+    kernels::AccumulateWeightedRows(table_.data(), offsets_.data(),
+                                    center_weights_.data(), num_directions,
+                                    num_weights(), gradient_.data());
+    for (int j = 0; j < num_weights(); j++) {
+      gradient_[j] *= stdev_[j];
+    }
+
+    // Stdev gradient: mean of (f_k - baseline) * (delta^2 - stdev^2) / stdev
+    // with delta = stdev * noise_k.
+    WeightedSquaredRows(table_, offsets_, stdev_weights_, &stdev_gradient_);
+    for (int j = 0; j < num_weights(); j++) {
+      stdev_gradient_[j] =
+          stdev_[j] * (stdev_gradient_[j] - sum_stdev_weights);
+    }
+
+    ClipUpStep();
+
+    const float max_change = options_.pgpe_stdev_max_change;
+    for (int j = 0; j < num_weights(); j++) {
+      const float updated =
+          stdev_[j] + options_.pgpe_stdev_learning_rate * stdev_gradient_[j];
+      stdev_[j] = std::clamp(updated, stdev_[j] * (1 - max_change),
+                             stdev_[j] * (1 + max_change));
+    }
+  }
+
+private:
+  // ClipUp: momentum on the normalized gradient, with a bounded speed.
+  void ClipUpStep() {
+    const double gradient_norm = Norm(gradient_);
+    const float step =
+        gradient_norm > 0 ? options_.pgpe_center_learning_rate / gradient_norm
+                          : 0.f;
+    for (int j = 0; j < num_weights(); j++) {
+      velocity_[j] =
+          options_.clipup_momentum * velocity_[j] + step * gradient_[j];
+    }
+    const double speed = Norm(velocity_);
+    if (speed > options_.clipup_max_speed) {
+      const float scale = options_.clipup_max_speed / speed;
+      for (auto &v : velocity_) {
+        v *= scale;
+      }
+    }
+    for (int j = 0; j < num_weights(); j++) {
+      center_[j] += velocity_[j];
+    }
+  }
+
+  const EsOptions options_;
+  NoiseTable table_;
+  CounterRng rnd_;
+  neural_net::VectorF stdev_;
+  neural_net::VectorF velocity_;
+  neural_net::VectorF gradient_;
+  neural_net::VectorF stdev_gradient_;
+  // Offsets in "table_" of the noise vector of each direction.
+  std::vector<int> offsets_;
+  std::vector<float> ranks_;
+  std::vector<float> center_weights_;
+  std::vector<float> stdev_weights_;
+};
+
+// Separable CMA-ES: CMA-ES restricted to a diagonal covariance matrix, so the
+// sampling and the updates are linear in the number of weights.
+class CmaEsOptimizer : public AbstractEsOptimizer {
+public:
+  CmaEsOptimizer(const EsOptions &options, const int num_weights)
+      : AbstractEsOptimizer(options.population_size, num_weights),
+        table_(options.noise_table_size, options.seed),
+        rnd_(options.seed, /*stream=*/1), sigma_(options.cma_es_sigma_init),
+        covariance_(num_weights, 1.f), path_sigma_(num_weights, 0.f),
+        path_covariance_(num_weights, 0.f), mean_noise_(num_weights),
+        rank_mu_(num_weights) {
+    center_.assign(num_weights, 0.f);
+
+    const double n = num_weights;
+    const int lambda = options.population_size;
+    mu_ = lambda / 2;
+    CHECK_GE(mu_, 1);
+    double sum_weights = 0;
+    for (int i = 0; i < mu_; i++) {
+      recombination_weights_.push_back(std::log(mu_ + 0.5) - std::log(i + 1.));
+      sum_weights += recombination_weights_.back();
+    }
+    double sum_squared_weights = 0;
+    for (auto &w : recombination_weights_) {
+      w /= sum_weights;
+      sum_squared_weights += w * w;
+    }
+    mu_eff_ = 1 / sum_squared_weights;
+
+    c_sigma_ = (mu_eff_ + 2) / (n + mu_eff_ + 5);
+    d_sigma_ = 1 + 2 * std::max(0., std::sqrt((mu_eff_ - 1) / (n + 1)) - 1) +
+               c_sigma_;
+    c_c_ = (4 + mu_eff_ / n) / (n + 4 + 2 * mu_eff_ / n);
+    // Learning rates of the full CMA-ES, scaled up for the diagonal model.
+    const double diagonal_scale = (n + 2) / 3;
+    c_1_ = std::min(
+        1., diagonal_scale * 2 / ((n + 1.3) * (n + 1.3) + mu_eff_));
+    c_mu_ = std::min(1 - c_1_, diagonal_scale * 2 *
+                                   (mu_eff_ - 2 + 1 / mu_eff_) /
+                                   ((n + 2) * (n + 2) + mu_eff_));
+    expected_norm_ = std::sqrt(n) * (1 - 1 / (4 * n) + 1 / (21 * n * n));
+  }
+
+  void Ask() override {
+    NewCandidates();
+    offsets_.resize(num_candidates());
+    scales_.resize(num_weights());
+    for (int j = 0; j < num_weights(); j++) {
+      scales_[j] = sigma_ * std::sqrt(covariance_[j]);
+    }
+    for (int k = 0; k < num_candidates(); k++) {
+      offsets_[k] = table_.SampleOffset(num_weights(), &rnd_);
+      const float *noise = table_.data() + offsets_[k];
+      auto candidate = mutable_candidate(k);
+      for (int j = 0; j < num_weights(); j++) {
+        candidate[j] = center_[j] + scales_[j] * noise[j];
+      }
+    }
+  }
+
+  void Tell(absl::Span<const double> fitnesses) override {
+    CHECK_EQ(fitnesses.size(), num_candidates());
+    std::vector<int> order(num_candidates());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const int a, const int b) {
+      return fitnesses[a] > fitnesses[b];
+    });
+    selected_offsets_.resize(mu_);
+    selected_weights_.resize(mu_);
+    for (int i = 0; i < mu_; i++) {
+      selected_offsets_[i] = offsets_[order[i]];
+      selected_weights_[i] = recombination_weights_[i];
+    }
+    generation_++;
+
+    // z_w: weighted mean of the selected standard normal noises.
+    std::fill(mean_noise_.begin(), mean_noise_.end(), 0.f);
+    kernels::AccumulateWeightedRows(table_.data(), selected_offsets_.data(),
+                                    selected_weights_.data(), mu_,
+                                    num_weights(), mean_noise_.data());
+
+    // Mean and evolution path of sigma. The update of the mean uses
+    // y_w = sqrt(C) * z_w.
+    const float path_sigma_scale =
+        std::sqrt(c_sigma_ * (2 - c_sigma_) * mu_eff_);
+    for (int j = 0; j < num_weights(); j++) {
+      center_[j] += scales_[j] * mean_noise_[j];
+      path_sigma_[j] = (1 - c_sigma_) * path_sigma_[j] +
+                       path_sigma_scale * mean_noise_[j];
+    }
+    const double path_sigma_norm = Norm(path_sigma_);
+    const bool h_sigma =
+        path_sigma_norm /
+            std::sqrt(1 - std::pow(1 - c_sigma_, 2. * generation_)) <
+        (1.4 + 2 / (num_weights() + 1.)) * expected_norm_;
+
+    // Evolution path and diagonal of the covariance matrix.
+    WeightedSquaredRows(table_, selected_offsets_, selected_weights_,
+                        &rank_mu_);
+    const float path_covariance_scale =
+        h_sigma ? std::sqrt(c_c_ * (2 - c_c_) * mu_eff_) : 0.f;
+    const float decay = 1 - c_1_ - c_mu_ +
+                        (h_sigma ? 0 : c_1_ * c_c_ * (2 - c_c_));
+    for (int j = 0; j < num_weights(); j++) {
+      const float mean_step = std::sqrt(covariance_[j]) * mean_noise_[j];
+      path_covariance_[j] = (1 - c_c_) * path_covariance_[j] +
+                            path_covariance_scale * mean_step;
+      covariance_[j] = decay * covariance_[j] +
+                       c_1_ * path_covariance_[j] * path_covariance_[j] +
+                       c_mu_ * covariance_[j] * rank_mu_[j];
+    }
+
+    sigma_ *= std::exp(c_sigma_ / d_sigma_ *
+                       (path_sigma_norm / expected_norm_ - 1));
+  }
+
+private:
+  NoiseTable table_;
+  CounterRng rnd_;
+  double sigma_;
+  neural_net::VectorF covariance_;
+  neural_net::VectorF path_sigma_;
+  neural_net::VectorF path_covariance_;
+  neural_net::VectorF mean_noise_;
+  neural_net::VectorF rank_mu_;
+  // sigma * sqrt(covariance) at the last "Ask".
+  neural_net::VectorF scales_;
+  std::vector<int> offsets_;
+  std::vector<int> selected_offsets_;
+  std::vector<float> selected_weights_;
+
+  int mu_;
+  std::vector<double> recombination_weights_;
+  double mu_eff_;
+  double c_sigma_;
+  double d_sigma_;
+  double c_c_;
+  double c_1_;
+  double c_mu_;
+  // Expected norm of a n-dimensional standard normal vector.
+  double expected_norm_;
+  int generation_ = 0;
+};
+
+// OpenAI-ES: mirrored sampling with a fixed sigma, centered ranks, and Adam
+// with L2 regularization for the center.
+class OpenAiEsOptimizer : public AbstractEsOptimizer {
+public:
+  OpenAiEsOptimizer(const EsOptions &options, const int num_weights)
+      : AbstractEsOptimizer(options.population_size, num_weights),
+        options_(options), table_(options.noise_table_size, options.seed),
+        rnd_(options.seed, /*stream=*/1), gradient_(num_weights),
+        first_moment_(num_weights, 0.f), second_moment_(num_weights, 0.f) {
+    CHECK_EQ(options.population_size % 2, 0);
+    center_.assign(num_weights, 0.f);
+  }
+
+  void Ask() override {
+    NewCandidates();
+    const int num_directions = num_candidates() / 2;
+    const float sigma = options_.openai_es_sigma;
+    offsets_.resize(num_directions);
+    for (int k = 0; k < num_directions; k++) {
+      offsets_[k] = table_.SampleOffset(num_weights(), &rnd_);
+      const float *noise = table_.data() + offsets_[k];
+      auto positive = mutable_candidate(2 * k);
+      auto negative = mutable_candidate(2 * k + 1);
+      for (int j = 0; j < num_weights(); j++) {
+        positive[j] = center_[j] + sigma * noise[j];
+        negative[j] = center_[j] - sigma * noise[j];
+      }
+    }
+  }
+
+  void Tell(absl::Span<const double> fitnesses) override {
+    CHECK_EQ(fitnesses.size(), num_candidates());
+    CenteredRanks(fitnesses, &ranks_);
+    const int num_directions = num_candidates() / 2;
+    direction_weights_.resize(num_directions);
+    for (int k = 0; k < num_directions; k++) {
+      direction_weights_[k] = (ranks_[2 * k] - ranks_[2 * k + 1]) /
+                              (num_candidates() * options_.openai_es_sigma);
+    }
+    std::fill(gradient_.begin(), gradient_.end(), 0.f);
+    kernels::AccumulateWeightedRows(table_.data(), offsets_.data(),
+                                    direction_weights_.data(), num_directions,
+                                    num_weights(), gradient_.data());
+
+    // Adam ascent step.
+    constexpr float kBeta1 = 0.9f;
+    constexpr float kBeta2 = 0.999f;
+    constexpr float kEpsilon = 1e-8f;
+    step_++;
+    const float step_size = options_.openai_es_learning_rate *
+                            std::sqrt(1 - std::pow(kBeta2, step_)) /
+                            (1 - std::pow(kBeta1, step_));
+    const float l2 = options_.openai_es_l2_coefficient;
+    for (int j = 0; j < num_weights(); j++) {
+      const float g = gradient_[j] - l2 * center_[j];
+      first_moment_[j] = kBeta1 * first_moment_[j] + (1 - kBeta1) * g;
+      second_moment_[j] = kBeta2 * second_moment_[j] + (1 - kBeta2) * g * g;
+      center_[j] += step_size * first_moment_[j] /
+                    (std::sqrt(second_moment_[j]) + kEpsilon);
+    }
+  }
+
+private:
+  const EsOptions options_;
+  NoiseTable table_;
+  CounterRng rnd_;
+  neural_net::VectorF gradient_;
+  neural_net::VectorF first_moment_;
+  neural_net::VectorF second_moment_;
+  std::vector<int> offsets_;
+  std::vector<float> ranks_;
+  std::vector<float> direction_weights_;
+  int step_ = 0;
+};
+
+} // namespace
+
+AbstractEsOptimizer::AbstractEsOptimizer(const int num_candidates,
+                                         const int num_weights)
+    : num_candidates_(num_candidates), num_weights_(num_weights),
+      stride_(kernels::GemvPaddedSize(num_weights)) {
+  CHECK_GT(num_candidates, 0);
+}
+
+neural_net::WeightBank AbstractEsOptimizer::Candidate(const int index) const {
+  DCHECK(candidates_);
+  DCHECK_LT(index, num_candidates_);
+  return neural_net::WeightBank(
+      candidates_, neural_net::CSVectorF(candidates_->data() + index * stride_,
+                                         num_weights_));
+}
+
+void AbstractEsOptimizer::NewCandidates() {
+  if (!candidates_ || candidates_.use_count() > 1) {
+    candidates_ = std::make_shared<kernels::AlignedVectorF>(
+        num_candidates_ * stride_, 0.f);
+  }
+}
+
+neural_net::SVectorF AbstractEsOptimizer::mutable_candidate(const int index) {
+  return neural_net::SVectorF(candidates_->data() + index * stride_,
+                              num_weights_);
+}
+
+bool ParseEsAlgorithm(const std::string &name,
+                      EsOptions::eAlgorithm *output) {
+  if (name == "pgpe") {
+    *output = EsOptions::eAlgorithm::kPgpe;
+  } else if (name == "cma_es") {
+    *output = EsOptions::eAlgorithm::kCmaEs;
+  } else if (name == "openai_es") {
+    *output = EsOptions::eAlgorithm::kOpenAiEs;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<AbstractEsOptimizer> CreateEsOptimizer(const EsOptions &options,
+                                                       const int num_weights) {
+  switch (options.algorithm) {
+  case EsOptions::eAlgorithm::kPgpe:
+    return std::make_unique<PgpeOptimizer>(options, num_weights);
+  case EsOptions::eAlgorithm::kCmaEs:
+    return std::make_unique<CmaEsOptimizer>(options, num_weights);
+  case EsOptions::eAlgorithm::kOpenAiEs:
+    return std::make_unique<OpenAiEsOptimizer>(options, num_weights);
+  }
+  CHECK(false);
+  return {};
+}
+
+NoiseTable::NoiseTable(const int size, const uint64_t seed) : values_(size) {
+  // Box-Muller transform of uniform values in (0, 1].
+  CounterRng rnd(seed);
+  std::vector<uint32_t> bits(size + 1);
+  rnd.Generate(bits.size(), bits.data());
+  constexpr float kScale = 1.f / (1 << 24);
+  constexpr float kTwoPi = 6.283185307179586f;
+  for (int i = 0; i + 1 < bits.size(); i += 2) {
+    const float u1 = ((bits[i] >> 8) + 1) * kScale;
+    const float u2 = (bits[i + 1] >> 8) * kScale;
+    const float radius = std::sqrt(-2.f * std::log(u1));
+    values_[i] = radius * std::cos(kTwoPi * u2);
+    if (i + 1 < size) {
+      values_[i + 1] = radius * std::sin(kTwoPi * u2);
+    }
+  }
+}
+
+int NoiseTable::SampleOffset(const int length, CounterRng *rnd) const {
+  CHECK_LE(length, size());
+  return std::uniform_int_distribution<int>(0, size() - length)(*rnd);
+}
+
+void CenteredRanks(absl::Span<const double> fitnesses,
+                   std::vector<float> *ranks) {
+  const int n = fitnesses.size();
+  std::vector<int> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](const int a, const int b) {
+    return fitnesses[a] < fitnesses[b];
+  });
+  ranks->resize(n);
+  for (int rank = 0; rank < n; rank++) {
+    (*ranks)[order[rank]] = n > 1 ? static_cast<float>(rank) / (n - 1) - 0.5f
+                                  : 0.f;
+  }
+}
+
+} // namespace external_optimizer
+} // namespace exploratron
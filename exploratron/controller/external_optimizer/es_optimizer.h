@@ -0,0 +1,135 @@
+#ifndef CONTROLLER_EXTERNAL_OPTIMIZER_ES_OPTIMIZER_H_
+#define CONTROLLER_EXTERNAL_OPTIMIZER_ES_OPTIMIZER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "exploratron/core/utils/counter_rng.h"
+#include "exploratron/core/utils/kernels.h"
+#include "exploratron/core/utils/neural_net.h"
+
+// Evolution strategies with an ask/tell interface:
+//
+//   auto optimizer = CreateEsOptimizer(options, num_weights);
+//   while (...) {
+//     optimizer->Ask();
+//     for (int i = 0; i < optimizer->num_candidates(); i++) {
+//       fitnesses[i] = Evaluate(optimizer->Candidate(i));
+//     }
+//     optimizer->Tell(fitnesses);
+//   }
+//   const auto best = optimizer->Center();
+//
+// The fitness is maximized.
+
+namespace exploratron {
+namespace external_optimizer {
+
+class AbstractEsOptimizer {
+public:
+  AbstractEsOptimizer(int num_candidates, int num_weights);
+  virtual ~AbstractEsOptimizer() = default;
+
+  // Samples the candidates to evaluate.
+  virtual void Ask() = 0;
+
+  // Updates the search distribution with the fitnesses of the candidates of
+  // the last "Ask".
+  virtual void Tell(absl::Span<const double> fitnesses) = 0;
+
+  int num_candidates() const { return num_candidates_; }
+  int num_weights() const { return num_weights_; }
+
+  // Weights of a candidate of the last "Ask". The bank is a view that keeps the
+  // candidates alive, and remains valid after the next "Ask".
+  neural_net::WeightBank Candidate(int index) const;
+
+  // Mean of the search distribution i.e. the current solution. The candidates
+  // of the last "Ask" are sampled around it.
+  neural_net::WeightBank Center() const {
+    return neural_net::WeightBank(center_);
+  }
+
+protected:
+  // Prepares the buffer of the candidates of a new "Ask". The buffer of the
+  // previous candidates is reused, unless a bank still views it.
+  void NewCandidates();
+  neural_net::SVectorF mutable_candidate(int index);
+
+  neural_net::VectorF center_;
+
+private:
+  int num_candidates_;
+  int num_weights_;
+  // Candidates, one per row of "stride_" floats.
+  size_t stride_;
+  std::shared_ptr<kernels::AlignedVectorF> candidates_;
+};
+
+struct EsOptions {
+  enum class eAlgorithm {
+    kPgpe,
+    kCmaEs,
+    kOpenAiEs,
+  };
+  eAlgorithm algorithm = eAlgorithm::kPgpe;
+
+  // Should be even for PGPE and OpenAI-ES (mirrored sampling).
+  int population_size = 50;
+  uint64_t seed = 1234;
+  // Number of values of the noise table.
+  int noise_table_size = 1 << 22;
+
+  // PGPE with the ClipUp optimizer (Toklu et al. 2020). Same defaults as
+  // pgpelib.
+  float pgpe_center_learning_rate = 0.15f;
+  float pgpe_stdev_init = 0.1f;
+  float pgpe_stdev_learning_rate = 0.1f;
+  float pgpe_stdev_max_change = 0.2f;
+  float clipup_momentum = 0.9f;
+  float clipup_max_speed = 0.3f;
+
+  // Diagonal (separable) CMA-ES (Ros and Hansen 2008).
+  float cma_es_sigma_init = 0.1f;
+
+  // OpenAI-ES with Adam (Salimans et al. 2017).
+  float openai_es_sigma = 0.02f;
+  float openai_es_learning_rate = 0.01f;
+  float openai_es_l2_coefficient = 0.005f;
+};
+
+// Parses "pgpe", "cma_es" or "openai_es". Returns false if unknown.
+bool ParseEsAlgorithm(const std::string &name, EsOptions::eAlgorithm *output);
+
+std::unique_ptr<AbstractEsOptimizer> CreateEsOptimizer(const EsOptions &options,
+                                                       int num_weights);
+
+// Table of standard normal values shared by the candidates (Salimans et al.
+// 2017). The noise vector of a candidate is a slice of the table at a random
+// offset, so sampling only reads contiguous memory, and the weighted sum of
+// the noise vectors of a generation is a single
+// kernels::AccumulateWeightedRows call.
+class NoiseTable {
+public:
+  NoiseTable(int size, uint64_t seed);
+
+  const float *data() const { return values_.data(); }
+  int size() const { return values_.size(); }
+
+  // Random offset of a slice of "length" values.
+  int SampleOffset(int length, CounterRng *rnd) const;
+
+private:
+  kernels::AlignedVectorF values_;
+};
+
+// Centered ranks of the fitnesses, in [-0.5, 0.5]. Ties are ranked in order.
+void CenteredRanks(absl::Span<const double> fitnesses,
+                   std::vector<float> *ranks);
+
+} // namespace external_optimizer
+} // namespace exploratron
+
+#endif
@@ -50,8 +50,9 @@ Genome GenomeManager::Random() {
   Genome child;
   child.map_definition = map_definition_;
 
-  weigh_allocator.AllocateWeightBank(&child.weight_bank);
-  neural_net::InitWeights(&child.weight_bank, &rnd_);
+  auto *weights = child.weight_bank.mutable_values();
+  weigh_allocator.AllocateWeightBank(weights);
+  neural_net::InitWeights(weights, &rnd_);
   return child;
 }
 
@@ -59,13 +60,49 @@ Genome GenomeManager::Empty() {
   Genome child;
   child.map_definition = map_definition_;
 
-  weigh_allocator.AllocateWeightBank(&child.weight_bank);
+  weigh_allocator.AllocateWeightBank(child.weight_bank.mutable_values());
   return child;
 }
 
+Genome GenomeManager::FromWeightBank(neural_net::WeightBank weight_bank) const {
+  CHECK_EQ(weight_bank.size(), weigh_allocator.size());
+  Genome genome;
+  genome.map_definition = map_definition_;
+  genome.weight_bank = std::move(weight_bank);
+  return genome;
+}
+
+PackedGenome::PackedGenome(const Genome &genome,
+                           const GenomeManager &genome_manager) {
+  const auto &hidden_dims = genome_manager.options_.hidden_layers;
+  const int first_dim = hidden_dims.empty() ? Numdir() : hidden_dims.front();
+  terrain = neural_net::FixedPointOneHotWeights(
+      genome.map_definition.shape.Size(), genome.map_definition.num_values,
+      first_dim, genome_manager.weight_address_1(genome.weight_bank));
+  past = neural_net::FixedPointOneHotWeights(
+      ExternalOptimizerController::HISTORY_LENGTH, Numdir(), first_dim,
+      genome_manager.weight_address_2(genome.weight_bank));
+  for (int i = 0; i < hidden_dims.size(); i++) {
+    const int output_dim =
+        i + 1 < hidden_dims.size() ? hidden_dims[i + 1] : Numdir();
+    hidden_layers.emplace_back(
+        genome_manager.hidden_layers[i](genome.weight_bank), hidden_dims[i],
+        output_dim);
+  }
+}
+
 ExternalOptimizerController::ExternalOptimizerController(
-    const Genome &genome, const GenomeManager *genome_manager)
-    : genome_(genome), genome_manager_(genome_manager) {
+    const Genome &genome, const GenomeManager *genome_manager,
+    std::shared_ptr<const PackedGenome> packed_genome)
+    : packed_genome_(std::move(packed_genome)),
+      genome_manager_(genome_manager) {
+  if (!packed_genome_) {
+    packed_genome_ =
+        std::make_shared<const PackedGenome>(genome, *genome_manager);
+  }
+  terrain_accumulator_ =
+      neural_net::OneHotAccumulator(&packed_genome_->terrain);
+  past_accumulator_ = neural_net::OneHotAccumulator(&packed_genome_->past);
 
   if (genome_manager->options_.hidden_layers.empty()) {
     cache_hidden_.push_back(neural_net::VectorF(Numdir()));
@@ -83,33 +120,26 @@ ExternalOptimizerController::ExternalOptimizerController(
 }
 
 Output ExternalOptimizerController::Step(const Input &input) {
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      input.surouding.values, genome_.map_definition.num_values,
-      genome_manager_->weight_address_1(genome_.weight_bank),
-      &cache_hidden_[0]);
-
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      last_dirs_, Numdir(),
-      genome_manager_->weight_address_2(genome_.weight_bank),
-      &cache_hidden_[1]);
+  terrain_accumulator_.Forward<neural_net::Identity>(input.surouding.values,
+                                                     &cache_hidden_[0]);
+  past_accumulator_.Forward<neural_net::Identity>(last_dirs_,
+                                                  &cache_hidden_[1]);
 
   if (!genome_manager_->options_.hidden_layers.empty()) {
     neural_net::AddTo<neural_net::Relu>(cache_hidden_[0],
                                             &cache_hidden_[1]);
 
+    const auto &hidden_layers = packed_genome_->hidden_layers;
+    padded_inputs_.resize(hidden_layers.size());
     for (int i = 0; i < genome_manager_->options_.hidden_layers.size() - 1;
          i++) {
-      neural_net::Forward<neural_net::Relu>(
-          cache_hidden_[i + 1],
-          genome_manager_->hidden_layers[i](genome_.weight_bank),
-          &cache_hidden_[i + 2]);
+      hidden_layers[i].Forward<neural_net::Relu>(
+          cache_hidden_[i + 1], &padded_inputs_[i], &cache_hidden_[i + 2]);
     }
 
     const int i = genome_manager_->options_.hidden_layers.size() - 1;
-    neural_net::Forward<neural_net::Identity>(
-        cache_hidden_[i + 1],
-        genome_manager_->hidden_layers[i](genome_.weight_bank),
-        &cache_hidden_[i + 2]);
+    hidden_layers[i].Forward<neural_net::Identity>(
+        cache_hidden_[i + 1], &padded_inputs_[i], &cache_hidden_[i + 2]);
   } else {
     neural_net::AddTo<neural_net::Identity>(cache_hidden_[0],
                                             &cache_hidden_[1]);
@@ -5,6 +5,7 @@
 #include <memory>
 
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 #include "exploratron/core/utils/maths.h"
 #include "exploratron/core/utils/neural_net.h"
 
@@ -18,9 +19,14 @@ struct Options {
 
   std::vector<int> hidden_layers = {}; // 20
 
+  // "external" for the python optimizer, or an in-process evolution strategy
+  // (see ParseEsAlgorithm).
+  std::string optimizer = "external";
+
   std::string to_string() const {
     std::stringstream ss;
-    ss << "pop-" << population_size;
+    ss << "opt-" << optimizer;
+    ss << "_pop-" << population_size;
     // ss << "_gen-" << num_generations;
     ss << "_evalr" << num_evaluation_repetitions;
     ss << "_h";
@@ -40,7 +46,7 @@ struct Genome {
   }
 
   float fitness = std::numeric_limits<float>::quiet_NaN();
-  neural_net::VectorF weight_bank;
+  neural_net::WeightBank weight_bank;
   MapDef map_definition;
 };
 
@@ -48,29 +54,50 @@ struct GenomeManager {
   GenomeManager(const MapDef &map_definition, const Options &options);
   Genome Random();
   Genome Empty();
+  // Genome with the weights "weight_bank" e.g. a candidate of an optimizer.
+  Genome FromWeightBank(neural_net::WeightBank weight_bank) const;
 
   MapDef map_definition_;
-  std::mt19937 rnd_;
+  CounterRng rnd_;
   neural_net::WeightsAllocator weigh_allocator;
+  // One-hot layers, in the neural_net::eOneHotLayout::kInputMajor layout.
   neural_net::WeightsAddress weight_address_1;
   neural_net::WeightsAddress weight_address_2;
   std::vector<neural_net::WeightsAddress> hidden_layers;
   const Options options_;
 };
 
+// Layers of a genome converted for inference: the one-hot layers in fixed
+// point and the hidden layers packed for the GEMV kernels. Immutable and shared
+// by the controllers of the genome.
+struct PackedGenome {
+  PackedGenome(const Genome &genome, const GenomeManager &genome_manager);
+
+  neural_net::FixedPointOneHotWeights terrain;
+  neural_net::FixedPointOneHotWeights past;
+  std::vector<neural_net::PackedDenseLayer> hidden_layers;
+};
+
 class ExternalOptimizerController : public AbstractController {
 public:
   virtual ~ExternalOptimizerController() = default;
-  ExternalOptimizerController(const Genome &genome,
-                              const GenomeManager *genome_manager);
+  // If not set, "packed_genome" is computed from the genome.
+  ExternalOptimizerController(
+      const Genome &genome, const GenomeManager *genome_manager,
+      std::shared_ptr<const PackedGenome> packed_genome = {});
   Output Step(const Input &input) override;
 
   static constexpr int HISTORY_LENGTH = 8;
 
 private:
-  Genome genome_;
   std::vector<neural_net::VectorF> cache_hidden_;
-  std::mt19937 rnd_;
+  // Input buffers of the hidden layers. The layers are shared by the
+  // controllers of the genome.
+  std::vector<neural_net::PackedDenseLayer::InputBuffer> padded_inputs_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
+  neural_net::OneHotAccumulator terrain_accumulator_;
+  neural_net::OneHotAccumulator past_accumulator_;
+  CounterRng rnd_;
   std::vector<int> last_dirs_;
   const GenomeManager *genome_manager_;
 };
@@ -80,13 +107,15 @@ public:
   ExternalOptimizerControllerBuilder(const std::string_view path) {}
   ExternalOptimizerControllerBuilder(const Genome &genome,
                                      const GenomeManager *genome_manager)
-      : genome_(genome), genome_manager_(genome_manager) {}
+      : genome_(genome), genome_manager_(genome_manager),
+        packed_genome_(
+            std::make_shared<const PackedGenome>(genome, *genome_manager)) {}
   virtual ~ExternalOptimizerControllerBuilder() = default;
 
   std::unique_ptr<AbstractController>
   Create(const MapDef &map_definition) const override {
-    return std::make_unique<ExternalOptimizerController>(genome_,
-                                                         genome_manager_);
+    return std::make_unique<ExternalOptimizerController>(
+        genome_, genome_manager_, packed_genome_);
   }
 
   std::string name() const override {
@@ -96,6 +125,7 @@ public:
 private:
   Genome genome_;
   const GenomeManager *genome_manager_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
 };
 
 } // namespace external_optimizer
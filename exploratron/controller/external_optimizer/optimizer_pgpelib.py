@@ -14,6 +14,13 @@ popsize = int(input())
 sys.stdout.write(f"#popsize={popsize}\n")
 sys.stdout.flush()
 
+# "text", or "shm <name>" for the binary protocol through shared memory.
+sys.stdout.write(f"#protocol?\n")
+sys.stdout.flush()
+protocol = input().split(" ")
+sys.stdout.write(f"#protocol={protocol}\n")
+sys.stdout.flush()
+
 pgpe = PGPE(
     solution_length=solution_length,   # A solution vector has the length of 5
     popsize=popsize,          # Our population size is 20
@@ -32,35 +39,73 @@ pgpe = PGPE(
     # ),
 )
 
-while True:
-    solutions = pgpe.ask()
 
-    sys.stdout.write(f"#new_candidate\n")
-    sys.stdout.flush()
+def run_text():
+    while True:
+        solutions = pgpe.ask()
+
+        sys.stdout.write(f"#new_candidate\n")
+        sys.stdout.flush()
+
+        raw_solutions = ",".join([" ".join([str(y) for y in x])
+                                 for x in solutions])
+        sys.stdout.write(raw_solutions + "\n")
+        sys.stdout.flush()
+
+        sys.stdout.write(f"#fitnesses?\n")
+        sys.stdout.flush()
+
+        raw_fitnesses = input()
+        fitnesses = np.array([float(v.strip())
+                             for v in raw_fitnesses.strip().split(" ")])
+
+        # sys.stdout.write(f"#fitnesses={fitnesses} ({type(fitnesses)})\n")
+        # sys.stdout.flush()
+
+        pgpe.tell(fitnesses)
+
+        sys.stdout.write(f"#center\n")
+        sys.stdout.flush()
+
+        raw_center = " ".join([str(x) for x in pgpe.center])
+        sys.stdout.write(raw_center + "\n")
+        sys.stdout.flush()
 
-    raw_solutions = ",".join([" ".join([str(y) for y in x])
-                             for x in solutions])
-    sys.stdout.write(raw_solutions + "\n")
-    sys.stdout.flush()
 
-    sys.stdout.write(f"#fitnesses?\n")
-    sys.stdout.flush()
+def run_shm(name):
+    # Layout of the region, see SharedRegion in train_main.cc.
+    from multiprocessing import resource_tracker, shared_memory
+    region = shared_memory.SharedMemory(name=name)
+    # The region is owned by the c++ process: the tracker should not unlink it.
+    # The tracker registers the POSIX name, i.e. with a leading slash.
+    resource_tracker.unregister("/" + region.name, "shared_memory")
 
-    raw_fitnesses = input()
-    fitnesses = np.array([float(v.strip())
-                         for v in raw_fitnesses.strip().split(" ")])
+    candidates = np.ndarray((popsize, solution_length), dtype=np.float32,
+                            buffer=region.buf)
+    offset = (candidates.nbytes + 7) // 8 * 8
+    fitnesses = np.ndarray((popsize,), dtype=np.float64, buffer=region.buf,
+                           offset=offset)
+    offset += fitnesses.nbytes
+    center = np.ndarray((solution_length,), dtype=np.float32,
+                        buffer=region.buf, offset=offset)
 
-    # sys.stdout.write(f"#fitnesses={fitnesses} ({type(fitnesses)})\n")
-    # sys.stdout.flush()
+    sequence = 0
+    while True:
+        candidates[:] = pgpe.ask()
+        sys.stdout.write(f"candidates {sequence}\n")
+        sys.stdout.flush()
 
-    pgpe.tell(fitnesses)
+        message = input()
+        assert message == f"fitnesses {sequence}", message
+        pgpe.tell(fitnesses.copy())
 
-    sys.stdout.write(f"#center\n")
-    sys.stdout.flush()
+        center[:] = pgpe.center
+        sys.stdout.write(f"center {sequence}\n")
+        sys.stdout.flush()
+        sequence += 1
 
-    raw_center = " ".join([str(x) for x in pgpe.center])
-    sys.stdout.write(raw_center + "\n")
-    sys.stdout.flush()
 
-# After 1000 generations, we print the center solution.
-# print(pgpe.center)
+if protocol[0] == "shm":
+    run_shm(protocol[1])
+else:
+    run_text()
@@ -1,16 +1,26 @@
 #include <iostream>
 
-#include <execution>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <signal.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <thread>
 #include <unistd.h>
@@ -20,6 +30,7 @@
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
+#include "exploratron/controller/external_optimizer/es_optimizer.h"
 #include "exploratron/controller/external_optimizer/external_optimizer.h"
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_controller.h"
@@ -31,11 +42,111 @@ ABSL_FLAG(std::string, training_log_base, "", "");
 
 ABSL_FLAG(int, step_sleep_ms, 10, "");
 ABSL_FLAG(bool, display, true, "");
-ABSL_FLAG(int, num_threads, 8, "");
+ABSL_FLAG(int, num_threads, 0,
+          "Number of evaluation threads. If 0, one per hardware thread.");
+ABSL_FLAG(int, repetitions_per_task, 5,
+          "The evaluation repetitions of a genome are split into tasks of "
+          "this many repetitions, so that the cores are balanced.");
+ABSL_FLAG(std::string, optimizer, "external",
+          "Optimizer: \"external\" for the python optimizer "
+          "(optimizer_pgpelib.py), or the in-process \"pgpe\", \"cma_es\" "
+          "or \"openai_es\".");
+ABSL_FLAG(std::string, external_protocol, "shm",
+          "Protocol with the python optimizer: \"shm\" exchanges the "
+          "candidates, fitnesses and center in binary through a POSIX "
+          "shared memory region, \"text\" as decimal text through the pipe.");
 
 namespace exploratron {
 namespace external_optimizer {
 
+// Threads running tasks in submission order. Measures the busy time of the
+// threads, to report the idle time.
+class EvaluationPool {
+public:
+  explicit EvaluationPool(const int num_threads) {
+    for (int i = 0; i < num_threads; i++) {
+      threads_.emplace_back([this]() { Work(); });
+    }
+  }
+
+  ~EvaluationPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  int num_threads() const { return threads_.size(); }
+
+  void Submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+  }
+
+  // Sum of the durations of the tasks completed since the last call, in
+  // seconds.
+  double ConsumeBusySeconds() { return busy_ns_.exchange(0) * 1e-9; }
+
+private:
+  void Work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      const auto begin = std::chrono::steady_clock::now();
+      task();
+      busy_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - begin)
+                      .count();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+  std::atomic<int64_t> busy_ns_{0};
+  std::vector<std::thread> threads_;
+};
+
+// Number of pending tasks of a group.
+class PendingTasks {
+public:
+  void Add(const int num) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_pending_ += num;
+  }
+  void Done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--num_pending_ == 0) {
+      cond_.notify_all();
+    }
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return num_pending_ == 0; });
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int num_pending_ = 0;
+};
+
 float EvaluateGenome(const AbstractArenaBuilder *arena_builder,
                      const Genome &genome, const EvaluateOptions &options,
                      const GenomeManager &genome_manager) {
@@ -51,16 +162,23 @@ float EvaluateGenome(const AbstractArenaBuilder *arena_builder,
 struct Connection {
 
   std::string RawReadData() {
-    char local_buffer[1024];
+    char local_buffer[1 << 16];
     while (true) {
-      int i = buffer.find_first_of('\n');
-      if (i != -1) {
-        const auto ret = buffer.substr(0, i);
-        buffer = buffer.substr(i + 1);
+      // Only the new data is scanned, and the consumed lines are erased once
+      // per read, so reading a line is linear in its size.
+      const auto end = buffer.find('\n', scanned);
+      if (end != std::string::npos) {
+        auto ret = buffer.substr(begin, end - begin);
+        begin = scanned = end + 1;
         return ret;
       }
-      int num_read = read(inpipefd[0], local_buffer, sizeof(local_buffer));
-      buffer += std::string_view(local_buffer, num_read);
+      buffer.erase(0, begin);
+      begin = 0;
+      scanned = buffer.size();
+      const int num_read =
+          read(inpipefd[0], local_buffer, sizeof(local_buffer));
+      CHECK_GT(num_read, 0) << "The optimizer process stopped";
+      buffer.append(local_buffer, num_read);
     }
   }
 
@@ -76,7 +194,13 @@ struct Connection {
 
   void WriteData(std::string value) {
     value += "\n";
-    write(outpipefd[1], value.c_str(), value.size());
+    size_t written = 0;
+    while (written < value.size()) {
+      const auto num_written = write(outpipefd[1], value.data() + written,
+                                     value.size() - written);
+      CHECK_GT(num_written, 0) << "The optimizer process stopped";
+      written += num_written;
+    }
   }
 
   void WriteData(int value) { WriteData(absl::StrCat(value)); }
@@ -112,23 +236,167 @@ struct Connection {
   pid_t pid;
   int status;
   std::string buffer;
+  // Beginning of the unread data in "buffer".
+  size_t begin = 0;
+  // Data of "buffer" before "scanned" contains no end of line.
+  size_t scanned = 0;
+};
+
+// POSIX shared memory region exchanged with the python optimizer:
+//   float32 candidates[num_candidates][num_weights]
+//   (padding to a multiple of 8 bytes)
+//   float64 fitnesses[num_candidates]
+//   float32 center[num_weights]
+// The control messages stay on the pipe, and only carry sequence numbers.
+class SharedRegion {
+public:
+  SharedRegion(const int num_candidates, const int num_weights)
+      : num_candidates_(num_candidates), num_weights_(num_weights) {
+    static int num_regions = 0;
+    name_ = absl::StrCat("exploratron_", getpid(), "_", num_regions++);
+    fitnesses_offset_ =
+        (sizeof(float) * num_candidates * num_weights + 7) / 8 * 8;
+    size_ = fitnesses_offset_ + sizeof(double) * num_candidates +
+            sizeof(float) * num_weights;
+    const int fd = shm_open(("/" + name_).c_str(), O_CREAT | O_EXCL | O_RDWR,
+                            S_IRUSR | S_IWUSR);
+    CHECK_GE(fd, 0) << "Cannot create the shared memory " << name_ << ": "
+                    << strerror(errno);
+    CHECK_EQ(ftruncate(fd, size_), 0);
+    data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(data_ != MAP_FAILED);
+  }
+
+  ~SharedRegion() {
+    munmap(data_, size_);
+    Unlink();
+  }
+
+  // Removes the name of the region. The mappings remain valid. Called as soon
+  // as the python optimizer is attached, so the region is released even if the
+  // process is killed.
+  void Unlink() {
+    if (!unlinked_) {
+      shm_unlink(("/" + name_).c_str());
+      unlinked_ = true;
+    }
+  }
+
+  // Name of the region, without the leading slash, as expected by python's
+  // multiprocessing.shared_memory.
+  const std::string &name() const { return name_; }
+
+  const float *candidate(const int index) const {
+    return static_cast<const float *>(data_) +
+           static_cast<size_t>(index) * num_weights_;
+  }
+  double *fitnesses() {
+    return reinterpret_cast<double *>(static_cast<char *>(data_) +
+                                      fitnesses_offset_);
+  }
+  const float *center() {
+    return reinterpret_cast<const float *>(fitnesses() + num_candidates_);
+  }
+
+private:
+  int num_candidates_;
+  int num_weights_;
+  std::string name_;
+  size_t fitnesses_offset_;
+  size_t size_;
+  void *data_;
+  bool unlinked_ = false;
 };
 
-void ParseVector(const std::string &in, std::vector<float> *output) {
+void ParseVector(const std::string &in, neural_net::SVectorF output) {
   std::vector<std::string> raw_ins = absl::StrSplit(in, " ");
-  output->clear();
-  output->reserve(raw_ins.size());
-  for (const auto &raw_in : raw_ins) {
-    output->push_back(std::stof(raw_in));
+  CHECK_EQ(raw_ins.size(), output.size());
+  for (int i = 0; i < raw_ins.size(); i++) {
+    output[i] = std::stof(raw_ins[i]);
   }
 }
 
+// The python optimizer, behind the ask/tell interface of the in-process
+// optimizers. Its initial center is zero, like pgpelib's.
+//
+// With the text protocol, the candidates, fitnesses and center are sent as
+// lines of decimal values. With the shared memory protocol, they are written
+// in a SharedRegion, and each step sends a line "<step> <sequence number>"
+// once the data is ready: "candidates" (python to c++), "fitnesses" (c++ to
+// python) and "center" (python to c++).
+class PythonOptimizer : public AbstractEsOptimizer {
+public:
+  PythonOptimizer(const int num_candidates, const int num_weights,
+                  const bool shared_memory)
+      : AbstractEsOptimizer(num_candidates, num_weights) {
+    center_.assign(num_weights, 0.f);
+    connection_.Initialize();
+    connection_.WriteData(num_weights);
+    connection_.WriteData(num_candidates);
+    if (shared_memory) {
+      region_ = std::make_unique<SharedRegion>(num_candidates, num_weights);
+      connection_.WriteData("shm " + region_->name());
+    } else {
+      connection_.WriteData("text");
+    }
+  }
+
+  ~PythonOptimizer() override { connection_.Stop(); }
+
+  void Ask() override {
+    NewCandidates();
+    if (region_) {
+      ReadControl("candidates");
+      region_->Unlink();
+      for (int i = 0; i < num_candidates(); i++) {
+        std::memcpy(mutable_candidate(i).data(), region_->candidate(i),
+                    sizeof(float) * num_weights());
+      }
+      return;
+    }
+    const auto raw_candidates = connection_.ReadData();
+    std::vector<std::string> rows = absl::StrSplit(raw_candidates, ",");
+    CHECK_EQ(rows.size(), num_candidates());
+    for (int i = 0; i < num_candidates(); i++) {
+      ParseVector(rows[i], mutable_candidate(i));
+    }
+  }
+
+  void Tell(absl::Span<const double> fitnesses) override {
+    if (region_) {
+      std::copy(fitnesses.begin(), fitnesses.end(), region_->fitnesses());
+      connection_.WriteData(absl::StrCat("fitnesses ", sequence_));
+      ReadControl("center");
+      std::memcpy(center_.data(), region_->center(),
+                  sizeof(float) * num_weights());
+      sequence_++;
+      return;
+    }
+    connection_.WriteData(absl::StrJoin(fitnesses, " "));
+    ParseVector(connection_.ReadData(), neural_net::SVectorF(center_));
+  }
+
+private:
+  // Waits for the control message of "step" for the current sequence number.
+  void ReadControl(const std::string &step) {
+    const auto message = connection_.ReadData();
+    CHECK_EQ(message, absl::StrCat(step, " ", sequence_))
+        << "Unexpected message from the optimizer";
+  }
+
+  Connection connection_;
+  std::unique_ptr<SharedRegion> region_;
+  int64_t sequence_ = 0;
+};
+
 void TrainExternalOptimizer() {
   // Select the working arena.
   const auto arena_builder =
       AbstractArenaBuilderRegisterer::Create(absl::GetFlag(FLAGS_arena));
 
   Options options;
+  options.optimizer = absl::GetFlag(FLAGS_optimizer);
 
   // Display during the learning.
   // Disable display and sleeping for maximum speed.
@@ -147,12 +415,22 @@ void TrainExternalOptimizer() {
   const auto map_definition = arena_builder->MapDefinition();
 
   GenomeManager genome_manager(map_definition, options);
-
-  Connection connection;
-  connection.Initialize();
-
-  connection.WriteData(genome_manager.weigh_allocator.size());
-  connection.WriteData(options.population_size);
+  const int num_weights = genome_manager.weigh_allocator.size();
+
+  std::unique_ptr<AbstractEsOptimizer> optimizer;
+  if (options.optimizer == "external") {
+    const auto protocol = absl::GetFlag(FLAGS_external_protocol);
+    CHECK(protocol == "shm" || protocol == "text")
+        << "Unknown protocol " << protocol;
+    optimizer = std::make_unique<PythonOptimizer>(
+        options.population_size, num_weights, protocol == "shm");
+  } else {
+    EsOptions es_options;
+    CHECK(ParseEsAlgorithm(options.optimizer, &es_options.algorithm))
+        << "Unknown optimizer " << options.optimizer;
+    es_options.population_size = options.population_size;
+    optimizer = CreateEsOptimizer(es_options, num_weights);
+  }
 
   size_t log_every = 10;
 
@@ -165,74 +443,157 @@ void TrainExternalOptimizer() {
     (*output_file) << "generation,max_fitness\n";
   }
 
-  std::vector<float> weights;
-  std::vector<double> evaluations;
-
-  std::vector<int> sequence(options.population_size); // TODO: Improve.
-  std::iota(sequence.begin(), sequence.end(), 0);
+  // Pipeline: the evaluation tasks of the candidates of a generation are
+  // followed by the tasks of the center they are sampled around. The optimizer
+  // only waits for the candidates: the center tasks drain while it runs
+  // "Tell" and "Ask", and the tasks of the next generation are queued behind
+  // them.
+  int num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  EvaluationPool pool(num_threads);
+  const int num_candidates = optimizer->num_candidates();
+  const int repetitions_per_task =
+      std::min(absl::GetFlag(FLAGS_repetitions_per_task),
+               options.num_evaluation_repetitions);
+  const int num_tasks_per_genome =
+      (options.num_evaluation_repetitions + repetitions_per_task - 1) /
+      repetitions_per_task;
+
+  // Sum of the scores of each candidate.
+  std::vector<std::atomic<double>> candidate_sums(num_candidates);
+  PendingTasks pending_candidates;
+  std::vector<double> fitnesses(num_candidates);
+
+  // Submits the tasks evaluating "genome", and adds the sum of their scores to
+  // "sum".
+  const auto submit_genome = [&](const Genome &genome, std::atomic<double> *sum,
+                                 PendingTasks *pending) {
+    // The tasks run concurrently and share the builder, i.e. the PackedGenome
+    // of the genome. The layers are immutable, and each controller owns its
+    // activations and layer input buffers.
+    const auto controller_builder =
+        std::make_shared<const ExternalOptimizerControllerBuilder>(
+            genome, &genome_manager);
+    pending->Add(num_tasks_per_genome);
+    for (int task_idx = 0; task_idx < num_tasks_per_genome; task_idx++) {
+      EvaluateOptions task_options = training_options;
+      task_options.num_repetitions =
+          std::min(repetitions_per_task, options.num_evaluation_repetitions -
+                                             task_idx * repetitions_per_task);
+      pool.Submit([&, controller_builder, task_options, sum, pending]() {
+        const float score =
+            Evaluate(arena_builder.get(), {controller_builder.get()},
+                     task_options)
+                .front();
+        double expected = sum->load();
+        while (!sum->compare_exchange_weak(
+            expected, expected + score * task_options.num_repetitions)) {
+        }
+        pending->Done();
+      });
+    }
+  };
 
-  Genome best_genome;
+  // Center of the previous generation, still being evaluated.
+  struct CenterEvaluation {
+    std::atomic<double> sum{0};
+    PendingTasks pending;
+  };
+  std::unique_ptr<CenterEvaluation> previous_center;
 
   double sum_last_log = 0;
   int count_last_log = 0;
-
-  for (int generation_idx = 0; generation_idx < options.num_generations;
-       generation_idx++) {
-
-    const auto raw_candidates = connection.ReadData();
-    // LOG(INFO) << "raw_candidates:" << raw_candidates;
-    std::vector<std::string> rows = absl::StrSplit(raw_candidates, ",");
-    evaluations.resize(rows.size());
-    std::for_each_n(
-        std::execution::par, sequence.begin(), sequence.size(), [&](int index) {
-          Genome genome = genome_manager.Empty();
-          ParseVector(rows[index], &genome.weight_bank);
-          evaluations[index] = EvaluateGenome(arena_builder.get(), genome,
-                                              training_options, genome_manager);
-        });
-
-    const auto raw_evaluations = absl::StrJoin(evaluations, " ");
-    // LOG(INFO) << "raw_evaluations:" << raw_evaluations;
-    connection.WriteData(raw_evaluations);
-
-    const auto raw_center = connection.ReadData();
-    // LOG(INFO) << "raw_center:" << raw_center;
-    Genome center_genome = genome_manager.Empty();
-    ParseVector(raw_center, &center_genome.weight_bank);
-    center_genome.fitness = EvaluateGenome(arena_builder.get(), center_genome,
-                                           training_options, genome_manager);
-
-    // if (std::isnan(best_genome.fitness) ||
-    //     center_genome.fitness > best_genome.fitness) {
-    best_genome = center_genome;
-    //}
-
-    sum_last_log += center_genome.fitness;
+  double idle_core_seconds_last_log = 0;
+  double wall_seconds_last_log = 0;
+  auto generation_begin = std::chrono::steady_clock::now();
+
+  // Logs the fitness of the center of the generation "generation_idx".
+  const auto log_center = [&](const int generation_idx,
+                              const double center_fitness) {
+    sum_last_log += center_fitness;
     count_last_log++;
-
     if (output_file) {
-      (*output_file) << generation_idx << "," << center_genome.fitness << "\n";
+      (*output_file) << generation_idx << "," << center_fitness << "\n";
     }
     if ((generation_idx % log_every) == 0) {
       if (output_file) {
         output_file->flush();
       }
       double mean_fitness = sum_last_log / count_last_log;
+      LOG(INFO) << "Generation #" << generation_idx
+                << " last_fitness: " << center_fitness
+                << " mean_fitness: " << mean_fitness
+                << " idle_core_s_per_generation: "
+                << idle_core_seconds_last_log / count_last_log
+                << " idle_cores: "
+                << 100 * idle_core_seconds_last_log /
+                       (num_threads * wall_seconds_last_log)
+                << "%";
       sum_last_log = 0;
       count_last_log = 0;
-      LOG(INFO) << "Generation #" << generation_idx
-                << " last_fitness: " << center_genome.fitness
-                << " mean_fitness: " << mean_fitness;
+      idle_core_seconds_last_log = 0;
+      wall_seconds_last_log = 0;
     }
+  };
+
+  optimizer->Ask();
+  for (int generation_idx = 0; generation_idx < options.num_generations;
+       generation_idx++) {
+    for (int index = 0; index < num_candidates; index++) {
+      candidate_sums[index] = 0;
+      submit_genome(genome_manager.FromWeightBank(optimizer->Candidate(index)),
+                    &candidate_sums[index], &pending_candidates);
+    }
+    auto center = std::make_unique<CenterEvaluation>();
+    submit_genome(genome_manager.FromWeightBank(optimizer->Center()),
+                  &center->sum, &center->pending);
+
+    // The center of the previous generation was queued before the candidates,
+    // and is done (or almost).
+    if (previous_center) {
+      previous_center->pending.Wait();
+      log_center(generation_idx - 1, previous_center->sum /
+                                         options.num_evaluation_repetitions);
+    }
+    previous_center = std::move(center);
+
+    pending_candidates.Wait();
+    for (int index = 0; index < num_candidates; index++) {
+      fitnesses[index] =
+          candidate_sums[index] / options.num_evaluation_repetitions;
+    }
+    optimizer->Tell(fitnesses);
+    if (generation_idx + 1 < options.num_generations) {
+      optimizer->Ask();
+    }
+
+    // A generation spans from the completion of the previous candidates to
+    // the completion of its candidates plus the optimizer update.
+    const auto now = std::chrono::steady_clock::now();
+    const double wall_seconds =
+        std::chrono::duration<double>(now - generation_begin).count();
+    generation_begin = now;
+    wall_seconds_last_log += wall_seconds;
+    idle_core_seconds_last_log += std::max(
+        0., num_threads * wall_seconds - pool.ConsumeBusySeconds());
+  }
+  if (previous_center) {
+    previous_center->pending.Wait();
+    log_center(options.num_generations - 1,
+               previous_center->sum / options.num_evaluation_repetitions);
   }
 
-  connection.Stop();
+  Genome best_genome = genome_manager.FromWeightBank(optimizer->Center());
+  // Stops the python optimizer, if any.
+  optimizer.reset();
 
   if (output_file) {
     output_file->close();
   }
 
-  LOG(INFO) << "Run with the best genome: " << best_genome.fitness << " : ";
+  LOG(INFO) << "Run with the final center";
   EvaluateGenome(arena_builder.get(), best_genome, evaluation_options,
                  genome_manager);
 }
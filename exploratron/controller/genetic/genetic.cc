@@ -2,7 +2,10 @@
 #include "exploratron/core/utils/logging.h"
 #include "exploratron/core/utils/macros.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <chrono>
+#include <cstring>
 #include <random>
 #include <stdint.h>
 
@@ -12,7 +15,7 @@ namespace genetic {
 constexpr int Numdir() { return static_cast<int>(eDirection::_NUM_DIRECTIONS); }
 
 void MutationRandomExp(const float rate, const float scale,
-                       std::vector<float> *data, std::mt19937 *rnd) {
+                       std::vector<float> *data, CounterRng *rnd) {
   const int k = std::binomial_distribution<int>(data->size(), rate)(*rnd);
   auto dist_a = std::uniform_real_distribution<float>(0, 10);
   auto dist_b = std::uniform_real_distribution<float>(0, 1);
@@ -27,57 +30,38 @@ void MutationRandomExp(const float rate, const float scale,
 }
 
 void MutationRandomAdd(const float rate, const float scale,
-                       std::vector<float> *data, std::mt19937 *rnd) {
-  const int k = std::binomial_distribution<int>(data->size(), rate)(*rnd);
+                       neural_net::SVectorF data, CounterRng *rnd) {
+  const int k = std::binomial_distribution<int>(data.size(), rate)(*rnd);
   auto noise_distribution =
       std::uniform_real_distribution<float>(-scale, scale);
   FOR_I(k) {
-    const int j = RND_UNIF_INT(data->size(), *rnd);
-    (*data)[j] += noise_distribution(*rnd);
+    const int j = RND_UNIF_INT(data.size(), *rnd);
+    data[j] += noise_distribution(*rnd);
   }
 }
 
-void MutationRandomAddAll(const float scale, std::vector<float> *data,
-                          std::mt19937 *rnd) {
-  auto noise_distribution =
-      std::uniform_real_distribution<float>(-scale, scale);
-  FOR_I(data->size()) { (*data)[i] += noise_distribution(*rnd); }
+void CrossoverOnePoint(const neural_net::CSVectorF a,
+                       const neural_net::CSVectorF b,
+                       neural_net::SVectorF child, CounterRng *rnd) {
+  const int point = RND_UNIF_INT(a.size(), *rnd);
+  std::copy(a.begin(), a.begin() + point, child.begin());
+  std::copy(b.begin() + point, b.end(), child.begin() + point);
 }
 
-Genome CrossoverOnePoint(const Genome &a, const Genome &b, std::mt19937 *rnd) {
-  Genome child = a;
-  const int point = RND_UNIF_INT(a.weight_bank.size(), *rnd);
-  std::copy(b.weight_bank.begin() + point, b.weight_bank.end(),
-            child.weight_bank.begin() + point);
-  return child;
-}
-
-Genome CrossoverTwoPoint(const Genome &a, const Genome &b, std::mt19937 *rnd) {
-  Genome child = a;
-  int p1 = RND_UNIF_INT(a.weight_bank.size(), *rnd);
-  int p2 = RND_UNIF_INT(a.weight_bank.size(), *rnd);
+void CrossoverTwoPoint(const neural_net::CSVectorF a,
+                       const neural_net::CSVectorF b,
+                       neural_net::SVectorF child, CounterRng *rnd) {
+  int p1 = RND_UNIF_INT(a.size(), *rnd);
+  int p2 = RND_UNIF_INT(a.size(), *rnd);
   if (p1 > p2) {
     std::swap(p1, p2);
   }
-  std::copy(b.weight_bank.begin() + p1, b.weight_bank.begin() + p2,
-            child.weight_bank.begin() + p1);
-  return child;
-}
-
-Genome CrossoverRandom(const Genome &a, const Genome &b, const float balance,
-                       std::mt19937 *rnd) {
-  Genome child = a;
-  auto balance_distribution = std::uniform_real_distribution<float>(0, 1);
-  FOR_I(a.weight_bank.size()) {
-    if (balance_distribution(*rnd) < balance) {
-      child.weight_bank[i] = b.weight_bank[i];
-    }
-  }
-  return child;
+  std::copy(a.begin(), a.end(), child.begin());
+  std::copy(b.begin() + p1, b.begin() + p2, child.begin() + p1);
 }
 
 const Genome &SelectionTournament(const std::vector<Genome> &population,
-                                  const int k, std::mt19937 *rnd) {
+                                  const int k, CounterRng *rnd) {
   assert(!population.empty());
   int best_individual_idx = 0;
   float best_fitness = -std::numeric_limits<float>::infinity();
@@ -92,18 +76,31 @@ const Genome &SelectionTournament(const std::vector<Genome> &population,
 }
 
 GenomeManager::GenomeManager(const MapDef &map_definition,
-                             const Options &options)
-    : map_definition_(map_definition), options_(options) {
+                             const Options &options, const uint64_t seed)
+    : map_definition_(map_definition), seed_(seed),
+      rnd_(seed, std::numeric_limits<uint64_t>::max()),
+      options_(options) {
+
+  const int first_dim =
+      options.hidden_layers.empty() ? Numdir() : options.hidden_layers.front();
+  if (sparse_terrain()) {
+    terrain_shape.input_size = map_definition_.shape.Size();
+    terrain_shape.num_input_values = map_definition_.num_values;
+    terrain_shape.output_size = first_dim;
+    terrain_shape.max_rows =
+        std::min(options.sparse_terrain_rows, terrain_shape.num_rows());
+    weight_address_1 =
+        weigh_allocator.CreateAddress(terrain_shape.NumWeights());
+  } else {
+    weight_address_1 = weigh_allocator.CreateAddress(
+        map_definition_.shape.Size() * map_definition_.num_values, first_dim);
+  }
 
   if (options.hidden_layers.empty()) {
-    weight_address_1 = weigh_allocator.CreateAddress(
-        map_definition_.shape.Size() * map_definition_.num_values, Numdir());
     weight_address_2 = weigh_allocator.CreateAddress(
         Numdir() * GeneticController::HISTORY_LENGTH, Numdir());
   } else {
     int n = options.hidden_layers.front();
-    weight_address_1 = weigh_allocator.CreateAddress(
-        map_definition_.shape.Size() * map_definition_.num_values, n);
     weight_address_2 = weigh_allocator.CreateAddress(
         Numdir() * GeneticController::HISTORY_LENGTH, n);
 
@@ -120,68 +117,454 @@ GenomeManager::GenomeManager(const MapDef &map_definition,
   LOG(INFO) << "Total number of weights: " << weigh_allocator.next_begin;
 }
 
+uint64_t GenomeManager::ReserveCounters(const int num) {
+  const uint64_t first = next_counter_;
+  next_counter_ += num;
+  return first;
+}
+
 void GenomeManager::Mutate(Genome *genome) {
+  auto &weights = *genome->weight_bank.mutable_values();
+  Mutate(ReserveCounters(1), neural_net::SVectorF(weights));
+}
+
+void GenomeManager::Mutate(const uint64_t counter,
+                           neural_net::SVectorF weights) const {
+  Mutate({counter, options_.mutate_scale}, weights);
+}
+
+void GenomeManager::Mutate(const CompactGenome::Mutation &mutation,
+                           neural_net::SVectorF weights) const {
+  // The row ids of the sparse layer are not mutated as weights.
+  std::vector<int> sparse_row_ids;
+  if (sparse_terrain()) {
+    const auto terrain = weight_address_1(weights);
+    FOR_I(terrain_shape.max_rows) {
+      sparse_row_ids.push_back(terrain_shape.RowId(terrain, i));
+    }
+  }
+
   switch (options_.mutate) {
   case Options::eMutate::kAll:
-    MutationRandomAddAll(options_.mutate_scale, &genome->weight_bank, &rnd_);
+    kernels::AddUniformNoise(seed_,
+                             StreamCounter(mutation.counter, eStream::kMutate),
+                             mutation.scale, weights.size(), weights.data());
     break;
   case Options::eMutate::kSome: {
-    MutationRandomAdd(options_.mutate_ratio, options_.mutate_scale,
-                      &genome->weight_bank, &rnd_);
+    CounterRng rnd(seed_, StreamCounter(mutation.counter, eStream::kMutate));
+    MutationRandomAdd(options_.mutate_ratio, mutation.scale, weights, &rnd);
   } break;
   default:
     CHECK(false);
     break;
   }
+
+  if (sparse_terrain()) {
+    const auto terrain = weight_address_1(weights);
+    FOR_I(terrain_shape.max_rows) {
+      terrain_shape.SetRowId(i, sparse_row_ids[i], terrain);
+    }
+    CounterRng rnd(seed_, StreamCounter(mutation.counter, eStream::kSparse));
+    neural_net::MutateSparseOneHot(terrain_shape, &rnd,
+                                   options_.sparse_prune_threshold,
+                                   options_.sparse_rewire_rate, 0.1f, terrain);
+  }
 }
 
 Genome GenomeManager::Crossover(const Genome &a, const Genome &b) {
-  // Cross-over
+  Genome child;
+  child.map_definition = a.map_definition;
+  auto &weights = *child.weight_bank.mutable_values();
+  weights.resize(a.weight_bank.size());
+  Crossover(a, b, ReserveCounters(1), neural_net::SVectorF(weights));
+  return child;
+}
+
+void GenomeManager::Crossover(const Genome &a, const Genome &b,
+                              const uint64_t counter,
+                              neural_net::SVectorF child) const {
+  const auto a_weights = a.weight_bank.values();
+  const auto b_weights = b.weight_bank.values();
+  DCHECK_EQ(a_weights.size(), child.size());
+  DCHECK_EQ(b_weights.size(), child.size());
+  CounterRng rnd(seed_, StreamCounter(counter, eStream::kCrossoverPoints));
+  const bool cross = options_.cross_over != Options::eCrossOver::kNone &&
+                     RND_UNIF_FLOAT(rnd) < options_.cross_over_rate;
+  if (!cross) {
+    std::copy(a_weights.begin(), a_weights.end(), child.begin());
+    return;
+  }
   switch (options_.cross_over) {
   case Options::eCrossOver::kOnePoint:
-    if (RND_UNIF_FLOAT(rnd_) < options_.cross_over_rate) {
-      return CrossoverOnePoint(a, b, &rnd_);
-    } else {
-      return a;
-    }
+    CrossoverOnePoint(a_weights, b_weights, child, &rnd);
+    break;
   case Options::eCrossOver::kTwoPoints:
-    if (RND_UNIF_FLOAT(rnd_) < options_.cross_over_rate) {
-      return CrossoverTwoPoint(a, b, &rnd_);
-    } else {
-      return a;
-    }
-  case Options::eCrossOver::kNone:
-    return a;
-
+    CrossoverTwoPoint(a_weights, b_weights, child, &rnd);
+    break;
   case Options::eCrossOver::kRandom:
-    if (RND_UNIF_FLOAT(rnd_) < options_.cross_over_rate) {
-      return CrossoverRandom(a, b, options_.cross_over_random_balance, &rnd_);
-    } else {
-      return a;
-    }
+    kernels::CrossoverUniform(
+        seed_, StreamCounter(counter, eStream::kCrossover),
+        options_.cross_over_random_balance, child.size(), a_weights.data(),
+        b_weights.data(), child.data());
+    break;
+  default:
+    CHECK(false);
+    break;
   }
 
-  CHECK(false);
+  if (sparse_terrain()) {
+    // Crosses whole rows, with their ids.
+    neural_net::CrossoverSparseOneHot(
+        terrain_shape, &rnd, options_.cross_over_random_balance,
+        weight_address_1(a.weight_bank), weight_address_1(b.weight_bank),
+        weight_address_1(child));
+  }
 }
 
 Genome GenomeManager::Random() {
   Genome child;
   child.map_definition = map_definition_;
-
-  weigh_allocator.AllocateWeightBank(&child.weight_bank);
-  neural_net::InitWeights(&child.weight_bank, &rnd_);
+  auto *weights = child.weight_bank.mutable_values();
+  weigh_allocator.AllocateWeightBank(weights);
+  Random(ReserveCounters(1), neural_net::SVectorF(*weights));
   return child;
 }
 
+void GenomeManager::Random(const uint64_t counter,
+                           neural_net::SVectorF weights) const {
+  // Same distribution as neural_net::InitWeights.
+  std::fill(weights.begin(), weights.end(), 0.f);
+  kernels::AddUniformNoise(seed_, StreamCounter(counter, eStream::kRandom),
+                           0.1f, weights.size(), weights.data());
+  if (sparse_terrain()) {
+    CounterRng rnd(seed_, StreamCounter(counter, eStream::kSparse));
+    neural_net::InitSparseOneHot(terrain_shape, &rnd, 0.1f,
+                                 weight_address_1(weights));
+  }
+}
+
 const Genome &
 GenomeManager::SelectIndividual(const std::vector<Genome> &population) {
+  return SelectIndividual(population, &rnd_);
+}
+
+const Genome &
+GenomeManager::SelectIndividual(const std::vector<Genome> &population,
+                                CounterRng *rnd) const {
   return SelectionTournament(
-      population, population.size() * options_.tournament_ratio, &rnd_);
+      population, population.size() * options_.tournament_ratio, rnd);
+}
+
+const Genome &
+GenomeManager::SelectParent(const std::vector<Genome> &population,
+                            const uint64_t counter) const {
+  CounterRng rnd = SelectionRng(counter);
+  return SelectIndividual(population, &rnd);
+}
+
+void GenomeManager::Decode(const CompactGenome &genome,
+                           neural_net::SVectorF weights) const {
+  Random(genome.init_counter(), weights);
+  for (const auto &mutation : genome.Mutations()) {
+    Mutate(mutation, weights);
+  }
+}
+
+CounterRng GenomeManager::SelectionRng(const uint64_t counter) const {
+  return CounterRng(seed_, StreamCounter(counter, eStream::kSelection));
+}
+
+void GenomeManager::Reproduce(const std::vector<Genome> &population,
+                              const uint64_t counter,
+                              neural_net::SVectorF child) const {
+  CounterRng rnd = SelectionRng(counter);
+  const auto &a = SelectIndividual(population, &rnd);
+  const auto &b = SelectIndividual(population, &rnd);
+  Crossover(a, b, counter, child);
+  Mutate(counter, child);
+}
+
+MigrationRing::MigrationRing(const int num_islands)
+    : mailboxes_(num_islands) {
+  for (auto &mailbox : mailboxes_) {
+    mailbox = nullptr;
+  }
+}
+
+MigrationRing::~MigrationRing() {
+  for (auto &mailbox : mailboxes_) {
+    delete mailbox.load();
+  }
+}
+
+void MigrationRing::Send(const int island,
+                         std::unique_ptr<Migrants> migrants) {
+  auto &mailbox = mailboxes_[(island + 1) % mailboxes_.size()];
+  // The migrants not received yet are dropped.
+  delete mailbox.exchange(migrants.release(), std::memory_order_acq_rel);
+}
+
+std::unique_ptr<MigrationRing::Migrants>
+MigrationRing::Receive(const int island) {
+  return std::unique_ptr<Migrants>(
+      mailboxes_[island].exchange(nullptr, std::memory_order_acq_rel));
+}
+
+namespace {
+uint64_t MixHash(uint64_t hash, const uint64_t value) {
+  constexpr uint64_t kMul = 0x9E3779B97F4A7C15ull;
+  hash = (hash ^ value) * kMul;
+  return hash ^ (hash >> 29);
+}
+} // namespace
+
+std::shared_ptr<const CompactGenome>
+CompactGenome::Random(const uint64_t init_counter) {
+  std::shared_ptr<CompactGenome> genome(new CompactGenome());
+  genome->init_counter_ = init_counter;
+  genome->hash_ = MixHash(0, init_counter);
+  return genome;
+}
+
+std::shared_ptr<const CompactGenome>
+CompactGenome::Mutated(std::shared_ptr<const CompactGenome> parent,
+                       const Mutation mutation) {
+  std::shared_ptr<CompactGenome> genome(new CompactGenome());
+  genome->init_counter_ = parent->init_counter_;
+  genome->mutation_ = mutation;
+  genome->num_mutations_ = parent->num_mutations_ + 1;
+  uint32_t scale_bits;
+  std::memcpy(&scale_bits, &mutation.scale, sizeof(scale_bits));
+  genome->hash_ =
+      MixHash(MixHash(parent->hash_, mutation.counter), scale_bits);
+  genome->parent_ = std::move(parent);
+  return genome;
+}
+
+CompactGenome::~CompactGenome() {
+  // Releases the ancestors iteratively: the recursive destruction of a long
+  // lineage could overflow the stack.
+  auto parent = std::move(parent_);
+  while (parent && parent.use_count() == 1) {
+    auto grand_parent =
+        std::move(const_cast<CompactGenome *>(parent.get())->parent_);
+    parent = std::move(grand_parent);
+  }
+}
+
+std::vector<CompactGenome::Mutation> CompactGenome::Mutations() const {
+  std::vector<Mutation> mutations(num_mutations_);
+  const CompactGenome *genome = this;
+  for (int i = num_mutations_ - 1; i >= 0; i--) {
+    mutations[i] = genome->mutation_;
+    genome = genome->parent();
+  }
+  return mutations;
+}
+
+std::string CompactGenome::Serialize() const {
+  const int32_t num_mutations = num_mutations_;
+  std::string output;
+  output.reserve(12 + 12 * num_mutations);
+  output.append(reinterpret_cast<const char *>(&init_counter_),
+                sizeof(init_counter_));
+  output.append(reinterpret_cast<const char *>(&num_mutations),
+                sizeof(num_mutations));
+  for (const auto &mutation : Mutations()) {
+    output.append(reinterpret_cast<const char *>(&mutation.counter),
+                  sizeof(mutation.counter));
+    output.append(reinterpret_cast<const char *>(&mutation.scale),
+                  sizeof(mutation.scale));
+  }
+  return output;
+}
+
+std::shared_ptr<const CompactGenome>
+CompactGenome::Deserialize(std::string_view *data) {
+  const auto read = [&](void *value, const size_t size) {
+    if (data->size() < size) {
+      return false;
+    }
+    std::memcpy(value, data->data(), size);
+    data->remove_prefix(size);
+    return true;
+  };
+  uint64_t init_counter;
+  int32_t num_mutations;
+  if (!read(&init_counter, sizeof(init_counter)) ||
+      !read(&num_mutations, sizeof(num_mutations)) || num_mutations < 0) {
+    return nullptr;
+  }
+  auto genome = Random(init_counter);
+  for (int i = 0; i < num_mutations; i++) {
+    Mutation mutation;
+    if (!read(&mutation.counter, sizeof(mutation.counter)) ||
+        !read(&mutation.scale, sizeof(mutation.scale))) {
+      return nullptr;
+    }
+    genome = Mutated(std::move(genome), mutation);
+  }
+  return genome;
+}
+
+GenomeDecoder::GenomeDecoder(const GenomeManager *genome_manager,
+                             const int capacity)
+    : genome_manager_(genome_manager), capacity_(capacity) {}
+
+void GenomeDecoder::Decode(const CompactGenome &genome,
+                           neural_net::SVectorF weights) {
+  num_encoded_mutations_ += genome.num_mutations();
+
+  // Mutations since the closest cached ancestor, from the last one.
+  std::vector<const CompactGenome *> lineage;
+  const CompactGenome *ancestor = &genome;
+  auto cached = index_.end();
+  while (ancestor) {
+    cached = index_.find(ancestor->hash());
+    if (cached != index_.end()) {
+      break;
+    }
+    lineage.push_back(ancestor);
+    ancestor = ancestor->parent();
+  }
+
+  if (cached != index_.end()) {
+    const auto &ancestor_weights = cached->second->second;
+    DCHECK_EQ(ancestor_weights.size(), weights.size());
+    std::copy(ancestor_weights.begin(), ancestor_weights.end(),
+              weights.begin());
+    entries_.splice(entries_.begin(), entries_, cached->second);
+  } else {
+    genome_manager_->Random(genome.init_counter(), weights);
+    // The root has no mutation.
+    lineage.pop_back();
+  }
+  for (auto it = lineage.rbegin(); it != lineage.rend(); ++it) {
+    genome_manager_->Mutate((*it)->mutation(), weights);
+    num_applied_mutations_++;
+  }
+
+  if (capacity_ <= 0 || index_.count(genome.hash())) {
+    return;
+  }
+  if (entries_.size() >= capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  entries_.emplace_front(genome.hash(),
+                         neural_net::VectorF(weights.begin(), weights.end()));
+  index_[genome.hash()] = entries_.begin();
+}
+
+uint64_t FitnessCache::Hash(const neural_net::CSVectorF weights) {
+  // Multiply-xorshift over the bits of the weights.
+  constexpr uint64_t kMul = 0x9E3779B97F4A7C15ull;
+  uint64_t hash = weights.size();
+  for (const float weight : weights) {
+    uint32_t bits;
+    std::memcpy(&bits, &weight, sizeof(bits));
+    hash = (hash ^ bits) * kMul;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+FitnessCache::Estimate FitnessCache::Lookup(const uint64_t hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.num_lookups++;
+  const auto it = entries_.find(hash);
+  if (it == entries_.end()) {
+    return {};
+  }
+  stats_.num_hits++;
+  it->second.used = true;
+  return it->second.estimate;
+}
+
+FitnessCache::Estimate FitnessCache::Add(const uint64_t hash,
+                                         const absl::Span<const float> scores) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &entry = entries_[hash];
+  entry.used = true;
+  auto &estimate = entry.estimate;
+  for (const float score : scores) {
+    estimate.count++;
+    const double delta = score - estimate.mean;
+    estimate.mean += delta / estimate.count;
+    estimate.m2 += delta * (score - estimate.mean);
+  }
+  return estimate;
+}
+
+FitnessCache::Stats FitnessCache::EndGeneration() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.used) {
+      it->second.used = false;
+      ++it;
+    } else {
+      it = entries_.erase(it);
+    }
+  }
+  Stats stats = stats_;
+  stats.num_entries = entries_.size();
+  stats_ = {};
+  return stats;
+}
+
+PopulationMatrix::PopulationMatrix(const int num_rows, const int num_weights)
+    : num_rows_(num_rows), num_weights_(num_weights),
+      stride_(kernels::GemvPaddedSize(num_weights)),
+      values_(static_cast<size_t>(num_rows) * stride_, 0.f) {}
+
+neural_net::WeightBank
+PopulationMatrix::RowBank(std::shared_ptr<const PopulationMatrix> matrix,
+                          const int row) {
+  const auto values = matrix->row(row);
+  return neural_net::WeightBank(std::move(matrix), values);
+}
+
+PackedGenome::PackedGenome(const Genome &genome,
+                           const GenomeManager &genome_manager,
+                           const bool quantize) {
+  const auto &hidden_dims = genome_manager.options_.hidden_layers;
+  const int first_dim = hidden_dims.empty() ? Numdir() : hidden_dims.front();
+  if (genome_manager.sparse_terrain()) {
+    terrain = neural_net::FixedPointOneHotWeights(
+        genome_manager.terrain_shape,
+        genome_manager.weight_address_1(genome.weight_bank));
+  } else {
+    terrain = neural_net::FixedPointOneHotWeights(
+        genome.map_definition.shape.Size(), genome.map_definition.num_values,
+        first_dim, genome_manager.weight_address_1(genome.weight_bank));
+  }
+  past = neural_net::FixedPointOneHotWeights(
+      GeneticController::HISTORY_LENGTH, Numdir(), first_dim,
+      genome_manager.weight_address_2(genome.weight_bank));
+  for (int i = 0; i < hidden_dims.size(); i++) {
+    const int output_dim =
+        i + 1 < hidden_dims.size() ? hidden_dims[i + 1] : Numdir();
+    const auto weights = genome_manager.hidden_layers[i](genome.weight_bank);
+    if (quantize) {
+      quantized_hidden_layers.emplace_back(weights, hidden_dims[i], output_dim);
+    } else {
+      hidden_layers.emplace_back(weights, hidden_dims[i], output_dim);
+    }
+  }
 }
 
-GeneticController::GeneticController(const Genome &genome,
-                                     const GenomeManager *genome_manager)
-    : genome_(genome), genome_manager_(genome_manager) {
+GeneticController::GeneticController(
+    const Genome &genome, const GenomeManager *genome_manager,
+    std::shared_ptr<const PackedGenome> packed_genome)
+    : packed_genome_(std::move(packed_genome)),
+      genome_manager_(genome_manager) {
+  if (!packed_genome_) {
+    packed_genome_ =
+        std::make_shared<const PackedGenome>(genome, *genome_manager);
+  }
+  terrain_accumulator_ =
+      neural_net::OneHotAccumulator(&packed_genome_->terrain);
+  past_accumulator_ = neural_net::OneHotAccumulator(&packed_genome_->past);
 
   if (genome_manager->options_.hidden_layers.empty()) {
     cache_hidden_.push_back(neural_net::VectorF(Numdir()));
@@ -199,35 +582,26 @@ GeneticController::GeneticController(const Genome &genome,
 }
 
 Output GeneticController::Step(const Input &input) {
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      input.surouding.values, genome_.map_definition.num_values,
-      genome_manager_->weight_address_1(genome_.weight_bank),
-      &cache_hidden_[0]);
-
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      last_dirs_, Numdir(),
-      genome_manager_->weight_address_2(genome_.weight_bank),
-      &cache_hidden_[1]);
+  terrain_accumulator_.Forward<neural_net::Identity>(input.surouding.values,
+                                                     &cache_hidden_[0]);
+  past_accumulator_.Forward<neural_net::Identity>(last_dirs_,
+                                                  &cache_hidden_[1]);
 
   neural_net::AddTo<neural_net::Identity>(cache_hidden_[0], &cache_hidden_[1]);
 
   if (!genome_manager_->options_.hidden_layers.empty()) {
-    for (int i = 0; i < genome_manager_->options_.hidden_layers.size() - 1;
-         i++) {
-      neural_net::Forward<neural_net::Relu>(
-          cache_hidden_[i + 1],
-          genome_manager_->hidden_layers[i](genome_.weight_bank),
-          &cache_hidden_[i + 2]);
+    if (packed_genome_->quantized_hidden_layers.empty()) {
+      ForwardHiddenLayers(packed_genome_->hidden_layers, &padded_inputs_);
+    } else {
+      ForwardHiddenLayers(packed_genome_->quantized_hidden_layers,
+                          &quantized_inputs_);
     }
-
-    const int i = genome_manager_->options_.hidden_layers.size() - 1;
-    neural_net::Forward<neural_net::Identity>(
-        cache_hidden_[i + 1],
-        genome_manager_->hidden_layers[i](genome_.weight_bank),
-        &cache_hidden_[i + 2]);
   }
 
-  int dir = neural_net::SoftMaxSampling(cache_hidden_.back(), &rnd_);
+  const int dir =
+      genome_manager_->options_.gumbel_sampling
+          ? neural_net::GumbelMaxSampling(cache_hidden_.back(), &rnd_)
+          : neural_net::SoftMaxSampling(cache_hidden_.back(), &rnd_);
 
   /*
     LOG(INFO) << "Inputs:\n" << input.surouding;
@@ -252,5 +626,251 @@ Output GeneticController::Step(const Input &input) {
   return output;
 }
 
+template <typename Layer>
+void GeneticController::ForwardHiddenLayers(
+    const std::vector<Layer> &layers,
+    std::vector<typename Layer::InputBuffer> *input_buffers) {
+  input_buffers->resize(layers.size());
+  for (int i = 0; i < layers.size() - 1; i++) {
+    layers[i].template Forward<neural_net::Relu>(
+        cache_hidden_[i + 1], &(*input_buffers)[i], &cache_hidden_[i + 2]);
+  }
+  const int i = layers.size() - 1;
+  layers[i].template Forward<neural_net::Identity>(
+      cache_hidden_[i + 1], &(*input_buffers)[i], &cache_hidden_[i + 2]);
+}
+
+namespace {
+
+template <typename Policy>
+std::unique_ptr<AbstractController>
+CreateIfMatches(const GenomeManager &genome_manager,
+                std::shared_ptr<const PackedGenome> packed_genome) {
+  if (!Policy::Matches(genome_manager)) {
+    return nullptr;
+  }
+  return std::make_unique<Policy>(std::move(packed_genome), genome_manager);
+}
+
+typedef std::unique_ptr<AbstractController> (*FixedPolicyFactory)(
+    const GenomeManager &, std::shared_ptr<const PackedGenome>);
+
+constexpr int kHistory = GeneticController::HISTORY_LENGTH;
+
+// Registered specializations of FixedPolicy.
+constexpr FixedPolicyFactory kFixedPolicyFactories[] = {
+    CreateIfMatches<FixedPolicy<7, 7, 3, kHistory>>,
+    CreateIfMatches<FixedPolicy<7, 7, 3, kHistory, 20>>,
+    CreateIfMatches<FixedPolicy<7, 7, 3, kHistory, 20, 20>>,
+    CreateIfMatches<FixedPolicy<7, 7, 5, kHistory>>,
+    CreateIfMatches<FixedPolicy<7, 7, 5, kHistory, 20>>,
+    CreateIfMatches<FixedPolicy<7, 7, 5, kHistory, 20, 20>>,
+};
+
+} // namespace
+
+std::unique_ptr<AbstractController>
+CreateFixedPolicy(const GenomeManager &genome_manager,
+                  std::shared_ptr<const PackedGenome> packed_genome) {
+  if (!packed_genome->quantized_hidden_layers.empty()) {
+    return nullptr;
+  }
+  for (const auto factory : kFixedPolicyFactories) {
+    auto policy = factory(genome_manager, packed_genome);
+    if (policy) {
+      return policy;
+    }
+  }
+  return nullptr;
+}
+
+BatchedPolicy::BatchedPolicy(const std::vector<const Genome *> &genomes,
+                             const int num_episodes_per_genome,
+                             const GenomeManager *genome_manager)
+    : genomes_(genomes), num_episodes_per_genome_(num_episodes_per_genome),
+      genome_manager_(genome_manager) {
+  packed_genomes_.reserve(genomes.size());
+  for (const auto *genome : genomes) {
+    packed_genomes_.emplace_back(*genome, *genome_manager);
+  }
+  episodes_.resize(genomes.size() * num_episodes_per_genome);
+  for (int episode_idx = 0; episode_idx < episodes_.size(); episode_idx++) {
+    auto &episode = episodes_[episode_idx];
+    const auto &layers =
+        packed_genomes_[episode_idx / num_episodes_per_genome];
+    episode.last_dirs.assign(GeneticController::HISTORY_LENGTH, 0);
+    episode.terrain_accumulator =
+        neural_net::OneHotAccumulator(&layers.terrain);
+    episode.past_accumulator = neural_net::OneHotAccumulator(&layers.past);
+  }
+
+  const auto &hidden_layers = genome_manager->options_.hidden_layers;
+  const int first_dim =
+      hidden_layers.empty() ? Numdir() : hidden_layers.front();
+  cache_terrain_.resize(first_dim);
+  cache_past_.resize(first_dim);
+  if (genome_manager->options_.gumbel_sampling) {
+    random_bits_.resize(num_episodes_per_genome * Numdir());
+    sampled_dirs_.resize(num_episodes_per_genome);
+  }
+
+  // Dimension of the activations.
+  std::vector<int> dims = {first_dim};
+  for (int i = 0; i < hidden_layers.size(); i++) {
+    dims.push_back(i + 1 < hidden_layers.size() ? hidden_layers[i + 1]
+                                                : Numdir());
+  }
+  for (int l = 0; l < dims.size(); l++) {
+    // The inputs of the hidden layers are padded for the kernels.
+    const int stride =
+        l + 1 < dims.size() ? kernels::GemvPaddedSize(dims[l]) : dims[l];
+    activation_strides_.push_back(stride);
+    activations_.emplace_back(stride * num_episodes_per_genome, 0.f);
+  }
+  running_episodes_.reserve(num_episodes_per_genome);
+}
+
+void BatchedPolicy::Step(const std::vector<const Input *> &inputs,
+                         std::vector<Output> *outputs) {
+  DCHECK_EQ(inputs.size(), episodes_.size());
+  DCHECK_EQ(outputs->size(), episodes_.size());
+  const int num_layers = genome_manager_->options_.hidden_layers.size();
+
+  for (int g = 0; g < genomes_.size(); g++) {
+    // One-hot layers, one episode at a time.
+    running_episodes_.clear();
+    for (int e = 0; e < num_episodes_per_genome_; e++) {
+      const int episode_idx = g * num_episodes_per_genome_ + e;
+      const Input *input = inputs[episode_idx];
+      if (!input) {
+        continue;
+      }
+      auto &episode = episodes_[episode_idx];
+      episode.terrain_accumulator.Forward<neural_net::Identity>(
+          input->surouding.values, &cache_terrain_);
+      episode.past_accumulator.Forward<neural_net::Identity>(
+          episode.last_dirs, &cache_past_);
+      neural_net::AddTo<neural_net::Identity>(cache_terrain_, &cache_past_);
+      std::copy(cache_past_.begin(), cache_past_.end(),
+                activations_[0].begin() +
+                    running_episodes_.size() * activation_strides_[0]);
+      running_episodes_.push_back(episode_idx);
+    }
+    if (running_episodes_.empty()) {
+      continue;
+    }
+
+    // Dense layers, all the running episodes at once.
+    const int batch_size = running_episodes_.size();
+    for (int l = 0; l < num_layers; l++) {
+      const auto &layer = packed_genomes_[g].hidden_layers[l];
+      if (l + 1 < num_layers) {
+        layer.ForwardBatch<neural_net::Relu>(activations_[l].data(),
+                                             batch_size,
+                                             activations_[l + 1].data(),
+                                             activation_strides_[l + 1]);
+      } else {
+        layer.ForwardBatch<neural_net::Identity>(activations_[l].data(),
+                                                 batch_size,
+                                                 activations_[l + 1].data(),
+                                                 activation_strides_[l + 1]);
+      }
+    }
+
+    // Sampling of the actions.
+    const auto &network_output = activations_.back();
+    const int stride = activation_strides_.back();
+    const bool gumbel_sampling = genome_manager_->options_.gumbel_sampling;
+    if (gumbel_sampling) {
+      FOR_I(batch_size) {
+        episodes_[running_episodes_[i]].rnd.Generate(
+            Numdir(), &random_bits_[i * Numdir()]);
+      }
+      kernels::GumbelMaxSampleBatch(network_output.data(), stride,
+                                    random_bits_.data(), batch_size, Numdir(),
+                                    sampled_dirs_.data());
+    }
+    FOR_I(batch_size) {
+      const int episode_idx = running_episodes_[i];
+      auto &episode = episodes_[episode_idx];
+      const int dir =
+          gumbel_sampling
+              ? sampled_dirs_[i]
+              : neural_net::SoftMaxSampling(
+                    neural_net::CSVectorF(&network_output[i * stride],
+                                          Numdir()),
+                    &episode.rnd);
+
+      Output &output = (*outputs)[episode_idx];
+      output = Output();
+      output.move = static_cast<eDirection>(dir);
+      auto &last_dirs = episode.last_dirs;
+      std::rotate(last_dirs.begin(), last_dirs.begin() + 1, last_dirs.end());
+      last_dirs.back() = dir;
+    }
+  }
+}
+
+QuantizationReport CompareQuantizedPolicy(
+    const AbstractArenaBuilder *arena_builder, const Genome &genome,
+    const GenomeManager &genome_manager, const int num_episodes) {
+  const GeneticControllerBuilder float_builder(genome, &genome_manager);
+  const QuantizedGeneticControllerBuilder int8_builder(genome, &genome_manager);
+  const MapDef map_definition = arena_builder->MapDefinition();
+  // The float policy is always a GeneticController, even if
+  // Options::fixed_policies is set, so that both policies only differ by the
+  // quantization.
+  const auto float_packed_genome =
+      std::make_shared<const PackedGenome>(genome, genome_manager);
+  const auto create_float_controller = [&]() {
+    return std::make_unique<GeneticController>(genome, &genome_manager,
+                                               float_packed_genome);
+  };
+  const auto create_int8_controller = [&]() {
+    return int8_builder.Create(map_definition);
+  };
+
+  QuantizationReport report;
+  int num_agreements = 0;
+  // Inputs of the steps of each episode.
+  std::vector<std::vector<Input>> episodes(num_episodes);
+  for (auto &inputs : episodes) {
+    const auto arena = arena_builder->Create({&float_builder});
+    const auto float_controller = create_float_controller();
+    const auto int8_controller = create_int8_controller();
+    const Input *input = arena->Observe();
+    CHECK(input) << "The arena does not support Observe / Act";
+    while (true) {
+      inputs.push_back(*input);
+      const Output output = float_controller->Step(*input);
+      num_agreements += int8_controller->Step(*input).move == output.move;
+      report.num_steps++;
+      if (!arena->Act(output)) {
+        break;
+      }
+      input = arena->Observe();
+    }
+  }
+  report.agreement =
+      static_cast<double>(num_agreements) / std::max(report.num_steps, 1);
+
+  const auto time_steps = [&](const auto &create_controller) {
+    std::chrono::steady_clock::duration duration{};
+    for (const auto &inputs : episodes) {
+      const auto controller = create_controller();
+      const auto begin = std::chrono::steady_clock::now();
+      for (const auto &input : inputs) {
+        controller->Step(input);
+      }
+      duration += std::chrono::steady_clock::now() - begin;
+    }
+    return std::chrono::duration<double, std::nano>(duration).count() /
+           std::max(report.num_steps, 1);
+  };
+  report.float_step_ns = time_steps(create_float_controller);
+  report.int8_step_ns = time_steps(create_int8_controller);
+  return report;
+}
+
 } // namespace genetic
 } // namespace exploratron
\ No newline at end of file
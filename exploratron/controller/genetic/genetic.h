@@ -2,9 +2,18 @@
 #define CONTROLLER_GENETIC_H_
 
 #include "absl/types/span.h"
+#include <array>
+#include <atomic>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 #include "exploratron/core/utils/maths.h"
 #include "exploratron/core/utils/neural_net.h"
 
@@ -42,6 +51,52 @@ struct Options {
 
   std::vector<int> hidden_layers = {20};
 
+  // Island model, used if num_islands > 1: the population, the elites and the
+  // random genomes are split among "num_islands" sub-populations evolved
+  // independently. Every "migration_interval" generations, each island sends
+  // copies of its "num_migrants" best genomes to the next island of a ring,
+  // where they replace the worst genomes.
+  int num_islands = 1;
+  int migration_interval = 25;
+  int num_migrants = 2;
+
+  // Steady-state evolution: instead of generations, each worker repeatedly
+  // breeds a child from the current population, evaluates it, and inserts it
+  // in place of the loser of a tournament if it is not worse. The budget is
+  // num_generations * population_size evaluations.
+  bool steady_state = false;
+
+  // Fitness cache: a genome evaluated in a previous generation (e.g. an elite)
+  // only gets "cached_repetitions" additional episodes, averaged with its
+  // previous ones. The elites are then ranked by a mean over more episodes
+  // than the new genomes. If 0, the cache is disabled.
+  int cached_repetitions = 0;
+
+  // Genomes are also encoded as CompactGenomes. Requires the crossover kNone:
+  // the children are mutations of a single parent (Such et al. 2017).
+  bool compact_genomes = false;
+
+  // If >0, the terrain layer is a sparse one-hot layer of at most this many
+  // (position, value) rows (see neural_net::SparseOneHotShape), so its size
+  // does not depend on the size of the observation window. At each mutation,
+  // the rows with a mean absolute weight below "sparse_prune_threshold" are
+  // pruned and regrown elsewhere, and each row is rewired with probability
+  // "sparse_rewire_rate".
+  int sparse_terrain_rows = 0;
+  float sparse_prune_threshold = 0.005f;
+  float sparse_rewire_rate = 0.01f;
+
+  // If true, the controllers of the genomes are FixedPolicys whenever one is
+  // registered for the shapes of the network (see CreateFixedPolicy).
+  bool fixed_policies = true;
+
+  // If true, the controllers sample their moves with the Gumbel-max trick
+  // (neural_net::GumbelMaxSampling) instead of inverting the cumulative
+  // distribution. Same distribution, but other random numbers. The lockstep
+  // evaluation then samples the moves of all the running episodes of a genome
+  // with a single kernel call.
+  bool gumbel_sampling = false;
+
   std::string to_string() const {
     std::stringstream ss;
 
@@ -85,10 +140,77 @@ struct Options {
     }
 
     ss << "_rep-" << num_repetitions;
+
+    if (num_islands > 1) {
+      ss << "_isl-" << num_islands << "-mi-" << migration_interval << "x"
+         << num_migrants;
+    }
+    if (steady_state) {
+      ss << "_ss";
+    }
+    if (cached_repetitions > 0) {
+      ss << "_fc-" << cached_repetitions;
+    }
+    if (compact_genomes) {
+      ss << "_compact";
+    }
+    if (sparse_terrain_rows > 0) {
+      ss << "_sp-" << sparse_terrain_rows;
+    }
     return ss.str();
   }
 };
 
+// Genome encoded by the operators that produced it, in the style of Such et
+// al. 2017: a random initialization followed by mutations, each one identified
+// by its counter and scale (see GenomeManager). A genome only holds its last
+// mutation and shares the others with its parent, so a child costs O(1)
+// memory. Decoded by GenomeManager::Decode or GenomeDecoder. Immutable.
+class CompactGenome {
+public:
+  struct Mutation {
+    uint64_t counter;
+    float scale;
+  };
+
+  // Randomly initialized genome.
+  static std::shared_ptr<const CompactGenome> Random(uint64_t init_counter);
+  // "parent" followed by "mutation".
+  static std::shared_ptr<const CompactGenome>
+  Mutated(std::shared_ptr<const CompactGenome> parent, Mutation mutation);
+
+  ~CompactGenome();
+
+  uint64_t init_counter() const { return init_counter_; }
+  int num_mutations() const { return num_mutations_; }
+  // Parent of the genome, null if the genome has no mutations.
+  const CompactGenome *parent() const { return parent_.get(); }
+  // Last mutation. Only defined if num_mutations() > 0.
+  const Mutation &mutation() const { return mutation_; }
+  // Mutations, from the oldest to the last one.
+  std::vector<Mutation> Mutations() const;
+  // Identifies the encoding.
+  uint64_t hash() const { return hash_; }
+
+  // Binary encoding, in the byte order of the machine: the initialization
+  // counter, the number of mutations, and the counter and scale of each
+  // mutation i.e. 12 + 12 * num_mutations() bytes.
+  std::string Serialize() const;
+  // Reads a genome from the beginning of "data", and removes it from "data".
+  // Returns null if "data" is not a valid encoding.
+  static std::shared_ptr<const CompactGenome>
+  Deserialize(std::string_view *data);
+
+private:
+  CompactGenome() = default;
+
+  std::shared_ptr<const CompactGenome> parent_;
+  uint64_t init_counter_ = 0;
+  Mutation mutation_ = {};
+  int num_mutations_ = 0;
+  uint64_t hash_ = 0;
+};
+
 struct Genome {
   bool operator<(const Genome &a) const { return fitness < a.fitness; }
   bool operator>(const Genome &a) const { return fitness > a.fitness; }
@@ -98,54 +220,450 @@ struct Genome {
   }
 
   float fitness = std::numeric_limits<float>::quiet_NaN();
-  neural_net::VectorF weight_bank;
+  neural_net::WeightBank weight_bank;
   MapDef map_definition;
+  // If set, encoding of "weight_bank". Can be shipped without the weights.
+  std::shared_ptr<const CompactGenome> compact;
+};
+
+// Weight banks of a population, stored as the rows of one aligned matrix so
+// that the genetic operators stream through contiguous memory. Rows are padded
+// to a multiple of kernels::kGemvPadding floats.
+class PopulationMatrix {
+public:
+  PopulationMatrix(int num_rows, int num_weights);
+
+  int num_rows() const { return num_rows_; }
+  int num_weights() const { return num_weights_; }
+  neural_net::SVectorF row(const int i) {
+    return neural_net::SVectorF(&values_[i * stride_], num_weights_);
+  }
+  neural_net::CSVectorF row(const int i) const {
+    return neural_net::CSVectorF(&values_[i * stride_], num_weights_);
+  }
+
+  // Weight bank viewing the row "row" of "matrix". The bank keeps the matrix
+  // alive.
+  static neural_net::WeightBank
+  RowBank(std::shared_ptr<const PopulationMatrix> matrix, int row);
+
+private:
+  int num_rows_;
+  int num_weights_;
+  size_t stride_;
+  kernels::AlignedVectorF values_;
 };
 
 struct GenomeManager {
-  GenomeManager(const MapDef &map_definition, const Options &options);
+  // Seed of the counter based generators. Fixed by default so that the
+  // training runs are reproducible.
+  static constexpr uint64_t kDefaultSeed = 5489;
+
+  GenomeManager(const MapDef &map_definition, const Options &options,
+                uint64_t seed = kDefaultSeed);
   void Mutate(Genome *genome);
   Genome Crossover(const Genome &a, const Genome &b);
   Genome Random();
   void PointMutate(float ratio, std::vector<float> *vs);
   const Genome &SelectIndividual(const std::vector<Genome> &population);
 
+  // Versions of the operators writing in place, e.g. in the rows of a
+  // PopulationMatrix. The random values of an operator only depend on
+  // "counter": the dense operators (kRandom crossover, kAll mutation and
+  // random initialization) use the counter based kernels, and the other ones a
+  // CounterRng on a stream derived from "counter". Each call should use a
+  // different counter obtained with "ReserveCounters". Thread safe.
+  void Mutate(uint64_t counter, neural_net::SVectorF weights) const;
+  void Mutate(const CompactGenome::Mutation &mutation,
+              neural_net::SVectorF weights) const;
+  void Crossover(const Genome &a, const Genome &b, uint64_t counter,
+                 neural_net::SVectorF child) const;
+  void Random(uint64_t counter, neural_net::SVectorF weights) const;
+
+  // Selects two parents of "population", and writes in "child" their mutated
+  // crossover. The selection uses a CounterRng on a stream derived from
+  // "counter", so the child only depends on "population" and "counter". Thread
+  // safe.
+  void Reproduce(const std::vector<Genome> &population, uint64_t counter,
+                 neural_net::SVectorF child) const;
+
+  // Parent of the asexual child "counter" (compact genomes), selected like the
+  // parents of "Reproduce". Thread safe.
+  const Genome &SelectParent(const std::vector<Genome> &population,
+                             uint64_t counter) const;
+
+  // Weights of "genome", from scratch. Thread safe.
+  void Decode(const CompactGenome &genome, neural_net::SVectorF weights) const;
+
+  // Generator of the parent selection of the child "counter", as used by
+  // "Reproduce".
+  CounterRng SelectionRng(uint64_t counter) const;
+
+  // Reserves "num" consecutive counters, and returns the first one.
+  uint64_t ReserveCounters(int num);
+
+  bool sparse_terrain() const { return options_.sparse_terrain_rows > 0; }
+
   MapDef map_definition_;
-  std::mt19937 rnd_;
+  const uint64_t seed_;
+  // Used for the selection. Its stream is not used by the operators.
+  CounterRng rnd_;
+  uint64_t next_counter_ = 0;
   neural_net::WeightsAllocator weigh_allocator;
+  // One-hot layers, in the neural_net::eOneHotLayout::kInputMajor layout. If
+  // options_.sparse_terrain_rows > 0, "weight_address_1" is a sparse one-hot
+  // layer of shape "terrain_shape".
   neural_net::WeightsAddress weight_address_1;
+  neural_net::SparseOneHotShape terrain_shape;
   neural_net::WeightsAddress weight_address_2;
   std::vector<neural_net::WeightsAddress> hidden_layers;
   const Options options_;
+
+private:
+  // Each operator uses its own sequences of the generator.
+  enum class eStream {
+    kMutate,
+    kCrossover,
+    kRandom,
+    // Decision and points of the non-uniform crossovers.
+    kCrossoverPoints,
+    kSelection,
+    // Structure of the sparse terrain layer.
+    kSparse,
+    _NUM_STREAMS,
+  };
+  static uint64_t StreamCounter(const uint64_t counter, const eStream stream) {
+    return counter * static_cast<uint64_t>(eStream::_NUM_STREAMS) +
+           static_cast<uint64_t>(stream);
+  }
+
+  const Genome &SelectIndividual(const std::vector<Genome> &population,
+                                 CounterRng *rnd) const;
+};
+
+// Decodes compact genomes, keeping the weights of the last decoded genomes
+// (least recently used eviction). A genome with a cached ancestor is decoded
+// from the ancestor, so decoding a child of a cached genome only costs a copy
+// and a mutation. Not thread safe: one decoder per worker.
+class GenomeDecoder {
+public:
+  GenomeDecoder(const GenomeManager *genome_manager, int capacity);
+
+  void Decode(const CompactGenome &genome, neural_net::SVectorF weights);
+
+  // Number of mutations applied by the decoder, and number of mutations a
+  // decoder without cache would have applied.
+  int64_t num_applied_mutations() const { return num_applied_mutations_; }
+  int64_t num_encoded_mutations() const { return num_encoded_mutations_; }
+
+private:
+  typedef std::list<std::pair<uint64_t, neural_net::VectorF>> Entries;
+
+  const GenomeManager *genome_manager_;
+  int capacity_;
+  // Most recently used first.
+  Entries entries_;
+  std::unordered_map<uint64_t, Entries::iterator> index_;
+  int64_t num_applied_mutations_ = 0;
+  int64_t num_encoded_mutations_ = 0;
+};
+
+// Ring of islands exchanging migrants (island model). Island i sends to island
+// (i + 1) % num_islands. Each island has a mailbox holding the last migrants
+// sent to it: sending replaces the migrants not received yet, and receiving
+// empties the mailbox. Both are lock-free, so the islands never wait for each
+// other.
+class MigrationRing {
+public:
+  // Copies of genomes. They own their weights.
+  typedef std::vector<Genome> Migrants;
+
+  explicit MigrationRing(int num_islands);
+  ~MigrationRing();
+
+  int num_islands() const { return mailboxes_.size(); }
+
+  // Sends "migrants" from the island "island" to the next island.
+  void Send(int island, std::unique_ptr<Migrants> migrants);
+
+  // Migrants sent to the island "island" since the last call, if any.
+  std::unique_ptr<Migrants> Receive(int island);
+
+private:
+  std::vector<std::atomic<Migrants *>> mailboxes_;
+};
+
+// Fitness estimates of genomes, keyed by a hash of their weights. Each entry
+// holds the running mean and variance of the episode scores of a genome, so a
+// genome evaluated again only needs a few more episodes to refine its
+// estimate. The entries not used during a generation are dropped at the end of
+// the generation. Thread safe.
+class FitnessCache {
+public:
+  struct Estimate {
+    int64_t count = 0;
+    double mean = 0;
+    // Sum of the squared differences to the mean (Welford).
+    double m2 = 0;
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+  };
+
+  struct Stats {
+    int64_t num_lookups = 0;
+    int64_t num_hits = 0;
+    int64_t num_entries = 0;
+
+    double hit_rate() const {
+      return num_lookups > 0 ? static_cast<double>(num_hits) / num_lookups
+                             : 0;
+    }
+  };
+
+  static uint64_t Hash(neural_net::CSVectorF weights);
+
+  // Estimate of the genome "hash". "count" is 0 if the genome is unknown.
+  Estimate Lookup(uint64_t hash);
+
+  // Adds episode scores to the estimate of the genome "hash", and returns the
+  // new estimate.
+  Estimate Add(uint64_t hash, absl::Span<const float> scores);
+
+  // Drops the entries not used since the last call, and returns the
+  // statistics of the generation.
+  Stats EndGeneration();
+
+private:
+  struct Entry {
+    Estimate estimate;
+    bool used = true;
+  };
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> entries_;
+  Stats stats_;
+};
+
+// Layers of a genome converted for inference: the one-hot layers in fixed
+// point for the incremental evaluation of the first layer, and the hidden
+// layers packed for the GEMV kernels. Immutable and shared by the controllers
+// of the genome.
+//
+// If "quantize" is true, the hidden layers are exported to int8 in
+// "quantized_hidden_layers" instead (the one-hot layers are already integer).
+struct PackedGenome {
+  PackedGenome(const Genome &genome, const GenomeManager &genome_manager,
+               bool quantize = false);
+
+  neural_net::FixedPointOneHotWeights terrain;
+  neural_net::FixedPointOneHotWeights past;
+  std::vector<neural_net::PackedDenseLayer> hidden_layers;
+  std::vector<neural_net::QuantizedDenseLayer> quantized_hidden_layers;
 };
 
 class GeneticController : public AbstractController {
 public:
   virtual ~GeneticController() = default;
-  GeneticController(const Genome &genome, const GenomeManager *genome_manager);
+  // If not set, "packed_genome" is computed from the genome.
+  GeneticController(const Genome &genome, const GenomeManager *genome_manager,
+                    std::shared_ptr<const PackedGenome> packed_genome = {});
   Output Step(const Input &input) override;
 
   static constexpr int HISTORY_LENGTH = 8;
 
 private:
-  Genome genome_;
+  template <typename Layer>
+  void ForwardHiddenLayers(
+      const std::vector<Layer> &layers,
+      std::vector<typename Layer::InputBuffer> *input_buffers);
+
   std::vector<neural_net::VectorF> cache_hidden_;
-  std::mt19937 rnd_;
+  // Input buffers of the hidden layers. The layers are shared by the
+  // controllers of the genome.
+  std::vector<neural_net::PackedDenseLayer::InputBuffer> padded_inputs_;
+  std::vector<neural_net::QuantizedDenseLayer::InputBuffer> quantized_inputs_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
+  neural_net::OneHotAccumulator terrain_accumulator_;
+  neural_net::OneHotAccumulator past_accumulator_;
+  CounterRng rnd_;
   std::vector<int> last_dirs_;
   const GenomeManager *genome_manager_;
 };
 
+// GeneticController specialized at compile time for the shapes of its
+// network: an ObsW x ObsH observation with NumValues values, the History last
+// moves, and the hidden layers "Hidden". The activations are
+// neural_net::FixedVectorFs on the stack, and the hidden layers are
+// neural_net::FixedDenseLayers viewing the layers of the shared PackedGenome.
+// Returns the same outputs as GeneticController. See CreateFixedPolicy for the
+// registered specializations.
+template <int ObsW, int ObsH, int NumValues, int History, int... Hidden>
+class FixedPolicy : public AbstractController {
+public:
+  static constexpr int kNumDirs =
+      static_cast<int>(eDirection::_NUM_DIRECTIONS);
+  static constexpr int kNumLayers = sizeof...(Hidden);
+  // Input dimension of each dense layer, and output dimension of the network.
+  static constexpr std::array<int, kNumLayers + 1> kDims = {Hidden...,
+                                                            kNumDirs};
+
+  // Tests if the network of "genome_manager" has the shapes of the policy.
+  static bool Matches(const GenomeManager &genome_manager) {
+    const auto &map_definition = genome_manager.map_definition_;
+    return map_definition.shape.x == ObsW && map_definition.shape.y == ObsH &&
+           map_definition.num_values == NumValues &&
+           History == GeneticController::HISTORY_LENGTH &&
+           genome_manager.options_.hidden_layers ==
+               std::vector<int>{Hidden...};
+  }
+
+  FixedPolicy(std::shared_ptr<const PackedGenome> packed_genome,
+              const GenomeManager &genome_manager)
+      : packed_genome_(std::move(packed_genome)),
+        terrain_accumulator_(&packed_genome_->terrain),
+        past_accumulator_(&packed_genome_->past),
+        layers_(LayersOf(packed_genome_->hidden_layers,
+                         std::make_index_sequence<kNumLayers>())),
+        gumbel_sampling_(genome_manager.options_.gumbel_sampling) {
+    CHECK(Matches(genome_manager));
+  }
+
+  Output Step(const Input &input) override {
+    Activations activations;
+    auto &first = std::get<0>(activations);
+    neural_net::FixedVectorF<kDims[0]> past;
+    terrain_accumulator_.Forward<neural_net::Identity, uint8_t>(
+        input.surouding.values, first.span());
+    past_accumulator_.Forward<neural_net::Identity, int>(last_dirs_,
+                                                         past.span());
+    for (int i = 0; i < kDims[0]; i++) {
+      first[i] = past[i] + first[i];
+    }
+
+    neural_net::Unroll<kNumLayers>([&](const auto layer_idx) {
+      constexpr int l = layer_idx;
+      if constexpr (l + 1 < kNumLayers) {
+        std::get<l>(layers_).template Forward<neural_net::Relu>(
+            std::get<l>(activations), &std::get<l + 1>(activations));
+      } else {
+        std::get<l>(layers_).template Forward<neural_net::Identity>(
+            std::get<l>(activations), &std::get<l + 1>(activations));
+      }
+    });
+
+    const auto logits = std::get<kNumLayers>(activations).span();
+    const int dir = gumbel_sampling_
+                        ? neural_net::GumbelMaxSampling(logits, &rnd_)
+                        : neural_net::SoftMaxSampling(logits, &rnd_);
+    Output output;
+    output.move = static_cast<eDirection>(dir);
+    std::copy(last_dirs_.begin() + 1, last_dirs_.end(), last_dirs_.begin());
+    last_dirs_.back() = dir;
+    return output;
+  }
+
+private:
+  template <size_t... I>
+  static std::tuple<neural_net::FixedDenseLayer<kDims[I], kDims[I + 1]>...>
+  LayersOf(const std::vector<neural_net::PackedDenseLayer> &layers,
+           std::index_sequence<I...>) {
+    CHECK_EQ(layers.size(), kNumLayers);
+    return {neural_net::FixedDenseLayer<kDims[I], kDims[I + 1]>(
+        &layers[I])...};
+  }
+  template <size_t... I>
+  static std::tuple<neural_net::FixedVectorF<kDims[I]>...>
+      ActivationsOf(std::index_sequence<I...>);
+
+  typedef decltype(LayersOf({}, std::make_index_sequence<kNumLayers>()))
+      Layers;
+  // activations[l] is the input of the hidden layer l, and the last one is
+  // the output of the network.
+  typedef decltype(ActivationsOf(std::make_index_sequence<kNumLayers + 1>()))
+      Activations;
+
+  std::shared_ptr<const PackedGenome> packed_genome_;
+  neural_net::OneHotAccumulator terrain_accumulator_;
+  neural_net::OneHotAccumulator past_accumulator_;
+  Layers layers_;
+  bool gumbel_sampling_;
+  CounterRng rnd_;
+  std::array<int, History> last_dirs_ = {};
+};
+
+// FixedPolicy of the genome packed in "packed_genome" if one is registered for
+// the shapes of the network of "genome_manager", and null otherwise. The
+// specializations cover the Gather arena (7x7 observations with 3 or 5
+// values) with no hidden layer, and with the hidden layers {20} (default) and
+// {20, 20}.
+std::unique_ptr<AbstractController>
+CreateFixedPolicy(const GenomeManager &genome_manager,
+                  std::shared_ptr<const PackedGenome> packed_genome);
+
+// Policy of GeneticController evaluated on many episodes at once. Episodes
+// [g * num_episodes_per_genome, (g + 1) * num_episodes_per_genome) are
+// controlled by "genomes[g]". At each step, each dense layer of a genome is
+// applied on all its running episodes with a single kernels::Gemm call. The
+// outputs are the same as the ones of GeneticController. The genomes should
+// outlive the policy.
+class BatchedPolicy : public AbstractBatchedPolicy {
+public:
+  BatchedPolicy(const std::vector<const Genome *> &genomes,
+                int num_episodes_per_genome,
+                const GenomeManager *genome_manager);
+  int num_episodes() const override { return episodes_.size(); }
+  void Step(const std::vector<const Input *> &inputs,
+            std::vector<Output> *outputs) override;
+
+private:
+  struct Episode {
+    CounterRng rnd;
+    std::vector<int> last_dirs;
+    neural_net::OneHotAccumulator terrain_accumulator;
+    neural_net::OneHotAccumulator past_accumulator;
+  };
+
+  std::vector<const Genome *> genomes_;
+  int num_episodes_per_genome_;
+  const GenomeManager *genome_manager_;
+  // packed_genomes_[g] is the packed version of genomes[g].
+  std::vector<PackedGenome> packed_genomes_;
+  std::vector<Episode> episodes_;
+
+  // Activations of the running episodes of a genome, one row per episode.
+  // activations_[l] is the input of the hidden layer l, and the last one is
+  // the output of the network.
+  std::vector<kernels::AlignedVectorF> activations_;
+  std::vector<int> activation_strides_;
+  // Indices of the running episodes of a genome.
+  std::vector<int> running_episodes_;
+  neural_net::VectorF cache_terrain_;
+  neural_net::VectorF cache_past_;
+  // Random values and moves of the running episodes of a genome, with
+  // Options::gumbel_sampling.
+  std::vector<uint32_t> random_bits_;
+  std::vector<int> sampled_dirs_;
+};
+
 class GeneticControllerBuilder : public AbstractControllerBuilder {
 public:
   GeneticControllerBuilder(const std::string_view path) {}
   GeneticControllerBuilder(const Genome &genome,
                            const GenomeManager *genome_manager)
-      : genome_(genome), genome_manager_(genome_manager) {}
+      : genome_(genome), genome_manager_(genome_manager),
+        packed_genome_(
+            std::make_shared<const PackedGenome>(genome, *genome_manager)) {}
   virtual ~GeneticControllerBuilder() = default;
 
   std::unique_ptr<AbstractController>
   Create(const MapDef &map_definition) const override {
-    return std::make_unique<GeneticController>(genome_, genome_manager_);
+    if (genome_manager_->options_.fixed_policies) {
+      auto controller = CreateFixedPolicy(*genome_manager_, packed_genome_);
+      if (controller) {
+        return controller;
+      }
+    }
+    return std::make_unique<GeneticController>(genome_, genome_manager_,
+                                               packed_genome_);
   }
 
   std::string name() const override { return "GeneticControllerBuilder"; }
@@ -153,8 +671,57 @@ public:
 private:
   Genome genome_;
   const GenomeManager *genome_manager_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
 };
 
+// GeneticControllerBuilder with the hidden layers of the genome quantized to
+// int8 (see PackedGenome). Not registered: it can only be created from a
+// genome.
+class QuantizedGeneticControllerBuilder : public AbstractControllerBuilder {
+public:
+  QuantizedGeneticControllerBuilder(const Genome &genome,
+                                    const GenomeManager *genome_manager)
+      : genome_(genome), genome_manager_(genome_manager),
+        packed_genome_(std::make_shared<const PackedGenome>(
+            genome, *genome_manager, /*quantize=*/true)) {}
+  virtual ~QuantizedGeneticControllerBuilder() = default;
+
+  std::unique_ptr<AbstractController>
+  Create(const MapDef &map_definition) const override {
+    return std::make_unique<GeneticController>(genome_, genome_manager_,
+                                               packed_genome_);
+  }
+
+  std::string name() const override {
+    return "QuantizedGeneticControllerBuilder";
+  }
+
+private:
+  Genome genome_;
+  const GenomeManager *genome_manager_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
+};
+
+// Comparison of the int8 and float policies of a genome.
+struct QuantizationReport {
+  // Fraction of the steps where the two policies select the same move.
+  double agreement = 0;
+  int num_steps = 0;
+  // Average duration of a controller step.
+  double float_step_ns = 0;
+  double int8_step_ns = 0;
+};
+
+// Plays "num_episodes" episodes with the float policy of "genome" (a
+// GeneticController, never a FixedPolicy). At each step, the int8 policy,
+// using the same random numbers, selects a move on the same input. Each policy
+// keeps the history of its own moves, so the agreement is a lower bound of the
+// one of a single step. The steps are then replayed to time each policy.
+// Requires an arena supporting Observe / Act.
+QuantizationReport CompareQuantizedPolicy(
+    const AbstractArenaBuilder *arena_builder, const Genome &genome,
+    const GenomeManager &genome_manager, int num_episodes);
+
 } // namespace genetic
 
 REGISTER_AbstractControllerBuilder(genetic::GeneticControllerBuilder,
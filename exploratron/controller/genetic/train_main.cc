@@ -1,15 +1,22 @@
 #include <iostream>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <execution>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 #include <string>
 #include <thread>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/strings/str_cat.h"
 
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_controller.h"
@@ -23,7 +30,62 @@ ABSL_FLAG(std::string, training_log_base, "", "");
 ABSL_FLAG(int, step_sleep_ms, 10, "");
 ABSL_FLAG(int, num_repetitions, 100, "");
 ABSL_FLAG(bool, display, true, "");
-ABSL_FLAG(int, num_threads, 8, "");
+ABSL_FLAG(int, num_threads, 0,
+          "Number of workers of the steady-state evolution. If 0, one per "
+          "hardware thread.");
+ABSL_FLAG(int, lockstep_genomes, 0,
+          "If >0, the population is evaluated by groups of this many genomes "
+          "with a BatchedPolicy, all the episodes of a group being advanced in "
+          "lockstep. Small groups (e.g. 4) keep the weights in cache. "
+          "Requires an arena supporting Observe / Act.");
+ABSL_FLAG(int, num_islands, 1,
+          "If >1, island model: the population is split into this many "
+          "sub-populations, each one evolved by its own thread and evaluated "
+          "in parallel.");
+ABSL_FLAG(int, migration_interval, 25,
+          "Island model: number of generations between migrations.");
+ABSL_FLAG(int, num_migrants, 2,
+          "Island model: number of best genomes sent to the next island at "
+          "each migration.");
+ABSL_FLAG(bool, steady_state, false,
+          "If true, steady-state evolution: the workers breed, evaluate and "
+          "insert children one at a time, without generation barriers. "
+          "Disables the fitness cache, and does not support the islands, "
+          "compact genomes, checkpoints and lockstep evaluation.");
+ABSL_FLAG(int, cached_repetitions, 0,
+          "Number of additional episodes of a genome already evaluated in a "
+          "previous generation, e.g. an elite. If 0 (default), the genomes "
+          "are fully re-evaluated at each generation.");
+ABSL_FLAG(bool, compact_genomes, false,
+          "If true, the genomes are also encoded as the counters of their "
+          "initialization and mutations (without crossover), and the migrants "
+          "are shipped as encodings.");
+ABSL_FLAG(std::string, checkpoint_path, "",
+          "If set, the population is restored from this file (if it exists), "
+          "and the training resumes from the saved generation. The population "
+          "is saved to it every --checkpoint_interval generations and at the "
+          "end of the training. Requires --compact_genomes. Its size grows by "
+          "up to 12 bytes per genome and generation.");
+ABSL_FLAG(int, checkpoint_interval, 10,
+          "Number of generations between checkpoints. If 0, the population is "
+          "only saved at the end of the training.");
+ABSL_FLAG(int, sparse_terrain_rows, 0,
+          "If >0, the terrain layer is sparse, with at most this many active "
+          "(position, value) rows, pruned and regrown during the mutations. "
+          "Its size does not depend on the size of the observation window.");
+ABSL_FLAG(int, int8_report_episodes, 0,
+          "If >0, the float and int8 policies of the best genome are compared "
+          "on this many episodes at the end of the training (agreement and "
+          "speedup).");
+ABSL_FLAG(bool, int8_evaluation, false,
+          "If true, the final evaluation of the best genome uses the int8 "
+          "policy (QuantizedGeneticControllerBuilder).");
+ABSL_FLAG(bool, fixed_policies, true,
+          "If true, the controllers use the policies specialized at compile "
+          "time for the shapes of the network when available (FixedPolicy).");
+ABSL_FLAG(bool, gumbel_sampling, false,
+          "If true, the moves are sampled with the Gumbel-max trick. Same "
+          "distribution, batched in the lockstep evaluation.");
 
 namespace exploratron {
 namespace genetic {
@@ -40,12 +102,609 @@ float EvaluateGenome(const AbstractArenaBuilder *arena_builder,
       .front();
 }
 
+// Final evaluation of the best genome, optionally preceded by the comparison of
+// its float and int8 policies.
+void EvaluateBestGenome(const AbstractArenaBuilder *arena_builder,
+                        const Genome &genome, const EvaluateOptions &options,
+                        const GenomeManager &genome_manager) {
+  const int report_episodes = absl::GetFlag(FLAGS_int8_report_episodes);
+  if (report_episodes > 0) {
+    const auto report = CompareQuantizedPolicy(arena_builder, genome,
+                                               genome_manager, report_episodes);
+    LOG(INFO) << "Int8 policy: agreement: " << 100 * report.agreement
+              << "% over " << report.num_steps
+              << " steps, float step: " << report.float_step_ns
+              << " ns, int8 step: " << report.int8_step_ns << " ns, speedup x"
+              << report.float_step_ns / report.int8_step_ns;
+  }
+  if (!absl::GetFlag(FLAGS_int8_evaluation)) {
+    EvaluateGenome(arena_builder, genome, options, genome_manager);
+    return;
+  }
+  const QuantizedGeneticControllerBuilder controller_builder(genome,
+                                                             &genome_manager);
+  Evaluate(arena_builder,
+           std::vector<const AbstractControllerBuilder *>{&controller_builder},
+           options);
+}
+
+// Scores of the episodes of "genome".
+std::vector<float> EvaluateGenomeEpisodes(
+    const AbstractArenaBuilder *arena_builder, const Genome &genome,
+    const EvaluateOptions &options, const GenomeManager &genome_manager) {
+  const auto controller_builder =
+      GeneticControllerBuilder(genome, &genome_manager);
+  std::vector<Scores> repetition_scores;
+  Evaluate(arena_builder,
+           std::vector<const AbstractControllerBuilder *>{&controller_builder},
+           options, &repetition_scores);
+  std::vector<float> scores;
+  for (const auto &repetition : repetition_scores) {
+    scores.push_back(repetition.front());
+  }
+  return scores;
+}
+
+// Evaluates "genomes" with a BatchedPolicy, reusing "arenas" from one
+// generation to the next. "(*scores)[g]" receives the scores of the episodes of
+// "genomes[g]". Returns false if the arena does not support lockstep
+// evaluation.
+bool EvaluateGenomesLockstep(
+    const AbstractArenaBuilder *arena_builder, const int num_repetitions,
+    const GenomeManager &genome_manager,
+    const std::vector<const Genome *> &genomes,
+    std::vector<std::vector<float>> *scores,
+    std::vector<std::unique_ptr<AbstractArena>> *arenas) {
+  BatchedPolicy policy(genomes, num_repetitions, &genome_manager);
+  std::vector<Scores> episode_scores;
+  if (!EvaluateLockstep(arena_builder, &policy, &episode_scores, arenas)) {
+    return false;
+  }
+  scores->assign(genomes.size(), {});
+  for (int g = 0; g < genomes.size(); g++) {
+    for (int r = 0; r < num_repetitions; r++) {
+      (*scores)[g].push_back(episode_scores[g * num_repetitions + r].front());
+    }
+  }
+  return true;
+}
+
+// Runs "fn(i)" for i in [0, num) in parallel. Can be nested, e.g. by the
+// islands of the island model.
+template <typename Fn>
+void ForEachIndex(const int num, Fn fn) {
+  std::vector<int> idxs(num);
+  std::iota(idxs.begin(), idxs.end(), 0);
+  std::for_each(std::execution::par, idxs.begin(), idxs.end(), fn);
+}
+
+// Population evolved by the genetic algorithm. The weights of the genomes are
+// the rows of a PopulationMatrix, except for the migrants of the island model
+// which own their weights. With Options::compact_genomes, the genomes also
+// have their compact encoding.
+class Population {
+public:
+  // The genomes are evaluated and generated in parallel. The counters of the
+  // genetic operators start at "first_counter".
+  Population(const AbstractArenaBuilder *arena_builder,
+             const MapDef &map_definition, const Options &options,
+             const uint64_t first_counter,
+             const EvaluateOptions &training_options,
+             const int lockstep_genomes)
+      : arena_builder_(arena_builder), map_definition_(map_definition),
+        options_(options), training_options_(training_options),
+        lockstep_genomes_(lockstep_genomes),
+        genome_manager_(map_definition, options),
+        decoder_(&genome_manager_, options.population_size) {
+    CHECK_GE(options_.population_size,
+             options_.num_elite + options_.num_random);
+    CHECK(!options_.compact_genomes ||
+          options_.cross_over == Options::eCrossOver::kNone)
+        << "Compact genomes require the crossover kNone";
+    genome_manager_.next_counter_ = first_counter;
+    genomes_.reserve(options_.population_size);
+    next_genomes_.reserve(options_.population_size);
+
+    // Weights of "genomes_" and "next_genomes_", one genome per row.
+    const int num_weights = genome_manager_.weigh_allocator.size();
+    weights_ = std::make_shared<PopulationMatrix>(options_.population_size,
+                                                  num_weights);
+    next_weights_ = std::make_shared<PopulationMatrix>(options_.population_size,
+                                                       num_weights);
+
+    const uint64_t initial_counter =
+        genome_manager_.ReserveCounters(options_.population_size);
+    for (int i = 0; i < options_.population_size; i++) {
+      genome_manager_.Random(initial_counter + i, weights_->row(i));
+      AddRowGenome(weights_, i, &genomes_);
+      if (options_.compact_genomes) {
+        genomes_.back().compact = CompactGenome::Random(initial_counter + i);
+      }
+    }
+  }
+
+  const std::vector<Genome> &genomes() const { return genomes_; }
+  const GenomeManager &genome_manager() const { return genome_manager_; }
+
+  // Evaluates all the genomes, and sorts them by decreasing fitness. Returns
+  // the statistics of the fitness cache of the generation.
+  FitnessCache::Stats Evaluate() {
+    const int num_genomes = genomes_.size();
+    const bool use_cache = options_.cached_repetitions > 0;
+
+    // Genomes evaluated in a previous generation only get
+    // "cached_repetitions" episodes.
+    std::vector<uint64_t> hashes(num_genomes);
+    std::vector<int> new_idxs;
+    std::vector<int> cached_idxs;
+    if (use_cache) {
+      ForEachIndex(num_genomes, [&](const int i) {
+        hashes[i] = FitnessCache::Hash(genomes_[i].weight_bank.values());
+      });
+      for (int i = 0; i < num_genomes; i++) {
+        if (fitness_cache_.Lookup(hashes[i]).count > 0) {
+          cached_idxs.push_back(i);
+        } else {
+          new_idxs.push_back(i);
+        }
+      }
+    } else {
+      new_idxs.resize(num_genomes);
+      std::iota(new_idxs.begin(), new_idxs.end(), 0);
+    }
+
+    // Sets the fitness of the genome "i" from the scores of its new episodes.
+    const auto set_fitness = [&](const int i,
+                                 const std::vector<float> &scores) {
+      if (use_cache) {
+        genomes_[i].fitness = fitness_cache_.Add(hashes[i], scores).mean;
+      } else {
+        genomes_[i].fitness =
+            std::accumulate(scores.begin(), scores.end(), 0.) / scores.size();
+      }
+    };
+
+    // Genomes evaluated one at a time.
+    std::vector<int> single_idxs = cached_idxs;
+    if (lockstep_genomes_ > 0) {
+      const int num_groups =
+          (new_idxs.size() + lockstep_genomes_ - 1) / lockstep_genomes_;
+      lockstep_arenas_.resize(
+          std::max<int>(lockstep_arenas_.size(), num_groups));
+      std::atomic<bool> supported{true};
+      ForEachIndex(num_groups, [&](const int group_idx) {
+        const int begin = group_idx * lockstep_genomes_;
+        const int end =
+            std::min<int>(begin + lockstep_genomes_, new_idxs.size());
+        std::vector<const Genome *> genomes;
+        for (int j = begin; j < end; j++) {
+          genomes.push_back(&genomes_[new_idxs[j]]);
+        }
+        std::vector<std::vector<float>> scores;
+        if (!EvaluateGenomesLockstep(arena_builder_, options_.num_repetitions,
+                                     genome_manager_, genomes, &scores,
+                                     &lockstep_arenas_[group_idx])) {
+          supported = false;
+          return;
+        }
+        for (int j = begin; j < end; j++) {
+          set_fitness(new_idxs[j], scores[j - begin]);
+        }
+      });
+      if (!supported) {
+        LOG(INFO) << "The arena does not support lockstep evaluation";
+        lockstep_genomes_ = 0;
+        single_idxs.insert(single_idxs.end(), new_idxs.begin(), new_idxs.end());
+      }
+    } else {
+      single_idxs.insert(single_idxs.end(), new_idxs.begin(), new_idxs.end());
+    }
+
+    EvaluateOptions cached_options = training_options_;
+    cached_options.num_repetitions = options_.cached_repetitions;
+    ForEachIndex(single_idxs.size(), [&](const int j) {
+      const int i = single_idxs[j];
+      const bool cached = j < cached_idxs.size();
+      set_fitness(i, EvaluateGenomeEpisodes(
+                         arena_builder_, genomes_[i],
+                         cached ? cached_options : training_options_,
+                         genome_manager_));
+    });
+    Sort();
+    return fitness_cache_.EndGeneration();
+  }
+
+  // Replaces the population by the next generation: elites, then children,
+  // then random genomes. The random values used for a genome only depend on
+  // its counter, so the genomes are generated in parallel and the result does
+  // not depend on the number of threads.
+  void NextGeneration() {
+    const int num_mutate_and_reproduce =
+        options_.population_size - options_.num_elite - options_.num_random;
+    next_genomes_.clear();
+    // The matrix of the previous generation is overwritten, unless a genome
+    // still uses it.
+    if (next_weights_.use_count() > 1) {
+      next_weights_ = std::make_shared<PopulationMatrix>(
+          options_.population_size, next_weights_->num_weights());
+    }
+    const uint64_t counter =
+        genome_manager_.ReserveCounters(options_.population_size);
+    // Compact encoding of the rows.
+    std::vector<std::shared_ptr<const CompactGenome>> compacts(
+        options_.compact_genomes ? options_.population_size : 0);
+    ForEachIndex(options_.population_size, [&](const int row) {
+      const auto child = next_weights_->row(row);
+      if (row < options_.num_elite) {
+        const auto elite_weights = genomes_[row].weight_bank.values();
+        std::copy(elite_weights.begin(), elite_weights.end(), child.begin());
+        if (options_.compact_genomes) {
+          compacts[row] = genomes_[row].compact;
+        }
+      } else if (row < options_.num_elite + num_mutate_and_reproduce) {
+        if (options_.compact_genomes) {
+          // The parent is the ancestor of the child: no decoding needed.
+          const auto &parent =
+              genome_manager_.SelectParent(genomes_, counter + row);
+          const auto parent_weights = parent.weight_bank.values();
+          std::copy(parent_weights.begin(), parent_weights.end(),
+                    child.begin());
+          const CompactGenome::Mutation mutation{counter + row,
+                                                 options_.mutate_scale};
+          genome_manager_.Mutate(mutation, child);
+          compacts[row] = CompactGenome::Mutated(parent.compact, mutation);
+        } else {
+          genome_manager_.Reproduce(genomes_, counter + row, child);
+        }
+      } else {
+        genome_manager_.Random(counter + row, child);
+        if (options_.compact_genomes) {
+          compacts[row] = CompactGenome::Random(counter + row);
+        }
+      }
+    });
+    for (int row = 0; row < options_.population_size; row++) {
+      AddRowGenome(next_weights_, row, &next_genomes_);
+      if (row < options_.num_elite) {
+        next_genomes_.back().fitness = genomes_[row].fitness;
+      }
+      if (options_.compact_genomes) {
+        next_genomes_.back().compact = std::move(compacts[row]);
+      }
+    }
+
+    // Keeps the memory of both populations for the next generation.
+    std::swap(genomes_, next_genomes_);
+    std::swap(weights_, next_weights_);
+  }
+
+  // Copies of the "num" best genomes. The population should be sorted. With
+  // compact genomes, only the encodings are copied.
+  std::unique_ptr<MigrationRing::Migrants> Emigrants(const int num) const {
+    auto migrants = std::make_unique<MigrationRing::Migrants>();
+    for (int i = 0; i < num; i++) {
+      Genome migrant;
+      migrant.map_definition = map_definition_;
+      if (options_.compact_genomes) {
+        migrant.compact = genomes_[i].compact;
+      } else {
+        const auto values = genomes_[i].weight_bank.values();
+        migrant.weight_bank = neural_net::WeightBank(
+            neural_net::VectorF(values.begin(), values.end()));
+      }
+      migrant.fitness = genomes_[i].fitness;
+      migrants->push_back(std::move(migrant));
+    }
+    return migrants;
+  }
+
+  // Replaces the worst genomes with "migrants", keeping their fitness, and
+  // sorts the population.
+  void Immigrate(MigrationRing::Migrants *migrants) {
+    CHECK_LE(migrants->size(), genomes_.size());
+    for (int i = 0; i < migrants->size(); i++) {
+      auto &migrant = (*migrants)[i];
+      if (migrant.weight_bank.size() == 0) {
+        DecodeWeights(&migrant);
+      }
+      genomes_[genomes_.size() - 1 - i] = std::move(migrant);
+    }
+    Sort();
+  }
+
+  // Compact encoding of the population and of the state of the genetic
+  // operators. Requires compact genomes. The lineages are not squashed: a
+  // genome takes up to 12 bytes per generation since its random
+  // initialization, so the checkpoints of long runs can exceed the dense
+  // weights. "generation_idx" is the index of the generation of the genomes.
+  std::string Checkpoint(const int64_t generation_idx) const {
+    CHECK(options_.compact_genomes);
+    std::string output;
+    const uint64_t next_counter = genome_manager_.next_counter_;
+    const int32_t num_genomes = genomes_.size();
+    output.append(reinterpret_cast<const char *>(&generation_idx),
+                  sizeof(generation_idx));
+    output.append(reinterpret_cast<const char *>(&next_counter),
+                  sizeof(next_counter));
+    output.append(reinterpret_cast<const char *>(&num_genomes),
+                  sizeof(num_genomes));
+    for (const auto &genome : genomes_) {
+      output += genome.compact->Serialize();
+    }
+    return output;
+  }
+
+  // Restores a population saved by "Checkpoint", and returns the index of its
+  // generation. The genomes are decoded, and will be evaluated by the next
+  // call to "Evaluate".
+  int64_t Restore(std::string_view data) {
+    CHECK(options_.compact_genomes);
+    int64_t generation_idx;
+    uint64_t next_counter;
+    int32_t num_genomes;
+    CHECK_GE(data.size(), sizeof(generation_idx) + sizeof(next_counter) +
+                              sizeof(num_genomes));
+    std::memcpy(&generation_idx, data.data(), sizeof(generation_idx));
+    data.remove_prefix(sizeof(generation_idx));
+    CHECK_GE(generation_idx, 0) << "Invalid checkpoint";
+    std::memcpy(&next_counter, data.data(), sizeof(next_counter));
+    data.remove_prefix(sizeof(next_counter));
+    std::memcpy(&num_genomes, data.data(), sizeof(num_genomes));
+    data.remove_prefix(sizeof(num_genomes));
+    CHECK_EQ(num_genomes, options_.population_size);
+    genome_manager_.next_counter_ = next_counter;
+    for (auto &genome : genomes_) {
+      genome.compact = CompactGenome::Deserialize(&data);
+      CHECK(genome.compact) << "Invalid checkpoint";
+      DecodeWeights(&genome);
+      genome.fitness = std::numeric_limits<float>::quiet_NaN();
+    }
+    CHECK(data.empty()) << "Invalid checkpoint: " << data.size()
+                        << " trailing bytes";
+    return generation_idx;
+  }
+
+  const GenomeDecoder &decoder() const { return decoder_; }
+
+private:
+  // Sets the weights of "genome" from its compact encoding.
+  void DecodeWeights(Genome *genome) {
+    neural_net::VectorF weights(genome_manager_.weigh_allocator.size());
+    decoder_.Decode(*genome->compact, neural_net::SVectorF(weights));
+    genome->weight_bank = neural_net::WeightBank(std::move(weights));
+  }
+
+  void Sort() {
+    std::sort(genomes_.begin(), genomes_.end(), std::greater<Genome>());
+  }
+
+  // Adds to "genomes" a genome viewing the row "row" of "matrix".
+  void AddRowGenome(std::shared_ptr<const PopulationMatrix> matrix,
+                    const int row, std::vector<Genome> *genomes) const {
+    Genome genome;
+    genome.map_definition = map_definition_;
+    genome.weight_bank = PopulationMatrix::RowBank(std::move(matrix), row);
+    genomes->push_back(std::move(genome));
+  }
+
+  const AbstractArenaBuilder *arena_builder_;
+  MapDef map_definition_;
+  const Options options_;
+  const EvaluateOptions training_options_;
+  int lockstep_genomes_;
+  GenomeManager genome_manager_;
+  // Decoder of the compact migrants and checkpoints.
+  GenomeDecoder decoder_;
+
+  std::vector<Genome> genomes_;
+  std::vector<Genome> next_genomes_;
+  std::shared_ptr<PopulationMatrix> weights_;
+  std::shared_ptr<PopulationMatrix> next_weights_;
+  // Arenas of each group of genomes evaluated in lockstep.
+  std::vector<std::vector<std::unique_ptr<AbstractArena>>> lockstep_arenas_;
+  FitnessCache fitness_cache_;
+};
+
+// Population of the steady-state evolution, shared by the workers. Each genome
+// has its own lock, so the workers only contend when they access the same
+// genome at the same time.
+class SteadyStatePopulation {
+public:
+  explicit SteadyStatePopulation(std::vector<Genome> genomes)
+      : slots_(genomes.size()) {
+    for (int i = 0; i < genomes.size(); i++) {
+      slots_[i].genome = std::move(genomes[i]);
+    }
+  }
+
+  // Best of "tournament_size" random genomes.
+  Genome Select(const int tournament_size, CounterRng *rnd) const {
+    Genome best;
+    FOR_I(tournament_size) {
+      Genome candidate = Get(RND_UNIF_INT(slots_.size(), *rnd));
+      if (i == 0 || candidate.fitness >= best.fitness) {
+        best = std::move(candidate);
+      }
+    }
+    return best;
+  }
+
+  // Replaces the worst of "tournament_size" random genomes with "child",
+  // unless the child is worse. Returns true if the child was inserted.
+  bool Insert(Genome child, const int tournament_size, CounterRng *rnd) {
+    int loser_idx = 0;
+    float loser_fitness = std::numeric_limits<float>::infinity();
+    FOR_I(tournament_size) {
+      const int idx = RND_UNIF_INT(slots_.size(), *rnd);
+      const float fitness = Get(idx).fitness;
+      if (fitness <= loser_fitness) {
+        loser_idx = idx;
+        loser_fitness = fitness;
+      }
+    }
+    {
+      auto &slot = slots_[loser_idx];
+      std::lock_guard<std::mutex> lock(slot.mutex);
+      // The loser might have been replaced in the meantime.
+      if (child.fitness < slot.genome.fitness) {
+        return false;
+      }
+      // The replaced genome is released after the lock.
+      std::swap(slot.genome, child);
+    }
+    return true;
+  }
+
+  // Copy of the genomes, sorted by decreasing fitness.
+  std::vector<Genome> Snapshot() const {
+    std::vector<Genome> genomes;
+    genomes.reserve(slots_.size());
+    for (int i = 0; i < slots_.size(); i++) {
+      genomes.push_back(Get(i));
+    }
+    std::sort(genomes.begin(), genomes.end(), std::greater<Genome>());
+    return genomes;
+  }
+
+private:
+  Genome Get(const int idx) const {
+    std::lock_guard<std::mutex> lock(slots_[idx].mutex);
+    return slots_[idx].genome;
+  }
+
+  struct Slot {
+    mutable std::mutex mutex;
+    Genome genome;
+  };
+  std::vector<Slot> slots_;
+};
+
+// Steady-state evolution: the initial population is followed by
+// (num_generations - 1) * population_size children, bred, evaluated and
+// inserted by "num_threads" workers. The child "i" only depends on its counter
+// and on the population at the time it is bred. "log_generation" is called
+// every population_size children. Returns the best genome.
+template <typename LogGeneration>
+Genome EvolveSteadyState(const AbstractArenaBuilder *arena_builder,
+                         const Options &options,
+                         const EvaluateOptions &training_options,
+                         const int num_threads, GenomeManager *genome_manager,
+                         LogGeneration log_generation) {
+  const int num_weights = genome_manager->weigh_allocator.size();
+  const auto new_genome = [&](neural_net::VectorF weights) {
+    Genome genome;
+    genome.map_definition = genome_manager->map_definition_;
+    genome.weight_bank = neural_net::WeightBank(std::move(weights));
+    return genome;
+  };
+
+  std::vector<Genome> initial_genomes(options.population_size);
+  const uint64_t initial_counter =
+      genome_manager->ReserveCounters(options.population_size);
+  ForEachIndex(options.population_size, [&](const int i) {
+    neural_net::VectorF weights(num_weights);
+    genome_manager->Random(initial_counter + i, neural_net::SVectorF(weights));
+    initial_genomes[i] = new_genome(std::move(weights));
+    initial_genomes[i].fitness = EvaluateGenome(
+        arena_builder, initial_genomes[i], training_options, *genome_manager);
+  });
+  SteadyStatePopulation population(std::move(initial_genomes));
+  // The children are never evaluated again: there is no fitness cache.
+  log_generation(0, 0, population.Snapshot(), 0.);
+
+  const uint64_t num_children =
+      options.num_generations == 0
+          ? 0
+          : (options.num_generations - 1) * options.population_size;
+  const uint64_t first_counter = genome_manager->ReserveCounters(num_children);
+  const int tournament_size = std::max(
+      2, static_cast<int>(options.population_size * options.tournament_ratio));
+  const float random_rate =
+      static_cast<float>(options.num_random) / options.population_size;
+  std::atomic<uint64_t> next_child_idx{0};
+  std::atomic<uint64_t> num_inserted{0};
+
+  const auto worker = [&]() {
+    while (true) {
+      const uint64_t child_idx = next_child_idx++;
+      if (child_idx >= num_children) {
+        break;
+      }
+      const uint64_t counter = first_counter + child_idx;
+      CounterRng rnd = genome_manager->SelectionRng(counter);
+      neural_net::VectorF weights(num_weights);
+      const neural_net::SVectorF child_weights(weights);
+      if (RND_UNIF_FLOAT(rnd) < random_rate) {
+        genome_manager->Random(counter, child_weights);
+      } else {
+        const Genome a = population.Select(tournament_size, &rnd);
+        const Genome b = population.Select(tournament_size, &rnd);
+        genome_manager->Crossover(a, b, counter, child_weights);
+        genome_manager->Mutate(counter, child_weights);
+      }
+      Genome child = new_genome(std::move(weights));
+      child.fitness = EvaluateGenome(arena_builder, child, training_options,
+                                     *genome_manager);
+      if (population.Insert(std::move(child), tournament_size, &rnd)) {
+        num_inserted++;
+      }
+      if ((child_idx + 1) % options.population_size == 0) {
+        log_generation(0, (child_idx + 1) / options.population_size,
+                       population.Snapshot(), 0.);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < num_threads; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  LOG(INFO) << "Inserted children: " << num_inserted << " / " << num_children;
+  return population.Snapshot().front();
+}
+
+// Options of an island: the population, the elites and the random genomes are
+// split among the islands.
+Options IslandOptions(const Options &options) {
+  Options island_options = options;
+  island_options.population_size =
+      options.population_size / options.num_islands;
+  island_options.num_elite =
+      std::max(1, options.num_elite / options.num_islands);
+  island_options.num_random = options.num_random / options.num_islands;
+  CHECK_GT(island_options.population_size,
+           island_options.num_elite + island_options.num_random +
+               options.num_migrants)
+      << "Islands too small";
+  return island_options;
+}
+
 void TrainGenetic() {
   // Select the working arena.
   const auto arena_builder =
       AbstractArenaBuilderRegisterer::Create(absl::GetFlag(FLAGS_arena));
 
   Options options;
+  options.num_islands = absl::GetFlag(FLAGS_num_islands);
+  options.migration_interval = absl::GetFlag(FLAGS_migration_interval);
+  options.num_migrants = absl::GetFlag(FLAGS_num_migrants);
+  options.steady_state = absl::GetFlag(FLAGS_steady_state);
+  options.cached_repetitions = absl::GetFlag(FLAGS_cached_repetitions);
+  options.compact_genomes = absl::GetFlag(FLAGS_compact_genomes);
+  options.sparse_terrain_rows = absl::GetFlag(FLAGS_sparse_terrain_rows);
+  options.fixed_policies = absl::GetFlag(FLAGS_fixed_policies);
+  options.gumbel_sampling = absl::GetFlag(FLAGS_gumbel_sampling);
+  if (options.compact_genomes) {
+    options.cross_over = Options::eCrossOver::kNone;
+  }
+  if (options.steady_state && options.cached_repetitions > 0) {
+    LOG(INFO) << "The steady-state evolution evaluates each genome once: the "
+                 "fitness cache is disabled";
+    options.cached_repetitions = 0;
+  }
 
   // Display during the learning.
   // Disable display and sleeping for maximum speed.
@@ -63,22 +722,8 @@ void TrainGenetic() {
 
   const auto map_definition = arena_builder->MapDefinition();
 
-  GenomeManager genome_manager(map_definition, options);
-
-  const int num_mutate_and_reproduce =
-      options.population_size - options.num_elite - options.num_random;
-
-  LOG(INFO) << "Initialize population";
-  std::vector<Genome> population;
-  std::vector<Genome> next_population;
-  population.reserve(options.population_size);
-  next_population.reserve(options.population_size);
-
-  for (int i = 0; i < options.population_size; i++) {
-    population.push_back(genome_manager.Random());
-  }
-
   size_t log_every = 100;
+  const int num_islands = std::max(1, options.num_islands);
 
   std::unique_ptr<std::ofstream> output_file;
   if (!absl::GetFlag(FLAGS_training_log_base).empty()) {
@@ -86,84 +731,220 @@ void TrainGenetic() {
         absl::GetFlag(FLAGS_training_log_base) + options.to_string() + ".csv";
     output_file = std::make_unique<std::ofstream>();
     output_file->open(log_path);
-    (*output_file) << "generation,max_fitness,median_fitness,min_fitness\n";
+    (*output_file) << "island,generation,max_fitness,median_fitness,min_"
+                      "fitness,cache_hit_rate\n";
   }
-
-  size_t generation_idx = 0;
-  while (options.num_generations != 0) {
-
-    /*
-    for (auto &genome : population) {
-      genome.fitness = EvaluateGenome(arena_builder.get(), genome,
-                                      training_options, genome_manager);
-    }*/
-    std::for_each(std::execution::par, population.begin(), population.end(),
-                  [&](auto &genome) {
-                    genome.fitness =
-                        EvaluateGenome(arena_builder.get(), genome,
-                                       training_options, genome_manager);
-                  });
-
-    std::sort(population.begin(), population.end(), std::greater<Genome>());
-
+  std::mutex output_mutex;
+
+  // Logs the fitnesses of a sorted population, and the hit rate of the fitness
+  // cache.
+  const auto log_generation = [&](const int island_idx,
+                                  const size_t generation_idx,
+                                  const std::vector<Genome> &population,
+                                  const double cache_hit_rate) {
     auto max_fitness = population.front().fitness;
     auto median_fitness = population[population.size() / 2].fitness;
     auto min_fitness = population.back().fitness;
 
+    std::lock_guard<std::mutex> lock(output_mutex);
     if (output_file) {
-      (*output_file) << generation_idx << "," << max_fitness << ","
-                     << median_fitness << "," << min_fitness << "\n";
+      (*output_file) << island_idx << "," << generation_idx << ","
+                     << max_fitness << "," << median_fitness << ","
+                     << min_fitness << "," << cache_hit_rate << "\n";
     }
     if ((generation_idx % log_every) == 0) {
       if (output_file) {
         output_file->flush();
       }
 
-      LOG(INFO) << "Generation #" << generation_idx
+      LOG(INFO) << (num_islands > 1 ? absl::StrCat("Island #", island_idx, " ")
+                                    : "")
+                << "Generation #" << generation_idx
                 << " max_fitness: " << max_fitness
                 << " med_fitness:" << median_fitness
                 << " min_fitness:" << min_fitness
-                << " population:" << population.size();
+                << " population:" << population.size()
+                << " cache_hit_rate:" << cache_hit_rate;
     }
-
-    if (generation_idx >= options.num_generations - 1) {
-      break;
+  };
+
+  if (options.steady_state) {
+    CHECK_EQ(num_islands, 1) << "The steady-state evolution has no islands";
+    CHECK(!options.compact_genomes)
+        << " The steady-state evolution does not support compact genomes";
+    CHECK(absl::GetFlag(FLAGS_checkpoint_path).empty())
+        << " The steady-state evolution does not support checkpoints";
+    CHECK_EQ(absl::GetFlag(FLAGS_lockstep_genomes), 0)
+        << " The steady-state evolution does not support the lockstep "
+           "evaluation";
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    if (num_threads <= 0) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
     }
-
-    next_population.clear();
-    // Elite
-    for (int i = 0; i < options.num_elite; i++) {
-      next_population.push_back(population[i]);
+    LOG(INFO) << "Steady-state evolution with " << num_threads << " workers";
+    GenomeManager genome_manager(map_definition, options);
+    const Genome best_genome =
+        EvolveSteadyState(arena_builder.get(), options, training_options,
+                          num_threads, &genome_manager, log_generation);
+    if (output_file) {
+      output_file->close();
     }
+    LOG(INFO) << "Best genome: " << best_genome.fitness << " : "
+              << best_genome;
+    EvaluateBestGenome(arena_builder.get(), best_genome, evaluation_options,
+                       genome_manager);
+    return;
+  }
 
-    // Normal
-    for (int i = 0; i < num_mutate_and_reproduce; i++) {
-      const auto &a = genome_manager.SelectIndividual(population);
-      const auto &b = genome_manager.SelectIndividual(population);
+  // The islands are evolved by their own thread, without any synchronization
+  // other than the migrations, and each island evaluates its genomes in
+  // parallel. A single island is the panmictic genetic algorithm.
+  const Options island_options =
+      num_islands > 1 ? IslandOptions(options) : options;
+  LOG(INFO) << "Initialize " << num_islands << " island(s) of "
+            << island_options.population_size << " genomes";
+  std::vector<std::unique_ptr<Population>> islands;
+  for (int island_idx = 0; island_idx < num_islands; island_idx++) {
+    // The islands share the seed of the generators and use disjoint ranges of
+    // counters, so that the compact genomes can be decoded on any island.
+    islands.push_back(std::make_unique<Population>(
+        arena_builder.get(), map_definition, island_options,
+        static_cast<uint64_t>(island_idx) << 48, training_options,
+        absl::GetFlag(FLAGS_lockstep_genomes)));
+  }
 
-      auto c = genome_manager.Crossover(a, b);
-      genome_manager.Mutate(&c);
-      next_population.push_back(c);
+  // Checkpoint of each island.
+  const auto checkpoint_path = [&](const int island_idx) {
+    std::string path = absl::GetFlag(FLAGS_checkpoint_path);
+    if (num_islands > 1) {
+      absl::StrAppend(&path, "-", island_idx);
     }
-
-    // Random.
-    for (int i = 0; i < options.num_random; i++) {
-      next_population.push_back(genome_manager.Random());
+    return path;
+  };
+  // The file is replaced atomically, so that an interrupted training keeps
+  // the previous checkpoint.
+  const auto write_checkpoint = [&](const int island_idx,
+                                    const std::string &checkpoint) {
+    const std::string path = checkpoint_path(island_idx);
+    const std::string tmp_path = absl::StrCat(path, ".tmp");
+    {
+      std::ofstream file(tmp_path, std::ios::binary);
+      file << checkpoint;
+      CHECK(file) << " Cannot write " << tmp_path;
+    }
+    std::filesystem::rename(tmp_path, path);
+  };
+  // Index of the first generation of each island.
+  std::vector<size_t> first_generations(num_islands, 0);
+  const int checkpoint_interval = absl::GetFlag(FLAGS_checkpoint_interval);
+  CHECK_GE(checkpoint_interval, 0);
+  if (!absl::GetFlag(FLAGS_checkpoint_path).empty()) {
+    CHECK(options.compact_genomes) << "Checkpoints require compact genomes";
+    for (int island_idx = 0; island_idx < num_islands; island_idx++) {
+      std::ifstream file(checkpoint_path(island_idx), std::ios::binary);
+      if (!file) {
+        continue;
+      }
+      std::stringstream data;
+      data << file.rdbuf();
+      first_generations[island_idx] = islands[island_idx]->Restore(data.str());
+      LOG(INFO) << "Island #" << island_idx << " restored from "
+                << checkpoint_path(island_idx) << " at generation "
+                << first_generations[island_idx];
     }
+  }
+  MigrationRing migration_ring(num_islands);
+
+  // Index of the last generation of each island.
+  std::vector<size_t> last_generations(num_islands, 0);
+  const auto evolve_island = [&](const int island_idx) {
+    auto &island = *islands[island_idx];
+    for (size_t generation_idx = first_generations[island_idx];
+         options.num_generations != 0; generation_idx++) {
+      const auto cache_stats = island.Evaluate();
+      log_generation(island_idx, generation_idx, island.genomes(),
+                     cache_stats.hit_rate());
+
+      last_generations[island_idx] = generation_idx;
+      if (generation_idx >= options.num_generations - 1) {
+        break;
+      }
+
+      if (num_islands > 1 && options.num_migrants > 0 &&
+          (generation_idx + 1) % options.migration_interval == 0) {
+        migration_ring.Send(island_idx,
+                            island.Emigrants(options.num_migrants));
+        // The migrants of the previous island, if it reached the migration.
+        auto migrants = migration_ring.Receive(island_idx);
+        if (migrants) {
+          island.Immigrate(migrants.get());
+        }
+      }
 
-    population = std::move(next_population);
-    generation_idx++;
+      island.NextGeneration();
+
+      if (checkpoint_interval > 0 &&
+          !absl::GetFlag(FLAGS_checkpoint_path).empty() &&
+          (generation_idx + 1) % checkpoint_interval == 0) {
+        write_checkpoint(island_idx, island.Checkpoint(generation_idx + 1));
+      }
+    }
+  };
+
+  if (num_islands == 1) {
+    evolve_island(0);
+  } else {
+    std::vector<std::thread> workers;
+    for (int island_idx = 0; island_idx < num_islands; island_idx++) {
+      workers.emplace_back(evolve_island, island_idx);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
   }
 
   if (output_file) {
     output_file->close();
   }
 
-  LOG(INFO) << "Best genome: " << population.front().fitness << " : "
-            << population.front();
+  if (options.compact_genomes) {
+    size_t compact_bytes = 0;
+    int64_t num_applied_mutations = 0;
+    int64_t num_encoded_mutations = 0;
+    for (int island_idx = 0; island_idx < num_islands; island_idx++) {
+      const auto &island = *islands[island_idx];
+      const std::string checkpoint =
+          island.Checkpoint(last_generations[island_idx]);
+      compact_bytes += checkpoint.size();
+      num_applied_mutations += island.decoder().num_applied_mutations();
+      num_encoded_mutations += island.decoder().num_encoded_mutations();
+      if (!absl::GetFlag(FLAGS_checkpoint_path).empty()) {
+        write_checkpoint(island_idx, checkpoint);
+      }
+    }
+    LOG(INFO) << "Compact population: " << compact_bytes
+              << " bytes (dense weights: "
+              << static_cast<size_t>(options.population_size) *
+                     islands.front()->genome_manager().weigh_allocator.size() *
+                     sizeof(float)
+              << " bytes). Decoded mutations: " << num_applied_mutations
+              << " / " << num_encoded_mutations;
+  }
+
+  int best_island_idx = 0;
+  for (int island_idx = 1; island_idx < num_islands; island_idx++) {
+    if (islands[island_idx]->genomes().front() >
+        islands[best_island_idx]->genomes().front()) {
+      best_island_idx = island_idx;
+    }
+  }
+  const auto &best_island = *islands[best_island_idx];
+  LOG(INFO) << "Best genome (island #" << best_island_idx
+            << "): " << best_island.genomes().front().fitness << " : "
+            << best_island.genomes().front();
 
-  EvaluateGenome(arena_builder.get(), population.front(), evaluation_options,
-                 genome_manager);
+  EvaluateBestGenome(arena_builder.get(), best_island.genomes().front(),
+                     evaluation_options, best_island.genome_manager());
 }
 
 } // namespace genetic
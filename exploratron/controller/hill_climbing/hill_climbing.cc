@@ -11,6 +11,9 @@ namespace hill_climbing {
 
 constexpr int Numdir() { return static_cast<int>(eDirection::_NUM_DIRECTIONS); }
 
+// Bound of the weights used by the controllers.
+constexpr float kWeightBound = 2;
+
 GenomeManager::GenomeManager(const MapDef &map_definition,
                              const Options &options)
     : map_definition_(map_definition), options_(options) {
@@ -30,7 +33,7 @@ GenomeManager::GenomeManager(const MapDef &map_definition,
 
 Genome GenomeManager::Mutate(const Genome &genome) {
   Genome candidate = genome;
-  auto &data = candidate.weight_bank;
+  auto &data = *candidate.weight_bank.mutable_values();
 
   auto noise_distribution = std::uniform_real_distribution<float>(
       -options_.mutate_scale, options_.mutate_scale);
@@ -66,23 +69,45 @@ Genome GenomeManager::Mutate(const Genome &genome) {
     }
   */
 
-  // neural_net::BoundValues(5, &data);
-
+  neural_net::BoundValues(kWeightBound, &data);
   return candidate;
 }
 
 Genome GenomeManager::Random() {
   Genome child;
   child.map_definition = map_definition_;
-  weigh_allocator.AllocateWeightBank(&child.weight_bank);
-  neural_net::InitWeights(&child.weight_bank, &rnd_, options_.init_weights,
+  auto *weights = child.weight_bank.mutable_values();
+  weigh_allocator.AllocateWeightBank(weights);
+  neural_net::InitWeights(weights, &rnd_, options_.init_weights,
                           neural_net::eEnumWeights::SYMETRICAL_UNIFORM);
+  neural_net::BoundValues(kWeightBound, weights);
   return child;
 }
 
+PackedGenome::PackedGenome(const Genome &genome,
+                           const GenomeManager &genome_manager) {
+  // The weights are bounded by the genome manager.
+  terrain = neural_net::FixedPointOneHotWeights(
+      genome.map_definition.shape.Size(), genome.map_definition.num_values,
+      Numdir(), genome_manager.weight_address_1(genome.weight_bank));
+  past = neural_net::FixedPointOneHotWeights(
+      HillClimbingController::HISTORY_LENGTH, Numdir(), Numdir(),
+      genome_manager.weight_address_2(genome.weight_bank));
+}
+
 HillClimbingController::HillClimbingController(
-    const Genome &genome, const GenomeManager *genome_manager)
-    : genome_(genome), genome_manager_(genome_manager) {
+    const Genome &genome, const GenomeManager *genome_manager,
+    std::shared_ptr<const PackedGenome> packed_genome)
+    : packed_genome_(std::move(packed_genome)),
+      genome_manager_(genome_manager) {
+  if (!packed_genome_) {
+    packed_genome_ =
+        std::make_shared<const PackedGenome>(genome, *genome_manager);
+  }
+  terrain_accumulator_ =
+      neural_net::OneHotAccumulator(&packed_genome_->terrain);
+  past_accumulator_ = neural_net::OneHotAccumulator(&packed_genome_->past);
+
   cache_hidden_1_.resize(Numdir());
   cache_hidden_2_.resize(Numdir());
   last_dirs_.assign(HISTORY_LENGTH, 0);
@@ -91,8 +116,6 @@ HillClimbingController::HillClimbingController(
 }
 
 Output HillClimbingController::Step(const Input &input) {
-  neural_net::BoundValues(2, &genome_.weight_bank);
-
   // Perfect automaton.
 
   // LOG(INFO) << print<float>(input.surouding.values);
@@ -102,21 +125,20 @@ Output HillClimbingController::Step(const Input &input) {
     neural_net::SetWeightOneHotConstant(
         genome_manager_->map_definition_.shape.Size(),
         genome_manager_->map_definition_.num_values, Numdir(),
-        static_cast<int>(eDirection::RIGHT), 0.5, &tmp);
+        static_cast<int>(eDirection::RIGHT), 0.5, &tmp,
+        neural_net::eOneHotLayout::kInputMajor);
 
     neural_net::SetWeightOneHot(genome_manager_->map_definition_.shape.Size(),
                                 genome_manager_->map_definition_.num_values,
                                 Numdir(), 5, 1,
-                                static_cast<int>(eDirection::UP), 1, &tmp);
+                                static_cast<int>(eDirection::UP), 1, &tmp,
+                                neural_net::eOneHotLayout::kInputMajor);
   }*/
 
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      input.surouding.values, genome_.map_definition.num_values,
-      genome_manager_->weight_address_1(genome_.weight_bank), &cache_hidden_1_);
-
-  neural_net::ForwardOneHot<neural_net::Identity>(
-      last_dirs_, Numdir(),
-      genome_manager_->weight_address_2(genome_.weight_bank), &cache_hidden_2_);
+  terrain_accumulator_.Forward<neural_net::Identity>(input.surouding.values,
+                                                     &cache_hidden_1_);
+  past_accumulator_.Forward<neural_net::Identity>(last_dirs_,
+                                                  &cache_hidden_2_);
 
   neural_net::AddTo<neural_net::Relu>(cache_hidden_1_, &cache_hidden_2_);
 
@@ -5,6 +5,7 @@
 #include <memory>
 
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 #include "exploratron/core/utils/maths.h"
 #include "exploratron/core/utils/neural_net.h"
 
@@ -20,9 +21,19 @@ struct Options {
 
   bool re_evaluate_best = true;
 
+  // (mu + lambda) selection: at each iteration, "num_candidates" mutants of
+  // the "num_parents" parents are evaluated, together with the parents if
+  // "re_evaluate_best", on the same arena seeds. The best "num_parents"
+  // genomes are kept, the candidates winning ties.
+  int num_parents = 1;
+  int num_candidates = 1;
+
   std::string to_string() const {
     std::stringstream ss;
     ss << "sm-" << mutate_ratio << "x" << mutate_scale;
+    if (num_parents != 1 || num_candidates != 1) {
+      ss << "_mu-" << num_parents << "_la-" << num_candidates;
+    }
     return ss.str();
   }
 };
@@ -32,7 +43,7 @@ struct Genome {
   bool operator>(const Genome &a) const { return fitness > a.fitness; }
 
   float fitness = std::numeric_limits<float>::quiet_NaN();
-  neural_net::VectorF weight_bank;
+  neural_net::WeightBank weight_bank;
   MapDef map_definition;
 
   friend std::ostream &operator<<(std::ostream &stream, const Genome &g) {
@@ -44,31 +55,47 @@ struct Genome {
 struct GenomeManager {
   GenomeManager(const MapDef &map_definition, const Options &options);
 
+  // The weights of the returned genomes are bounded, so that the controllers
+  // can use them as is.
   Genome Mutate(const Genome &genome);
   Genome Random();
 
   MapDef map_definition_;
-  std::mt19937 rnd_;
+  CounterRng rnd_;
   neural_net::WeightsAllocator weigh_allocator;
+  // One-hot layers, in the neural_net::eOneHotLayout::kInputMajor layout.
   neural_net::WeightsAddress weight_address_1;
   neural_net::WeightsAddress weight_address_2;
   const Options options_;
 };
 
+// Layers of a genome converted for inference: the one-hot layers in fixed
+// point. Immutable and shared by the controllers of the genome.
+struct PackedGenome {
+  PackedGenome(const Genome &genome, const GenomeManager &genome_manager);
+
+  neural_net::FixedPointOneHotWeights terrain;
+  neural_net::FixedPointOneHotWeights past;
+};
+
 class HillClimbingController : public AbstractController {
 public:
   virtual ~HillClimbingController() = default;
-  HillClimbingController(const Genome &genome,
-                         const GenomeManager *genome_manager);
+  // If not set, "packed_genome" is computed from the genome.
+  HillClimbingController(
+      const Genome &genome, const GenomeManager *genome_manager,
+      std::shared_ptr<const PackedGenome> packed_genome = {});
   Output Step(const Input &input) override;
 
   static constexpr int HISTORY_LENGTH = 3;
 
 private:
-  Genome genome_;
   neural_net::VectorF cache_hidden_1_;
   neural_net::VectorF cache_hidden_2_;
-  std::mt19937 rnd_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
+  neural_net::OneHotAccumulator terrain_accumulator_;
+  neural_net::OneHotAccumulator past_accumulator_;
+  CounterRng rnd_;
   std::vector<int> last_dirs_;
   const GenomeManager *genome_manager_;
 };
@@ -78,12 +105,15 @@ public:
   HillClimbingControllerBuilder(const std::string_view path) {}
   HillClimbingControllerBuilder(const Genome &genome,
                                 const GenomeManager *genome_manager)
-      : genome_(genome), genome_manager_(genome_manager) {}
+      : genome_(genome), genome_manager_(genome_manager),
+        packed_genome_(
+            std::make_shared<const PackedGenome>(genome, *genome_manager)) {}
   virtual ~HillClimbingControllerBuilder() = default;
 
   std::unique_ptr<AbstractController>
   Create(const MapDef &map_definition) const override {
-    return std::make_unique<HillClimbingController>(genome_, genome_manager_);
+    return std::make_unique<HillClimbingController>(genome_, genome_manager_,
+                                                    packed_genome_);
   }
 
   std::string name() const override { return "HillClimbingControllerBuilder"; }
@@ -91,6 +121,7 @@ public:
 private:
   Genome genome_;
   const GenomeManager *genome_manager_;
+  std::shared_ptr<const PackedGenome> packed_genome_;
 };
 
 } // namespace hill_climbing
@@ -1,8 +1,12 @@
 #include <iostream>
 
+#include <algorithm>
+#include <execution>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <numeric>
+#include <random>
 #include <sstream>
 #include <string>
 
@@ -17,6 +21,10 @@
 ABSL_FLAG(std::string, arena, "Gather", "");
 ABSL_FLAG(std::string, output_path, "", "");
 ABSL_FLAG(std::string, training_log_base, "", "");
+ABSL_FLAG(int, num_parents, 1, "Number of parents (mu).");
+ABSL_FLAG(int, num_candidates, 1,
+          "Number of mutants evaluated in parallel at each iteration "
+          "(lambda).");
 
 namespace exploratron {
 namespace hill_climbing {
@@ -53,9 +61,12 @@ void Train() {
 
   // Initiate search
   Options options;
+  options.num_parents = absl::GetFlag(FLAGS_num_parents);
+  options.num_candidates = absl::GetFlag(FLAGS_num_candidates);
+  CHECK_GE(options.num_parents, 1);
+  CHECK_GE(options.num_candidates, 1);
   const auto map_definition = arena_builder->MapDefinition();
   GenomeManager genome_manager(map_definition, options);
-  Genome genome = genome_manager.Random();
   size_t log_every = 1000;
 
   // Loggin
@@ -69,40 +80,87 @@ void Train() {
                       "num_equal_candidates\n";
   }
 
+  // Seeds of the arenas. All the genomes of an iteration play the same
+  // episodes, so that their fitnesses are comparable.
+  std::mt19937_64 seed_generator(std::random_device{}());
+  const auto evaluate_all = [&](std::vector<Genome> *genomes) {
+    EvaluateOptions seeded_options = training_options;
+    // Non zero.
+    seeded_options.seed = seed_generator() | 1;
+    std::for_each(std::execution::par, genomes->begin(), genomes->end(),
+                  [&](Genome &genome) {
+                    genome.fitness = Evaluate(arena_builder.get(), genome,
+                                              seeded_options, genome_manager);
+                  });
+  };
+
+  // Parents, sorted by decreasing fitness.
+  std::vector<Genome> parents;
+  for (int i = 0; i < options.num_parents; i++) {
+    parents.push_back(genome_manager.Random());
+  }
+  evaluate_all(&parents);
+  std::sort(parents.begin(), parents.end(), std::greater<Genome>());
+
   size_t num_better_candidates = 0;
   size_t num_equal_candidates = 0;
-  size_t iteration_idx = 0;
   float best_fitness = -1;
-  float fitness =
-      Evaluate(arena_builder.get(), genome, training_options, genome_manager);
-  LOG(INFO) << "Initial fitness: " << fitness;
+  LOG(INFO) << "Initial fitness: " << parents.front().fitness;
 
+  // The candidates, followed by the parents.
+  std::vector<Genome> genomes;
   for (size_t iteration_idx = 0; iteration_idx < options.num_iterations;
        iteration_idx++) {
 
+    // New candidates
+    genomes.clear();
+    for (int i = 0; i < options.num_candidates; i++) {
+      genomes.push_back(
+          genome_manager.Mutate(parents[i % options.num_parents]));
+    }
+
     // Re-evaluate because of stocastic evaluation
     if (options.re_evaluate_best) {
-      fitness = Evaluate(arena_builder.get(), genome, training_options,
-                         genome_manager);
+      genomes.insert(genomes.end(), parents.begin(), parents.end());
+      evaluate_all(&genomes);
+    } else {
+      evaluate_all(&genomes);
+      genomes.insert(genomes.end(), parents.begin(), parents.end());
     }
-
-    // New candidate
-    auto candidate = genome_manager.Mutate(genome);
-    // auto candidate = genome_manager.Random();
-    // LOG(INFO) << candidate;
-
-    auto candidate_fitness = Evaluate(arena_builder.get(), candidate,
-                                      training_options, genome_manager);
-
-    if (candidate_fitness >= fitness) {
-      if (candidate_fitness > fitness) {
-        num_better_candidates++;
-      } else {
-        num_equal_candidates++;
+    const float parent_fitness =
+        options.re_evaluate_best
+            ? std::max_element(genomes.begin() + options.num_candidates,
+                               genomes.end())
+                  ->fitness
+            : parents.front().fitness;
+    const float candidate_fitness =
+        std::max_element(genomes.begin(),
+                         genomes.begin() + options.num_candidates)
+            ->fitness;
+    const float worst_parent_fitness =
+        std::min_element(genomes.begin() + options.num_candidates,
+                         genomes.end())
+            ->fitness;
+
+    // The candidates are before the parents, and win the ties.
+    std::vector<int> order(genomes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const int a, const int b) {
+      return genomes[a].fitness > genomes[b].fitness;
+    });
+    parents.clear();
+    for (int i = 0; i < options.num_parents; i++) {
+      const auto &genome = genomes[order[i]];
+      if (order[i] < options.num_candidates) {
+        if (genome.fitness > worst_parent_fitness) {
+          num_better_candidates++;
+        } else {
+          num_equal_candidates++;
+        }
       }
-      fitness = candidate_fitness;
-      genome = candidate;
+      parents.push_back(genome);
     }
+    const float fitness = parents.front().fitness;
 
     if (fitness > best_fitness) {
       best_fitness = fitness;
@@ -122,6 +180,7 @@ void Train() {
                 << " better:" << num_better_candidates
                 << " equal:" << num_equal_candidates
                 << " best_fitness:" << best_fitness
+                << " parent_fitness:" << parent_fitness
                 << " candidate_fitness:" << candidate_fitness;
     }
   }
@@ -129,7 +188,8 @@ void Train() {
   if (output_file) {
     output_file->close();
   }
-  Evaluate(arena_builder.get(), genome, evaluation_options, genome_manager);
+  Evaluate(arena_builder.get(), parents.front(), evaluation_options,
+           genome_manager);
 }
 
 } // namespace hill_climbing
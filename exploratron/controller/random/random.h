@@ -5,6 +5,7 @@
 #include <random>
 
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 
 namespace exploratron {
 namespace random {
@@ -15,7 +16,7 @@ public:
   Output Step(const Input& input) override;
 
 private:
-  std::mt19937_64 rnd_;
+  CounterRng rnd_;
 };
 
 class RandomControllerBuilder : public AbstractControllerBuilder {
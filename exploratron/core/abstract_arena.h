@@ -12,6 +12,10 @@ namespace exploratron {
 
 typedef std::vector<float> Scores;
 
+class AbstractControllerBuilder;
+struct Input;
+struct Output;
+
 class AbstractArena {
 public:
   virtual ~AbstractArena() = default;
@@ -20,6 +24,24 @@ public:
   virtual void Draw() const = 0;
   virtual Scores FinalScore() const = 0;
 
+  // Restores the arena to its initial state, with new controllers, for a new
+  // episode. Returns false if the arena does not support being reset, in which
+  // case a new arena should be created instead.
+  virtual bool Reset(
+      const std::vector<const AbstractControllerBuilder *> &controller_builders,
+      uint64_t seed) {
+    return false;
+  }
+
+  // Split form of Step() for arenas with a single controller, used to
+  // evaluate the controllers of many arenas together (see EvaluateLockstep).
+  // Observe() returns the input of the controller for the next step, or
+  // nullptr if the arena does not support the split form. Act() applies the
+  // output of the controller and, like Step(), returns false when the episode
+  // is over. The controller created by the arena is not used.
+  virtual const Input *Observe() { return nullptr; }
+  virtual bool Act(const Output &output) { return false; }
+
 private:
 };
 
@@ -34,8 +56,6 @@ struct MapDef {
   uint8_t num_values;
 };
 
-class AbstractControllerBuilder;
-
 class AbstractArenaBuilder {
 public:
   virtual ~AbstractArenaBuilder() = default;
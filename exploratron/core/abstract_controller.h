@@ -6,6 +6,7 @@
 #include "exploratron/core/utils/register.h"
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace exploratron {
 
@@ -36,6 +37,19 @@ public:
   virtual Output Step(const Input &) = 0;
 };
 
+// Policy of the controllers of many episodes evaluated together, see
+// EvaluateLockstep.
+class AbstractBatchedPolicy {
+public:
+  virtual ~AbstractBatchedPolicy() = default;
+  virtual int num_episodes() const = 0;
+  // Computes the output of each episode. "inputs[i]" is the input of episode
+  // i, or nullptr if the episode is over, in which case "(*outputs)[i]" is
+  // left unchanged.
+  virtual void Step(const std::vector<const Input *> &inputs,
+                    std::vector<Output> *outputs) = 0;
+};
+
 class AbstractControllerBuilder {
 public:
   virtual ~AbstractControllerBuilder() = default;
@@ -14,7 +14,8 @@ namespace abstract_game_area {
 
 AbstractGameArena::AbstractGameArena(
     const std::vector<const AbstractControllerBuilder *> &controller_builders,
-    const MapDef &map_definition) {
+    const MapDef &map_definition)
+    : map_definition_(map_definition) {
   DCHECK_EQ(controller_builders.size(), 1);
   controller_ = controller_builders[0]->Create(map_definition);
   AddLog("player @ is born");
@@ -433,7 +434,7 @@ void AbstractGameArena::Draw() const {
   }
 }
 
-std::optional<Vector2i> Map::RandomNonOccupiedCell(std::mt19937_64 *rnd) const {
+std::optional<Vector2i> Map::RandomNonOccupiedCell(CounterRng *rnd) const {
   std::vector<Vector2i> candidates;
   for (int y = 0; y < size_.y; y++) {
     for (int x = 0; x < size_.x; x++) {
@@ -457,8 +458,7 @@ Map::Map(AbstractGameArena *parent, Vector2i size)
   cells_.resize(size.Size());
 
   std::random_device rnd_device;
-  std::seed_seq seed{rnd_device()};
-  rnd_.seed(seed);
+  rnd_.seed((static_cast<uint64_t>(rnd_device()) << 32) | rnd_device());
 }
 
 void AbstractGameArena::AddEntity(const Vector2i &pos,
@@ -476,6 +476,31 @@ void AbstractGameArena::Initialize(Vector2i size) {
   map_ = std::make_unique<Map>(this, size);
 }
 
+void AbstractGameArena::ResetState(
+    const std::vector<const AbstractControllerBuilder *> &controller_builders,
+    uint64_t seed) {
+  DCHECK(map_);
+  DCHECK_EQ(controller_builders.size(), 1);
+  controller_ = controller_builders[0]->Create(map_definition_);
+  map_->Clear(seed);
+  logs_.clear();
+  AddLog("player @ is born");
+}
+
+void Map::Clear(uint64_t seed) {
+  for (auto &c : cells_) {
+    c.entities_.clear();
+  }
+  entities_.clear();
+  pending_to_add_.clear();
+  pending_to_remove_.clear();
+  pending_to_move_.clear();
+  last_controlled_.reset();
+  next_entity_id_ = 0;
+  time_ = 0;
+  rnd_.seed(seed);
+}
+
 void Entity::SetHp(int value, std::shared_ptr<Entity> me, Map *map) {
   if (hp_ <= 0) {
     DCHECK(removed_);
@@ -1,16 +1,20 @@
 #ifndef EXPLORATRON_CORE_ABSTRACT_GAME_ARENA_H_
 #define EXPLORATRON_CORE_ABSTRACT_GAME_ARENA_H_
 
+#include <array>
 #include <functional>
 #include <memory>
 #include <optional>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 #include "exploratron/core/abstract_arena.h"
 #include "exploratron/core/abstract_controller.h"
+#include "exploratron/core/utils/counter_rng.h"
 #include "exploratron/core/utils/maths.h"
+#include "exploratron/core/utils/pool_allocator.h"
 #include "exploratron/core/utils/register.h"
 #include "exploratron/core/utils/terminal.h"
 
@@ -112,6 +116,7 @@ class Map {
   }
 
   int NumCells() const { return cells_.size(); }
+  const Vector2i &size() const { return size_; }
 
   void Draw() const;
   void Step(const Output &control);
@@ -136,13 +141,18 @@ class Map {
   void IterateLine(Vector2i p1, Vector2i p2,
                    const std::function<bool(const Vector2i &p)> &callback);
 
-  std::optional<Vector2i> RandomNonOccupiedCell(std::mt19937_64 *rnd) const;
+  std::optional<Vector2i> RandomNonOccupiedCell(CounterRng *rnd) const;
 
   int time() const { return time_; }
-  std::mt19937_64 &rnd() { return rnd_; }
+  CounterRng &rnd() { return rnd_; }
   void AddLog(std::string log);
   std::vector<std::shared_ptr<Entity>> ControlledEntities();
   void ApplyPending();
+
+  // Removes all the entities and restarts the time. The cell storage is kept
+  // for the next entities.
+  void Clear(uint64_t seed);
+
   void Explode(Vector2i pos, int radius,
                std::function<bool(const Vector2i &)> explore);
 
@@ -160,7 +170,7 @@ class Map {
   std::vector<std::shared_ptr<Entity>> entities_;
   int next_entity_id_ = 0;
   int time_ = 0;
-  std::mt19937_64 rnd_;
+  CounterRng rnd_;
   AbstractGameArena *parent_;
 
   std::shared_ptr<Entity> last_controlled_;
@@ -179,6 +189,11 @@ class AbstractGameArena : public AbstractArena {
   bool Step() override;
   void Draw() const override;
   void Initialize(Vector2i size);
+  // Re-creates the controller and clears the map and logs. Used by the
+  // sub-classes implementing "Reset".
+  void ResetState(
+      const std::vector<const AbstractControllerBuilder *> &controller_builders,
+      uint64_t seed);
   void AddEntity(const Vector2i &pos, std::shared_ptr<Entity> entity);
   void AddLog(std::string log);
   Map &map() { return *map_; }
@@ -189,6 +204,7 @@ class AbstractGameArena : public AbstractArena {
   std::vector<std::pair<int, std::string>> logs_;
 
  private:
+  MapDef map_definition_;
 };
 
 struct EntityDef {
@@ -209,6 +225,71 @@ inline std::unordered_map<int, EntityDef> global_registered_entities;
     }                                                               \
   } register_##X;
 
+// Creates an entity in the memory pool of its type.
+template <typename X, typename... Args>
+std::shared_ptr<X> MakeEntity(Args &&...args) {
+  return std::allocate_shared<X>(PoolAllocator<X>(),
+                                 std::forward<Args>(args)...);
+}
+
+// Creates the entity of a map symbol. "message" is the message of the map
+// object, if any.
+using SymbolBuilder = std::shared_ptr<Entity> (*)(const std::string &message);
+
+// Number of map symbols i.e. characters of the tileset.
+constexpr int kNumSymbols = 256;
+
+// Entity builders indexed by map symbol. Null for symbols without entity.
+inline std::array<SymbolBuilder, kNumSymbols> global_symbol_builders{};
+
+// Default symbol builder. "Args" are given to the constructor of the entity.
+// Entities constructible from a string receive the message instead.
+template <typename X, auto... Args>
+std::shared_ptr<Entity> BuildEntityFromSymbol(const std::string &message) {
+  if constexpr (sizeof...(Args) == 0 &&
+                std::is_constructible_v<X, const std::string &>) {
+    return MakeEntity<X>(message);
+  } else {
+    return MakeEntity<X>(Args...);
+  }
+}
+
+inline Empty RegisterEntitySymbol(const int symbol,
+                                  const SymbolBuilder builder) {
+  CHECK(symbol >= 0 && symbol < kNumSymbols) << " Invalid symbol " << symbol;
+  CHECK(!global_symbol_builders[symbol])
+      << " Symbol " << symbol << " registered twice";
+  global_symbol_builders[symbol] = builder;
+  return {};
+}
+
+#define INTERNAL_ENTITY_SYMBOL_NAME(X, LINE) register_##X##_symbol_##LINE
+#define INTERNAL_ENTITY_SYMBOL_NAME_EXPAND(X, LINE) \
+  INTERNAL_ENTITY_SYMBOL_NAME(X, LINE)
+
+// Registers the builder of the entity created by a map symbol.
+//
+// Usage example:
+//   REGISTER_ENTITY_SYMBOL_BUILDER(Player, 2, BuildControlledPlayer);
+//
+#define REGISTER_ENTITY_SYMBOL_BUILDER(X, SYMBOL, BUILDER)                  \
+  inline const ::exploratron::Empty INTERNAL_ENTITY_SYMBOL_NAME_EXPAND(     \
+      X, __LINE__) =                                                        \
+      ::exploratron::abstract_game_area::RegisterEntitySymbol(SYMBOL, BUILDER);
+
+// Registers the entity created by a map symbol with the default builder. The
+// extra arguments are given to the constructor of the entity.
+//
+// Usage example:
+//   REGISTER_ENTITY_SYMBOL(Wall, 219);
+//   REGISTER_ENTITY_SYMBOL(ConveyorBelt, 24, eDirection::UP);
+//
+#define REGISTER_ENTITY_SYMBOL(X, SYMBOL, ...)                      \
+  REGISTER_ENTITY_SYMBOL_BUILDER(                                   \
+      X, SYMBOL,                                                    \
+      (::exploratron::abstract_game_area::BuildEntityFromSymbol<    \
+          X, ##__VA_ARGS__>))
+
 }  // namespace abstract_game_area
 }  // namespace exploratron
 #endif
\ No newline at end of file
@@ -6,25 +6,60 @@
 #include <assert.h>
 #include <chrono>
 #include <iostream>
+#include <random>
 #include <thread>
 
 namespace exploratron {
+namespace {
+
+// Controller given to the arenas evaluated in lockstep. Never called.
+class LockstepController : public AbstractController {
+public:
+  Output Step(const Input &) override {
+    LOG(FATAL) << "The controllers of lockstep arenas are not used";
+    return {};
+  }
+};
+
+class LockstepControllerBuilder : public AbstractControllerBuilder {
+public:
+  std::unique_ptr<AbstractController>
+  Create(const MapDef &map_definition) const override {
+    return std::make_unique<LockstepController>();
+  }
+  std::string name() const override { return "LockstepControllerBuilder"; }
+};
+
+} // namespace
 
 Scores Evaluate(
     const AbstractArenaBuilder *arena_builder,
     const std::vector<const AbstractControllerBuilder *> &controller_builders,
-    const EvaluateOptions &options) {
+    const EvaluateOptions &options, std::vector<Scores> *repetition_scores) {
 
+  if (repetition_scores) {
+    repetition_scores->clear();
+  }
   if (options.display) {
     terminal::Initialize();
   }
 
   Scores scores = {};
+  std::unique_ptr<AbstractArena> area;
+  std::random_device seed_generator;
 
   for (int repetition_idx = 0; repetition_idx < options.num_repetitions;
        repetition_idx++) {
-    // Create area.
-    auto area = arena_builder->Create(controller_builders);
+    // Create or reset area.
+    const uint64_t seed = options.seed != 0 ? options.seed + repetition_idx
+                                            : seed_generator();
+    if (!area || !options.reuse_arena ||
+        !area->Reset(controller_builders, seed)) {
+      area = arena_builder->Create(controller_builders);
+      if (options.seed != 0) {
+        area->Reset(controller_builders, seed);
+      }
+    }
 
     // Run area.
     while (true) {
@@ -48,6 +83,9 @@ Scores Evaluate(
 
     // Merge scores.
     const auto sub_scores = area->FinalScore();
+    if (repetition_scores) {
+      repetition_scores->push_back(sub_scores);
+    }
     if (repetition_idx == 0) {
       scores = sub_scores;
     } else {
@@ -69,6 +107,59 @@ Scores Evaluate(
   return scores;
 }
 
+bool EvaluateLockstep(const AbstractArenaBuilder *arena_builder,
+                      AbstractBatchedPolicy *policy,
+                      std::vector<Scores> *scores,
+                      std::vector<std::unique_ptr<AbstractArena>> *arenas) {
+  const int num_episodes = policy->num_episodes();
+  const LockstepControllerBuilder controller_builder;
+  const std::vector<const AbstractControllerBuilder *> controller_builders{
+      &controller_builder};
+
+  std::vector<std::unique_ptr<AbstractArena>> local_arenas;
+  if (!arenas) {
+    arenas = &local_arenas;
+  }
+  arenas->resize(num_episodes);
+  std::mt19937_64 seed_generator(std::random_device{}());
+
+  std::vector<const Input *> inputs(num_episodes);
+  for (int episode_idx = 0; episode_idx < num_episodes; episode_idx++) {
+    auto &arena = (*arenas)[episode_idx];
+    if (!arena || !arena->Reset(controller_builders, seed_generator())) {
+      arena = arena_builder->Create(controller_builders);
+    }
+    inputs[episode_idx] = arena->Observe();
+    if (!inputs[episode_idx]) {
+      return false;
+    }
+  }
+
+  std::vector<Output> outputs(num_episodes);
+  int num_running = num_episodes;
+  while (num_running > 0) {
+    policy->Step(inputs, &outputs);
+    for (int episode_idx = 0; episode_idx < num_episodes; episode_idx++) {
+      if (!inputs[episode_idx]) {
+        continue;
+      }
+      if ((*arenas)[episode_idx]->Act(outputs[episode_idx])) {
+        inputs[episode_idx] = (*arenas)[episode_idx]->Observe();
+      } else {
+        inputs[episode_idx] = nullptr;
+        num_running--;
+      }
+    }
+  }
+
+  scores->clear();
+  scores->reserve(num_episodes);
+  for (const auto &arena : *arenas) {
+    scores->push_back(arena->FinalScore());
+  }
+  return true;
+}
+
 void DisplayScores(const Scores &scores) {
   LOG(INFO) << "Score:";
   for (const auto score : scores) {
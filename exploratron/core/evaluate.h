@@ -1,6 +1,7 @@
 #ifndef EXPLORATRON_CORE_EVALUATE_H_
 #define EXPLORATRON_CORE_EVALUATE_H_
 
+#include <memory>
 #include <vector>
 
 #include "exploratron/core/abstract_arena.h"
@@ -13,12 +14,33 @@ struct EvaluateOptions {
   int step_sleep_ms = 0;
   bool display = true;
   bool pause = false;
+  // If true, the arena is reset in between repetitions instead of being
+  // re-created (if supported by the arena).
+  bool reuse_arena = true;
+  // If non zero, the repetition r is played in an arena reset with the seed
+  // "seed + r" (if supported by the arena). Controllers evaluated with the
+  // same seed play the same episodes, up to their own randomness.
+  uint64_t seed = 0;
 };
 
+// Returns the scores averaged over the repetitions. If "repetition_scores" is
+// set, it receives the scores of each repetition.
 Scores Evaluate(
     const AbstractArenaBuilder *arena_builder,
     const std::vector<const AbstractControllerBuilder *> &controller_builders,
-    const EvaluateOptions &options = {});
+    const EvaluateOptions &options = {},
+    std::vector<Scores> *repetition_scores = nullptr);
+
+// Runs the episodes of "policy" in lockstep, each one in its own arena: at
+// each step, the inputs of all the running episodes are gathered and
+// evaluated with a single call to the policy. Returns false if the arena does
+// not support the split Observe / Act form of Step. Otherwise, "(*scores)[i]"
+// is the final score of episode i. If "arenas" is set, the arenas are kept in
+// it and reset (if supported) instead of being re-created by the next calls.
+bool EvaluateLockstep(
+    const AbstractArenaBuilder *arena_builder, AbstractBatchedPolicy *policy,
+    std::vector<Scores> *scores,
+    std::vector<std::unique_ptr<AbstractArena>> *arenas = nullptr);
 
 void DisplayScores(const Scores &scores);
 
@@ -0,0 +1,55 @@
+#include "exploratron/core/utils/counter_rng.h"
+
+#include <algorithm>
+
+#include "exploratron/core/utils/kernels.h"
+
+namespace exploratron {
+
+CounterRng::CounterRng(const uint64_t seed, const uint64_t stream,
+                       const uint64_t counter)
+    : key_(seed), stream_(stream) {
+  SetPosition(counter);
+}
+
+void CounterRng::seed(const uint64_t seed) {
+  key_ = seed;
+  stream_ = 0;
+  SetPosition(0);
+}
+
+void CounterRng::Fill(const uint64_t position) {
+  kernels::RandomBlocks(key_, stream_, position / 4, kBufferSize / 4,
+                        buffer_.data());
+  buffer_position_ = position;
+  buffer_index_ = 0;
+}
+
+void CounterRng::SetPosition(const uint64_t position) {
+  Fill(position & ~uint64_t{3});
+  buffer_index_ = position & 3;
+}
+
+void CounterRng::Generate(int size, uint32_t *output) {
+  const int num_buffered = std::min(size, kBufferSize - buffer_index_);
+  std::copy_n(buffer_.begin() + buffer_index_, num_buffered, output);
+  buffer_index_ += num_buffered;
+  size -= num_buffered;
+  output += num_buffered;
+  if (size == 0) {
+    return;
+  }
+
+  // The buffer is exhausted, and the next position is a multiple of 4.
+  const uint64_t first_block = (buffer_position_ + kBufferSize) / 4;
+  const int num_blocks = size / 4;
+  kernels::RandomBlocks(key_, stream_, first_block, num_blocks, output);
+  size -= 4 * num_blocks;
+  output += 4 * num_blocks;
+
+  Fill(4 * (first_block + num_blocks));
+  std::copy_n(buffer_.begin(), size, output);
+  buffer_index_ = size;
+}
+
+} // namespace exploratron
@@ -0,0 +1,91 @@
+#ifndef EXPLORATRON_CORE_UTILS_COUNTER_RNG_H_
+#define EXPLORATRON_CORE_UTILS_COUNTER_RNG_H_
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+// Counter based random generator.
+//
+// The value i of the sequence (seed, stream) is a pure function of
+// (seed, stream, i): the word i % 4 of the Philox4x32-10 block i / 4 (see
+// kernels::RandomBlocks). Unlike std::mt19937, the generator has no state to
+// carry around: independent generators are created for free, e.g. one per
+// genome or per episode with the index as stream, and give the same values
+// regardless of the order in which they are used.
+//
+// Usage example:
+//   CounterRng rnd(seed, /*stream=*/genome_idx);
+//   const float v = std::uniform_real_distribution<float>(0, 1)(rnd);
+
+namespace exploratron {
+
+class CounterRng {
+public:
+  // Satisfies the UniformRandomBitGenerator requirements, so CounterRng can be
+  // used with the std distributions and algorithms.
+  using result_type = uint32_t;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  CounterRng() : CounterRng(0) {}
+  // Generator at the position "counter" of the sequence ("seed", "stream").
+  explicit CounterRng(uint64_t seed, uint64_t stream = 0,
+                      uint64_t counter = 0);
+
+  result_type operator()() {
+    if (buffer_index_ == kBufferSize) {
+      Fill(buffer_position_ + kBufferSize);
+    }
+    return buffer_[buffer_index_++];
+  }
+
+  // Restarts at the beginning of the sequence ("seed", 0).
+  void seed(uint64_t seed);
+
+  // Restarts at the beginning of the sequence (s, 0) where "s" is generated by
+  // "seq" e.g. a std::seed_seq. Used by InitRandom.
+  template <typename SeedSeq,
+            typename = std::enable_if_t<!std::is_arithmetic_v<SeedSeq>>>
+  void seed(SeedSeq &seq) {
+    std::array<uint32_t, 2> words;
+    seq.generate(words.begin(), words.end());
+    seed((static_cast<uint64_t>(words[1]) << 32) | words[0]);
+  }
+
+  // Skips "num" values.
+  void discard(uint64_t num) { SetPosition(counter() + num); }
+
+  // Writes the next "size" values in "output". Same result as calling
+  // operator() "size" times, but the full blocks are generated in bulk with
+  // the SIMD kernels.
+  void Generate(int size, uint32_t *output);
+
+  uint64_t key() const { return key_; }
+  uint64_t stream() const { return stream_; }
+  // Position in the sequence i.e. number of values generated since the
+  // beginning of the sequence.
+  uint64_t counter() const { return buffer_position_ + buffer_index_; }
+
+private:
+  // Number of values generated at once. Multiple of 4.
+  static constexpr int kBufferSize = 64;
+
+  // Fills the buffer with the values starting at "position", a multiple of 4.
+  void Fill(uint64_t position);
+  void SetPosition(uint64_t position);
+
+  uint64_t key_;
+  uint64_t stream_;
+  // Position of buffer_[0] in the sequence.
+  uint64_t buffer_position_;
+  int buffer_index_;
+  std::array<uint32_t, kBufferSize> buffer_;
+};
+
+} // namespace exploratron
+
+#endif
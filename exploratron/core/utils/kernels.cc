@@ -0,0 +1,1651 @@
+#include "exploratron/core/utils/kernels.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#include "exploratron/core/utils/logging.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__GNUC__) || defined(__clang__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace exploratron {
+namespace kernels {
+namespace {
+
+using AccumulateRowsFn = void (*)(const float *, const int *, int, int,
+                                  float *);
+using AccumulateWeightedRowsFn = void (*)(const float *, const int *,
+                                          const float *, int, int, float *);
+using ChangedIndicesFn = int (*)(const uint8_t *, const uint8_t *, int, int *);
+using ReplaceRowsFn = void (*)(const int32_t *, const int *, const int *, int,
+                               int, int32_t *);
+using FixedPointToFloatFn = void (*)(const int32_t *, int, float, float *);
+using GemvFn = void (*)(const float *, const float *, const float *, int, int,
+                        eActivation, float *);
+using RandomBlocksFn = void (*)(uint64_t, uint64_t, uint64_t, int,
+                                uint32_t *);
+using AddUniformNoiseFn = void (*)(uint64_t, uint64_t, float, int, float *);
+using CrossoverUniformFn = void (*)(uint64_t, uint64_t, uint32_t, int,
+                                    const float *, const float *, float *);
+using GemmFn = void (*)(const float *, const float *, const float *, int, int,
+                        int, eActivation, float *, int);
+using GemvInt8Fn = void (*)(const int8_t *, const int32_t *, const float *,
+                            const float *, const uint8_t *, float, int, int,
+                            eActivation, float *);
+using QuantizeInt7Fn = float (*)(const float *, int, uint8_t *);
+using ExpShiftedFn = void (*)(const float *, int, float, float *);
+using GumbelNoiseFn = void (*)(const uint32_t *, int, float *);
+
+struct Implementation {
+  eInstructionSet instruction_set;
+  AccumulateRowsFn accumulate_rows;
+  AccumulateWeightedRowsFn accumulate_weighted_rows;
+  ChangedIndicesFn changed_indices;
+  ReplaceRowsFn replace_rows;
+  FixedPointToFloatFn fixed_point_to_float;
+  GemvFn gemv;
+  GemmFn gemm;
+  GemvInt8Fn gemv_int8;
+  QuantizeInt7Fn quantize_int7;
+  RandomBlocksFn random_blocks;
+  AddUniformNoiseFn add_uniform_noise;
+  CrossoverUniformFn crossover_uniform;
+  // output[i] = exp(input[i] - shift) for input[i] <= shift.
+  ExpShiftedFn exp_shifted;
+  // output[i] = -log(-log(u_i)), the Gumbel noise of GumbelMaxSample.
+  GumbelNoiseFn gumbel_noise;
+};
+
+inline float Activate(const float value, const eActivation activation) {
+  return activation == eActivation::kRelu ? std::max(value, 0.f) : value;
+}
+
+void AccumulateRowsScalar(const float *table, const int *row_offsets,
+                          int num_rows, int size, float *output) {
+  for (int r = 0; r < num_rows; r++) {
+    const float *row = table + row_offsets[r];
+    for (int j = 0; j < size; j++) {
+      output[j] += row[j];
+    }
+  }
+}
+
+void AccumulateWeightedRowsScalar(const float *table, const int *row_offsets,
+                                  const float *row_weights, int num_rows,
+                                  int size, float *output) {
+  for (int r = 0; r < num_rows; r++) {
+    const float *row = table + row_offsets[r];
+    const float weight = row_weights[r];
+    for (int j = 0; j < size; j++) {
+      output[j] += weight * row[j];
+    }
+  }
+}
+
+int ChangedIndicesScalar(const uint8_t *a, const uint8_t *b, int size,
+                         int *indices) {
+  int num_changed = 0;
+  for (int i = 0; i < size; i++) {
+    indices[num_changed] = i;
+    num_changed += a[i] != b[i];
+  }
+  return num_changed;
+}
+
+// The additions are done on unsigned integers to wrap around on overflow.
+void ReplaceRowsScalar(const int32_t *table, const int *sub_offsets,
+                       const int *add_offsets, int num_rows, int size,
+                       int32_t *accumulator) {
+  for (int r = 0; r < num_rows; r++) {
+    const int32_t *add_row = table + add_offsets[r];
+    for (int j = 0; j < size; j++) {
+      accumulator[j] =
+          static_cast<int32_t>(static_cast<uint32_t>(accumulator[j]) +
+                               static_cast<uint32_t>(add_row[j]));
+    }
+    if (sub_offsets) {
+      const int32_t *sub_row = table + sub_offsets[r];
+      for (int j = 0; j < size; j++) {
+        accumulator[j] = static_cast<int32_t>(
+            static_cast<uint32_t>(accumulator[j]) -
+            static_cast<uint32_t>(sub_row[j]));
+      }
+    }
+  }
+}
+
+void FixedPointToFloatScalar(const int32_t *values, int size, float scale,
+                             float *output) {
+  for (int j = 0; j < size; j++) {
+    output[j] = static_cast<float>(values[j]) * scale;
+  }
+}
+
+void GemvScalar(const float *weights, const float *bias, const float *input,
+                int padded_input_dim, int output_dim, eActivation activation,
+                float *output) {
+  for (int o = 0; o < output_dim; o++) {
+    const float *row = weights + o * padded_input_dim;
+    float acc = bias[o];
+    for (int i = 0; i < padded_input_dim; i++) {
+      acc += row[i] * input[i];
+    }
+    output[o] = Activate(acc, activation);
+  }
+}
+
+// Zero point of the inputs quantized by QuantizeInt7.
+constexpr int32_t kInt7ZeroPoint = 64;
+
+// Output of GemvInt8 for the dot product "dot" of the output.
+inline float Int8Output(const int32_t dot, const int32_t row_sum,
+                        const float scale, const float bias,
+                        const float input_scale, const eActivation activation) {
+  return Activate(bias + input_scale * scale *
+                             static_cast<float>(dot - kInt7ZeroPoint * row_sum),
+                  activation);
+}
+
+void GemvInt8Scalar(const int8_t *weights, const int32_t *row_sums,
+                    const float *scales, const float *bias,
+                    const uint8_t *input, float input_scale,
+                    int padded_input_dim, int output_dim,
+                    eActivation activation, float *output) {
+  for (int o = 0; o < output_dim; o++) {
+    const int8_t *row = weights + o * padded_input_dim;
+    int32_t acc = 0;
+    for (int i = 0; i < padded_input_dim; i++) {
+      acc += static_cast<int32_t>(row[i]) * input[i];
+    }
+    output[o] = Int8Output(acc, row_sums[o], scales[o], bias[o], input_scale,
+                           activation);
+  }
+}
+
+// Scale of QuantizeInt7 for an input of maximum absolute value "max_input".
+inline float Int7Scale(const float max_input) {
+  return max_input > 0 ? max_input / 63 : 1.f;
+}
+
+inline uint8_t QuantizeInt7Value(const float value, const float inv_scale) {
+  return static_cast<uint8_t>(
+      static_cast<int>(value * inv_scale + (kInt7ZeroPoint + 0.5f)));
+}
+
+float QuantizeInt7Scalar(const float *input, int size, uint8_t *output) {
+  float max_input = 0;
+  for (int i = 0; i < size; i++) {
+    max_input = std::max(max_input, std::abs(input[i]));
+  }
+  const float scale = Int7Scale(max_input);
+  const float inv_scale = 1.f / scale;
+  for (int i = 0; i < size; i++) {
+    output[i] = QuantizeInt7Value(input[i], inv_scale);
+  }
+  return scale;
+}
+
+// Gemm as one Gemv call per input.
+template <GemvFn gemv>
+void GemmByRows(const float *weights, const float *bias, const float *inputs,
+                int padded_input_dim, int output_dim, int batch_size,
+                eActivation activation, float *outputs, int output_stride) {
+  for (int b = 0; b < batch_size; b++) {
+    gemv(weights, bias, inputs + b * padded_input_dim, padded_input_dim,
+         output_dim, activation, outputs + b * output_stride);
+  }
+}
+
+// Philox4x32-10 counter based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3", 2011).
+constexpr uint32_t kPhiloxM0 = 0xD2511F53;
+constexpr uint32_t kPhiloxM1 = 0xCD9E8D57;
+constexpr uint32_t kPhiloxW0 = 0x9E3779B9;
+constexpr uint32_t kPhiloxW1 = 0xBB67AE85;
+constexpr int kPhiloxRounds = 10;
+
+// Number of Philox blocks per group of kRandomGroupSize values.
+constexpr int kRandomGroupBlocks = 16;
+constexpr int kRandomGroupSize = 4 * kRandomGroupBlocks;
+
+// Scale of the 24 bits random integers: [0, 2^24) -> [0, 2).
+constexpr float kUniform24Scale = 1.f / (1 << 23);
+
+// The 4 words of the block "block" of the sequence ("key", "stream"), i.e.
+// the Philox output for the counter {block_low, stream_low, stream_high,
+// block_high}.
+void PhiloxBlock(const uint64_t key, const uint64_t stream,
+                 const uint64_t block, uint32_t *output) {
+  uint32_t c0 = static_cast<uint32_t>(block);
+  uint32_t c1 = static_cast<uint32_t>(stream);
+  uint32_t c2 = static_cast<uint32_t>(stream >> 32);
+  uint32_t c3 = static_cast<uint32_t>(block >> 32);
+  uint32_t k0 = static_cast<uint32_t>(key);
+  uint32_t k1 = static_cast<uint32_t>(key >> 32);
+  for (int round = 0; round < kPhiloxRounds; round++) {
+    const uint64_t p0 = static_cast<uint64_t>(kPhiloxM0) * c0;
+    const uint64_t p1 = static_cast<uint64_t>(kPhiloxM1) * c2;
+    c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    c1 = static_cast<uint32_t>(p1);
+    c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c3 = static_cast<uint32_t>(p0);
+    k0 += kPhiloxW0;
+    k1 += kPhiloxW1;
+  }
+  output[0] = c0;
+  output[1] = c1;
+  output[2] = c2;
+  output[3] = c3;
+}
+
+// The random values [group * kRandomGroupSize, (group + 1) *
+// kRandomGroupSize) of the sequence ("key", "counter"), in the order
+// documented in kernels.h.
+void RandomGroupScalar(const uint64_t key, const uint64_t counter,
+                       const int group, uint32_t *output) {
+  uint32_t words[4];
+  for (int j = 0; j < kRandomGroupBlocks; j++) {
+    PhiloxBlock(key, counter, group * kRandomGroupBlocks + j, words);
+    for (int w = 0; w < 4; w++) {
+      output[w * kRandomGroupBlocks + j] = words[w];
+    }
+  }
+}
+
+void RandomBlocksScalar(const uint64_t key, const uint64_t stream,
+                        const uint64_t first_block, const int num_blocks,
+                        uint32_t *output) {
+  for (int b = 0; b < num_blocks; b++) {
+    PhiloxBlock(key, stream, first_block + b, output + 4 * b);
+  }
+}
+
+// True if the low 32 bits of the block indices [first_block, first_block +
+// num_blocks) wrap around.
+bool BlocksWrapAround(const uint64_t first_block, const int num_blocks) {
+  return static_cast<uint32_t>(first_block) >
+         static_cast<uint32_t>(-num_blocks);
+}
+
+void AddUniformNoiseScalar(const uint64_t key, const uint64_t counter,
+                           const float scale, const int size, float *data) {
+  uint32_t values[kRandomGroupSize];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    RandomGroupScalar(key, counter, begin / kRandomGroupSize, values);
+    const int end = std::min(size, begin + kRandomGroupSize);
+    for (int i = begin; i < end; i++) {
+      const float noise =
+          static_cast<float>(values[i - begin] >> 8) * kUniform24Scale - 1.f;
+      data[i] = std::fma(scale, noise, data[i]);
+    }
+  }
+}
+
+void CrossoverUniformScalar(const uint64_t key, const uint64_t counter,
+                            const uint32_t threshold, const int size,
+                            const float *a, const float *b, float *output) {
+  uint32_t values[kRandomGroupSize];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    RandomGroupScalar(key, counter, begin / kRandomGroupSize, values);
+    const int end = std::min(size, begin + kRandomGroupSize);
+    for (int i = begin; i < end; i++) {
+      output[i] = (values[i - begin] >> 8) < threshold ? b[i] : a[i];
+    }
+  }
+}
+
+// Exponential and logarithm of the Cephes library (Moshier 1992). The SIMD
+// implementations evaluate the same expressions in the same order.
+
+// Below, exp(x) is a denormal.
+constexpr float kExpMin = -87.3f;
+constexpr float kLog2e = 1.44269504088896341f;
+// ln(2) = kLn2High + kLn2Low, where n * kLn2High is exact for the exponents n
+// of the floats.
+constexpr float kLn2High = 0.693359375f;
+constexpr float kLn2Low = -2.12194440e-4f;
+constexpr float kSqrt2 = 1.41421356237309505f;
+constexpr int kExpDegree = 6;
+constexpr float kExpCoefficients[kExpDegree] = {
+    1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+    4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+constexpr int kLogDegree = 9;
+constexpr float kLogCoefficients[kLogDegree] = {
+    7.0376836292e-2f,  -1.1514610310e-1f, 1.1676998740e-1f,
+    -1.2420140846e-1f, 1.4249322787e-1f,  -1.6668057665e-1f,
+    2.0000714765e-1f,  -2.4999993993e-1f, 3.3333331174e-1f};
+// Scale of the 23 bits random integers of the Gumbel noise: [0, 2^23) ->
+// [0, 1).
+constexpr float kUniform23Scale = 1.f / (1 << 23);
+
+// exp(x) for x <= 0. Values below kExpMin are rounded up to kExpMin.
+inline float ExpNonPositive(float x) {
+  x = std::max(x, kExpMin);
+  const float n = std::floor(x * kLog2e + 0.5f);
+  x = x - n * kLn2High;
+  x = x - n * kLn2Low;
+  float p = kExpCoefficients[0];
+  for (int k = 1; k < kExpDegree; k++) {
+    p = p * x + kExpCoefficients[k];
+  }
+  p = p * (x * x) + x + 1.f;
+  // 2^n, with n in [-126, 0].
+  const uint32_t exponent = static_cast<uint32_t>(static_cast<int>(n) + 127)
+                            << 23;
+  float scale;
+  std::memcpy(&scale, &exponent, sizeof(scale));
+  return p * scale;
+}
+
+// log(x) for a positive normal x.
+inline float LogPositive(const float x) {
+  uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  float e = static_cast<float>(static_cast<int>(bits >> 23) - 127);
+  // Mantissa in [1, 2), then in (sqrt(2) / 2, sqrt(2)].
+  bits = (bits & 0x007FFFFF) | 0x3F800000;
+  float m;
+  std::memcpy(&m, &bits, sizeof(m));
+  if (m > kSqrt2) {
+    m = m * 0.5f;
+    e = e + 1.f;
+  }
+  const float y = m - 1.f;
+  const float z = y * y;
+  float p = kLogCoefficients[0];
+  for (int k = 1; k < kLogDegree; k++) {
+    p = p * y + kLogCoefficients[k];
+  }
+  float r = p * y * z;
+  r = r + e * kLn2Low;
+  r = r - 0.5f * z;
+  r = y + r;
+  return r + e * kLn2High;
+}
+
+inline float GumbelNoise(const uint32_t bits) {
+  const float u = (static_cast<float>(bits >> 9) + 0.5f) * kUniform23Scale;
+  return -LogPositive(-LogPositive(u));
+}
+
+void ExpShiftedScalar(const float *input, const int size, const float shift,
+                      float *output) {
+  for (int i = 0; i < size; i++) {
+    output[i] = ExpNonPositive(input[i] - shift);
+  }
+}
+
+void GumbelNoiseScalar(const uint32_t *bits, const int size, float *output) {
+  for (int i = 0; i < size; i++) {
+    output[i] = GumbelNoise(bits[i]);
+  }
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("sse2"))) float HorizontalSumSse(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2"))) void
+GemvSse(const float *weights, const float *bias, const float *input,
+        int padded_input_dim, int output_dim, eActivation activation,
+        float *output) {
+  for (int o = 0; o < output_dim; o++) {
+    const float *row = weights + o * padded_input_dim;
+    __m128 acc_1 = _mm_setzero_ps();
+    __m128 acc_2 = _mm_setzero_ps();
+    for (int i = 0; i < padded_input_dim; i += 8) {
+      acc_1 = _mm_add_ps(
+          acc_1, _mm_mul_ps(_mm_load_ps(row + i), _mm_load_ps(input + i)));
+      acc_2 = _mm_add_ps(acc_2, _mm_mul_ps(_mm_load_ps(row + i + 4),
+                                           _mm_load_ps(input + i + 4)));
+    }
+    output[o] =
+        Activate(HorizontalSumSse(_mm_add_ps(acc_1, acc_2)) + bias[o],
+                 activation);
+  }
+}
+
+// Sums each of the four registers of int32, and returns the four sums.
+__attribute__((target("avx2"))) __m128i HorizontalSum4Avx2(__m256i a,
+                                                           __m256i b,
+                                                           __m256i c,
+                                                           __m256i d) {
+  const __m256i s =
+      _mm256_hadd_epi32(_mm256_hadd_epi32(a, b), _mm256_hadd_epi32(c, d));
+  return _mm_add_epi32(_mm256_castsi256_si128(s),
+                       _mm256_extracti128_si256(s, 1));
+}
+
+// Adds to "acc" the dot products of the 8 groups of 4 bytes of "x" (unsigned)
+// and "w" (signed). Exact if the values of "x" are in [0, 127].
+__attribute__((target("avx2"))) __m256i DotBytesAvx2(const __m256i acc,
+                                                     const __m256i x,
+                                                     const __m256i w) {
+  const __m256i pairs = _mm256_maddubs_epi16(x, w);
+  return _mm256_add_epi32(acc,
+                          _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2"))) __m256i LoadBytesAvx2(const void *data) {
+  return _mm256_load_si256(static_cast<const __m256i *>(data));
+}
+
+// Writes the outputs [o, o + 4) of GemvInt8 from their dot products.
+__attribute__((target("sse2"))) void
+StoreInt8Outputs(const __m128i dots, const int32_t *row_sums,
+                 const float *scales, const float *bias,
+                 const float input_scale, const eActivation activation,
+                 float *output) {
+  static_assert(kInt7ZeroPoint == 1 << 6);
+  const __m128i centered = _mm_sub_epi32(
+      dots, _mm_slli_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(row_sums)),
+                6));
+  __m128 values = _mm_add_ps(
+      _mm_loadu_ps(bias),
+      _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(input_scale), _mm_loadu_ps(scales)),
+                 _mm_cvtepi32_ps(centered)));
+  if (activation == eActivation::kRelu) {
+    values = _mm_max_ps(values, _mm_setzero_ps());
+  }
+  _mm_storeu_ps(output, values);
+}
+
+__attribute__((target("avx2"))) void
+GemvInt8Avx2(const int8_t *weights, const int32_t *row_sums,
+             const float *scales, const float *bias, const uint8_t *input,
+             float input_scale, int padded_input_dim, int output_dim,
+             eActivation activation, float *output) {
+  int o = 0;
+  // Four rows at a time, sharing the loads of the input.
+  for (; o + 4 <= output_dim; o += 4) {
+    const int8_t *row = weights + o * padded_input_dim;
+    __m256i acc_0 = _mm256_setzero_si256();
+    __m256i acc_1 = _mm256_setzero_si256();
+    __m256i acc_2 = _mm256_setzero_si256();
+    __m256i acc_3 = _mm256_setzero_si256();
+    for (int i = 0; i < padded_input_dim; i += 32) {
+      const __m256i x = LoadBytesAvx2(input + i);
+      acc_0 = DotBytesAvx2(acc_0, x, LoadBytesAvx2(row + i));
+      acc_1 = DotBytesAvx2(acc_1, x, LoadBytesAvx2(row + padded_input_dim + i));
+      acc_2 =
+          DotBytesAvx2(acc_2, x, LoadBytesAvx2(row + 2 * padded_input_dim + i));
+      acc_3 =
+          DotBytesAvx2(acc_3, x, LoadBytesAvx2(row + 3 * padded_input_dim + i));
+    }
+    StoreInt8Outputs(HorizontalSum4Avx2(acc_0, acc_1, acc_2, acc_3),
+                     row_sums + o, scales + o, bias + o, input_scale,
+                     activation, output + o);
+  }
+  for (; o < output_dim; o++) {
+    const int8_t *row = weights + o * padded_input_dim;
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < padded_input_dim; i += 32) {
+      acc = DotBytesAvx2(acc, LoadBytesAvx2(input + i), LoadBytesAvx2(row + i));
+    }
+    output[o] =
+        Int8Output(_mm_cvtsi128_si32(HorizontalSum4Avx2(acc, acc, acc, acc)),
+                   row_sums[o], scales[o], bias[o], input_scale, activation);
+  }
+}
+
+// Mask of the "n" first lanes of a 256 bits register with n in [0, 8].
+__attribute__((target("avx2"))) __m256i MaskAvx2(int n) {
+  static const int32_t kMask[16] = {-1, -1, -1, -1, -1, -1, -1, -1,
+                                    0,  0,  0,  0,  0,  0,  0,  0};
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kMask + 8 - n));
+}
+
+__attribute__((target("avx2"))) float HorizontalSumAvx2(__m256 v) {
+  return HorizontalSumSse(
+      _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+// Sums each of the four registers, and returns the four sums.
+__attribute__((target("avx2"))) __m128 HorizontalSum4Avx2(__m256 a, __m256 b,
+                                                          __m256 c, __m256 d) {
+  const __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a, b), _mm256_hadd_ps(c, d));
+  return _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+}
+
+__attribute__((target("avx2"))) float
+QuantizeInt7Avx2(const float *input, int size, uint8_t *output) {
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  __m256 max_abs = _mm256_setzero_ps();
+  for (int i = 0; i < size; i += 8) {
+    const __m256 x =
+        _mm256_maskload_ps(input + i, MaskAvx2(std::min(size - i, 8)));
+    max_abs = _mm256_max_ps(max_abs, _mm256_and_ps(x, abs_mask));
+  }
+  __m128 m = _mm_max_ps(_mm256_castps256_ps128(max_abs),
+                        _mm256_extractf128_ps(max_abs, 1));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+  const float scale = Int7Scale(_mm_cvtss_f32(m));
+  const float inv_scale = 1.f / scale;
+
+  const __m256 inv_scale_v = _mm256_set1_ps(inv_scale);
+  const __m256 zero_v = _mm256_set1_ps(kInt7ZeroPoint + 0.5f);
+  int i = 0;
+  for (; i + 8 <= size; i += 8) {
+    // Multiplication then addition (no fma), as in QuantizeInt7Value.
+    const __m256i q = _mm256_cvttps_epi32(_mm256_add_ps(
+        _mm256_mul_ps(_mm256_loadu_ps(input + i), inv_scale_v), zero_v));
+    const __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                        _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(output + i),
+                     _mm_packus_epi16(q16, q16));
+  }
+  for (; i < size; i++) {
+    output[i] = QuantizeInt7Value(input[i], inv_scale);
+  }
+  return scale;
+}
+
+__attribute__((target("avx2"))) void
+AccumulateRowsAvx2(const float *table, const int *row_offsets, int num_rows,
+                   int size, float *output) {
+  int j = 0;
+  for (; j + 16 <= size; j += 16) {
+    __m256 acc_1 = _mm256_loadu_ps(output + j);
+    __m256 acc_2 = _mm256_loadu_ps(output + j + 8);
+    for (int r = 0; r < num_rows; r++) {
+      const float *row = table + row_offsets[r] + j;
+      acc_1 = _mm256_add_ps(acc_1, _mm256_loadu_ps(row));
+      acc_2 = _mm256_add_ps(acc_2, _mm256_loadu_ps(row + 8));
+    }
+    _mm256_storeu_ps(output + j, acc_1);
+    _mm256_storeu_ps(output + j + 8, acc_2);
+  }
+  for (; j < size; j += 8) {
+    const __m256i mask = MaskAvx2(size - j < 8 ? size - j : 8);
+    __m256 acc = _mm256_maskload_ps(output + j, mask);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm256_add_ps(
+          acc, _mm256_maskload_ps(table + row_offsets[r] + j, mask));
+    }
+    _mm256_maskstore_ps(output + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+AccumulateWeightedRowsAvx2(const float *table, const int *row_offsets,
+                           const float *row_weights, int num_rows, int size,
+                           float *output) {
+  int j = 0;
+  for (; j + 16 <= size; j += 16) {
+    __m256 acc_1 = _mm256_loadu_ps(output + j);
+    __m256 acc_2 = _mm256_loadu_ps(output + j + 8);
+    for (int r = 0; r < num_rows; r++) {
+      const float *row = table + row_offsets[r] + j;
+      const __m256 weight = _mm256_set1_ps(row_weights[r]);
+      acc_1 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row), acc_1);
+      acc_2 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + 8), acc_2);
+    }
+    _mm256_storeu_ps(output + j, acc_1);
+    _mm256_storeu_ps(output + j + 8, acc_2);
+  }
+  for (; j < size; j += 8) {
+    const __m256i mask = MaskAvx2(size - j < 8 ? size - j : 8);
+    __m256 acc = _mm256_maskload_ps(output + j, mask);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm256_fmadd_ps(
+          _mm256_set1_ps(row_weights[r]),
+          _mm256_maskload_ps(table + row_offsets[r] + j, mask), acc);
+    }
+    _mm256_maskstore_ps(output + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx2,bmi"))) int
+ChangedIndicesAvx2(const uint8_t *a, const uint8_t *b, int size, int *indices) {
+  int num_changed = 0;
+  int i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i equal = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+    uint32_t changed = ~static_cast<uint32_t>(_mm256_movemask_epi8(equal));
+    while (changed) {
+      indices[num_changed++] = i + _tzcnt_u32(changed);
+      changed &= changed - 1;
+    }
+  }
+  for (; i < size; i++) {
+    indices[num_changed] = i;
+    num_changed += a[i] != b[i];
+  }
+  return num_changed;
+}
+
+__attribute__((target("avx2"))) void
+ReplaceRowsAvx2(const int32_t *table, const int *sub_offsets,
+                const int *add_offsets, int num_rows, int size,
+                int32_t *accumulator) {
+  for (int j = 0; j < size; j += 8) {
+    const __m256i mask = MaskAvx2(size - j < 8 ? size - j : 8);
+    auto *acc_ptr = reinterpret_cast<int *>(accumulator + j);
+    __m256i acc = _mm256_maskload_epi32(acc_ptr, mask);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm256_add_epi32(
+          acc, _mm256_maskload_epi32(table + add_offsets[r] + j, mask));
+      if (sub_offsets) {
+        acc = _mm256_sub_epi32(
+            acc, _mm256_maskload_epi32(table + sub_offsets[r] + j, mask));
+      }
+    }
+    _mm256_maskstore_epi32(acc_ptr, mask, acc);
+  }
+}
+
+__attribute__((target("avx2"))) void
+FixedPointToFloatAvx2(const int32_t *values, int size, float scale,
+                      float *output) {
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  for (int j = 0; j < size; j += 8) {
+    const __m256i mask = MaskAvx2(size - j < 8 ? size - j : 8);
+    const __m256i v = _mm256_maskload_epi32(values + j, mask);
+    _mm256_maskstore_ps(output + j, mask,
+                        _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale_v));
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+GemvAvx2(const float *weights, const float *bias, const float *input,
+         int padded_input_dim, int output_dim, eActivation activation,
+         float *output) {
+  int o = 0;
+  // Four rows at a time, sharing the loads of the input.
+  for (; o + 4 <= output_dim; o += 4) {
+    const float *row = weights + o * padded_input_dim;
+    __m256 acc_0 = _mm256_setzero_ps();
+    __m256 acc_1 = _mm256_setzero_ps();
+    __m256 acc_2 = _mm256_setzero_ps();
+    __m256 acc_3 = _mm256_setzero_ps();
+    for (int i = 0; i < padded_input_dim; i += 8) {
+      const __m256 x = _mm256_load_ps(input + i);
+      acc_0 = _mm256_fmadd_ps(_mm256_load_ps(row + i), x, acc_0);
+      acc_1 = _mm256_fmadd_ps(_mm256_load_ps(row + padded_input_dim + i), x,
+                              acc_1);
+      acc_2 = _mm256_fmadd_ps(_mm256_load_ps(row + 2 * padded_input_dim + i),
+                              x, acc_2);
+      acc_3 = _mm256_fmadd_ps(_mm256_load_ps(row + 3 * padded_input_dim + i),
+                              x, acc_3);
+    }
+    __m128 sums = _mm_add_ps(HorizontalSum4Avx2(acc_0, acc_1, acc_2, acc_3),
+                             _mm_loadu_ps(bias + o));
+    if (activation == eActivation::kRelu) {
+      sums = _mm_max_ps(sums, _mm_setzero_ps());
+    }
+    _mm_storeu_ps(output + o, sums);
+  }
+  for (; o < output_dim; o++) {
+    const float *row = weights + o * padded_input_dim;
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < padded_input_dim; i += 8) {
+      acc = _mm256_fmadd_ps(_mm256_load_ps(row + i), _mm256_load_ps(input + i),
+                            acc);
+    }
+    output[o] = Activate(HorizontalSumAvx2(acc) + bias[o], activation);
+  }
+}
+
+// Two inputs at a time, sharing the loads of the weights. The sums are
+// computed in the same order as GemvAvx2.
+__attribute__((target("avx2,fma"))) void
+GemmAvx2(const float *weights, const float *bias, const float *inputs,
+         int padded_input_dim, int output_dim, int batch_size,
+         eActivation activation, float *outputs, int output_stride) {
+  int b = 0;
+  for (; b + 2 <= batch_size; b += 2) {
+    const float *input_0 = inputs + b * padded_input_dim;
+    const float *input_1 = input_0 + padded_input_dim;
+    float *output_0 = outputs + b * output_stride;
+    float *output_1 = output_0 + output_stride;
+    int o = 0;
+    for (; o + 4 <= output_dim; o += 4) {
+      const float *row = weights + o * padded_input_dim;
+      __m256 acc_00 = _mm256_setzero_ps(), acc_01 = _mm256_setzero_ps();
+      __m256 acc_02 = _mm256_setzero_ps(), acc_03 = _mm256_setzero_ps();
+      __m256 acc_10 = _mm256_setzero_ps(), acc_11 = _mm256_setzero_ps();
+      __m256 acc_12 = _mm256_setzero_ps(), acc_13 = _mm256_setzero_ps();
+      for (int i = 0; i < padded_input_dim; i += 8) {
+        const __m256 x_0 = _mm256_load_ps(input_0 + i);
+        const __m256 x_1 = _mm256_load_ps(input_1 + i);
+        const __m256 w_0 = _mm256_load_ps(row + i);
+        const __m256 w_1 = _mm256_load_ps(row + padded_input_dim + i);
+        const __m256 w_2 = _mm256_load_ps(row + 2 * padded_input_dim + i);
+        const __m256 w_3 = _mm256_load_ps(row + 3 * padded_input_dim + i);
+        acc_00 = _mm256_fmadd_ps(w_0, x_0, acc_00);
+        acc_01 = _mm256_fmadd_ps(w_1, x_0, acc_01);
+        acc_02 = _mm256_fmadd_ps(w_2, x_0, acc_02);
+        acc_03 = _mm256_fmadd_ps(w_3, x_0, acc_03);
+        acc_10 = _mm256_fmadd_ps(w_0, x_1, acc_10);
+        acc_11 = _mm256_fmadd_ps(w_1, x_1, acc_11);
+        acc_12 = _mm256_fmadd_ps(w_2, x_1, acc_12);
+        acc_13 = _mm256_fmadd_ps(w_3, x_1, acc_13);
+      }
+      const __m128 b_sums = _mm_loadu_ps(bias + o);
+      __m128 sums_0 = _mm_add_ps(
+          HorizontalSum4Avx2(acc_00, acc_01, acc_02, acc_03), b_sums);
+      __m128 sums_1 = _mm_add_ps(
+          HorizontalSum4Avx2(acc_10, acc_11, acc_12, acc_13), b_sums);
+      if (activation == eActivation::kRelu) {
+        sums_0 = _mm_max_ps(sums_0, _mm_setzero_ps());
+        sums_1 = _mm_max_ps(sums_1, _mm_setzero_ps());
+      }
+      _mm_storeu_ps(output_0 + o, sums_0);
+      _mm_storeu_ps(output_1 + o, sums_1);
+    }
+    for (; o < output_dim; o++) {
+      const float *row = weights + o * padded_input_dim;
+      __m256 acc_0 = _mm256_setzero_ps();
+      __m256 acc_1 = _mm256_setzero_ps();
+      for (int i = 0; i < padded_input_dim; i += 8) {
+        const __m256 w = _mm256_load_ps(row + i);
+        acc_0 = _mm256_fmadd_ps(w, _mm256_load_ps(input_0 + i), acc_0);
+        acc_1 = _mm256_fmadd_ps(w, _mm256_load_ps(input_1 + i), acc_1);
+      }
+      output_0[o] = Activate(HorizontalSumAvx2(acc_0) + bias[o], activation);
+      output_1[o] = Activate(HorizontalSumAvx2(acc_1) + bias[o], activation);
+    }
+  }
+  if (b < batch_size) {
+    GemvAvx2(weights, bias, inputs + b * padded_input_dim, padded_input_dim,
+             output_dim, activation, outputs + b * output_stride);
+  }
+}
+
+// 32 x 32 -> 64 bits products of the 8 lanes of "x" with "m", split into
+// high and low halves.
+__attribute__((target("avx2"))) void MulHiLoAvx2(const __m256i x,
+                                                 const __m256i m, __m256i *hi,
+                                                 __m256i *lo) {
+  const __m256i even = _mm256_mul_epu32(x, m);
+  const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+  *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+  *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Philox blocks [first_block, first_block + 8) of the sequence ("key",
+// "stream"), one block per lane. The low 32 bits of the block indices should
+// not wrap around.
+__attribute__((target("avx2"))) void
+PhiloxBlocksAvx2(const uint64_t key, const uint64_t stream,
+                 const uint64_t first_block, __m256i *words) {
+  __m256i c0 = _mm256_add_epi32(
+      _mm256_set1_epi32(static_cast<uint32_t>(first_block)),
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i c1 = _mm256_set1_epi32(static_cast<uint32_t>(stream));
+  __m256i c2 = _mm256_set1_epi32(static_cast<uint32_t>(stream >> 32));
+  __m256i c3 = _mm256_set1_epi32(static_cast<uint32_t>(first_block >> 32));
+  uint32_t k0 = static_cast<uint32_t>(key);
+  uint32_t k1 = static_cast<uint32_t>(key >> 32);
+  const __m256i m0 = _mm256_set1_epi32(kPhiloxM0);
+  const __m256i m1 = _mm256_set1_epi32(kPhiloxM1);
+  for (int round = 0; round < kPhiloxRounds; round++) {
+    __m256i hi0, lo0, hi1, lo1;
+    MulHiLoAvx2(c0, m0, &hi0, &lo0);
+    MulHiLoAvx2(c2, m1, &hi1, &lo1);
+    c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+    c1 = lo1;
+    c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+    c3 = lo0;
+    k0 += kPhiloxW0;
+    k1 += kPhiloxW1;
+  }
+  words[0] = c0;
+  words[1] = c1;
+  words[2] = c2;
+  words[3] = c3;
+}
+
+__attribute__((target("avx2"))) void
+RandomBlocksAvx2(const uint64_t key, const uint64_t stream,
+                 const uint64_t first_block, const int num_blocks,
+                 uint32_t *output) {
+  int b = 0;
+  for (; b + 8 <= num_blocks; b += 8) {
+    if (BlocksWrapAround(first_block + b, 8)) {
+      RandomBlocksScalar(key, stream, first_block + b, 8, output + 4 * b);
+      continue;
+    }
+    __m256i words[4];
+    PhiloxBlocksAvx2(key, stream, first_block + b, words);
+    // Transposes the words (one block per lane) into consecutive blocks.
+    const __m256i t0 = _mm256_unpacklo_epi32(words[0], words[1]);
+    const __m256i t1 = _mm256_unpackhi_epi32(words[0], words[1]);
+    const __m256i t2 = _mm256_unpacklo_epi32(words[2], words[3]);
+    const __m256i t3 = _mm256_unpackhi_epi32(words[2], words[3]);
+    // Blocks {0, 4}, {1, 5}, {2, 6} and {3, 7}.
+    const __m256i r0 = _mm256_unpacklo_epi64(t0, t2);
+    const __m256i r1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i r2 = _mm256_unpacklo_epi64(t1, t3);
+    const __m256i r3 = _mm256_unpackhi_epi64(t1, t3);
+    auto *dst = reinterpret_cast<__m256i *>(output + 4 * b);
+    _mm256_storeu_si256(dst, _mm256_permute2x128_si256(r0, r1, 0x20));
+    _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(r2, r3, 0x20));
+    _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(r0, r1, 0x31));
+    _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(r2, r3, 0x31));
+  }
+  RandomBlocksScalar(key, stream, first_block + b, num_blocks - b,
+                     output + 4 * b);
+}
+
+__attribute__((target("avx2,fma"))) void
+AddUniformNoiseAvx2(const uint64_t key, const uint64_t counter,
+                    const float scale, const int size, float *data) {
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  const __m256 uniform_scale = _mm256_set1_ps(kUniform24Scale);
+  const __m256 one = _mm256_set1_ps(1.f);
+  __m256i words[4];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    for (int half = 0; half < 2; half++) {
+      PhiloxBlocksAvx2(key, counter,
+                       begin / kRandomGroupSize * kRandomGroupBlocks + half * 8,
+                       words);
+      for (int w = 0; w < 4; w++) {
+        const int offset = begin + w * kRandomGroupBlocks + half * 8;
+        if (offset >= size) {
+          break;
+        }
+        const __m256i mask = MaskAvx2(std::min(8, size - offset));
+        const __m256 noise = _mm256_sub_ps(
+            _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(words[w], 8)),
+                          uniform_scale),
+            one);
+        const __m256 value = _mm256_maskload_ps(data + offset, mask);
+        _mm256_maskstore_ps(data + offset, mask,
+                            _mm256_fmadd_ps(scale_v, noise, value));
+      }
+    }
+  }
+}
+
+__attribute__((target("avx2"))) void
+CrossoverUniformAvx2(const uint64_t key, const uint64_t counter,
+                     const uint32_t threshold, const int size, const float *a,
+                     const float *b, float *output) {
+  // The compared values are in [0, 2^24], so the signed comparison is exact.
+  const __m256i threshold_v = _mm256_set1_epi32(threshold);
+  __m256i words[4];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    for (int half = 0; half < 2; half++) {
+      PhiloxBlocksAvx2(key, counter,
+                       begin / kRandomGroupSize * kRandomGroupBlocks + half * 8,
+                       words);
+      for (int w = 0; w < 4; w++) {
+        const int offset = begin + w * kRandomGroupBlocks + half * 8;
+        if (offset >= size) {
+          break;
+        }
+        const __m256i mask = MaskAvx2(std::min(8, size - offset));
+        const __m256 take_b = _mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(threshold_v, _mm256_srli_epi32(words[w], 8)));
+        const __m256 value =
+            _mm256_blendv_ps(_mm256_maskload_ps(a + offset, mask),
+                             _mm256_maskload_ps(b + offset, mask), take_b);
+        _mm256_maskstore_ps(output + offset, mask, value);
+      }
+    }
+  }
+}
+
+__attribute__((target("avx2"))) __m256 ExpNonPositiveAvx2(__m256 x) {
+  x = _mm256_max_ps(x, _mm256_set1_ps(kExpMin));
+  const __m256 n = _mm256_floor_ps(_mm256_add_ps(
+      _mm256_mul_ps(x, _mm256_set1_ps(kLog2e)), _mm256_set1_ps(0.5f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(kLn2High)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(kLn2Low)));
+  __m256 p = _mm256_set1_ps(kExpCoefficients[0]);
+  for (int k = 1; k < kExpDegree; k++) {
+    p = _mm256_add_ps(_mm256_mul_ps(p, x),
+                      _mm256_set1_ps(kExpCoefficients[k]));
+  }
+  p = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(p, _mm256_mul_ps(x, x)), x),
+      _mm256_set1_ps(1.f));
+  const __m256i exponent = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+}
+
+__attribute__((target("avx2"))) __m256 LogPositiveAvx2(const __m256 x) {
+  const __m256i bits = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                                 _mm256_set1_epi32(127)));
+  __m256 m = _mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+                      _mm256_set1_epi32(0x3F800000)));
+  const __m256 above = _mm256_cmp_ps(m, _mm256_set1_ps(kSqrt2), _CMP_GT_OQ);
+  m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), above);
+  e = _mm256_add_ps(e, _mm256_and_ps(above, _mm256_set1_ps(1.f)));
+  const __m256 y = _mm256_sub_ps(m, _mm256_set1_ps(1.f));
+  const __m256 z = _mm256_mul_ps(y, y);
+  __m256 p = _mm256_set1_ps(kLogCoefficients[0]);
+  for (int k = 1; k < kLogDegree; k++) {
+    p = _mm256_add_ps(_mm256_mul_ps(p, y),
+                      _mm256_set1_ps(kLogCoefficients[k]));
+  }
+  __m256 r = _mm256_mul_ps(_mm256_mul_ps(p, y), z);
+  r = _mm256_add_ps(r, _mm256_mul_ps(e, _mm256_set1_ps(kLn2Low)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(_mm256_set1_ps(0.5f), z));
+  r = _mm256_add_ps(y, r);
+  return _mm256_add_ps(r, _mm256_mul_ps(e, _mm256_set1_ps(kLn2High)));
+}
+
+__attribute__((target("avx2"))) void ExpShiftedAvx2(const float *input,
+                                                    const int size,
+                                                    const float shift,
+                                                    float *output) {
+  const __m256 shift_v = _mm256_set1_ps(shift);
+  for (int i = 0; i < size; i += 8) {
+    const __m256i mask = MaskAvx2(std::min(size - i, 8));
+    const __m256 x = _mm256_maskload_ps(input + i, mask);
+    _mm256_maskstore_ps(output + i, mask,
+                        ExpNonPositiveAvx2(_mm256_sub_ps(x, shift_v)));
+  }
+}
+
+__attribute__((target("avx2"))) void
+GumbelNoiseAvx2(const uint32_t *bits, const int size, float *output) {
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  for (int i = 0; i < size; i += 8) {
+    const __m256i mask = MaskAvx2(std::min(size - i, 8));
+    const __m256i values =
+        _mm256_maskload_epi32(reinterpret_cast<const int *>(bits + i), mask);
+    const __m256 u = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(values, 9)),
+                      _mm256_set1_ps(0.5f)),
+        _mm256_set1_ps(kUniform23Scale));
+    const __m256 noise = _mm256_xor_ps(
+        LogPositiveAvx2(_mm256_xor_ps(LogPositiveAvx2(u), sign)), sign);
+    _mm256_maskstore_ps(output + i, mask, noise);
+  }
+}
+
+__attribute__((target("avx512f"))) __m256i FoldAvx512(__m512i v) {
+  return _mm256_add_epi32(_mm512_castsi512_si256(v),
+                          _mm512_extracti64x4_epi64(v, 1));
+}
+
+__attribute__((target("avx512f,avx512vnni"))) void
+GemvInt8Vnni(const int8_t *weights, const int32_t *row_sums,
+             const float *scales, const float *bias, const uint8_t *input,
+             float input_scale, int padded_input_dim, int output_dim,
+             eActivation activation, float *output) {
+  int o = 0;
+  for (; o + 4 <= output_dim; o += 4) {
+    const int8_t *row = weights + o * padded_input_dim;
+    __m512i acc_0 = _mm512_setzero_si512();
+    __m512i acc_1 = _mm512_setzero_si512();
+    __m512i acc_2 = _mm512_setzero_si512();
+    __m512i acc_3 = _mm512_setzero_si512();
+    for (int i = 0; i < padded_input_dim; i += 64) {
+      const __m512i x = _mm512_load_si512(input + i);
+      acc_0 = _mm512_dpbusd_epi32(acc_0, x, _mm512_load_si512(row + i));
+      acc_1 = _mm512_dpbusd_epi32(
+          acc_1, x, _mm512_load_si512(row + padded_input_dim + i));
+      acc_2 = _mm512_dpbusd_epi32(
+          acc_2, x, _mm512_load_si512(row + 2 * padded_input_dim + i));
+      acc_3 = _mm512_dpbusd_epi32(
+          acc_3, x, _mm512_load_si512(row + 3 * padded_input_dim + i));
+    }
+    StoreInt8Outputs(HorizontalSum4Avx2(FoldAvx512(acc_0), FoldAvx512(acc_1),
+                                        FoldAvx512(acc_2), FoldAvx512(acc_3)),
+                     row_sums + o, scales + o, bias + o, input_scale,
+                     activation, output + o);
+  }
+  for (; o < output_dim; o++) {
+    const int8_t *row = weights + o * padded_input_dim;
+    __m512i acc = _mm512_setzero_si512();
+    for (int i = 0; i < padded_input_dim; i += 64) {
+      acc = _mm512_dpbusd_epi32(acc, _mm512_load_si512(input + i),
+                                _mm512_load_si512(row + i));
+    }
+    output[o] = Int8Output(_mm512_reduce_add_epi32(acc), row_sums[o],
+                           scales[o], bias[o], input_scale, activation);
+  }
+}
+
+// Mask of the first min(n, 16) lanes.
+__attribute__((target("avx512f"))) __mmask16 MaskAvx512(const int n) {
+  return n >= 16 ? static_cast<__mmask16>(0xFFFF)
+                 : static_cast<__mmask16>((1u << n) - 1);
+}
+
+__attribute__((target("avx512f"))) void
+AccumulateRowsAvx512(const float *table, const int *row_offsets, int num_rows,
+                     int size, float *output) {
+  int j = 0;
+  for (; j + 32 <= size; j += 32) {
+    __m512 acc_1 = _mm512_loadu_ps(output + j);
+    __m512 acc_2 = _mm512_loadu_ps(output + j + 16);
+    for (int r = 0; r < num_rows; r++) {
+      const float *row = table + row_offsets[r] + j;
+      acc_1 = _mm512_add_ps(acc_1, _mm512_loadu_ps(row));
+      acc_2 = _mm512_add_ps(acc_2, _mm512_loadu_ps(row + 16));
+    }
+    _mm512_storeu_ps(output + j, acc_1);
+    _mm512_storeu_ps(output + j + 16, acc_2);
+  }
+  for (; j < size; j += 16) {
+    const __mmask16 mask =
+        size - j < 16 ? static_cast<__mmask16>((1u << (size - j)) - 1)
+                      : static_cast<__mmask16>(0xFFFF);
+    __m512 acc = _mm512_maskz_loadu_ps(mask, output + j);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm512_add_ps(
+          acc, _mm512_maskz_loadu_ps(mask, table + row_offsets[r] + j));
+    }
+    _mm512_mask_storeu_ps(output + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+AccumulateWeightedRowsAvx512(const float *table, const int *row_offsets,
+                             const float *row_weights, int num_rows, int size,
+                             float *output) {
+  int j = 0;
+  for (; j + 32 <= size; j += 32) {
+    __m512 acc_1 = _mm512_loadu_ps(output + j);
+    __m512 acc_2 = _mm512_loadu_ps(output + j + 16);
+    for (int r = 0; r < num_rows; r++) {
+      const float *row = table + row_offsets[r] + j;
+      const __m512 weight = _mm512_set1_ps(row_weights[r]);
+      acc_1 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row), acc_1);
+      acc_2 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + 16), acc_2);
+    }
+    _mm512_storeu_ps(output + j, acc_1);
+    _mm512_storeu_ps(output + j + 16, acc_2);
+  }
+  for (; j < size; j += 16) {
+    const __mmask16 mask = MaskAvx512(size - j);
+    __m512 acc = _mm512_maskz_loadu_ps(mask, output + j);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm512_fmadd_ps(
+          _mm512_set1_ps(row_weights[r]),
+          _mm512_maskz_loadu_ps(mask, table + row_offsets[r] + j), acc);
+    }
+    _mm512_mask_storeu_ps(output + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+ReplaceRowsAvx512(const int32_t *table, const int *sub_offsets,
+                  const int *add_offsets, int num_rows, int size,
+                  int32_t *accumulator) {
+  for (int j = 0; j < size; j += 16) {
+    const __mmask16 mask =
+        size - j < 16 ? static_cast<__mmask16>((1u << (size - j)) - 1)
+                      : static_cast<__mmask16>(0xFFFF);
+    __m512i acc = _mm512_maskz_loadu_epi32(mask, accumulator + j);
+    for (int r = 0; r < num_rows; r++) {
+      acc = _mm512_add_epi32(
+          acc, _mm512_maskz_loadu_epi32(mask, table + add_offsets[r] + j));
+      if (sub_offsets) {
+        acc = _mm512_sub_epi32(
+            acc, _mm512_maskz_loadu_epi32(mask, table + sub_offsets[r] + j));
+      }
+    }
+    _mm512_mask_storeu_epi32(accumulator + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+FixedPointToFloatAvx512(const int32_t *values, int size, float scale,
+                        float *output) {
+  const __m512 scale_v = _mm512_set1_ps(scale);
+  for (int j = 0; j < size; j += 16) {
+    const __mmask16 mask =
+        size - j < 16 ? static_cast<__mmask16>((1u << (size - j)) - 1)
+                      : static_cast<__mmask16>(0xFFFF);
+    const __m512i v = _mm512_maskz_loadu_epi32(mask, values + j);
+    _mm512_mask_storeu_ps(output + j, mask,
+                          _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale_v));
+  }
+}
+
+// Adds the two halves of a 512 bits register.
+__attribute__((target("avx512f"))) __m256 FoldAvx512(__m512 v) {
+  return _mm256_add_ps(
+      _mm512_castps512_ps256(v),
+      _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+__attribute__((target("avx512f,avx2,fma"))) void
+GemvAvx512(const float *weights, const float *bias, const float *input,
+           int padded_input_dim, int output_dim, eActivation activation,
+           float *output) {
+  int o = 0;
+  for (; o + 4 <= output_dim; o += 4) {
+    const float *row = weights + o * padded_input_dim;
+    __m512 acc_0 = _mm512_setzero_ps();
+    __m512 acc_1 = _mm512_setzero_ps();
+    __m512 acc_2 = _mm512_setzero_ps();
+    __m512 acc_3 = _mm512_setzero_ps();
+    for (int i = 0; i < padded_input_dim; i += 16) {
+      const __m512 x = _mm512_load_ps(input + i);
+      acc_0 = _mm512_fmadd_ps(_mm512_load_ps(row + i), x, acc_0);
+      acc_1 = _mm512_fmadd_ps(_mm512_load_ps(row + padded_input_dim + i), x,
+                              acc_1);
+      acc_2 = _mm512_fmadd_ps(_mm512_load_ps(row + 2 * padded_input_dim + i),
+                              x, acc_2);
+      acc_3 = _mm512_fmadd_ps(_mm512_load_ps(row + 3 * padded_input_dim + i),
+                              x, acc_3);
+    }
+    __m128 sums = _mm_add_ps(
+        HorizontalSum4Avx2(FoldAvx512(acc_0), FoldAvx512(acc_1),
+                           FoldAvx512(acc_2), FoldAvx512(acc_3)),
+        _mm_loadu_ps(bias + o));
+    if (activation == eActivation::kRelu) {
+      sums = _mm_max_ps(sums, _mm_setzero_ps());
+    }
+    _mm_storeu_ps(output + o, sums);
+  }
+  for (; o < output_dim; o++) {
+    const float *row = weights + o * padded_input_dim;
+    __m512 acc = _mm512_setzero_ps();
+    for (int i = 0; i < padded_input_dim; i += 16) {
+      acc = _mm512_fmadd_ps(_mm512_load_ps(row + i), _mm512_load_ps(input + i),
+                            acc);
+    }
+    output[o] =
+        Activate(HorizontalSumAvx2(FoldAvx512(acc)) + bias[o], activation);
+  }
+}
+
+__attribute__((target("avx512f,avx2,fma"))) void
+GemmAvx512(const float *weights, const float *bias, const float *inputs,
+           int padded_input_dim, int output_dim, int batch_size,
+           eActivation activation, float *outputs, int output_stride) {
+  int b = 0;
+  for (; b + 2 <= batch_size; b += 2) {
+    const float *input_0 = inputs + b * padded_input_dim;
+    const float *input_1 = input_0 + padded_input_dim;
+    float *output_0 = outputs + b * output_stride;
+    float *output_1 = output_0 + output_stride;
+    int o = 0;
+    for (; o + 4 <= output_dim; o += 4) {
+      const float *row = weights + o * padded_input_dim;
+      __m512 acc_00 = _mm512_setzero_ps(), acc_01 = _mm512_setzero_ps();
+      __m512 acc_02 = _mm512_setzero_ps(), acc_03 = _mm512_setzero_ps();
+      __m512 acc_10 = _mm512_setzero_ps(), acc_11 = _mm512_setzero_ps();
+      __m512 acc_12 = _mm512_setzero_ps(), acc_13 = _mm512_setzero_ps();
+      for (int i = 0; i < padded_input_dim; i += 16) {
+        const __m512 x_0 = _mm512_load_ps(input_0 + i);
+        const __m512 x_1 = _mm512_load_ps(input_1 + i);
+        const __m512 w_0 = _mm512_load_ps(row + i);
+        const __m512 w_1 = _mm512_load_ps(row + padded_input_dim + i);
+        const __m512 w_2 = _mm512_load_ps(row + 2 * padded_input_dim + i);
+        const __m512 w_3 = _mm512_load_ps(row + 3 * padded_input_dim + i);
+        acc_00 = _mm512_fmadd_ps(w_0, x_0, acc_00);
+        acc_01 = _mm512_fmadd_ps(w_1, x_0, acc_01);
+        acc_02 = _mm512_fmadd_ps(w_2, x_0, acc_02);
+        acc_03 = _mm512_fmadd_ps(w_3, x_0, acc_03);
+        acc_10 = _mm512_fmadd_ps(w_0, x_1, acc_10);
+        acc_11 = _mm512_fmadd_ps(w_1, x_1, acc_11);
+        acc_12 = _mm512_fmadd_ps(w_2, x_1, acc_12);
+        acc_13 = _mm512_fmadd_ps(w_3, x_1, acc_13);
+      }
+      const __m128 b_sums = _mm_loadu_ps(bias + o);
+      __m128 sums_0 = _mm_add_ps(
+          HorizontalSum4Avx2(FoldAvx512(acc_00), FoldAvx512(acc_01),
+                             FoldAvx512(acc_02), FoldAvx512(acc_03)),
+          b_sums);
+      __m128 sums_1 = _mm_add_ps(
+          HorizontalSum4Avx2(FoldAvx512(acc_10), FoldAvx512(acc_11),
+                             FoldAvx512(acc_12), FoldAvx512(acc_13)),
+          b_sums);
+      if (activation == eActivation::kRelu) {
+        sums_0 = _mm_max_ps(sums_0, _mm_setzero_ps());
+        sums_1 = _mm_max_ps(sums_1, _mm_setzero_ps());
+      }
+      _mm_storeu_ps(output_0 + o, sums_0);
+      _mm_storeu_ps(output_1 + o, sums_1);
+    }
+    for (; o < output_dim; o++) {
+      const float *row = weights + o * padded_input_dim;
+      __m512 acc_0 = _mm512_setzero_ps();
+      __m512 acc_1 = _mm512_setzero_ps();
+      for (int i = 0; i < padded_input_dim; i += 16) {
+        const __m512 w = _mm512_load_ps(row + i);
+        acc_0 = _mm512_fmadd_ps(w, _mm512_load_ps(input_0 + i), acc_0);
+        acc_1 = _mm512_fmadd_ps(w, _mm512_load_ps(input_1 + i), acc_1);
+      }
+      output_0[o] = Activate(HorizontalSumAvx2(FoldAvx512(acc_0)) + bias[o],
+                             activation);
+      output_1[o] = Activate(HorizontalSumAvx2(FoldAvx512(acc_1)) + bias[o],
+                             activation);
+    }
+  }
+  if (b < batch_size) {
+    GemvAvx512(weights, bias, inputs + b * padded_input_dim, padded_input_dim,
+               output_dim, activation, outputs + b * output_stride);
+  }
+}
+
+// 32 x 32 -> 64 bits products of the 16 lanes of "x" with "m", split into
+// high and low halves.
+__attribute__((target("avx512f"))) void MulHiLoAvx512(const __m512i x,
+                                                      const __m512i m,
+                                                      __m512i *hi,
+                                                      __m512i *lo) {
+  const __m512i even = _mm512_mul_epu32(x, m);
+  const __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(x, 32), m);
+  *lo = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+  *hi = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+}
+
+// Philox blocks [first_block, first_block + 16) of the sequence ("key",
+// "stream"), one block per lane. The low 32 bits of the block indices should
+// not wrap around.
+__attribute__((target("avx512f"))) void
+PhiloxBlocksAvx512(const uint64_t key, const uint64_t stream,
+                   const uint64_t first_block, __m512i *words) {
+  __m512i c0 = _mm512_add_epi32(
+      _mm512_set1_epi32(static_cast<uint32_t>(first_block)),
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  __m512i c1 = _mm512_set1_epi32(static_cast<uint32_t>(stream));
+  __m512i c2 = _mm512_set1_epi32(static_cast<uint32_t>(stream >> 32));
+  __m512i c3 = _mm512_set1_epi32(static_cast<uint32_t>(first_block >> 32));
+  uint32_t k0 = static_cast<uint32_t>(key);
+  uint32_t k1 = static_cast<uint32_t>(key >> 32);
+  const __m512i m0 = _mm512_set1_epi32(kPhiloxM0);
+  const __m512i m1 = _mm512_set1_epi32(kPhiloxM1);
+  for (int round = 0; round < kPhiloxRounds; round++) {
+    __m512i hi0, lo0, hi1, lo1;
+    MulHiLoAvx512(c0, m0, &hi0, &lo0);
+    MulHiLoAvx512(c2, m1, &hi1, &lo1);
+    c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1), _mm512_set1_epi32(k0));
+    c1 = lo1;
+    c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3), _mm512_set1_epi32(k1));
+    c3 = lo0;
+    k0 += kPhiloxW0;
+    k1 += kPhiloxW1;
+  }
+  words[0] = c0;
+  words[1] = c1;
+  words[2] = c2;
+  words[3] = c3;
+}
+
+__attribute__((target("avx512f"))) void
+RandomBlocksAvx512(const uint64_t key, const uint64_t stream,
+                   const uint64_t first_block, const int num_blocks,
+                   uint32_t *output) {
+  int b = 0;
+  for (; b + 16 <= num_blocks; b += 16) {
+    if (BlocksWrapAround(first_block + b, 16)) {
+      RandomBlocksScalar(key, stream, first_block + b, 16, output + 4 * b);
+      continue;
+    }
+    __m512i words[4];
+    PhiloxBlocksAvx512(key, stream, first_block + b, words);
+    // Transposes the words (one block per lane) into consecutive blocks.
+    const __m512i t0 = _mm512_unpacklo_epi32(words[0], words[1]);
+    const __m512i t1 = _mm512_unpackhi_epi32(words[0], words[1]);
+    const __m512i t2 = _mm512_unpacklo_epi32(words[2], words[3]);
+    const __m512i t3 = _mm512_unpackhi_epi32(words[2], words[3]);
+    // Blocks {0, 4, 8, 12}, {1, 5, 9, 13}, {2, 6, 10, 14} and {3, 7, 11, 15}.
+    const __m512i r0 = _mm512_unpacklo_epi64(t0, t2);
+    const __m512i r1 = _mm512_unpackhi_epi64(t0, t2);
+    const __m512i r2 = _mm512_unpacklo_epi64(t1, t3);
+    const __m512i r3 = _mm512_unpackhi_epi64(t1, t3);
+    // Blocks {0, 8, 1, 9}, {2, 10, 3, 11}, {4, 12, 5, 13} and {6, 14, 7, 15}.
+    const __m512i u0 = _mm512_shuffle_i32x4(r0, r1, 0x88);
+    const __m512i u1 = _mm512_shuffle_i32x4(r2, r3, 0x88);
+    const __m512i u2 = _mm512_shuffle_i32x4(r0, r1, 0xDD);
+    const __m512i u3 = _mm512_shuffle_i32x4(r2, r3, 0xDD);
+    uint32_t *dst = output + 4 * b;
+    _mm512_storeu_si512(dst, _mm512_shuffle_i32x4(u0, u1, 0x88));
+    _mm512_storeu_si512(dst + 16, _mm512_shuffle_i32x4(u2, u3, 0x88));
+    _mm512_storeu_si512(dst + 32, _mm512_shuffle_i32x4(u0, u1, 0xDD));
+    _mm512_storeu_si512(dst + 48, _mm512_shuffle_i32x4(u2, u3, 0xDD));
+  }
+  RandomBlocksScalar(key, stream, first_block + b, num_blocks - b,
+                     output + 4 * b);
+}
+
+__attribute__((target("avx512f"))) void
+AddUniformNoiseAvx512(const uint64_t key, const uint64_t counter,
+                      const float scale, const int size, float *data) {
+  const __m512 scale_v = _mm512_set1_ps(scale);
+  const __m512 uniform_scale = _mm512_set1_ps(kUniform24Scale);
+  const __m512 one = _mm512_set1_ps(1.f);
+  __m512i words[4];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    PhiloxBlocksAvx512(key, counter,
+                       begin / kRandomGroupSize * kRandomGroupBlocks, words);
+    for (int w = 0; w < 4; w++) {
+      const int offset = begin + w * kRandomGroupBlocks;
+      if (offset >= size) {
+        break;
+      }
+      const __mmask16 mask = MaskAvx512(size - offset);
+      const __m512 noise = _mm512_sub_ps(
+          _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(words[w], 8)),
+                        uniform_scale),
+          one);
+      const __m512 value = _mm512_maskz_loadu_ps(mask, data + offset);
+      _mm512_mask_storeu_ps(data + offset, mask,
+                            _mm512_fmadd_ps(scale_v, noise, value));
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) void
+CrossoverUniformAvx512(const uint64_t key, const uint64_t counter,
+                       const uint32_t threshold, const int size, const float *a,
+                       const float *b, float *output) {
+  const __m512i threshold_v = _mm512_set1_epi32(threshold);
+  __m512i words[4];
+  for (int begin = 0; begin < size; begin += kRandomGroupSize) {
+    PhiloxBlocksAvx512(key, counter,
+                       begin / kRandomGroupSize * kRandomGroupBlocks, words);
+    for (int w = 0; w < 4; w++) {
+      const int offset = begin + w * kRandomGroupBlocks;
+      if (offset >= size) {
+        break;
+      }
+      const __mmask16 mask = MaskAvx512(size - offset);
+      const __mmask16 take_b = _mm512_cmplt_epu32_mask(
+          _mm512_srli_epi32(words[w], 8), threshold_v);
+      const __m512 value =
+          _mm512_mask_blend_ps(take_b, _mm512_maskz_loadu_ps(mask, a + offset),
+                               _mm512_maskz_loadu_ps(mask, b + offset));
+      _mm512_mask_storeu_ps(output + offset, mask, value);
+    }
+  }
+}
+
+#endif
+
+eInstructionSet DetectInstructionSet() {
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return eInstructionSet::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return eInstructionSet::kAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return eInstructionSet::kSse;
+  }
+#endif
+  return eInstructionSet::kScalar;
+}
+
+Implementation GetImplementation(const eInstructionSet instruction_set) {
+  switch (instruction_set) {
+#ifdef KERNELS_X86
+  case eInstructionSet::kAvx512:
+    // VNNI is not part of the AVX-512 foundation.
+    return {instruction_set,
+            AccumulateRowsAvx512,
+            AccumulateWeightedRowsAvx512,
+            ChangedIndicesAvx2,
+            ReplaceRowsAvx512,
+            FixedPointToFloatAvx512,
+            GemvAvx512,
+            GemmAvx512,
+            __builtin_cpu_supports("avx512vnni") ? GemvInt8Vnni : GemvInt8Avx2,
+            QuantizeInt7Avx2,
+            RandomBlocksAvx512,
+            AddUniformNoiseAvx512,
+            CrossoverUniformAvx512,
+            // With AVX-512, the compiler fuses the multiplications and
+            // additions, which would change the results.
+            ExpShiftedAvx2,
+            GumbelNoiseAvx2};
+  case eInstructionSet::kAvx2:
+    return {instruction_set,       AccumulateRowsAvx2,
+            AccumulateWeightedRowsAvx2,
+            ChangedIndicesAvx2,    ReplaceRowsAvx2,
+            FixedPointToFloatAvx2, GemvAvx2,
+            GemmAvx2,              GemvInt8Avx2,
+            QuantizeInt7Avx2,      RandomBlocksAvx2,
+            AddUniformNoiseAvx2,   CrossoverUniformAvx2,
+            ExpShiftedAvx2,        GumbelNoiseAvx2};
+  case eInstructionSet::kSse:
+    return {instruction_set,         AccumulateRowsScalar,
+            AccumulateWeightedRowsScalar,
+            ChangedIndicesScalar,    ReplaceRowsScalar,
+            FixedPointToFloatScalar, GemvSse,
+            GemmByRows<GemvSse>,     GemvInt8Scalar,
+            QuantizeInt7Scalar,      RandomBlocksScalar,
+            AddUniformNoiseScalar,   CrossoverUniformScalar,
+            ExpShiftedScalar,        GumbelNoiseScalar};
+#endif
+  default:
+    return {eInstructionSet::kScalar, AccumulateRowsScalar,
+            AccumulateWeightedRowsScalar,
+            ChangedIndicesScalar,     ReplaceRowsScalar,
+            FixedPointToFloatScalar,  GemvScalar,
+            GemmByRows<GemvScalar>,   GemvInt8Scalar,
+            QuantizeInt7Scalar,       RandomBlocksScalar,
+            AddUniformNoiseScalar,    CrossoverUniformScalar,
+            ExpShiftedScalar,         GumbelNoiseScalar};
+  }
+}
+
+Implementation &CurrentImplementation() {
+  static Implementation implementation =
+      GetImplementation(SupportedInstructionSet());
+  return implementation;
+}
+
+} // namespace
+
+eInstructionSet SupportedInstructionSet() {
+  static const eInstructionSet instruction_set = DetectInstructionSet();
+  return instruction_set;
+}
+
+eInstructionSet CurrentInstructionSet() {
+  return CurrentImplementation().instruction_set;
+}
+
+void SetInstructionSet(const eInstructionSet instruction_set) {
+  CHECK(instruction_set <= SupportedInstructionSet())
+      << " Instruction set " << InstructionSetName(instruction_set)
+      << " not supported";
+  CurrentImplementation() = GetImplementation(instruction_set);
+}
+
+std::string_view InstructionSetName(const eInstructionSet instruction_set) {
+  switch (instruction_set) {
+  case eInstructionSet::kScalar:
+    return "scalar";
+  case eInstructionSet::kSse:
+    return "sse";
+  case eInstructionSet::kAvx2:
+    return "avx2";
+  case eInstructionSet::kAvx512:
+    return "avx512";
+  }
+  return "unknown";
+}
+
+void AccumulateRows(const float *table, const int *row_offsets,
+                    const int num_rows, const int size, float *output) {
+  CurrentImplementation().accumulate_rows(table, row_offsets, num_rows, size,
+                                          output);
+}
+
+void AccumulateWeightedRows(const float *table, const int *row_offsets,
+                            const float *row_weights, const int num_rows,
+                            const int size, float *output) {
+  CurrentImplementation().accumulate_weighted_rows(
+      table, row_offsets, row_weights, num_rows, size, output);
+}
+
+int ChangedIndices(const uint8_t *a, const uint8_t *b, const int size,
+                   int *indices) {
+  return CurrentImplementation().changed_indices(a, b, size, indices);
+}
+
+void ReplaceRows(const int32_t *table, const int *sub_offsets,
+                 const int *add_offsets, const int num_rows, const int size,
+                 int32_t *accumulator) {
+  CurrentImplementation().replace_rows(table, sub_offsets, add_offsets,
+                                       num_rows, size, accumulator);
+}
+
+void FixedPointToFloat(const int32_t *values, const int size,
+                       const float scale, float *output) {
+  CurrentImplementation().fixed_point_to_float(values, size, scale, output);
+}
+
+void Gemv(const float *weights, const float *bias, const float *input,
+          const int padded_input_dim, const int output_dim,
+          const eActivation activation, float *output) {
+  DCHECK_EQ(padded_input_dim % kGemvPadding, 0);
+  CurrentImplementation().gemv(weights, bias, input, padded_input_dim,
+                               output_dim, activation, output);
+}
+
+void Gemm(const float *weights, const float *bias, const float *inputs,
+          const int padded_input_dim, const int output_dim,
+          const int batch_size, const eActivation activation, float *outputs,
+          const int output_stride) {
+  DCHECK_EQ(padded_input_dim % kGemvPadding, 0);
+  CurrentImplementation().gemm(weights, bias, inputs, padded_input_dim,
+                               output_dim, batch_size, activation, outputs,
+                               output_stride);
+}
+
+void GemvInt8(const int8_t *weights, const int32_t *row_sums,
+              const float *scales, const float *bias, const uint8_t *input,
+              const float input_scale, const int padded_input_dim,
+              const int output_dim, const eActivation activation,
+              float *output) {
+  DCHECK_EQ(padded_input_dim % kGemvInt8Padding, 0);
+  CurrentImplementation().gemv_int8(weights, row_sums, scales, bias, input,
+                                    input_scale, padded_input_dim, output_dim,
+                                    activation, output);
+}
+
+float QuantizeInt7(const float *input, const int size, uint8_t *output) {
+  return CurrentImplementation().quantize_int7(input, size, output);
+}
+
+void RandomBlocks(const uint64_t key, const uint64_t stream,
+                  const uint64_t first_block, const int num_blocks,
+                  uint32_t *output) {
+  CurrentImplementation().random_blocks(key, stream, first_block, num_blocks,
+                                        output);
+}
+
+void AddUniformNoise(const uint64_t key, const uint64_t counter,
+                     const float scale, const int size, float *data) {
+  CurrentImplementation().add_uniform_noise(key, counter, scale, size, data);
+}
+
+void CrossoverUniform(const uint64_t key, const uint64_t counter,
+                      const float probability, const int size, const float *a,
+                      const float *b, float *output) {
+  const uint32_t threshold = static_cast<uint32_t>(
+      std::clamp(probability, 0.f, 1.f) * (1 << 24));
+  CurrentImplementation().crossover_uniform(key, counter, threshold, size, a,
+                                            b, output);
+}
+
+int SoftMaxSample(const float *logits, const int size, const float uniform,
+                  float *prefix_sums) {
+  DCHECK_GT(size, 0);
+  const float max_logit = *std::max_element(logits, logits + size);
+  CurrentImplementation().exp_shifted(logits, size, max_logit, prefix_sums);
+  for (int i = 1; i < size; i++) {
+    prefix_sums[i] += prefix_sums[i - 1];
+  }
+  const float threshold = uniform * prefix_sums[size - 1];
+  const int index =
+      std::upper_bound(prefix_sums, prefix_sums + size, threshold) -
+      prefix_sums;
+  // The product can round up to the total.
+  return std::min(index, size - 1);
+}
+
+namespace {
+
+// Number of noise values computed at once by the Gumbel-max kernels.
+constexpr int kGumbelChunkSize = 256;
+
+// Index of the maximum of logits[i] + noise[i], and the maximum.
+std::pair<int, float> ArgMaxWithNoise(const float *logits, const float *noise,
+                                      const int size) {
+  int best_index = 0;
+  float best_value = logits[0] + noise[0];
+  for (int i = 1; i < size; i++) {
+    const float value = logits[i] + noise[i];
+    if (value > best_value) {
+      best_value = value;
+      best_index = i;
+    }
+  }
+  return {best_index, best_value};
+}
+
+} // namespace
+
+int GumbelMaxSample(const float *logits, const uint32_t *bits,
+                    const int size) {
+  DCHECK_GT(size, 0);
+  float noise[kGumbelChunkSize];
+  int best_index = 0;
+  float best_value = 0;
+  for (int begin = 0; begin < size; begin += kGumbelChunkSize) {
+    const int chunk_size = std::min(size - begin, kGumbelChunkSize);
+    CurrentImplementation().gumbel_noise(bits + begin, chunk_size, noise);
+    const auto [index, value] =
+        ArgMaxWithNoise(logits + begin, noise, chunk_size);
+    if (begin == 0 || value > best_value) {
+      best_index = begin + index;
+      best_value = value;
+    }
+  }
+  return best_index;
+}
+
+void GumbelMaxSampleBatch(const float *logits, const int logits_stride,
+                          const uint32_t *bits, const int batch_size,
+                          const int size, int *outputs) {
+  DCHECK_GT(size, 0);
+  if (size > kGumbelChunkSize) {
+    for (int b = 0; b < batch_size; b++) {
+      outputs[b] =
+          GumbelMaxSample(logits + b * logits_stride, bits + b * size, size);
+    }
+    return;
+  }
+  // Noise of whole rows, "rows_per_chunk" rows at a time.
+  float noise[kGumbelChunkSize];
+  const int rows_per_chunk = kGumbelChunkSize / size;
+  for (int begin = 0; begin < batch_size; begin += rows_per_chunk) {
+    const int num_rows = std::min(batch_size - begin, rows_per_chunk);
+    CurrentImplementation().gumbel_noise(bits + begin * size, num_rows * size,
+                                         noise);
+    for (int r = 0; r < num_rows; r++) {
+      outputs[begin + r] =
+          ArgMaxWithNoise(logits + (begin + r) * logits_stride,
+                          noise + r * size, size)
+              .first;
+    }
+  }
+}
+
+} // namespace kernels
+} // namespace exploratron
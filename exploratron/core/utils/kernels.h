@@ -0,0 +1,234 @@
+#ifndef EXPLORATRON_CORE_UTILS_KERNELS_H_
+#define EXPLORATRON_CORE_UTILS_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string_view>
+#include <vector>
+
+// Vectorized kernels of the neural networks.
+//
+// Each kernel has a scalar implementation and, on x86 with gcc or clang,
+// SSE, AVX2 and AVX-512 implementations. The implementation is selected at
+// startup from the instruction sets supported by the cpu.
+
+namespace exploratron {
+namespace kernels {
+
+// Ordered by capability.
+enum class eInstructionSet {
+  kScalar,
+  kSse,
+  kAvx2,
+  kAvx512,
+};
+
+// Best instruction set supported by both the cpu and the compiler.
+eInstructionSet SupportedInstructionSet();
+
+// Instruction set used by the kernels.
+eInstructionSet CurrentInstructionSet();
+
+// Changes the instruction set used by the kernels. Should not be called while
+// kernels are running. For benchmarks and debugging.
+void SetInstructionSet(eInstructionSet instruction_set);
+
+std::string_view InstructionSetName(eInstructionSet instruction_set);
+
+// Sums rows of a table into "output":
+//   output[j] += sum_r table[row_offsets[r] + j] for j in [0, size).
+// Rows are added in order, so the result is the same as the scalar loop.
+void AccumulateRows(const float *table, const int *row_offsets, int num_rows,
+                    int size, float *output);
+
+// Weighted version of AccumulateRows:
+//   output[j] += sum_r row_weights[r] * table[row_offsets[r] + j].
+// The SIMD implementations use fused multiply-adds, so the result can differ
+// from the scalar loop by rounding.
+void AccumulateWeightedRows(const float *table, const int *row_offsets,
+                            const float *row_weights, int num_rows, int size,
+                            float *output);
+
+// Writes in "indices" the positions i in [0, size) where a[i] != b[i], in
+// increasing order, and returns their number. "indices" should have room for
+// "size" values.
+int ChangedIndices(const uint8_t *a, const uint8_t *b, int size, int *indices);
+
+// Updates a fixed point accumulator by replacing rows of a table:
+//   accumulator[j] += sum_r table[add_offsets[r] + j] -
+//                           table[sub_offsets[r] + j] for j in [0, size).
+// If "sub_offsets" is null, the rows are only added. The arithmetic wraps
+// around on overflow. Since it is modular, the result does not depend on the
+// order of the rows, and is exact whenever the final values fit in 32 bits.
+void ReplaceRows(const int32_t *table, const int *sub_offsets,
+                 const int *add_offsets, int num_rows, int size,
+                 int32_t *accumulator);
+
+// Converts fixed point values to floats: output[j] = float(values[j]) * scale
+// where "scale" is a power of two.
+void FixedPointToFloat(const int32_t *values, int size, float scale,
+                       float *output);
+
+enum class eActivation {
+  kIdentity,
+  kRelu,
+};
+
+// Alignment and padding, in number of floats, of the GEMV operands.
+constexpr int kGemvPadding = 16;
+
+// Rounds up "size" to a multiple of kGemvPadding.
+constexpr int GemvPaddedSize(const int size) {
+  return (size + kGemvPadding - 1) / kGemvPadding * kGemvPadding;
+}
+
+// Allocator of memory aligned for the kernels.
+template <typename T>
+struct AlignedAllocator {
+  using value_type = T;
+  static constexpr std::align_val_t kAlignment{kGemvPadding * sizeof(float)};
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U> &) {}
+
+  T *allocate(const std::size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T), kAlignment));
+  }
+  void deallocate(T *p, const std::size_t) {
+    ::operator delete(p, kAlignment);
+  }
+  template <typename U>
+  bool operator==(const AlignedAllocator<U> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U> &) const {
+    return false;
+  }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedVectorF;
+typedef std::vector<int8_t, AlignedAllocator<int8_t>> AlignedVectorI8;
+typedef std::vector<uint8_t, AlignedAllocator<uint8_t>> AlignedVectorU8;
+
+// Dense layer with fused bias and activation:
+//   output[o] = activation(bias[o] + sum_i weights[o * padded_input_dim + i] *
+//                          input[i])
+// "weights" is a row-major output_dim x padded_input_dim matrix, and "input"
+// contains padded_input_dim values. "padded_input_dim" is a multiple of
+// kGemvPadding. The padding of both the weights and the input should be
+// zeros. "weights" and "input" should be aligned e.g. using AlignedVectorF.
+void Gemv(const float *weights, const float *bias, const float *input,
+          int padded_input_dim, int output_dim, eActivation activation,
+          float *output);
+
+// Gemv applied to a batch of inputs sharing the same weights:
+//   outputs[b * output_stride + o] = activation(bias[o] + sum_i
+//       weights[o * padded_input_dim + i] * inputs[b * padded_input_dim + i])
+// for b in [0, batch_size). The rows of "inputs" follow the constraints of the
+// input of Gemv. Each output row is bit-identical to the one computed by Gemv.
+void Gemm(const float *weights, const float *bias, const float *inputs,
+          int padded_input_dim, int output_dim, int batch_size,
+          eActivation activation, float *outputs, int output_stride);
+
+// Alignment and padding, in number of bytes, of the GemvInt8 operands.
+constexpr int kGemvInt8Padding = 64;
+
+// Rounds up "size" to a multiple of kGemvInt8Padding.
+constexpr int GemvInt8PaddedSize(const int size) {
+  return (size + kGemvInt8Padding - 1) / kGemvInt8Padding * kGemvInt8Padding;
+}
+
+// Quantizes the input of GemvInt8 with a single scale and a zero point of 64:
+//   output[i] = trunc(input[i] / scale + 64.5) in [1, 127]
+// with scale = max_i |input[i]| / 63, or 1 if the input is zero. Returns
+// "scale". The result is the same for all the instruction sets.
+float QuantizeInt7(const float *input, int size, uint8_t *output);
+
+// Int8 dense layer with fused bias and activation:
+//   output[o] = activation(bias[o] + input_scale * scales[o] *
+//       (sum_i weights[o * padded_input_dim + i] * input[i]
+//        - 64 * row_sums[o]))
+// i.e. Gemv with the weights scales[o] * weights[o * padded_input_dim + i] and
+// an input quantized by QuantizeInt7 with the scale "input_scale". "weights"
+// is a row-major output_dim x padded_input_dim int8 matrix, and "row_sums[o]"
+// is the sum of its row o. "padded_input_dim" is a multiple of
+// kGemvInt8Padding. The padding of the weights should be zeros. "weights" and
+// "input" should be aligned e.g. using AlignedVectorI8.
+//
+// The input is limited to 7 bits so that the pairwise sums of the AVX2
+// implementation (vpmaddubsw) do not saturate: the integer dot products are
+// exact, and the same for all the instruction sets. The AVX-512
+// implementation uses VNNI (vpdpbusd) if the cpu supports it.
+void GemvInt8(const int8_t *weights, const int32_t *row_sums,
+              const float *scales, const float *bias, const uint8_t *input,
+              float input_scale, int padded_input_dim, int output_dim,
+              eActivation activation, float *output);
+
+// Counter based random numbers: the Philox4x32-10 generator (Salmon et al.
+// 2011). Each 128 bits block of the sequence ("key", "stream") is the output
+// of Philox keyed by "key" for the counter
+// {block_low, stream_low, stream_high, block_high}. See CounterRng
+// (counter_rng.h) for a generator object.
+
+// Writes the 4 * num_blocks words of the blocks [first_block, first_block +
+// num_blocks) of the sequence ("key", "stream"), block after block.
+void RandomBlocks(uint64_t key, uint64_t stream, uint64_t first_block,
+                  int num_blocks, uint32_t *output);
+
+// The following genetic operators use the blocks [0, 2^32) of the sequence
+// ("key", "counter"). The value i of a sequence is the word
+// (i % 64) / 16 of the block (i / 64) * 16 + i % 16. This order lets the SIMD
+// implementations compute 16 blocks at once, and is the same for all the
+// instruction sets. The kernels only use the 24 high bits of each value, so
+// their results are also the same for all the instruction sets.
+//
+// Distinct (key, counter) pairs give independent sequences of up to 2^34
+// values, so a caller can e.g. use the index of a genome as counter.
+
+// Adds uniform noise in [-scale, scale) to "data":
+//   data[i] = fma(scale, u_i, data[i]) with u_i = (value_i >> 8) * 2^-23 - 1.
+void AddUniformNoise(uint64_t key, uint64_t counter, float scale, int size,
+                     float *data);
+
+// Uniform crossover: output[i] = u_i < probability ? b[i] : a[i] with
+// u_i = (value_i >> 8) * 2^-24. "output" can alias "a" or "b".
+void CrossoverUniform(uint64_t key, uint64_t counter, float probability,
+                      int size, const float *a, const float *b, float *output);
+
+// Sampling of the softmax distribution of "size" logits:
+//   p_i = exp(logits[i] - m) / sum_j exp(logits[j] - m)
+// with m = max_j logits[j].
+// The logits should be finite. The exponentials and logarithms are
+// polynomial approximations (Cephes) with a relative error of a few 1e-7,
+// evaluated with the same multiplications and additions (no fma) by all the
+// instruction sets, so the results are the same for all the instruction sets.
+
+// Inverse transform sampling with a single uniform value in [0, 1). Writes in
+// "prefix_sums" the running sums of exp(logits[i] - m), and returns the first
+// i such that uniform * prefix_sums[size - 1] < prefix_sums[i] (binary
+// search). Subtracting the maximum avoids overflows: the total is in
+// [1, size].
+int SoftMaxSample(const float *logits, int size, float uniform,
+                  float *prefix_sums);
+
+// Gumbel-max sampling: returns argmax_i logits[i] + g_i with the Gumbel noise
+// g_i = -log(-log(u_i)) and u_i = ((bits[i] >> 9) + 0.5) * 2^-23 in (0, 1).
+// Follows the same distribution as SoftMaxSample without any normalization,
+// but uses one random value per logit. Ties go to the first index.
+int GumbelMaxSample(const float *logits, const uint32_t *bits, int size);
+
+// GumbelMaxSample on a batch of logit rows, with the noise of all the rows
+// computed at once:
+//   outputs[b] = GumbelMaxSample(logits + b * logits_stride, bits + b * size,
+//                                size) for b in [0, batch_size).
+void GumbelMaxSampleBatch(const float *logits, int logits_stride,
+                          const uint32_t *bits, int batch_size, int size,
+                          int *outputs);
+
+} // namespace kernels
+} // namespace exploratron
+
+#endif
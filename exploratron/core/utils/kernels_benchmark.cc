@@ -0,0 +1,322 @@
+// Benchmarks the GEMV and GEMM kernels (neural_net::PackedDenseLayer) and the
+// int8 GEMV kernel (neural_net::QuantizedDenseLayer) against
+// neural_net::Forward, for each supported instruction set, on the dense layer
+// shapes used by the controllers. Also benchmarks the mutation noise kernel
+// against a std::mt19937 based mutation, CounterRng against std::mt19937, and
+// the softmax sampling kernels against a std::exp based sampling.
+//
+// Usage example:
+//   bazel run -c opt //exploratron/core/utils:kernels_benchmark
+//
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "exploratron/core/utils/counter_rng.h"
+#include "exploratron/core/utils/kernels.h"
+#include "exploratron/core/utils/logging.h"
+#include "exploratron/core/utils/neural_net.h"
+
+ABSL_FLAG(int, num_calls, 2000000, "Number of calls of each kernel.");
+
+namespace exploratron {
+namespace {
+
+using neural_net::VectorF;
+
+// Average duration of "fn", in nanoseconds.
+template <typename Fn>
+double TimeCalls(Fn fn) {
+  const int num_calls = absl::GetFlag(FLAGS_num_calls);
+  const auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_calls; i++) {
+    fn(i);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() /
+         num_calls;
+}
+
+void BenchmarkShape(const int input_dim, const int output_dim) {
+  CounterRng rnd(1234);
+  VectorF weights(neural_net::NumWeights(input_dim, output_dim));
+  neural_net::InitWeights(&weights, &rnd);
+  VectorF input(input_dim);
+  neural_net::InitWeights(&input, &rnd, 1.f);
+  VectorF expected(output_dim);
+  VectorF output(output_dim);
+
+  // The input changes at each call to prevent the compiler from hoisting the
+  // computation.
+  const double forward_time = TimeCalls([&](const int i) {
+    input[i % input_dim] += 1e-7f;
+    neural_net::Forward<neural_net::Relu>(input, neural_net::SVectorF(weights),
+                                          &expected);
+  });
+  LOG(INFO) << input_dim << " -> " << output_dim << " Forward: " << forward_time
+            << " ns";
+
+  const neural_net::PackedDenseLayer layer(weights, input_dim, output_dim);
+  const neural_net::QuantizedDenseLayer quantized_layer(weights, input_dim,
+                                                        output_dim);
+  neural_net::PackedDenseLayer::InputBuffer padded_input;
+  neural_net::QuantizedDenseLayer::InputBuffer quantized_input;
+  const auto supported = kernels::SupportedInstructionSet();
+  for (const auto instruction_set :
+       {kernels::eInstructionSet::kScalar, kernels::eInstructionSet::kSse,
+        kernels::eInstructionSet::kAvx2, kernels::eInstructionSet::kAvx512}) {
+    if (instruction_set > supported) {
+      continue;
+    }
+    kernels::SetInstructionSet(instruction_set);
+    const double time = TimeCalls([&](const int i) {
+      input[i % input_dim] += 1e-7f;
+      layer.Forward<neural_net::Relu>(input, &padded_input, &output);
+    });
+
+    neural_net::Forward<neural_net::Relu>(input, neural_net::SVectorF(weights),
+                                          &expected);
+    layer.Forward<neural_net::Relu>(input, &padded_input, &output);
+    float max_error = 0;
+    FOR_I(output_dim) {
+      max_error = std::max(max_error, std::abs(output[i] - expected[i]));
+    }
+    LOG(INFO) << input_dim << " -> " << output_dim << " Gemv "
+              << kernels::InstructionSetName(instruction_set) << ": " << time
+              << " ns, speedup x" << forward_time / time
+              << ", max error: " << max_error;
+
+    // Batch of inputs, as used by genetic::BatchedPolicy.
+    constexpr int kBatchSize = 8;
+    kernels::AlignedVectorF inputs(kBatchSize * layer.padded_input_dim(), 0.f);
+    FOR_I(kBatchSize) {
+      std::copy(input.begin(), input.end(),
+                inputs.begin() + i * layer.padded_input_dim());
+    }
+    VectorF outputs(kBatchSize * output_dim);
+    const double batch_time =
+        TimeCalls([&](const int i) {
+          inputs[i % input_dim] += 1e-7f;
+          layer.ForwardBatch<neural_net::Relu>(inputs.data(), kBatchSize,
+                                               outputs.data(), output_dim);
+        }) /
+        kBatchSize;
+    LOG(INFO) << input_dim << " -> " << output_dim << " Gemm "
+              << kernels::InstructionSetName(instruction_set) << ": "
+              << batch_time << " ns per input, speedup x"
+              << forward_time / batch_time;
+    // Int8 quantization, as used by genetic::QuantizedGeneticControllerBuilder.
+    const double int8_time = TimeCalls([&](const int i) {
+      input[i % input_dim] += 1e-7f;
+      quantized_layer.Forward<neural_net::Relu>(input, &quantized_input,
+                                                &output);
+    });
+    quantized_layer.Forward<neural_net::Relu>(input, &quantized_input, &output);
+    float max_int8_error = 0;
+    FOR_I(output_dim) {
+      max_int8_error =
+          std::max(max_int8_error, std::abs(output[i] - expected[i]));
+    }
+    LOG(INFO) << input_dim << " -> " << output_dim << " GemvInt8 "
+              << kernels::InstructionSetName(instruction_set) << ": "
+              << int8_time << " ns, speedup x" << forward_time / int8_time
+              << " (x" << time / int8_time
+              << " vs Gemv), max error: " << max_int8_error;
+  }
+  kernels::SetInstructionSet(supported);
+}
+
+void BenchmarkNoise(const int num_weights) {
+  VectorF weights(num_weights, 0.f);
+  const int num_calls = absl::GetFlag(FLAGS_num_calls) / num_weights + 1;
+  const auto time_mutations = [&](auto fn) {
+    const auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_calls; i++) {
+      fn(i);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() /
+           (static_cast<double>(num_calls) * num_weights);
+  };
+
+  std::mt19937 rnd(1234);
+  std::uniform_real_distribution<float> noise(-0.03f, 0.03f);
+  const double mt_time = time_mutations([&](const int i) {
+    for (auto &w : weights) {
+      w += noise(rnd);
+    }
+  });
+  LOG(INFO) << num_weights << " weights mutation std::mt19937: " << mt_time
+            << " ns per weight";
+
+  const auto supported = kernels::SupportedInstructionSet();
+  for (const auto instruction_set :
+       {kernels::eInstructionSet::kScalar, kernels::eInstructionSet::kAvx2,
+        kernels::eInstructionSet::kAvx512}) {
+    if (instruction_set > supported) {
+      continue;
+    }
+    kernels::SetInstructionSet(instruction_set);
+    const double time = time_mutations([&](const int i) {
+      kernels::AddUniformNoise(1234, i, 0.03f, num_weights, weights.data());
+    });
+    LOG(INFO) << num_weights << " weights AddUniformNoise "
+              << kernels::InstructionSetName(instruction_set) << ": " << time
+              << " ns per weight, speedup x" << mt_time / time;
+  }
+  kernels::SetInstructionSet(supported);
+}
+
+void BenchmarkRandomBits() {
+  constexpr int kSize = 1024;
+  std::vector<uint32_t> values(kSize);
+  const int num_calls = absl::GetFlag(FLAGS_num_calls) / kSize + 1;
+  const auto time_values = [&](auto fn) {
+    const auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_calls; i++) {
+      fn();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() /
+           (static_cast<double>(num_calls) * kSize);
+  };
+
+  std::mt19937 mt_rnd(1234);
+  const double mt_time = time_values([&]() {
+    for (auto &v : values) {
+      v = mt_rnd();
+    }
+  });
+  LOG(INFO) << "std::mt19937: " << mt_time << " ns per value";
+
+  CounterRng rnd(1234);
+  const double call_time = time_values([&]() {
+    for (auto &v : values) {
+      v = rnd();
+    }
+  });
+  LOG(INFO) << "CounterRng::operator(): " << call_time
+            << " ns per value, speedup x" << mt_time / call_time;
+
+  const auto supported = kernels::SupportedInstructionSet();
+  for (const auto instruction_set :
+       {kernels::eInstructionSet::kScalar, kernels::eInstructionSet::kAvx2,
+        kernels::eInstructionSet::kAvx512}) {
+    if (instruction_set > supported) {
+      continue;
+    }
+    kernels::SetInstructionSet(instruction_set);
+    const double time =
+        time_values([&]() { rnd.Generate(kSize, values.data()); });
+    LOG(INFO) << "CounterRng::Generate "
+              << kernels::InstructionSetName(instruction_set) << ": " << time
+              << " ns per value, speedup x" << mt_time / time;
+  }
+  kernels::SetInstructionSet(supported);
+}
+
+// Softmax sampling with std::exp, as neural_net::SoftMaxSampling before the
+// sampling kernels.
+int SoftMaxSamplingStdExp(const VectorF &input, CounterRng *rnd) {
+  float sum = 0;
+  for (const auto v : input) {
+    sum += std::exp(v);
+  }
+  float v = std::uniform_real_distribution<float>(0, sum)(*rnd);
+  for (int i = 0; i < input.size(); i++) {
+    v -= std::exp(input[i]);
+    if (v <= 0) {
+      return i;
+    }
+  }
+  return input.size() - 1;
+}
+
+void BenchmarkSampling(const int size) {
+  CounterRng rnd(1234);
+  VectorF logits(size);
+  neural_net::InitWeights(&logits, &rnd, 2.f);
+  int checksum = 0;
+  const double std_exp_time = TimeCalls([&](const int i) {
+    logits[i % size] += 1e-7f;
+    checksum += SoftMaxSamplingStdExp(logits, &rnd);
+  });
+  LOG(INFO) << size << " logits sampling std::exp: " << std_exp_time << " ns";
+
+  // Rows of the lockstep evaluation (genetic::BatchedPolicy).
+  constexpr int kBatchSize = 64;
+  VectorF batch_logits(kBatchSize * size);
+  neural_net::InitWeights(&batch_logits, &rnd, 2.f);
+  std::vector<uint32_t> bits(kBatchSize * size);
+  rnd.Generate(bits.size(), bits.data());
+  std::vector<int> sampled(kBatchSize);
+
+  const auto supported = kernels::SupportedInstructionSet();
+  for (const auto instruction_set :
+       {kernels::eInstructionSet::kScalar, kernels::eInstructionSet::kAvx2,
+        kernels::eInstructionSet::kAvx512}) {
+    if (instruction_set > supported) {
+      continue;
+    }
+    kernels::SetInstructionSet(instruction_set);
+    const double softmax_time = TimeCalls([&](const int i) {
+      logits[i % size] += 1e-7f;
+      checksum += neural_net::SoftMaxSampling(logits, &rnd);
+    });
+    const double gumbel_time = TimeCalls([&](const int i) {
+      logits[i % size] += 1e-7f;
+      checksum += neural_net::GumbelMaxSampling(logits, &rnd);
+    });
+    const double batch_time =
+        TimeCalls([&](const int i) {
+          bits[i % bits.size()] += 1;
+          kernels::GumbelMaxSampleBatch(batch_logits.data(), size,
+                                        bits.data(), kBatchSize, size,
+                                        sampled.data());
+          checksum += sampled[i % kBatchSize];
+        }) /
+        kBatchSize;
+    LOG(INFO) << size << " logits "
+              << kernels::InstructionSetName(instruction_set)
+              << " SoftMaxSampling: " << softmax_time << " ns, speedup x"
+              << std_exp_time / softmax_time
+              << " GumbelMaxSampling: " << gumbel_time << " ns, speedup x"
+              << std_exp_time / gumbel_time
+              << " GumbelMaxSampleBatch: " << batch_time
+              << " ns per row, speedup x" << std_exp_time / batch_time;
+  }
+  kernels::SetInstructionSet(supported);
+  LOG(INFO) << "checksum: " << checksum;
+}
+
+void Benchmark() {
+  LOG(INFO) << "Supported instruction set: "
+            << kernels::InstructionSetName(kernels::SupportedInstructionSet());
+  // Output layer of the genetic controller with the default options, hidden
+  // layers of the larger configurations, and their output layers.
+  for (const auto &[input_dim, output_dim] :
+       std::vector<std::pair<int, int>>{{20, 5}, {20, 20}, {64, 64}, {64, 5}}) {
+    BenchmarkShape(input_dim, output_dim);
+  }
+  // Weights of the genetic controller with the default options, and with two
+  // hidden layers of 64 units.
+  for (const int num_weights : {3885, 16581}) {
+    BenchmarkNoise(num_weights);
+  }
+  BenchmarkRandomBits();
+  // Moves of the controllers.
+  BenchmarkSampling(5);
+}
+
+} // namespace
+} // namespace exploratron
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  exploratron::Benchmark();
+}
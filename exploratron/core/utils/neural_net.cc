@@ -3,7 +3,9 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cmath>
+#include <functional>
 #include <numeric>
 
 namespace exploratron {
@@ -13,7 +15,7 @@ int NumWeights(int input_dim, int output_dim) {
   return (input_dim + 1) * output_dim;
 }
 
-void InitWeights(VectorF *output, std::mt19937 *rnd, const float scale,
+void InitWeights(VectorF *output, CounterRng *rnd, const float scale,
                  const eEnumWeights type) {
 
   switch (type) {
@@ -47,6 +49,27 @@ SVectorF WeightsAddress::operator()(VectorF &weights) const {
   return SVectorF(&weights[begin], size);
 }
 
+CSVectorF WeightsAddress::operator()(const VectorF &weights) const {
+  return CSVectorF(&weights[begin], size);
+}
+
+VectorF *WeightBank::mutable_values() {
+  if (owner_) {
+    values_ = std::make_shared<VectorF>(view_.begin(), view_.end());
+    owner_.reset();
+    view_ = {};
+  } else if (!values_) {
+    values_ = std::make_shared<VectorF>();
+  } else if (values_.use_count() > 1) {
+    values_ = std::make_shared<VectorF>(*values_);
+  } else {
+    // Synchronizes with the release of the other owners, if any, so their
+    // reads happen before the writes of the caller.
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+  return values_.get();
+}
+
 WeightsAddress WeightsAllocator::CreateAddress(int size) {
   WeightsAddress a;
   a.begin = next_begin;
@@ -63,26 +86,287 @@ void WeightsAllocator::AllocateWeightBank(VectorF *bank) {
   bank->resize(next_begin);
 }
 
+namespace {
+
+// Index of a one-hot weight. "row" is the (input, input_value) pair i.e.
+// input * num_input_values + input_value, or the constant.
+int OneHotWeightIndex(const int num_rows, const int output_size,
+                      const int row, const int output,
+                      const eOneHotLayout layout) {
+  switch (layout) {
+  case eOneHotLayout::kOutputMajor:
+    return row + output * num_rows;
+  case eOneHotLayout::kInputMajor:
+    return output + row * output_size;
+  }
+  CHECK(false);
+  return -1;
+}
+
+} // namespace
+
+void ConvertOneHotLayout(const int input_size, int num_input_values,
+                         const int output_size, const eOneHotLayout src,
+                         const eOneHotLayout dst, SVectorF *weights) {
+  const int num_rows = input_size * num_input_values + 1;
+  CHECK_EQ(num_rows * output_size, weights->size());
+  if (src == dst) {
+    return;
+  }
+  const VectorF src_weights(weights->begin(), weights->end());
+  for (int row = 0; row < num_rows; row++) {
+    for (int output = 0; output < output_size; output++) {
+      (*weights)[OneHotWeightIndex(num_rows, output_size, row, output, dst)] =
+          src_weights[OneHotWeightIndex(num_rows, output_size, row, output,
+                                        src)];
+    }
+  }
+}
+
 void SetWeightOneHot(const int input_size, int num_input_values,
                      const int output_size, const int input,
                      const int input_value, const int output, const float value,
-                     SVectorF *weights) {
+                     SVectorF *weights, const eOneHotLayout layout) {
   DCHECK_EQ((input_size * num_input_values + 1) * output_size, weights->size());
-  const int offset_factor = input_size * num_input_values + 1;
+  const int num_rows = input_size * num_input_values + 1;
   const int idx =
-      input_value + input * num_input_values + output * offset_factor;
+      OneHotWeightIndex(num_rows, output_size,
+                        input_value + input * num_input_values, output, layout);
   (*weights)[idx] = value;
 }
 
 void SetWeightOneHotConstant(const int input_size, int num_input_values,
                              const int output_size, const int output,
-                             const float value, SVectorF *weights) {
+                             const float value, SVectorF *weights,
+                             const eOneHotLayout layout) {
   DCHECK_EQ((input_size * num_input_values + 1) * output_size, weights->size());
-  const int offset_factor = input_size * num_input_values + 1;
-  const int idx = (offset_factor - 1) + output * offset_factor;
+  const int num_rows = input_size * num_input_values + 1;
+  const int idx =
+      OneHotWeightIndex(num_rows, output_size, num_rows - 1, output, layout);
   (*weights)[idx] = value;
 }
 
+namespace {
+
+// Random row id not in "used", which is updated. "used" should not contain
+// all the rows.
+int SampleUnusedRow(const SparseOneHotShape &shape, CounterRng *rnd,
+                    std::vector<bool> *used) {
+  while (true) {
+    const int row_id = RND_UNIF_INT(shape.num_rows(), *rnd);
+    if (!(*used)[row_id]) {
+      (*used)[row_id] = true;
+      return row_id;
+    }
+  }
+}
+
+void InitSparseRow(const SparseOneHotShape &shape, const int slot,
+                   const int row_id, const float scale, CounterRng *rnd,
+                   SVectorF weights) {
+  shape.SetRowId(slot, row_id, weights);
+  std::uniform_real_distribution<float> dist(-scale, scale);
+  for (auto &w : shape.Row(slot, weights)) {
+    w = dist(*rnd);
+  }
+}
+
+} // namespace
+
+void InitSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                      const float scale, SVectorF weights) {
+  CHECK_EQ(weights.size(), shape.NumWeights());
+  CHECK_LE(shape.max_rows, shape.num_rows());
+  std::vector<bool> used(shape.num_rows(), false);
+  FOR_I(shape.max_rows) {
+    InitSparseRow(shape, i, SampleUnusedRow(shape, rnd, &used), scale, rnd,
+                  weights);
+  }
+  std::uniform_real_distribution<float> dist(-scale, scale);
+  for (int i = shape.max_rows * shape.slot_size(); i < weights.size(); i++) {
+    weights[i] = dist(*rnd);
+  }
+}
+
+int MutateSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                       const float prune_threshold, const float rewire_rate,
+                       const float scale, SVectorF weights) {
+  CHECK_EQ(weights.size(), shape.NumWeights());
+  int num_pruned = 0;
+  std::vector<bool> used(shape.num_rows(), false);
+  FOR_I(shape.max_rows) {
+    const int row_id = shape.RowId(weights, i);
+    if (row_id < 0) {
+      continue;
+    }
+    const auto row = shape.Row(i, weights);
+    float sum_abs = 0;
+    for (const float w : row) {
+      sum_abs += std::abs(w);
+    }
+    if (sum_abs < prune_threshold * shape.output_size) {
+      shape.SetRowId(i, -1, weights);
+      num_pruned++;
+    } else {
+      used[row_id] = true;
+    }
+  }
+  FOR_I(shape.max_rows) {
+    const int row_id = shape.RowId(weights, i);
+    if (row_id >= 0 && RND_UNIF_FLOAT(*rnd) >= rewire_rate) {
+      continue;
+    }
+    if (row_id >= 0) {
+      used[row_id] = false;
+    }
+    InitSparseRow(shape, i, SampleUnusedRow(shape, rnd, &used), scale, rnd,
+                  weights);
+  }
+  return num_pruned;
+}
+
+void CrossoverSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                           const float probability, const CSVectorF &a,
+                           const CSVectorF &b, SVectorF child) {
+  CHECK_EQ(a.size(), shape.NumWeights());
+  CHECK_EQ(b.size(), shape.NumWeights());
+  CHECK_EQ(child.size(), shape.NumWeights());
+  FOR_I(shape.max_rows) {
+    const auto &src = RND_UNIF_FLOAT(*rnd) < probability ? b : a;
+    const auto slot = src.subspan(i * shape.slot_size(), shape.slot_size());
+    std::copy(slot.begin(), slot.end(),
+              child.begin() + i * shape.slot_size());
+  }
+  const int constants = shape.max_rows * shape.slot_size();
+  std::copy(a.begin() + constants, a.end(), child.begin() + constants);
+}
+
+FixedPointOneHotWeights::FixedPointOneHotWeights(
+    const SparseOneHotShape &shape, const CSVectorF &weights) {
+  CHECK_EQ(weights.size(), shape.NumWeights());
+  // Rows of the table: the zeros, the non-zero rows, and the constants. The
+  // missing rows point to the zeros.
+  const int zeros_offset = 0;
+  std::vector<int> offsets(shape.num_rows() + 1, zeros_offset);
+  std::vector<float> table(shape.output_size, 0.f);
+  FOR_I(shape.max_rows) {
+    const int row_id = shape.RowId(weights, i);
+    if (row_id < 0) {
+      continue;
+    }
+    DCHECK_LT(row_id, shape.num_rows());
+    if (offsets[row_id] == zeros_offset) {
+      offsets[row_id] = table.size();
+      table.resize(table.size() + shape.output_size, 0.f);
+    }
+    const auto row = shape.Row(i, weights);
+    std::transform(row.begin(), row.end(), table.begin() + offsets[row_id],
+                   table.begin() + offsets[row_id], std::plus<float>());
+  }
+  offsets[shape.num_rows()] = table.size();
+  table.insert(table.end(), weights.end() - shape.output_size, weights.end());
+
+  // Only the rows of the table can be non-zero, so the fixed point precision
+  // is chosen as for a dense layer of these rows.
+  *this = FixedPointOneHotWeights(table.size() / shape.output_size - 1, 1,
+                                  shape.output_size, table);
+  input_size = shape.input_size;
+  num_input_values = shape.num_input_values;
+  row_offsets = std::move(offsets);
+}
+
+FixedPointOneHotWeights::FixedPointOneHotWeights(const int input_size,
+                                                 const int num_input_values,
+                                                 const int output_size,
+                                                 const CSVectorF &weights)
+    : input_size(input_size), num_input_values(num_input_values),
+      output_size(output_size), weights(weights.size()) {
+  CHECK_EQ(weights.size(), (input_size * num_input_values + 1) * output_size);
+  float max_weight = 0;
+  for (const auto w : weights) {
+    max_weight = std::max(max_weight, std::abs(w));
+  }
+  // A pre-activation is the sum of input_size + 1 weights, each rounded to
+  // at most max_weight * 2^fraction_bits + 1.
+  const double max_abs_weight =
+      (std::ldexp(1., 31) / (input_size + 1) - 1) / std::max(max_weight, 1e-6f);
+  fraction_bits =
+      std::min(kMaxFractionBits,
+               static_cast<int>(std::floor(std::log2(max_abs_weight))));
+  CHECK_GE(fraction_bits, 0)
+      << " Weights too large for the fixed point one-hot layer";
+  scale = std::ldexp(1.f, -fraction_bits);
+  const double to_fixed_point = std::ldexp(1., fraction_bits);
+  FOR_I(weights.size()) {
+    this->weights[i] =
+        static_cast<int32_t>(std::lrint(weights[i] * to_fixed_point));
+  }
+}
+
+OneHotAccumulator::OneHotAccumulator(const FixedPointOneHotWeights *weights)
+    : weights_(weights), accumulator_(weights->output_size),
+      last_input_(weights->input_size), changed_(weights->input_size),
+      sub_offsets_(weights->input_size), add_offsets_(weights->input_size) {
+  CHECK_LE(weights->num_input_values, 256);
+}
+
+void OneHotAccumulator::Recompute(std::vector<int32_t> *accumulator) {
+  const int32_t *constants =
+      &weights_->weights[weights_->row_offset(weights_->input_size, 0)];
+  std::copy(constants, constants + weights_->output_size,
+            accumulator->begin());
+  FOR_I(weights_->input_size) {
+    add_offsets_[i] = weights_->row_offset(i, last_input_[i]);
+  }
+  kernels::ReplaceRows(weights_->weights.data(), nullptr, add_offsets_.data(),
+                       weights_->input_size, weights_->output_size,
+                       accumulator->data());
+}
+
+void OneHotAccumulator::Verify() {
+  std::vector<int32_t> expected(weights_->output_size);
+  Recompute(&expected);
+  CHECK(expected == accumulator_) << " Incremental one-hot layer mismatch";
+}
+
+PackedDenseLayer::PackedDenseLayer(const CSVectorF &weights,
+                                   const int input_dim, const int output_dim)
+    : input_dim_(input_dim), output_dim_(output_dim),
+      padded_input_dim_(kernels::GemvPaddedSize(input_dim)),
+      weights_(padded_input_dim_ * output_dim, 0.f), bias_(output_dim) {
+  CHECK_EQ(weights.size(), NumWeights(input_dim, output_dim));
+  for (int o_idx = 0; o_idx < output_dim; o_idx++) {
+    const auto row = weights.subspan(o_idx * (input_dim + 1), input_dim + 1);
+    std::copy(row.begin(), row.begin() + input_dim,
+              weights_.begin() + o_idx * padded_input_dim_);
+    bias_[o_idx] = row[input_dim];
+  }
+}
+
+QuantizedDenseLayer::QuantizedDenseLayer(const CSVectorF &weights,
+                                         const int input_dim,
+                                         const int output_dim)
+    : input_dim_(input_dim), output_dim_(output_dim),
+      padded_input_dim_(kernels::GemvInt8PaddedSize(input_dim)),
+      weights_(padded_input_dim_ * output_dim, 0), row_sums_(output_dim, 0),
+      scales_(output_dim), bias_(output_dim) {
+  CHECK_EQ(weights.size(), NumWeights(input_dim, output_dim));
+  for (int o_idx = 0; o_idx < output_dim; o_idx++) {
+    const auto row = weights.subspan(o_idx * (input_dim + 1), input_dim);
+    float max_weight = 0;
+    for (const float w : row) {
+      max_weight = std::max(max_weight, std::abs(w));
+    }
+    scales_[o_idx] = max_weight > 0 ? max_weight / 127 : 1.f;
+    FOR_I(input_dim) {
+      const int8_t q = static_cast<int8_t>(std::lrint(row[i] / scales_[o_idx]));
+      weights_[o_idx * padded_input_dim_ + i] = q;
+      row_sums_[o_idx] += q;
+    }
+    bias_[o_idx] = weights[o_idx * (input_dim + 1) + input_dim];
+  }
+}
+
 int ArgMax(const VectorF &input) {
   // const auto it_max = std::max_element(input.begin(), input.begin());
   // return std::distance(input.begin(), it_max);
@@ -95,20 +379,32 @@ int ArgMax(const VectorF &input) {
   return j;
 }
 
-int SoftMaxSampling(const VectorF &input, std::mt19937 *rnd) {
-  assert(!input.empty());
-  float sum = 0;
-  for (auto v : input) {
-    sum += std::exp(v);
+int SoftMaxSampling(CSVectorF input, CounterRng *rnd) {
+  DCHECK(!input.empty());
+  // Uniform in [0, 1).
+  const float uniform = static_cast<float>((*rnd)() >> 8) * (1.f / (1 << 24));
+  constexpr int kMaxStackSize = 64;
+  if (input.size() <= kMaxStackSize) {
+    float prefix_sums[kMaxStackSize];
+    return kernels::SoftMaxSample(input.data(), input.size(), uniform,
+                                  prefix_sums);
   }
-  float v = std::uniform_real_distribution<float>(0, sum)(*rnd);
-  for (int i = 0; i < input.size(); i++) {
-    v -= std::exp(input[i]);
-    if (v <= 0) {
-      return i;
-    }
+  VectorF prefix_sums(input.size());
+  return kernels::SoftMaxSample(input.data(), input.size(), uniform,
+                                prefix_sums.data());
+}
+
+int GumbelMaxSampling(CSVectorF input, CounterRng *rnd) {
+  DCHECK(!input.empty());
+  constexpr int kMaxStackSize = 64;
+  if (input.size() <= kMaxStackSize) {
+    uint32_t bits[kMaxStackSize];
+    rnd->Generate(input.size(), bits);
+    return kernels::GumbelMaxSample(input.data(), bits, input.size());
   }
-  return input.size() - 1;
+  std::vector<uint32_t> bits(input.size());
+  rnd->Generate(input.size(), bits.data());
+  return kernels::GumbelMaxSample(input.data(), bits.data(), input.size());
 }
 
 void BoundValues(float r, VectorF *output) {
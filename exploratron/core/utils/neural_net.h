@@ -1,13 +1,21 @@
 #ifndef EXPLORATRON_CORE_UTILS_NEURAL_NET_H_
 #define EXPLORATRON_CORE_UTILS_NEURAL_NET_H_
 
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <ostream>
 #include <random>
 #include <sstream>
 #include <stdint.h>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "absl/base/attributes.h"
 #include "absl/types/span.h"
+#include "exploratron/core/utils/counter_rng.h"
+#include "exploratron/core/utils/kernels.h"
 #include "exploratron/core/utils/logging.h"
 #include "exploratron/core/utils/macros.h"
 
@@ -19,8 +27,49 @@ typedef std::vector<int> VectorI;
 typedef absl::Span<float> SVectorF;
 typedef absl::Span<const float> CSVectorF;
 
+// Immutable and reference counted weight bank. Copies share the same values,
+// so genomes and their controllers can be copied without copying the weights.
+// The values are either owned by the bank, or are a view on memory owned by
+// another object (e.g. a row of a population matrix) kept alive by the bank.
+// "mutable_values" gives a private copy of the values if they are shared or
+// viewed (copy-on-write).
+class WeightBank {
+public:
+  WeightBank() = default;
+  explicit WeightBank(VectorF values)
+      : values_(std::make_shared<VectorF>(std::move(values))) {}
+  // View on "values", owned by "owner".
+  WeightBank(std::shared_ptr<const void> owner, CSVectorF values)
+      : owner_(std::move(owner)), view_(values) {}
+
+  CSVectorF values() const {
+    if (owner_) {
+      return view_;
+    }
+    return values_ ? CSVectorF(*values_) : CSVectorF();
+  }
+  VectorF *mutable_values();
+
+  size_t size() const { return values().size(); }
+  float operator[](const int i) const { return values()[i]; }
+  CSVectorF::const_iterator begin() const { return values().begin(); }
+  CSVectorF::const_iterator end() const { return values().end(); }
+
+private:
+  std::shared_ptr<VectorF> values_;
+  std::shared_ptr<const void> owner_;
+  CSVectorF view_;
+};
+
 struct WeightsAddress {
   SVectorF operator()(VectorF &weights) const;
+  CSVectorF operator()(const VectorF &weights) const;
+  CSVectorF operator()(const WeightBank &weights) const {
+    return weights.values().subspan(begin, size);
+  }
+  SVectorF operator()(SVectorF weights) const {
+    return weights.subspan(begin, size);
+  }
 
   int begin;
   int size;
@@ -47,12 +96,18 @@ enum class eEnumWeights {
   POSITIVE_UNIFORM,
   UNIT,
 };
-void InitWeights(VectorF *output, std::mt19937 *rnd, const float scale = 0.1f,
+void InitWeights(VectorF *output, CounterRng *rnd, const float scale = 0.1f,
                  const eEnumWeights type = eEnumWeights::SYMETRICAL_UNIFORM);
 
 int ArgMax(const VectorF &input);
 
-int SoftMaxSampling(const VectorF &input, std::mt19937 *rnd);
+// Samples an index with the probabilities softmax(input). Uses one value of
+// "rnd" (see kernels::SoftMaxSample).
+int SoftMaxSampling(CSVectorF input, CounterRng *rnd);
+
+// Samples an index with the probabilities softmax(input) using the Gumbel-max
+// trick. Uses input.size() values of "rnd" (see kernels::GumbelMaxSample).
+int GumbelMaxSampling(CSVectorF input, CounterRng *rnd);
 
 template <ActivationFn Activation, typename V>
 void ForwardOneHot(const std::vector<V> &input, int num_input_values,
@@ -81,14 +136,247 @@ void ForwardOneHot(const std::vector<V> &input, int num_input_values,
   }
 }
 
-void SetWeightOneHot(const int input_size, int num_input_values,
-                     const int output_size, const int input,
-                     const int input_value, const int output, const float value,
-                     SVectorF *weights);
+// Layout of the weights of a one-hot layer.
+enum class eOneHotLayout {
+  // From minor to major: input_value, input dim, constant, output dim. Used by
+  // "ForwardOneHot".
+  kOutputMajor,
+  // From minor to major: output dim, input_value, input dim, constant. Each
+  // (input, value) pair owns a contiguous row of output_dim weights, and the
+  // last row contains the constants. Used by "ForwardOneHotInputMajor".
+  kInputMajor,
+};
+
+// Same as "ForwardOneHot" with the kInputMajor layout. Computes the same
+// values, but only reads input_size + 1 contiguous rows of weights.
+template <ActivationFn Activation, typename V>
+void ForwardOneHotInputMajor(const std::vector<V> &input, int num_input_values,
+                             const CSVectorF &weights, VectorF *output) {
+  DCHECK_EQ((input.size() * num_input_values + 1) * output->size(),
+            weights.size());
+
+  const int i_s = input.size();
+  const int o_s = output->size();
+
+  const float *constants = weights.data() + i_s * num_input_values * o_s;
+  std::copy(constants, constants + o_s, output->begin());
+
+  // Offsets of the active rows, processed by chunks.
+  constexpr int kChunkSize = 64;
+  int row_offsets[kChunkSize];
+  for (int begin = 0; begin < i_s; begin += kChunkSize) {
+    const int end = std::min(i_s, begin + kChunkSize);
+    for (int i_idx = begin; i_idx < end; i_idx++) {
+      DCHECK_LT(input[i_idx], num_input_values);
+      DCHECK_GE(input[i_idx], 0);
+      row_offsets[i_idx - begin] =
+          (i_idx * num_input_values + input[i_idx]) * o_s;
+    }
+    kernels::AccumulateRows(weights.data(), row_offsets, end - begin, o_s,
+                            output->data());
+  }
+
+  if (Activation != Identity) {
+    FOR_I(o_s) { (*output)[i] = Activation((*output)[i]); }
+  }
+}
+
+// Shape of a sparse one-hot layer: a one-hot layer in the
+// eOneHotLayout::kInputMajor layout where at most "max_rows" of the
+// (input, value) rows are non-zero. Its size does not depend on
+// input_size * num_input_values, so it scales to large inputs.
+//
+// The weights are "max_rows" slots followed by the row of constants. A slot is
+// the id of its row (input * num_input_values + value, stored as a float, or -1
+// if the slot is empty) followed by the output_size weights of the row. Rows
+// of several slots with the same id are summed.
+struct SparseOneHotShape {
+  int input_size = 0;
+  int num_input_values = 0;
+  int output_size = 0;
+  int max_rows = 0;
+
+  int num_rows() const { return input_size * num_input_values; }
+  int slot_size() const { return output_size + 1; }
+  int NumWeights() const { return max_rows * slot_size() + output_size; }
+
+  int RowId(const CSVectorF &weights, const int slot) const {
+    return static_cast<int>(weights[slot * slot_size()]);
+  }
+  void SetRowId(const int slot, const int row_id, SVectorF weights) const {
+    weights[slot * slot_size()] = row_id;
+  }
+  SVectorF Row(const int slot, SVectorF weights) const {
+    return weights.subspan(slot * slot_size() + 1, output_size);
+  }
+  CSVectorF Row(const int slot, const CSVectorF &weights) const {
+    return weights.subspan(slot * slot_size() + 1, output_size);
+  }
+};
+
+// Initializes a sparse one-hot layer with rows of distinct random ids, and
+// uniform weights in [-scale, scale].
+void InitSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                      float scale, SVectorF weights);
+
+// Sparse-aware mutation of the structure of a sparse one-hot layer (the
+// weights of the rows are mutated as dense weights):
+//   - Pruning: the rows whose mean absolute weight is below "prune_threshold"
+//     are removed.
+//   - Regrowth: the empty slots receive a new random row.
+//   - Rewiring: each row is moved to a new random row with probability
+//     "rewire_rate".
+// The new rows are initialized like "InitSparseOneHot". Returns the number of
+// pruned rows.
+int MutateSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                       float prune_threshold, float rewire_rate, float scale,
+                       SVectorF weights);
+
+// Sparse-aware crossover: each slot of "child" is the slot of "b" with
+// probability "probability", and the one of "a" otherwise. The constants are
+// the ones of "a". "child" can alias "a" or "b".
+void CrossoverSparseOneHot(const SparseOneHotShape &shape, CounterRng *rnd,
+                           float probability, const CSVectorF &a,
+                           const CSVectorF &b, SVectorF child);
+
+// Weights of a one-hot layer in the eOneHotLayout::kInputMajor layout,
+// converted to fixed point (32 bits integers with "fraction_bits" bits after
+// the point) for OneHotAccumulator. "fraction_bits" is the largest value (up to
+// kMaxFractionBits) such that any pre-activation of the layer fits in 32 bits.
+struct FixedPointOneHotWeights {
+  static constexpr int kMaxFractionBits = 24;
+
+  FixedPointOneHotWeights() = default;
+  FixedPointOneHotWeights(int input_size, int num_input_values,
+                          int output_size, const CSVectorF &weights);
+  // Sparse layer. Only the non-zero rows are stored, and the missing rows are
+  // a shared row of zeros.
+  FixedPointOneHotWeights(const SparseOneHotShape &shape,
+                          const CSVectorF &weights);
+
+  // Offset of the row of the value "input_value" of the input dimension
+  // "input_idx". The constants are the row (input_size, 0).
+  int row_offset(const int input_idx, const int input_value) const {
+    const int row = input_idx * num_input_values + input_value;
+    return row_offsets.empty() ? row * output_size : row_offsets[row];
+  }
+
+  int input_size = 0;
+  int num_input_values = 0;
+  int output_size = 0;
+  int fraction_bits = 0;
+  // 2^-fraction_bits.
+  float scale = 1;
+  std::vector<int32_t> weights;
+  // Offset of each row in "weights", for sparse layers. Empty for dense
+  // layers.
+  std::vector<int> row_offsets;
+};
+
+// Incremental version of "ForwardOneHotInputMajor". Keeps the pre-activation
+// of the layer for the last input, and only replaces the weight rows of the
+// input dimensions whose value changed since the last call. Falls back to a
+// full recompute when more than half of the input changed.
+//
+// The accumulation is done in fixed point, so the result does not depend on
+// the order of the additions: it is exactly the one of a full recompute. It
+// differs from "ForwardOneHotInputMajor" by at most
+// (input_size + 1) * 2^-(fraction_bits + 1), plus the rounding errors of the
+// latter. In debug builds, each call is verified against a full recompute.
+class OneHotAccumulator {
+public:
+  OneHotAccumulator() = default;
+  // "weights" should outlive the accumulator.
+  explicit OneHotAccumulator(const FixedPointOneHotWeights *weights);
 
-void SetWeightOneHotConstant(const int input_size, int num_input_values,
-                             const int output_size, const int output,
-                             const float value, SVectorF *weights);
+  template <ActivationFn Activation, typename V>
+  void Forward(const std::vector<V> &input, VectorF *output) {
+    Forward<Activation, V>(absl::MakeConstSpan(input), absl::MakeSpan(*output));
+  }
+
+  template <ActivationFn Activation, typename V>
+  void Forward(absl::Span<const V> input, SVectorF output) {
+    const int input_size = weights_->input_size;
+    const int output_size = weights_->output_size;
+    DCHECK_EQ(input.size(), input_size);
+    DCHECK_EQ(output.size(), output_size);
+    if (!has_last_input_) {
+      std::copy(input.begin(), input.end(), last_input_.begin());
+      Recompute(&accumulator_);
+      has_last_input_ = true;
+    } else {
+      int num_changed;
+      if constexpr (std::is_same_v<V, uint8_t>) {
+        num_changed = kernels::ChangedIndices(
+            input.data(), last_input_.data(), input_size, changed_.data());
+      } else {
+        num_changed = 0;
+        for (int i_idx = 0; i_idx < input_size; i_idx++) {
+          changed_[num_changed] = i_idx;
+          num_changed += input[i_idx] != last_input_[i_idx];
+        }
+      }
+      if (2 * num_changed >= input_size + 1) {
+        std::copy(input.begin(), input.end(), last_input_.begin());
+        Recompute(&accumulator_);
+      } else {
+        FOR_I(num_changed) {
+          const int i_idx = changed_[i];
+          const int value = input[i_idx];
+          DCHECK_LT(value, weights_->num_input_values);
+          DCHECK_GE(value, 0);
+          sub_offsets_[i] = weights_->row_offset(i_idx, last_input_[i_idx]);
+          add_offsets_[i] = weights_->row_offset(i_idx, value);
+          last_input_[i_idx] = value;
+        }
+        kernels::ReplaceRows(weights_->weights.data(), sub_offsets_.data(),
+                             add_offsets_.data(), num_changed, output_size,
+                             accumulator_.data());
+      }
+#ifndef NDEBUG
+      Verify();
+#endif
+    }
+    kernels::FixedPointToFloat(accumulator_.data(), output_size,
+                               weights_->scale, output.data());
+    if (Activation != Identity) {
+      FOR_I(output_size) { output[i] = Activation(output[i]); }
+    }
+  }
+
+  // Forgets the last input. The next call to "Forward" is a full recompute.
+  void Reset() { has_last_input_ = false; }
+
+private:
+  // Computes the pre-activation of "last_input_" from scratch.
+  void Recompute(std::vector<int32_t> *accumulator);
+  // Checks that "accumulator_" is equal to a full recompute.
+  void Verify();
+
+  const FixedPointOneHotWeights *weights_ = nullptr;
+  std::vector<int32_t> accumulator_;
+  bool has_last_input_ = false;
+  std::vector<uint8_t> last_input_;
+  std::vector<int> changed_;
+  std::vector<int> sub_offsets_;
+  std::vector<int> add_offsets_;
+};
+
+// Converts the weights of a one-hot layer from one layout to another.
+void ConvertOneHotLayout(const int input_size, int num_input_values,
+                         const int output_size, const eOneHotLayout src,
+                         const eOneHotLayout dst, SVectorF *weights);
+
+void SetWeightOneHot(
+    const int input_size, int num_input_values, const int output_size,
+    const int input, const int input_value, const int output, const float value,
+    SVectorF *weights,
+    const eOneHotLayout layout = eOneHotLayout::kOutputMajor);
+
+void SetWeightOneHotConstant(
+    const int input_size, int num_input_values, const int output_size,
+    const int output, const float value, SVectorF *weights,
+    const eOneHotLayout layout = eOneHotLayout::kOutputMajor);
 
 template <ActivationFn Activation>
 inline void Forward(const VectorF &input, const SVectorF &weights,
@@ -108,6 +396,172 @@ inline void Forward(const VectorF &input, const SVectorF &weights,
   }
 }
 
+// Dense layer packed for the kernels::Gemv kernel. Computes the same function
+// as "Forward" (up to the rounding errors), with the weights of "Forward".
+// Immutable: the layer can be shared by threads.
+class PackedDenseLayer {
+public:
+  // Copy of the input with the zero padding, owned by the caller.
+  typedef kernels::AlignedVectorF InputBuffer;
+
+  PackedDenseLayer() = default;
+  PackedDenseLayer(const CSVectorF &weights, int input_dim, int output_dim);
+
+  // "padded_input" is resized if needed.
+  template <ActivationFn Activation>
+  void Forward(const VectorF &input, InputBuffer *padded_input,
+               VectorF *output) const {
+    DCHECK_EQ(input.size(), input_dim_);
+    DCHECK_EQ(output->size(), output_dim_);
+    static_assert(Activation == Identity || Activation == Relu,
+                  "Unsupported activation");
+    if (padded_input->size() != padded_input_dim_) {
+      padded_input->assign(padded_input_dim_, 0.f);
+    }
+    std::copy(input.begin(), input.end(), padded_input->begin());
+    kernels::Gemv(weights_.data(), bias_.data(), padded_input->data(),
+                  padded_input_dim_, output_dim_,
+                  Activation == Relu ? kernels::eActivation::kRelu
+                                     : kernels::eActivation::kIdentity,
+                  output->data());
+  }
+
+  // Applies the layer on "batch_size" inputs. "inputs" is a row-major
+  // batch_size x padded_input_dim() matrix aligned for the kernels and with
+  // zero padding. Output row b starts at outputs[b * output_stride].
+  template <ActivationFn Activation>
+  void ForwardBatch(const float *inputs, const int batch_size, float *outputs,
+                    const int output_stride) const {
+    static_assert(Activation == Identity || Activation == Relu,
+                  "Unsupported activation");
+    kernels::Gemm(weights_.data(), bias_.data(), inputs, padded_input_dim_,
+                  output_dim_, batch_size,
+                  Activation == Relu ? kernels::eActivation::kRelu
+                                     : kernels::eActivation::kIdentity,
+                  outputs, output_stride);
+  }
+
+  int input_dim() const { return input_dim_; }
+  int output_dim() const { return output_dim_; }
+  int padded_input_dim() const { return padded_input_dim_; }
+  // Row-major output_dim() x padded_input_dim() matrix, and bias.
+  const float *weights() const { return weights_.data(); }
+  const float *bias() const { return bias_.data(); }
+
+private:
+  int input_dim_ = 0;
+  int output_dim_ = 0;
+  int padded_input_dim_ = 0;
+  kernels::AlignedVectorF weights_;
+  VectorF bias_;
+};
+
+// Dense layer quantized for the kernels::GemvInt8 kernel. The weights are
+// rounded to int8 with one scale per output, and the bias is kept in float.
+// At each call, the input is rounded to 7 bits with a single scale (see
+// kernels::QuantizeInt7). Computes the function of "Forward" up to the
+// quantization errors. Immutable: the layer can be shared by threads.
+class QuantizedDenseLayer {
+public:
+  // Quantized input, owned by the caller. Its padding is multiplied by zero
+  // weights.
+  typedef kernels::AlignedVectorU8 InputBuffer;
+
+  QuantizedDenseLayer() = default;
+  QuantizedDenseLayer(const CSVectorF &weights, int input_dim, int output_dim);
+
+  // "quantized_input" is resized if needed.
+  template <ActivationFn Activation>
+  void Forward(const VectorF &input, InputBuffer *quantized_input,
+               VectorF *output) const {
+    DCHECK_EQ(input.size(), input_dim_);
+    DCHECK_EQ(output->size(), output_dim_);
+    static_assert(Activation == Identity || Activation == Relu,
+                  "Unsupported activation");
+    if (quantized_input->size() != padded_input_dim_) {
+      quantized_input->assign(padded_input_dim_, 0);
+    }
+    const float input_scale = kernels::QuantizeInt7(input.data(), input_dim_,
+                                                    quantized_input->data());
+    kernels::GemvInt8(weights_.data(), row_sums_.data(), scales_.data(),
+                      bias_.data(), quantized_input->data(), input_scale,
+                      padded_input_dim_, output_dim_,
+                      Activation == Relu ? kernels::eActivation::kRelu
+                                         : kernels::eActivation::kIdentity,
+                      output->data());
+  }
+
+  int input_dim() const { return input_dim_; }
+  int output_dim() const { return output_dim_; }
+
+private:
+  int input_dim_ = 0;
+  int output_dim_ = 0;
+  int padded_input_dim_ = 0;
+  kernels::AlignedVectorI8 weights_;
+  // Sum of the quantized weights of each output.
+  std::vector<int32_t> row_sums_;
+  // Scale of the weights of each output.
+  VectorF scales_;
+  VectorF bias_;
+};
+
+template <typename Fn, int... I>
+ABSL_ATTRIBUTE_ALWAYS_INLINE inline void
+UnrollImpl(Fn &&fn, std::integer_sequence<int, I...>) {
+  (fn(std::integral_constant<int, I>()), ...);
+}
+
+// Calls fn(std::integral_constant<int, i>()) for i in [0, N), in order. The
+// loop is unrolled at compile time.
+template <int N, typename Fn>
+ABSL_ATTRIBUTE_ALWAYS_INLINE inline void Unroll(Fn &&fn) {
+  UnrollImpl(fn, std::make_integer_sequence<int, N>());
+}
+
+// Vector of N floats on the stack, aligned and zero padded for the
+// kernels::Gemv kernel.
+template <int N>
+struct alignas(kernels::kGemvPadding * sizeof(float)) FixedVectorF {
+  static constexpr int kSize = N;
+
+  float &operator[](const int i) { return values[i]; }
+  float operator[](const int i) const { return values[i]; }
+  SVectorF span() { return SVectorF(values.data(), N); }
+  CSVectorF span() const { return CSVectorF(values.data(), N); }
+
+  std::array<float, kernels::GemvPaddedSize(N)> values = {};
+};
+
+// PackedDenseLayer with dimensions known at compile time, applied on
+// FixedVectorFs. The vectors are already padded, so kernels::Gemv reads them
+// without copy. Does not own the layer. Returns the same outputs as
+// PackedDenseLayer::Forward.
+template <int InputDim, int OutputDim>
+class FixedDenseLayer {
+public:
+  FixedDenseLayer() = default;
+  explicit FixedDenseLayer(const PackedDenseLayer *layer) : layer_(layer) {
+    CHECK_EQ(layer->input_dim(), InputDim);
+    CHECK_EQ(layer->output_dim(), OutputDim);
+  }
+
+  template <ActivationFn Activation>
+  void Forward(const FixedVectorF<InputDim> &input,
+               FixedVectorF<OutputDim> *output) const {
+    static_assert(Activation == Identity || Activation == Relu,
+                  "Unsupported activation");
+    kernels::Gemv(layer_->weights(), layer_->bias(), input.values.data(),
+                  kernels::GemvPaddedSize(InputDim), OutputDim,
+                  Activation == Relu ? kernels::eActivation::kRelu
+                                     : kernels::eActivation::kIdentity,
+                  output->values.data());
+  }
+
+private:
+  const PackedDenseLayer *layer_ = nullptr;
+};
+
 template <ActivationFn Activation>
 inline void AddTo(const VectorF &input, VectorF *output) {
   DCHECK_EQ(input.size(), output->size());
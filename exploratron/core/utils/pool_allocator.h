@@ -0,0 +1,94 @@
+#ifndef EXPLORATRON_CORE_UTILS_POOL_ALLOCATOR_H_
+#define EXPLORATRON_CORE_UTILS_POOL_ALLOCATOR_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace exploratron {
+
+// STL allocator serving single objects of type T from blocks of memory shared
+// by all the allocators of the same type. Released objects are recycled by
+// the next allocations of the same thread. The memory is never returned to
+// the system.
+//
+// Usage example:
+//   auto wall = std::allocate_shared<Wall>(PoolAllocator<Wall>());
+//
+template <typename T>
+class PoolAllocator {
+ public:
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(const std::size_t n) {
+    if (n != 1) {
+      return std::allocator<T>().allocate(n);
+    }
+    Node *&free_list = FreeList();
+    if (!free_list) {
+      free_list = AllocateBlock();
+    }
+    Node *node = free_list;
+    free_list = node->next;
+    return reinterpret_cast<T *>(node);
+  }
+
+  void deallocate(T *value, const std::size_t n) {
+    if (n != 1) {
+      std::allocator<T>().deallocate(value, n);
+      return;
+    }
+    Node *node = reinterpret_cast<Node *>(value);
+    Node *&free_list = FreeList();
+    node->next = free_list;
+    free_list = node;
+  }
+
+  template <typename U>
+  bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+
+ private:
+  static constexpr int kNodesPerBlock = 256;
+
+  union Node {
+    Node *next;
+    alignas(T) unsigned char value[sizeof(T)];
+  };
+
+  static Node *&FreeList() {
+    thread_local Node *free_list = nullptr;
+    return free_list;
+  }
+
+  // Allocates a new block, and returns its nodes chained.
+  static Node *AllocateBlock() {
+    // Never destroyed, as objects can be released during the static
+    // destruction.
+    static auto *mutex = new std::mutex();
+    static auto *blocks = new std::vector<std::unique_ptr<Node[]>>();
+
+    auto block = std::make_unique<Node[]>(kNodesPerBlock);
+    for (int node_idx = 0; node_idx < kNodesPerBlock - 1; node_idx++) {
+      block[node_idx].next = &block[node_idx + 1];
+    }
+    block[kNodesPerBlock - 1].next = nullptr;
+    Node *first = block.get();
+    std::lock_guard<std::mutex> lock(*mutex);
+    blocks->push_back(std::move(block));
+    return first;
+  }
+};
+
+}  // namespace exploratron
+#endif
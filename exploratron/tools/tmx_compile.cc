@@ -0,0 +1,43 @@
+// Converts a tmx map into a compiled map (see compiled_map.h).
+//
+// Usage example:
+//   bazel run //exploratron/tools:tmx_compile --
+//     --input=exploratron/assets/map/tutorial.tmx
+//
+#include <string>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "exploratron/arena/common_game/common_game.h"
+#include "exploratron/arena/common_game/compiled_map.h"
+#include "exploratron/core/utils/logging.h"
+
+ABSL_FLAG(std::string, input, "", "Path to the tmx map.");
+ABSL_FLAG(std::string, output, "",
+          "Path to the compiled map. Defaults to the input path with the "
+          "\".cmap\" extension.");
+
+namespace exploratron {
+
+void CompileMap() {
+  const auto input = absl::GetFlag(FLAGS_input);
+  CHECK(!input.empty()) << " --input is required";
+  auto output = absl::GetFlag(FLAGS_output);
+  if (output.empty()) {
+    output = input.substr(0, input.find_last_of('.')) +
+             common_game::kCompiledMapExtension;
+  }
+
+  const auto prototype = common_game::LoadTmx(input);
+  common_game::SaveCompiledMap(prototype, output);
+  LOG(INFO) << "Compiled map saved to " << output << " with "
+            << prototype.layers.size() << " layer(s) and "
+            << prototype.objects.size() << " object(s)";
+}
+
+}  // namespace exploratron
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  exploratron::CompileMap();
+}